@@ -18,6 +18,9 @@ stage2_start:
     mov si, stage2_message
     call print_string
     
+    ; Collect BIOS memory map for the kernel page allocator
+    call detect_memory_map
+    
     ; Enable A20 line
     call enable_a20
     
@@ -98,6 +101,50 @@ wait_8042_data:
     jz wait_8042_data
     ret
 
+; Collect the BIOS E820 memory map at E820_MAP_ADDRESS
+; Layout: dword entry count, then 24-byte entries (base, length, type, ACPI)
+detect_memory_map:
+    pushad
+    push es
+    
+    xor ax, ax
+    mov es, ax
+    mov dword [es:E820_MAP_ADDRESS], 0
+    mov di, E820_MAP_ADDRESS + 4
+    xor ebx, ebx            ; Continuation value, 0 = first entry
+    xor bp, bp              ; Entries stored
+    
+.next_entry:
+    mov eax, 0xE820
+    mov edx, 0x534D4150     ; 'SMAP'
+    mov ecx, 24
+    mov dword [es:di + 20], 1   ; Default ACPI attributes: entry valid
+    int 0x15
+    jc .done                ; Unsupported or end of list
+    cmp eax, 0x534D4150
+    jne .done
+    
+    ; Skip empty entries
+    mov eax, [es:di + 8]
+    or eax, [es:di + 12]
+    jz .skip_entry
+    
+    inc bp
+    add di, 24
+    cmp bp, E820_MAX_ENTRIES
+    jae .done
+    
+.skip_entry:
+    test ebx, ebx           ; EBX = 0 after the last entry
+    jnz .next_entry
+    
+.done:
+    mov [es:E820_MAP_ADDRESS], bp
+    
+    pop es
+    popad
+    ret
+
 ; Load kernel from disk
 load_kernel:
     pusha
@@ -213,5 +260,8 @@ boot_drive_offset       equ 0x1BE  ; Offset to boot drive in MBR
 
 kernel_entry_point      equ 0x20000
 
+E820_MAP_ADDRESS        equ 0x0500 ; Must match BOOT_E820_MAP_ADDRESS in omnios.h
+E820_MAX_ENTRIES        equ 32     ; Must match BOOT_E820_MAX_ENTRIES
+
 ; Pad stage 2 to exactly 2KB
 times 2048-($-$$) db 0
@@ -0,0 +1,925 @@
+/*
+ * OmniOS 2.0 Buffer Cache
+ * Block buffers hashed by block number, recycled in LRU order and
+ * written back lazily. Delayed buffers hold file data by (inode, file
+ * block) until the file system allocates disk blocks for them; journaled
+ * metadata stays unwritten until the journal has committed it. Metadata
+ * checksums are computed once per write-out and verified once per read.
+ *
+ * One spinlock guards the hash, the LRU list, buffer flags, pins and
+ * statistics; device reads and writes and buffer allocations run outside
+ * it. A block being read sits in the hash marked loading, and threads
+ * that want it wait for that read instead of issuing their own. Eviction
+ * prefers clean buffers; when only dirty ones are left, the oldest is
+ * pinned and written back with the lock dropped before it is reused.
+ */
+
+#include "omnios.h"
+#include "kernel/memory.h"
+#include "kernel/crc32c.h"
+#include "kernel/sync.h"
+#include "fs/bcache.h"
+
+#define BCACHE_HASH_BUCKETS     256     // Power of two
+
+// External device I/O functions (implemented by storage driver)
+extern int device_read(const char* device, uint32_t offset, void* buffer, uint32_t size);
+extern int device_write(const char* device, uint32_t offset, const void* buffer, uint32_t size);
+
+// Cache state
+static const char* g_device = NULL;
+static uint32_t g_block_size = 0;
+static uint32_t g_max_buffers = 0;
+static bcache_buffer_t* g_hash[BCACHE_HASH_BUCKETS];
+static bcache_buffer_t g_lru;        // Sentinel: next is most recent, prev least recent
+static uint32_t g_now = 0;           // Last tick seen by bcache_periodic_sync
+static uint8_t* g_staging = NULL;    // Gathers adjacent blocks for one device request
+static bcache_flush_t g_flush_hook = NULL;
+static bcache_flush_t g_sync_lock = NULL;
+static bcache_flush_t g_sync_unlock = NULL;
+static bool g_checksums = false;
+static uint32_t g_journal_limit = 0;  // 0 while journaling is off
+static bcache_flush_t g_journal_commit = NULL;
+static bcache_stats_t g_stats;
+static spinlock_t g_lock = SPINLOCK_INIT;
+static spinlock_t g_staging_lock = SPINLOCK_INIT; // Whoever holds it may use g_staging
+static uint32_t g_writing_back = 0;  // Dirty buffers pinned by eviction while written
+
+static inline uint32_t bcache_hash(uint32_t owner, uint32_t block) {
+    return (((block ^ (owner << 20)) * 2654435761u) >> 24) & (BCACHE_HASH_BUCKETS - 1);
+}
+
+static void bcache_lru_unlink(bcache_buffer_t* buffer) {
+    buffer->lru_prev->lru_next = buffer->lru_next;
+    buffer->lru_next->lru_prev = buffer->lru_prev;
+}
+
+static void bcache_lru_push_front(bcache_buffer_t* buffer) {
+    buffer->lru_prev = &g_lru;
+    buffer->lru_next = g_lru.lru_next;
+    g_lru.lru_next->lru_prev = buffer;
+    g_lru.lru_next = buffer;
+}
+
+// Emptied buffers go to the LRU tail, to be reused before any holding data
+static void bcache_lru_push_back(bcache_buffer_t* buffer) {
+    bcache_lru_unlink(buffer);
+    buffer->lru_next = &g_lru;
+    buffer->lru_prev = g_lru.lru_prev;
+    g_lru.lru_prev->lru_next = buffer;
+    g_lru.lru_prev = buffer;
+}
+
+static bcache_buffer_t* bcache_lookup(uint32_t owner, uint32_t block) {
+    for (bcache_buffer_t* buffer = g_hash[bcache_hash(owner, block)]; buffer; buffer = buffer->hash_next) {
+        if (buffer->block == block && buffer->owner == owner) {
+            return buffer;
+        }
+    }
+    
+    return NULL;
+}
+
+static void bcache_hash_insert(bcache_buffer_t* buffer) {
+    uint32_t bucket = bcache_hash(buffer->owner, buffer->block);
+    buffer->hash_next = g_hash[bucket];
+    g_hash[bucket] = buffer;
+}
+
+static void bcache_hash_remove(bcache_buffer_t* buffer) {
+    bcache_buffer_t** link = &g_hash[bcache_hash(buffer->owner, buffer->block)];
+    while (*link && *link != buffer) {
+        link = &(*link)->hash_next;
+    }
+    
+    if (*link) {
+        *link = buffer->hash_next;
+    }
+    buffer->hash_next = NULL;
+}
+
+// Store the CRC32C of a changed metadata block in its last four bytes
+static void bcache_seal(bcache_buffer_t* buffer) {
+    if (buffer->flags & BCACHE_SEAL) {
+        uint32_t crc = crc32c(0, buffer->data, g_block_size - sizeof(uint32_t));
+        memcpy(buffer->data + g_block_size - sizeof(uint32_t), &crc, sizeof(uint32_t));
+        buffer->flags &= ~BCACHE_SEAL;
+        g_stats.checksums_computed++;
+    }
+}
+
+// Write pinned buffers holding consecutive blocks, with a single device
+// request when the staging buffer is free. They count as clean from the
+// moment they are sealed, so a change made meanwhile marks them dirty again.
+// Another thread may be writing some of them already; only buffers still
+// dirty are counted.
+static int bcache_write_blocks(bcache_buffer_t** buffers, uint32_t count) {
+    spin_lock(&g_lock);
+    for (uint32_t i = 0; i < count; i++) {
+        bcache_seal(buffers[i]);
+        if (buffers[i]->flags & BCACHE_DIRTY) {
+            buffers[i]->flags &= ~BCACHE_DIRTY;
+            g_stats.dirty_buffers--;
+        }
+    }
+    spin_unlock(&g_lock);
+    
+    int result = OMNIOS_SUCCESS;
+    uint32_t requests = 0;
+    if (count > 1 && g_staging && spin_trylock(&g_staging_lock)) {
+        for (uint32_t i = 0; i < count; i++) {
+            memcpy(g_staging + i * g_block_size, buffers[i]->data, g_block_size);
+        }
+        result = device_write(g_device, buffers[0]->block * g_block_size, g_staging, count * g_block_size);
+        spin_unlock(&g_staging_lock);
+        requests = 1;
+    } else {
+        for (uint32_t i = 0; i < count && result == OMNIOS_SUCCESS; i++) {
+            result = device_write(g_device, buffers[i]->block * g_block_size, buffers[i]->data, g_block_size);
+            requests++;
+        }
+    }
+    
+    spin_lock(&g_lock);
+    if (result != OMNIOS_SUCCESS) {
+        for (uint32_t i = 0; i < count; i++) {
+            if (!(buffers[i]->flags & BCACHE_DIRTY)) {
+                buffers[i]->flags |= BCACHE_DIRTY;
+                g_stats.dirty_buffers++;
+            }
+        }
+    } else {
+        g_stats.writebacks += count;
+    }
+    g_stats.write_requests += requests;
+    spin_unlock(&g_lock);
+    return result != OMNIOS_SUCCESS ? OMNIOS_ERROR_IO : OMNIOS_SUCCESS;
+}
+
+// Pin up to max dirty blocks in [first, last] into list, sorted by block
+static uint32_t bcache_collect_dirty(uint32_t first, uint32_t last, bool expired_only, bcache_buffer_t** list,
+                                     uint32_t max) {
+    uint32_t count = 0;
+    spin_lock(&g_lock);
+    for (bcache_buffer_t* buffer = g_lru.lru_next; buffer != &g_lru && count < max; buffer = buffer->lru_next) {
+        if (!(buffer->flags & BCACHE_DIRTY) || (buffer->flags & BCACHE_JOURNAL) ||
+            buffer->block < first || buffer->block > last ||
+            (expired_only && g_now - buffer->dirty_since < BCACHE_DIRTY_EXPIRE)) {
+            continue;
+        }
+        
+        uint32_t i = count++;
+        while (i > 0 && list[i - 1]->block > buffer->block) {
+            list[i] = list[i - 1];
+            i--;
+        }
+        list[i] = buffer;
+        buffer->refcount++;
+    }
+    spin_unlock(&g_lock);
+    
+    return count;
+}
+
+// Write the dirty blocks in [first, last] in block order, merging runs of
+// adjacent blocks. expired_only limits it to blocks dirty for too long.
+// Passes repeat until one finds nothing left, so blocks dirtied again
+// meanwhile are written too.
+static int bcache_write_dirty(uint32_t first, uint32_t last, bool expired_only) {
+    if (!g_device) {
+        return OMNIOS_SUCCESS;
+    }
+    
+    int result = OMNIOS_SUCCESS;
+    uint32_t count;
+    do {
+        spin_lock(&g_lock);
+        uint32_t capacity = g_stats.dirty_buffers;
+        spin_unlock(&g_lock);
+        if (capacity == 0) {
+            break;
+        }
+        
+        // No memory to sort: write one block per pass, in LRU order
+        bcache_buffer_t* single;
+        bcache_buffer_t** list = memory_allocate(capacity * sizeof(bcache_buffer_t*));
+        if (!list) {
+            list = &single;
+            capacity = 1;
+        }
+        
+        count = bcache_collect_dirty(first, last, expired_only, list, capacity);
+        for (uint32_t i = 0; i < count;) {
+            uint32_t end = i + 1;
+            while (end < count && end - i < BCACHE_MAX_IO_BLOCKS && list[end]->block == list[end - 1]->block + 1) {
+                end++;
+            }
+            
+            if (bcache_write_blocks(&list[i], end - i) != OMNIOS_SUCCESS) {
+                result = OMNIOS_ERROR_IO;
+            }
+            i = end;
+        }
+        
+        spin_lock(&g_lock);
+        for (uint32_t i = 0; i < count; i++) {
+            list[i]->refcount--;
+        }
+        spin_unlock(&g_lock);
+        
+        if (list != &single) {
+            memory_free(list);
+        }
+    } while (count > 0 && result == OMNIOS_SUCCESS);
+    
+    return result;
+}
+
+// Take a buffer for a new block, with the lock held: a fresh one while
+// under the limit, otherwise the least recently used clean one nobody
+// holds. Allocating a buffer or writing back a dirty one happens with the
+// lock dropped, and *unlocked tells the caller to look its block up again.
+static bcache_buffer_t* bcache_take_buffer(bool* unlocked) {
+    *unlocked = false;
+    if (g_stats.buffers < g_max_buffers) {
+        g_stats.buffers++; // Reserved while the lock is dropped
+        spin_unlock(&g_lock);
+        bcache_buffer_t* buffer = memory_allocate(sizeof(bcache_buffer_t));
+        uint8_t* data = buffer ? memory_allocate_aligned(g_block_size, g_block_size) : NULL;
+        if (!data) {
+            memory_free(buffer);
+            buffer = NULL;
+        }
+        spin_lock(&g_lock);
+        *unlocked = true;
+        
+        if (buffer) {
+            memset(buffer, 0, sizeof(bcache_buffer_t));
+            buffer->data = data;
+            bcache_lru_push_front(buffer);
+            return buffer;
+        }
+        g_stats.buffers--; // Out of memory: fall back to recycling
+    }
+    
+    for (;;) {
+        bcache_buffer_t* dirty = NULL;
+        for (bcache_buffer_t* buffer = g_lru.lru_prev; buffer != &g_lru; buffer = buffer->lru_prev) {
+            if (buffer->refcount > 0 || (buffer->flags & (BCACHE_DELAYED | BCACHE_JOURNAL))) {
+                continue;
+            }
+            
+            if (!(buffer->flags & BCACHE_DIRTY)) {
+                bcache_hash_remove(buffer);
+                buffer->flags = 0;
+                g_stats.evictions++;
+                return buffer;
+            }
+            
+            if (!dirty) {
+                dirty = buffer;
+            }
+        }
+        
+        if (!dirty && g_writing_back == 0) {
+            return NULL; // Every buffer is pinned
+        }
+        
+        // Another thread's write-back will free a buffer soon
+        if (!dirty) {
+            spin_unlock(&g_lock);
+            SYNC_WAIT();
+            spin_lock(&g_lock);
+            *unlocked = true;
+            continue;
+        }
+        
+        // Only dirty buffers are left: write back the oldest and look again
+        dirty->refcount++;
+        g_writing_back++;
+        spin_unlock(&g_lock);
+        int result = bcache_write_blocks(&dirty, 1);
+        spin_lock(&g_lock);
+        dirty->refcount--;
+        g_writing_back--;
+        *unlocked = true;
+        if (result != OMNIOS_SUCCESS) {
+            return NULL; // Keep data we could not write
+        }
+    }
+}
+
+// The cached buffer of a block, or with *taken set a buffer to load it
+// into; NULL when it is missing and every buffer is pinned
+static bcache_buffer_t* bcache_lookup_or_take(uint32_t owner, uint32_t block, bool* taken) {
+    bcache_buffer_t* buffer = bcache_lookup(owner, block);
+    *taken = false;
+    if (buffer) {
+        return buffer;
+    }
+    
+    bool unlocked;
+    bcache_buffer_t* fresh = bcache_take_buffer(&unlocked);
+    
+    // Another thread may have brought the block in while the lock was dropped
+    buffer = unlocked ? bcache_lookup(owner, block) : NULL;
+    if (buffer) {
+        if (fresh) {
+            bcache_lru_push_back(fresh);
+        }
+        return buffer;
+    }
+    
+    *taken = fresh != NULL;
+    return fresh;
+}
+
+static void bcache_pin(bcache_buffer_t* buffer) {
+    buffer->refcount++;
+    bcache_lru_unlink(buffer);
+    bcache_lru_push_front(buffer);
+}
+
+// Unhash a buffer nobody holds and queue it for reuse
+static void bcache_drop(bcache_buffer_t* buffer) {
+    if (buffer->flags & BCACHE_DIRTY) {
+        g_stats.dirty_buffers--;
+    }
+    if (buffer->flags & BCACHE_JOURNAL) {
+        g_stats.journal_buffers--;
+    }
+    
+    bcache_hash_remove(buffer);
+    buffer->flags = 0;
+    bcache_lru_push_back(buffer);
+}
+
+// Wait until a read started by another thread is done. NULL, with the
+// pin dropped, when that read failed.
+static bcache_buffer_t* bcache_wait_loaded(bcache_buffer_t* buffer) {
+    for (;;) {
+        spin_lock(&g_lock);
+        uint16_t flags = buffer->flags;
+        if (!(flags & BCACHE_LOADING)) {
+            if (!(flags & BCACHE_VALID)) {
+                buffer->refcount--;
+                buffer = NULL;
+            }
+            spin_unlock(&g_lock);
+            return buffer;
+        }
+        spin_unlock(&g_lock);
+        SYNC_WAIT();
+    }
+}
+
+// Finish the reads of buffers this thread claimed as loading and drop
+// pins from each; a failed read unhashes them again
+static void bcache_loaded(bcache_buffer_t** buffers, uint32_t count, uint32_t pins, bool ok) {
+    spin_lock(&g_lock);
+    for (uint32_t i = 0; i < count; i++) {
+        bcache_buffer_t* buffer = buffers[i];
+        buffer->refcount -= pins;
+        if (ok) {
+            buffer->flags = BCACHE_VALID;
+        } else {
+            bcache_hash_remove(buffer);
+            buffer->flags = 0;
+            bcache_lru_push_back(buffer);
+        }
+    }
+    if (!ok) {
+        g_stats.read_errors++;
+    }
+    spin_unlock(&g_lock);
+}
+
+static bcache_buffer_t* bcache_acquire(uint32_t owner, uint32_t block, bool read) {
+    if (!g_device) {
+        return NULL;
+    }
+    
+    spin_lock(&g_lock);
+    bool taken;
+    bcache_buffer_t* buffer = bcache_lookup_or_take(owner, block, &taken);
+    if (buffer && !taken) {
+        g_stats.hits++;
+        bcache_pin(buffer);
+        bool loading = buffer->flags & BCACHE_LOADING;
+        spin_unlock(&g_lock);
+        return loading ? bcache_wait_loaded(buffer) : buffer;
+    }
+    
+    g_stats.misses++;
+    if (!buffer) {
+        spin_unlock(&g_lock);
+        return NULL;
+    }
+    
+    buffer->block = block;
+    buffer->owner = owner;
+    buffer->flags = read ? BCACHE_LOADING : BCACHE_VALID;
+    bcache_hash_insert(buffer);
+    bcache_pin(buffer);
+    if (read) {
+        g_stats.read_requests++;
+    }
+    spin_unlock(&g_lock);
+    
+    if (read) {
+        // Loading keeps everyone else off the data, so no lock is needed
+        bool ok = device_read(g_device, block * g_block_size, buffer->data, g_block_size) == OMNIOS_SUCCESS;
+        bcache_loaded(&buffer, 1, ok ? 0 : 1, ok);
+        return ok ? buffer : NULL;
+    }
+    return buffer;
+}
+
+int bcache_init(const char* device, uint32_t block_size, uint32_t max_buffers) {
+    if (g_device) {
+        bcache_shutdown();
+    }
+    
+    g_device = device;
+    g_block_size = block_size;
+    g_max_buffers = max_buffers ? max_buffers : BCACHE_DEFAULT_BUFFERS;
+    memset(g_hash, 0, sizeof(g_hash));
+    memset(&g_stats, 0, sizeof(g_stats));
+    g_stats.capacity = g_max_buffers;
+    g_lru.lru_next = &g_lru;
+    g_lru.lru_prev = &g_lru;
+    
+    // Without a staging buffer every block is written on its own
+    g_staging = memory_allocate(BCACHE_MAX_IO_BLOCKS * block_size);
+    return OMNIOS_SUCCESS;
+}
+
+void bcache_shutdown(void) {
+    if (!g_device) {
+        return;
+    }
+    
+    bcache_sync();
+    
+    bcache_buffer_t* buffer = g_lru.lru_next;
+    while (buffer != &g_lru) {
+        bcache_buffer_t* next = buffer->lru_next;
+        memory_free(buffer->data);
+        memory_free(buffer);
+        buffer = next;
+    }
+    
+    g_lru.lru_next = &g_lru;
+    g_lru.lru_prev = &g_lru;
+    memset(g_hash, 0, sizeof(g_hash));
+    memory_free(g_staging);
+    g_staging = NULL;
+    g_stats.buffers = 0;
+    g_stats.delayed_buffers = 0;
+    g_stats.journal_buffers = 0;
+    g_journal_limit = 0;
+    g_journal_commit = NULL;
+    g_sync_lock = NULL;
+    g_sync_unlock = NULL;
+    g_checksums = false;
+    g_device = NULL;
+}
+
+bcache_buffer_t* bcache_get(uint32_t block) {
+    return bcache_acquire(0, block, true);
+}
+
+bcache_buffer_t* bcache_get_new(uint32_t block) {
+    return bcache_acquire(0, block, false);
+}
+
+bcache_buffer_t* bcache_get_metadata(uint32_t block) {
+    bcache_buffer_t* buffer = bcache_acquire(0, block, true);
+    if (!buffer || !g_checksums) {
+        return buffer;
+    }
+    
+    // Checked under the lock, so no one can start changing the block
+    // before it has passed
+    spin_lock(&g_lock);
+    if (!(buffer->flags & (BCACHE_VERIFIED | BCACHE_SEAL))) {
+        uint32_t stored;
+        memcpy(&stored, buffer->data + g_block_size - sizeof(uint32_t), sizeof(uint32_t));
+        if (crc32c(0, buffer->data, g_block_size - sizeof(uint32_t)) != stored) {
+            g_stats.checksum_errors++;
+            if (--buffer->refcount == 0) {
+                bcache_drop(buffer); // Read it again next time
+            }
+            buffer = NULL;
+        } else {
+            buffer->flags |= BCACHE_VERIFIED;
+        }
+    }
+    spin_unlock(&g_lock);
+    return buffer;
+}
+
+static void bcache_mark_dirty_locked(bcache_buffer_t* buffer) {
+    buffer->flags &= ~(BCACHE_SEAL | BCACHE_VERIFIED);
+    if (!(buffer->flags & (BCACHE_DIRTY | BCACHE_DELAYED))) {
+        buffer->flags |= BCACHE_DIRTY;
+        buffer->dirty_since = g_now;
+        g_stats.dirty_buffers++;
+    }
+}
+
+// Data written over a block leaves nothing to seal or trust as metadata
+void bcache_mark_dirty(bcache_buffer_t* buffer) {
+    spin_lock(&g_lock);
+    bcache_mark_dirty_locked(buffer);
+    spin_unlock(&g_lock);
+}
+
+void bcache_release(bcache_buffer_t* buffer) {
+    if (!buffer) {
+        return;
+    }
+    
+    spin_lock(&g_lock);
+    if (buffer->refcount > 0) {
+        buffer->refcount--;
+    }
+    spin_unlock(&g_lock);
+}
+
+void bcache_invalidate(uint32_t block) {
+    spin_lock(&g_lock);
+    bcache_buffer_t* buffer = bcache_lookup(0, block);
+    if (buffer && buffer->refcount == 0) {
+        bcache_drop(buffer);
+    }
+    spin_unlock(&g_lock);
+}
+
+int bcache_read_ahead(uint32_t block, uint32_t count) {
+    if (!g_device || !g_staging) {
+        return OMNIOS_SUCCESS; // Only a hint
+    }
+    
+    bcache_buffer_t* loading[BCACHE_MAX_IO_BLOCKS];
+    uint32_t end = block + count;
+    while (block < end) {
+        // Claim the next stretch of missing blocks
+        spin_lock(&g_lock);
+        while (block < end && bcache_lookup(0, block)) {
+            block++;
+        }
+        
+        uint32_t length = 0;
+        bool pinned = false;
+        while (block + length < end && length < BCACHE_MAX_IO_BLOCKS) {
+            bool taken;
+            bcache_buffer_t* buffer = bcache_lookup_or_take(0, block + length, &taken);
+            if (!buffer) {
+                pinned = true; // Everything is pinned; the rest is read on demand
+                break;
+            }
+            if (!taken) {
+                break; // Cached already, the stretch ends here
+            }
+            
+            buffer->block = block + length;
+            buffer->owner = 0;
+            buffer->flags = BCACHE_LOADING;
+            bcache_hash_insert(buffer);
+            bcache_pin(buffer);
+            loading[length++] = buffer;
+        }
+        if (length > 0) {
+            g_stats.read_requests++;
+            g_stats.readahead_blocks += length;
+        }
+        spin_unlock(&g_lock);
+        
+        if (length == 0) {
+            break;
+        }
+        
+        // Through the staging buffer in one request, or block by block
+        // straight into the buffers while another thread has it
+        bool ok = true;
+        if (spin_trylock(&g_staging_lock)) {
+            ok = device_read(g_device, block * g_block_size, g_staging, length * g_block_size) == OMNIOS_SUCCESS;
+            for (uint32_t i = 0; i < length && ok; i++) {
+                memcpy(loading[i]->data, g_staging + i * g_block_size, g_block_size);
+            }
+            spin_unlock(&g_staging_lock);
+        } else {
+            for (uint32_t i = 0; i < length && ok; i++) {
+                ok = device_read(g_device, (block + i) * g_block_size, loading[i]->data,
+                                 g_block_size) == OMNIOS_SUCCESS;
+            }
+        }
+        
+        bcache_loaded(loading, length, 1, ok);
+        if (!ok) {
+            return OMNIOS_ERROR_IO;
+        }
+        if (pinned) {
+            break;
+        }
+        block += length;
+    }
+    
+    return OMNIOS_SUCCESS;
+}
+
+int bcache_read_direct(uint32_t block, uint32_t count, void* buffer) {
+    if (!g_device) {
+        return OMNIOS_ERROR_IO;
+    }
+    
+    uint8_t* out = (uint8_t*)buffer;
+    uint32_t i = 0;
+    while (i < count) {
+        // The cached copy may be newer than the disk
+        spin_lock(&g_lock);
+        bcache_buffer_t* cached = bcache_lookup(0, block + i);
+        if (cached) {
+            g_stats.hits++;
+            bcache_pin(cached);
+            spin_unlock(&g_lock);
+            
+            cached = bcache_wait_loaded(cached);
+            if (!cached) {
+                return OMNIOS_ERROR_IO;
+            }
+            memcpy(out + i * g_block_size, cached->data, g_block_size);
+            bcache_release(cached);
+            i++;
+            continue;
+        }
+        
+        uint32_t length = 1;
+        while (i + length < count && !bcache_lookup(0, block + i + length)) {
+            length++;
+        }
+        g_stats.read_requests++;
+        g_stats.direct_blocks += length;
+        spin_unlock(&g_lock);
+        
+        if (device_read(g_device, (block + i) * g_block_size, out + i * g_block_size,
+                        length * g_block_size) != OMNIOS_SUCCESS) {
+            spin_lock(&g_lock);
+            g_stats.read_errors++;
+            spin_unlock(&g_lock);
+            return OMNIOS_ERROR_IO;
+        }
+        i += length;
+    }
+    
+    return OMNIOS_SUCCESS;
+}
+
+int bcache_sync(void) {
+    return bcache_write_dirty(0, 0xFFFFFFFF, false);
+}
+
+int bcache_write_run(uint32_t block, uint32_t count) {
+    return count ? bcache_write_dirty(block, block + count - 1, false) : OMNIOS_SUCCESS;
+}
+
+void bcache_periodic_sync(uint32_t now) {
+    spin_lock(&g_lock);
+    g_now = now;
+    spin_unlock(&g_lock);
+    if (!g_device) {
+        return;
+    }
+    
+    if (g_sync_lock) {
+        g_sync_lock();
+    }
+    
+    // Expired delayed data is allocated and held metadata committed first
+    // so they go out in this pass
+    bool expired = false;
+    spin_lock(&g_lock);
+    if (g_flush_hook && g_stats.delayed_buffers + g_stats.journal_buffers > 0) {
+        for (bcache_buffer_t* buffer = g_lru.lru_prev; buffer != &g_lru && !expired; buffer = buffer->lru_prev) {
+            expired = (buffer->flags & (BCACHE_DELAYED | BCACHE_JOURNAL)) &&
+                      now - buffer->dirty_since >= BCACHE_DIRTY_EXPIRE;
+        }
+    }
+    spin_unlock(&g_lock);
+    if (expired) {
+        g_flush_hook();
+    }
+    
+    bcache_write_dirty(0, 0xFFFFFFFF, true);
+    if (g_sync_unlock) {
+        g_sync_unlock();
+    }
+}
+
+bcache_buffer_t* bcache_get_delayed(uint32_t owner, uint32_t block, bool* created) {
+    if (owner == 0 || !g_device) {
+        return NULL;
+    }
+    
+    spin_lock(&g_lock);
+    bool taken;
+    bcache_buffer_t* buffer = bcache_lookup_or_take(owner, block, &taken);
+    bool found = buffer && !taken;
+    if (found) {
+        g_stats.hits++;
+        bcache_pin(buffer);
+    } else {
+        g_stats.misses++;
+        if (buffer) {
+            memset(buffer->data, 0, g_block_size);
+            buffer->block = block;
+            buffer->owner = owner;
+            buffer->flags = BCACHE_VALID | BCACHE_DELAYED;
+            buffer->dirty_since = g_now;
+            bcache_hash_insert(buffer);
+            bcache_pin(buffer);
+            g_stats.delayed_buffers++;
+        }
+    }
+    spin_unlock(&g_lock);
+    
+    if (created) {
+        *created = buffer && !found;
+    }
+    return buffer;
+}
+
+bcache_buffer_t* bcache_find_delayed(uint32_t owner, uint32_t block) {
+    if (owner == 0) {
+        return NULL;
+    }
+    
+    spin_lock(&g_lock);
+    bcache_buffer_t* buffer = bcache_lookup(owner, block);
+    if (buffer) {
+        bcache_pin(buffer);
+    }
+    spin_unlock(&g_lock);
+    return buffer;
+}
+
+uint32_t bcache_collect_delayed(uint32_t owner, bcache_buffer_t** buffers, uint32_t max) {
+    uint32_t count = 0;
+    spin_lock(&g_lock);
+    for (bcache_buffer_t* buffer = g_lru.lru_prev; buffer != &g_lru && count < max; buffer = buffer->lru_prev) {
+        if ((buffer->flags & BCACHE_DELAYED) && buffer->owner == owner) {
+            buffer->refcount++;
+            buffers[count++] = buffer;
+        }
+    }
+    spin_unlock(&g_lock);
+    
+    return count;
+}
+
+uint32_t bcache_next_delayed_owner(void) {
+    uint32_t owner = 0;
+    spin_lock(&g_lock);
+    if (g_stats.delayed_buffers > 0) {
+        for (bcache_buffer_t* buffer = g_lru.lru_prev; buffer != &g_lru; buffer = buffer->lru_prev) {
+            if (buffer->flags & BCACHE_DELAYED) {
+                owner = buffer->owner;
+                break;
+            }
+        }
+    }
+    spin_unlock(&g_lock);
+    
+    return owner;
+}
+
+int bcache_assign_block(bcache_buffer_t* buffer, uint32_t block) {
+    spin_lock(&g_lock);
+    if (!(buffer->flags & BCACHE_DELAYED)) {
+        spin_unlock(&g_lock);
+        return OMNIOS_ERROR_GENERIC;
+    }
+    
+    // A cached copy of a block freed earlier must not shadow the new data
+    bcache_buffer_t* stale = bcache_lookup(0, block);
+    if (stale) {
+        if (stale->refcount > 0) {
+            spin_unlock(&g_lock);
+            return OMNIOS_ERROR_GENERIC;
+        }
+        bcache_drop(stale);
+    }
+    
+    bcache_hash_remove(buffer);
+    buffer->owner = 0;
+    buffer->block = block;
+    buffer->flags = BCACHE_VALID | BCACHE_DIRTY;
+    bcache_hash_insert(buffer);
+    
+    g_stats.delayed_buffers--;
+    g_stats.dirty_buffers++;
+    spin_unlock(&g_lock);
+    return OMNIOS_SUCCESS;
+}
+
+void bcache_discard_delayed(bcache_buffer_t* buffer) {
+    spin_lock(&g_lock);
+    if (buffer->flags & BCACHE_DELAYED) {
+        bcache_hash_remove(buffer);
+        buffer->owner = 0;
+        buffer->flags = 0;
+        bcache_lru_push_back(buffer);
+        g_stats.delayed_buffers--;
+    }
+    spin_unlock(&g_lock);
+}
+
+void bcache_set_journaling(uint32_t limit, bcache_flush_t commit) {
+    spin_lock(&g_lock);
+    g_journal_limit = commit ? limit : 0;
+    g_journal_commit = commit;
+    
+    // Turning it off releases whatever is still held
+    if (g_journal_limit == 0) {
+        for (bcache_buffer_t* buffer = g_lru.lru_next; buffer != &g_lru; buffer = buffer->lru_next) {
+            buffer->flags &= ~BCACHE_JOURNAL;
+        }
+        g_stats.journal_buffers = 0;
+    }
+    spin_unlock(&g_lock);
+}
+
+void bcache_mark_metadata(bcache_buffer_t* buffer) {
+    bool commit = false;
+    spin_lock(&g_lock);
+    if (g_journal_limit == 0 || (buffer->flags & BCACHE_DELAYED)) {
+        bcache_mark_dirty_locked(buffer);
+        if (g_checksums && !(buffer->flags & BCACHE_DELAYED)) {
+            buffer->flags |= BCACHE_SEAL | BCACHE_VERIFIED;
+        }
+    } else {
+        if (g_checksums) {
+            buffer->flags |= BCACHE_SEAL | BCACHE_VERIFIED;
+        }
+        
+        // The commit interval runs from the first change since the last commit
+        if (!(buffer->flags & BCACHE_JOURNAL)) {
+            if (!(buffer->flags & BCACHE_DIRTY)) {
+                g_stats.dirty_buffers++;
+            }
+            buffer->flags |= BCACHE_DIRTY | BCACHE_JOURNAL;
+            buffer->dirty_since = g_now;
+            commit = ++g_stats.journal_buffers >= g_journal_limit;
+        }
+    }
+    spin_unlock(&g_lock);
+    
+    // Outside the lock: the commit collects buffers itself
+    if (commit) {
+        g_journal_commit();
+    }
+}
+
+uint32_t bcache_collect_metadata(bcache_buffer_t** buffers, uint32_t max) {
+    uint32_t count = 0;
+    spin_lock(&g_lock);
+    for (bcache_buffer_t* buffer = g_lru.lru_prev; buffer != &g_lru && count < max; buffer = buffer->lru_prev) {
+        if (buffer->flags & BCACHE_JOURNAL) {
+            bcache_seal(buffer);
+            buffer->refcount++;
+            buffers[count++] = buffer;
+        }
+    }
+    spin_unlock(&g_lock);
+    
+    return count;
+}
+
+void bcache_commit_metadata(bcache_buffer_t* buffer) {
+    spin_lock(&g_lock);
+    if (buffer->flags & BCACHE_JOURNAL) {
+        buffer->flags &= ~BCACHE_JOURNAL;
+        g_stats.journal_buffers--;
+    }
+    spin_unlock(&g_lock);
+}
+
+void bcache_set_checksums(bool enable) {
+    g_checksums = enable;
+}
+
+void bcache_set_flush_hook(bcache_flush_t flush) {
+    g_flush_hook = flush;
+}
+
+void bcache_set_sync_lock(bcache_flush_t lock, bcache_flush_t unlock) {
+    g_sync_lock = lock;
+    g_sync_unlock = unlock;
+}
+
+void bcache_get_stats(bcache_stats_t* stats) {
+    spin_lock(&g_lock);
+    *stats = g_stats;
+    spin_unlock(&g_lock);
+}
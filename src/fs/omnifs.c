@@ -4,54 +4,60 @@
  */
 
 #include "omnios.h"
+#include "kernel/crc32c.h"
+#include "kernel/sync.h"
 #include "fs/omnifs.h"
+#include "fs/omnifs_format.h"
+#include "fs/omnifs_extent.h"
+#include "fs/omnifs_dir.h"
+#include "fs/omnifs_dcache.h"
+#include "fs/omnifs_bitmap.h"
+#include "fs/omnifs_journal.h"
+#include "fs/omnifs_icache.h"
+#include "fs/omnifs_compress.h"
+#include "fs/bcache.h"
 
-// OmniFS structures
-typedef struct {
-    uint32_t magic;           // 'OMNI'
-    uint32_t version;         // File system version
-    uint32_t block_size;      // Block size in bytes
-    uint32_t total_blocks;    // Total number of blocks
-    uint32_t free_blocks;     // Number of free blocks
-    uint32_t inode_count;     // Total number of inodes
-    uint32_t free_inodes;     // Number of free inodes
-    uint32_t root_inode;      // Root directory inode
-    uint32_t block_bitmap;    // Block bitmap location
-    uint32_t inode_bitmap;    // Inode bitmap location
-    uint32_t inode_table;     // Inode table location
-    uint32_t data_blocks;     // First data block
-    uint8_t reserved[468];    // Reserved space
-} omnifs_superblock_t;
-
-typedef struct {
-    uint32_t mode;            // File type and permissions
-    uint32_t uid;             // User ID
-    uint32_t gid;             // Group ID
-    uint32_t size;            // File size in bytes
-    uint32_t atime;           // Access time
-    uint32_t mtime;           // Modification time
-    uint32_t ctime;           // Creation time
-    uint32_t blocks;          // Number of blocks used
-    uint32_t direct[12];      // Direct block pointers
-    uint32_t indirect;        // Indirect block pointer
-    uint32_t double_indirect; // Double indirect block pointer
-    uint32_t triple_indirect; // Triple indirect block pointer
-} omnifs_inode_t;
+#define OMNIFS_FLUSH_BATCH      64      // Delayed buffers allocated per pass
+#define OMNIFS_RA_STREAMS       8       // Files tracked for sequential reads
+#define OMNIFS_RA_MIN_BLOCKS    4       // First read-ahead window
+#define OMNIFS_RA_MAX_BLOCKS    BCACHE_MAX_IO_BLOCKS
+#define OMNIFS_DIRECT_MIN_BLOCKS 4      // Whole blocks a read needs to bypass the cache
+#define OMNIFS_FORMAT_CHUNK_BLOCKS 32   // Inode table blocks written per request at format
+#define OMNIFS_LIST_BATCH       8       // Entries decoded per readdir call by 'ls'
+#define OMNIFS_RECLAIM_BATCH    64      // Revoked blocks returned to the bitmap per pass
 
+// Sequential read detection for one file
 typedef struct {
-    uint32_t inode;           // Inode number
-    uint16_t rec_len;         // Record length
-    uint8_t name_len;         // Name length
-    uint8_t file_type;        // File type
-    char name[];              // File name (variable length)
-} omnifs_dirent_t;
+    uint32_t inode;
+    uint32_t next_offset;     // Where a sequential read would continue
+    uint32_t window;          // Read-ahead in blocks, 0 while access looks random
+    uint32_t ahead;           // First file block not read ahead yet
+} omnifs_readahead_t;
 
 // File system state
 static omnifs_superblock_t* g_superblock = NULL;
 static uint8_t* g_block_bitmap = NULL;
 static uint8_t* g_inode_bitmap = NULL;
-static omnifs_inode_t* g_inode_table = NULL;
+static omnifs_bitmap_t g_block_map;
+static omnifs_bitmap_t g_inode_map;
+static uint32_t g_delayed_blocks = 0;   // Free blocks promised to delayed buffers
+static uint16_t* g_refcounts = NULL;    // Owners of each block beyond the first, version 4
+static omnifs_readahead_t g_readahead[OMNIFS_RA_STREAMS];
+static bool g_journaled = false;        // Metadata goes through the journal
 static bool g_omnifs_mounted = false;
+static const char* g_device = NULL;
+
+// Locking. Calls on single files and directories hold the volume shared
+// and lock the inodes they use; calls that change many inodes at once,
+// sync and journal commits hold it exclusively. Smaller state has a
+// spinlock of its own, taken after any inode lock.
+static rwlock_t g_volume_lock = RWLOCK_INIT;
+static bool g_exclusive = false;        // Volume held exclusively
+static uint32_t g_commit_wanted = 0;    // Commit asked for while shared
+static spinlock_t g_space_lock = SPINLOCK_INIT;     // Free counts, g_delayed_blocks
+static spinlock_t g_refcount_lock = SPINLOCK_INIT;
+static spinlock_t g_table_lock = SPINLOCK_INIT;     // Copies of the bitmaps into the cache
+static spinlock_t g_readahead_lock = SPINLOCK_INIT;
 
 // Function prototypes
 int omnifs_format(const char* device, uint32_t size);
@@ -62,57 +68,382 @@ int omnifs_delete_file(const char* path);
 int omnifs_read_file(const char* path, void* buffer, uint32_t size, uint32_t offset);
 int omnifs_write_file(const char* path, const void* buffer, uint32_t size, uint32_t offset);
 int omnifs_list_directory(const char* path, omnifs_dirent_t* entries, int max_entries);
+int omnifs_readdir(const char* path, uint32_t* cookie, omnifs_dir_entry_t* entries, int max_entries);
+int omnifs_set_compression(const char* path, bool enable);
+int omnifs_clone(const char* source, const char* target);
+int omnifs_exchange(const char* first, const char* second);
+int omnifs_snapshot_create(const char* name);
+int omnifs_snapshot_restore(const char* name);
+int omnifs_snapshot_delete(const char* name);
+int omnifs_sync(void);
+int omnifs_write_inode_data(omnifs_inode_t* inode, const void* buffer, uint32_t size, uint32_t offset);
+uint32_t omnifs_allocate_block_near(uint32_t goal);
+uint32_t omnifs_allocate_blocks(uint32_t goal, uint32_t* count);
+int omnifs_flush_delayed(void);
+static int omnifs_flush_inode(omnifs_inode_t* inode);
+static int omnifs_flush_delayed_inode(uint32_t number);
+static void omnifs_periodic_flush(void);
+void omnifs_free_block(uint32_t block);
+static int omnifs_release_inode(uint32_t number, uint32_t keep);
+static void omnifs_release_state(void);
+static uint32_t omnifs_find_parent(const char* path, const char** name);
+static uint32_t omnifs_walk_path(const char* path);
+static int omnifs_sync_volume(void);
 
-// Fixed 'ls' command implementation
-int omnifs_list_directory_fixed(const char* path, omnifs_dirent_t* entries, int max_entries) {
-    if (!g_omnifs_mounted) {
-        return OMNIOS_ERROR_IO;
+// Version 2 file systems map file blocks with extent trees
+static inline bool omnifs_uses_extents(void) {
+    return g_superblock->version >= OMNIFS_VERSION_EXTENTS;
+}
+
+// Version 3 keeps small files and directories in the inode
+static inline bool omnifs_uses_inline(void) {
+    return g_superblock->version >= OMNIFS_VERSION_INLINE;
+}
+
+// Version 4 counts block owners, so files can share blocks
+static inline bool omnifs_uses_reflinks(void) {
+    return g_superblock->version >= OMNIFS_VERSION_REFLINK && g_refcounts != NULL;
+}
+
+// Version 5 closes every metadata block with a CRC32C
+static inline bool omnifs_uses_checksums(void) {
+    return g_superblock->version >= OMNIFS_VERSION_CHECKSUMS;
+}
+
+// Bytes of an on-disk table held by each of its blocks
+static inline uint32_t omnifs_table_payload(void) {
+    return g_superblock->block_size - (omnifs_uses_checksums() ? OMNIFS_CHECKSUM_SIZE : 0);
+}
+
+// Bytes per inode table record
+static inline uint32_t omnifs_inode_size(void) {
+    return g_superblock->inode_size ? g_superblock->inode_size : OMNIFS_INODE_SIZE_V2;
+}
+
+static inline uint32_t omnifs_inode_number(const omnifs_inode_t* inode) {
+    return omnifs_icache_number(inode);
+}
+
+// Regular file data on version 2 waits in the buffer cache for its disk
+// blocks; directories are allocated as they are written
+static inline bool omnifs_delays_allocation(const omnifs_inode_t* inode) {
+    return omnifs_uses_extents() && (inode->mode & 0xF000) != 0x4000;
+}
+
+// Copy a byte range of an on-disk table starting at base_block through the
+// cache; fails on a read error or a block whose checksum does not match
+static int omnifs_read_region(uint32_t base_block, void* table, uint32_t size) {
+    uint32_t payload = omnifs_table_payload();
+    
+    for (uint32_t done = 0; done < size; done += payload) {
+        bcache_buffer_t* buffer = bcache_get_metadata(base_block + done / payload);
+        if (!buffer) {
+            return OMNIOS_ERROR_IO;
+        }
+        
+        uint32_t bytes = (size - done < payload) ? size - done : payload;
+        memcpy((uint8_t*)table + done, buffer->data, bytes);
+        bcache_release(buffer);
     }
     
-    // Find directory inode
-    uint32_t dir_inode = omnifs_find_inode(path);
-    if (dir_inode == 0) {
-        return OMNIOS_ERROR_NOT_FOUND;
+    return OMNIOS_SUCCESS;
+}
+
+// Push changed bytes [offset, offset + size) of an in-memory table back
+// into its cached blocks; they reach the disk on the next sync. lock
+// guards the table while it is copied.
+static int omnifs_write_metadata(uint32_t base_block, const void* table, uint32_t offset, uint32_t size,
+                                 spinlock_t* lock) {
+    uint32_t payload = omnifs_table_payload();
+    uint32_t end = offset + size;
+    
+    while (offset < end) {
+        uint32_t block_offset = offset % payload;
+        uint32_t bytes = payload - block_offset;
+        if (bytes > end - offset) {
+            bytes = end - offset;
+        }
+        
+        bcache_buffer_t* buffer = bcache_get_metadata(base_block + offset / payload);
+        if (!buffer) {
+            return OMNIOS_ERROR_IO;
+        }
+        
+        // The bitmaps change with atomic stores under their group locks,
+        // so the table is read the same way
+        spin_lock(lock);
+        for (uint32_t i = 0; i < bytes; i++) {
+            buffer->data[block_offset + i] = __atomic_load_n((const uint8_t*)table + offset + i, __ATOMIC_RELAXED);
+        }
+        spin_unlock(lock);
+        bcache_mark_metadata(buffer);
+        bcache_release(buffer);
+        offset += bytes;
     }
     
-    // Get directory inode
-    omnifs_inode_t* inode = &g_inode_table[dir_inode];
-    if ((inode->mode & 0xF000) != 0x4000) { // Not a directory
-        return OMNIOS_ERROR_GENERIC;
+    return OMNIOS_SUCCESS;
+}
+
+static inline void omnifs_inode_dirty(const omnifs_inode_t* inode) {
+    omnifs_icache_dirty(inode);
+}
+
+// Free counts travel with the bitmap changes they describe
+static inline void omnifs_superblock_dirty(void) {
+    omnifs_write_metadata(0, g_superblock, 0, sizeof(omnifs_superblock_t), &g_space_lock);
+}
+
+static inline bool omnifs_block_shared(uint32_t block) {
+    if (!g_refcounts || block >= g_superblock->total_blocks) {
+        return false;
+    }
+    
+    spin_lock(&g_refcount_lock);
+    bool shared = g_refcounts[block] > 0;
+    spin_unlock(&g_refcount_lock);
+    return shared;
+}
+
+// Promise a free block to a new delayed buffer; false when every free
+// block is already spoken for
+static bool omnifs_reserve_delayed(void) {
+    spin_lock(&g_space_lock);
+    bool reserved = g_delayed_blocks < g_superblock->free_blocks;
+    if (reserved) {
+        g_delayed_blocks++;
+    }
+    spin_unlock(&g_space_lock);
+    return reserved;
+}
+
+static void omnifs_unreserve_delayed(uint32_t count) {
+    spin_lock(&g_space_lock);
+    g_delayed_blocks -= count;
+    spin_unlock(&g_space_lock);
+}
+
+// Called by the journal when a transaction is full. A commit must not see
+// metadata halfway through a change, so a thread sharing the volume leaves
+// it to the next exclusive holder.
+static void omnifs_commit_wanted(void) {
+    if (g_exclusive) {
+        omnifs_journal_commit();
+    } else {
+        __atomic_store_n(&g_commit_wanted, 1, __ATOMIC_RELAXED);
+    }
+}
+
+// Return blocks whose revokes have been committed to the bitmap. They
+// stay allocated until then, so replay cannot write an old copy over the
+// data of a new owner.
+static void omnifs_reclaim_blocks(void) {
+    uint32_t blocks[OMNIFS_RECLAIM_BATCH];
+    uint32_t count;
+    while ((count = omnifs_journal_reclaim(blocks, OMNIFS_RECLAIM_BATCH)) > 0) {
+        for (uint32_t i = 0; i < count; i++) {
+            if (!omnifs_bitmap_free(&g_block_map, blocks[i], 1)) {
+                continue;
+            }
+            
+            omnifs_write_metadata(g_superblock->block_bitmap, g_block_bitmap, blocks[i] / 8, 1, &g_table_lock);
+            spin_lock(&g_space_lock);
+            g_superblock->free_blocks++;
+            spin_unlock(&g_space_lock);
+            omnifs_superblock_dirty();
+        }
+    }
+}
+
+static void omnifs_enter(void) {
+    rw_read_lock(&g_volume_lock);
+}
+
+static void omnifs_enter_exclusive(void) {
+    rw_write_lock(&g_volume_lock);
+    g_exclusive = true;
+}
+
+// Commits held back by shared holders run before the volume is let go
+static void omnifs_leave_exclusive(void) {
+    if (g_omnifs_mounted && g_journaled) {
+        if (__atomic_exchange_n(&g_commit_wanted, 0, __ATOMIC_RELAXED)) {
+            omnifs_journal_commit();
+        }
+        omnifs_reclaim_blocks();
+    }
+    g_exclusive = false;
+    rw_write_unlock(&g_volume_lock);
+}
+
+static void omnifs_leave(void) {
+    rw_read_unlock(&g_volume_lock);
+    if (__atomic_load_n(&g_commit_wanted, __ATOMIC_RELAXED)) {
+        omnifs_enter_exclusive();
+        omnifs_leave_exclusive();
+    }
+}
+
+// Give count blocks from start one more owner each; false, with nothing
+// changed, when one of them has run out of counts
+static bool omnifs_share_blocks(uint32_t start, uint32_t count) {
+    spin_lock(&g_refcount_lock);
+    for (uint32_t i = 0; i < count; i++) {
+        if (g_refcounts[start + i] == OMNIFS_REFCOUNT_MAX) {
+            spin_unlock(&g_refcount_lock);
+            return false;
+        }
+    }
+    
+    for (uint32_t i = 0; i < count; i++) {
+        g_refcounts[start + i]++;
     }
+    spin_unlock(&g_refcount_lock);
     
-    // Read directory entries
+    omnifs_write_metadata(g_superblock->refcount_table, g_refcounts, start * sizeof(uint16_t),
+                          count * sizeof(uint16_t), &g_refcount_lock);
+    return true;
+}
+
+// Empty block map for a new inode; on version 3 the contents start inline
+static void omnifs_inode_init_data(omnifs_inode_t* inode) {
+    memset(inode->inline_data, 0, sizeof(inode->inline_data));
+    inode->flags = 0;
+    if (omnifs_uses_inline()) {
+        inode->flags = OMNIFS_INODE_INLINE;
+    } else if (omnifs_uses_extents()) {
+        omnifs_extent_init_root(inode);
+    }
+}
+
+// Fixed 'ls' command implementation. Entries are packed one after the
+// other with NUL-terminated names; rec_len steps to the next one.
+int omnifs_list_directory_fixed(const char* path, omnifs_dirent_t* entries, int max_entries) {
+    omnifs_dir_entry_t batch[OMNIFS_LIST_BATCH];
+    uint8_t* out = (uint8_t*)entries;
+    uint32_t cookie = 0;
     int entry_count = 0;
-    uint32_t offset = 0;
     
-    while (offset < inode->size && entry_count < max_entries) {
-        omnifs_dirent_t* dirent = (omnifs_dirent_t*)((uint8_t*)entries + offset);
-        
-        // Read directory entry from disk
-        if (omnifs_read_inode_data(inode, dirent, sizeof(omnifs_dirent_t), offset) != OMNIOS_SUCCESS) {
-            break;
-        }
-        
-        // Validate entry
-        if (dirent->rec_len == 0 || dirent->name_len == 0) {
+    while (entry_count < max_entries) {
+        int wanted = max_entries - entry_count;
+        int count = omnifs_readdir(path, &cookie, batch, wanted < OMNIFS_LIST_BATCH ? wanted : OMNIFS_LIST_BATCH);
+        if (count <= 0) {
+            if (count < 0 && entry_count == 0) {
+                return count;
+            }
             break;
         }
         
-        // Read file name
-        if (omnifs_read_inode_data(inode, dirent->name, dirent->name_len, 
-                                   offset + sizeof(omnifs_dirent_t)) != OMNIOS_SUCCESS) {
-            break;
+        for (int i = 0; i < count; i++) {
+            omnifs_dirent_t* dirent = (omnifs_dirent_t*)out;
+            dirent->inode = batch[i].inode;
+            dirent->rec_len = (sizeof(omnifs_dirent_t) + batch[i].name_len + 1 + 3) & ~3;
+            dirent->name_len = batch[i].name_len;
+            dirent->file_type = batch[i].file_type;
+            memcpy(dirent->name, batch[i].name, batch[i].name_len + 1);
+            out += dirent->rec_len;
         }
-        
-        dirent->name[dirent->name_len] = '\0'; // Null terminate
-        
-        entry_count++;
-        offset += dirent->rec_len;
+        entry_count += count;
     }
     
     return entry_count;
 }
 
+// Batched readdir: up to max_entries entries from *cookie on (0 to start),
+// decoded from each directory block in one pass. *cookie is advanced for
+// the next call, which returns 0 once the directory is exhausted.
+int omnifs_readdir(const char* path, uint32_t* cookie, omnifs_dir_entry_t* entries, int max_entries) {
+    if (!g_omnifs_mounted) {
+        return OMNIOS_ERROR_IO;
+    }
+    
+    omnifs_enter();
+    uint32_t dir_inode = omnifs_walk_path(path);
+    omnifs_inode_t* inode = dir_inode ? omnifs_icache_get(dir_inode) : NULL;
+    
+    int count;
+    if (!inode) {
+        count = dir_inode ? OMNIOS_ERROR_IO : OMNIOS_ERROR_NOT_FOUND;
+    } else {
+        omnifs_icache_lock_shared(inode);
+        if ((inode->mode & 0xF000) != 0x4000) { // Not a directory
+            count = OMNIOS_ERROR_GENERIC;
+        } else {
+            count = max_entries > 0 ? omnifs_dir_read(inode, cookie, entries, max_entries) : 0;
+        }
+        omnifs_icache_unlock_shared(inode);
+        omnifs_icache_put(inode);
+    }
+    omnifs_leave();
+    return count;
+}
+
+// Opt a file in or out of cluster compression. Only files still
+// without data blocks can switch, as their stored data would otherwise be
+// read in the wrong form.
+int omnifs_set_compression(const char* path, bool enable) {
+    if (!g_omnifs_mounted) {
+        return OMNIOS_ERROR_IO;
+    }
+    if (!omnifs_uses_inline()) {
+        return OMNIOS_ERROR_PERMISSION; // No inode flags before version 3
+    }
+    
+    omnifs_enter();
+    uint32_t file_inode = omnifs_walk_path(path);
+    omnifs_inode_t* inode = file_inode ? omnifs_icache_get(file_inode) : NULL;
+    if (!inode) {
+        omnifs_leave();
+        return file_inode ? OMNIOS_ERROR_IO : OMNIOS_ERROR_NOT_FOUND;
+    }
+    
+    int result = OMNIOS_SUCCESS;
+    omnifs_icache_lock_exclusive(inode);
+    if ((inode->mode & 0xF000) == 0x4000) {
+        result = OMNIOS_ERROR_GENERIC; // Directories stay uncompressed
+    } else if (inode->flags & OMNIFS_INODE_READONLY) {
+        result = OMNIOS_ERROR_PERMISSION;
+    } else if (!(inode->flags & OMNIFS_INODE_INLINE) && inode->size > 0) {
+        result = OMNIOS_ERROR_PERMISSION;
+    } else if (enable != !!(inode->flags & OMNIFS_INODE_COMPRESSED)) {
+        inode->flags ^= OMNIFS_INODE_COMPRESSED;
+        omnifs_inode_dirty(inode);
+    }
+    omnifs_icache_unlock_exclusive(inode);
+    
+    omnifs_icache_put(inode);
+    omnifs_leave();
+    return result;
+}
+
+// Close a metadata block with the CRC32C of the rest of it
+static void omnifs_seal_block(uint8_t* block, uint32_t block_size) {
+    uint32_t crc = crc32c(0, block, block_size - OMNIFS_CHECKSUM_SIZE);
+    memcpy(block + block_size - OMNIFS_CHECKSUM_SIZE, &crc, OMNIFS_CHECKSUM_SIZE);
+}
+
+// Write a table from block start on at format time, each block holding
+// the payload bytes that omnifs_read_region expects and a checksum
+static int omnifs_format_table(const char* device, uint32_t start, const void* table, uint32_t size,
+                               uint32_t block_size) {
+    uint8_t* block = memory_allocate(block_size);
+    if (!block) {
+        return OMNIOS_ERROR_MEMORY;
+    }
+    
+    uint32_t payload = block_size - OMNIFS_CHECKSUM_SIZE;
+    int result = OMNIOS_SUCCESS;
+    for (uint32_t done = 0; done < size && result == OMNIOS_SUCCESS; done += payload) {
+        uint32_t bytes = (size - done < payload) ? size - done : payload;
+        memset(block, 0, block_size);
+        memcpy(block, (const uint8_t*)table + done, bytes);
+        omnifs_seal_block(block, block_size);
+        result = device_write(device, (start + done / payload) * block_size, block, block_size);
+    }
+    
+    memory_free(block);
+    return result;
+}
+
 int omnifs_format(const char* device, uint32_t size) {
     console_print("Formatting %s with OmniFS...\n", device);
     
@@ -121,68 +452,125 @@ int omnifs_format(const char* device, uint32_t size) {
     uint32_t total_blocks = size / block_size;
     uint32_t inode_count = total_blocks / 4; // 1 inode per 4 blocks
     
+    // Up to 1/16 of the device for the journal; small devices go without
+    uint32_t journal_blocks = total_blocks / 16;
+    if (journal_blocks > OMNIFS_JOURNAL_DEFAULT_BLOCKS) {
+        journal_blocks = OMNIFS_JOURNAL_DEFAULT_BLOCKS;
+    } else if (journal_blocks < OMNIFS_JOURNAL_MIN_BLOCKS) {
+        journal_blocks = 0;
+    }
+    
+    // Layout: superblock, block bitmap, inode bitmap, inode table, journal,
+    // reference counts, data. Every metadata block ends in its checksum.
+    uint32_t payload = block_size - OMNIFS_CHECKSUM_SIZE;
+    uint32_t inodes_per_block = payload / sizeof(omnifs_inode_t);
+    uint32_t bitmap_size = (total_blocks + 7) / 8;
+    uint32_t inode_bitmap_size = (inode_count + 7) / 8;
+    uint32_t refcount_size = total_blocks * sizeof(uint16_t);
+    uint32_t block_bitmap_start = 1;
+    uint32_t inode_bitmap_start = block_bitmap_start + (bitmap_size + payload - 1) / payload;
+    uint32_t inode_table_start = inode_bitmap_start + (inode_bitmap_size + payload - 1) / payload;
+    uint32_t journal_start = inode_table_start + (inode_count + inodes_per_block - 1) / inodes_per_block;
+    uint32_t refcount_start = journal_start + journal_blocks;
+    uint32_t refcount_blocks = (refcount_size + payload - 1) / payload;
+    uint32_t data_start = refcount_start + refcount_blocks;
+    
+    if (data_start >= total_blocks) {
+        return OMNIOS_ERROR_GENERIC; // Device too small
+    }
+    
     // Allocate superblock
     omnifs_superblock_t superblock;
     memset(&superblock, 0, sizeof(omnifs_superblock_t));
     
-    superblock.magic = 0x494E4D4F; // 'OMNI'
-    superblock.version = 1;
+    superblock.magic = OMNIFS_MAGIC;
+    superblock.version = OMNIFS_VERSION_CURRENT;
     superblock.block_size = block_size;
     superblock.total_blocks = total_blocks;
-    superblock.free_blocks = total_blocks - 10; // Reserve first 10 blocks
+    superblock.free_blocks = total_blocks - data_start; // Metadata blocks are reserved
     superblock.inode_count = inode_count;
     superblock.free_inodes = inode_count - 1; // Root inode used
     superblock.root_inode = 1;
-    superblock.block_bitmap = 1;
-    superblock.inode_bitmap = 2;
-    superblock.inode_table = 3;
-    superblock.data_blocks = 10;
+    superblock.block_bitmap = block_bitmap_start;
+    superblock.inode_bitmap = inode_bitmap_start;
+    superblock.inode_table = inode_table_start;
+    superblock.data_blocks = data_start;
+    superblock.journal_start = journal_start;
+    superblock.journal_blocks = journal_blocks;
+    superblock.inode_size = sizeof(omnifs_inode_t);
+    superblock.refcount_table = refcount_start;
+    superblock.refcount_blocks = refcount_blocks;
     
     // Write superblock to device
-    if (device_write(device, 0, &superblock, sizeof(omnifs_superblock_t)) != OMNIOS_SUCCESS) {
+    if (omnifs_format_table(device, 0, &superblock, sizeof(omnifs_superblock_t), block_size) != OMNIOS_SUCCESS) {
         return OMNIOS_ERROR_IO;
     }
     
     // Initialize block bitmap
-    uint32_t bitmap_size = (total_blocks + 7) / 8;
     uint8_t* block_bitmap = memory_allocate(bitmap_size);
     memset(block_bitmap, 0, bitmap_size);
     
     // Mark reserved blocks as used
-    for (int i = 0; i < 10; i++) {
+    for (uint32_t i = 0; i < data_start; i++) {
         block_bitmap[i / 8] |= (1 << (i % 8));
     }
     
-    device_write(device, block_size, block_bitmap, bitmap_size);
+    omnifs_format_table(device, block_bitmap_start, block_bitmap, bitmap_size, block_size);
     memory_free(block_bitmap);
     
     // Initialize inode bitmap
-    uint32_t inode_bitmap_size = (inode_count + 7) / 8;
     uint8_t* inode_bitmap = memory_allocate(inode_bitmap_size);
     memset(inode_bitmap, 0, inode_bitmap_size);
     
     // Mark root inode as used
     inode_bitmap[1 / 8] |= (1 << (1 % 8));
     
-    device_write(device, block_size * 2, inode_bitmap, inode_bitmap_size);
+    omnifs_format_table(device, inode_bitmap_start, inode_bitmap, inode_bitmap_size, block_size);
     memory_free(inode_bitmap);
     
-    // Initialize inode table
-    uint32_t inode_table_size = inode_count * sizeof(omnifs_inode_t);
-    omnifs_inode_t* inode_table = memory_allocate(inode_table_size);
-    memset(inode_table, 0, inode_table_size);
+    // Write the inode table a chunk at a time; only the root inode is set
+    uint32_t table_blocks = journal_start - inode_table_start;
+    uint32_t chunk_blocks = table_blocks < OMNIFS_FORMAT_CHUNK_BLOCKS ? table_blocks : OMNIFS_FORMAT_CHUNK_BLOCKS;
+    uint8_t* chunk = memory_allocate(chunk_blocks * block_size);
+    if (!chunk) {
+        return OMNIOS_ERROR_MEMORY;
+    }
+    memset(chunk, 0, chunk_blocks * block_size);
     
     // Create root directory inode
-    omnifs_inode_t* root_inode = &inode_table[1];
+    omnifs_inode_t* root_inode = &((omnifs_inode_t*)chunk)[1];
     root_inode->mode = 0x41ED; // Directory with 755 permissions
     root_inode->uid = 0;
     root_inode->gid = 0;
     root_inode->size = 0;
     root_inode->atime = root_inode->mtime = root_inode->ctime = get_current_time();
     root_inode->blocks = 0;
+    root_inode->flags = OMNIFS_INODE_INLINE;
+    
+    for (uint32_t i = 0; i < chunk_blocks; i++) {
+        omnifs_seal_block(chunk + i * block_size, block_size);
+    }
+    
+    for (uint32_t done = 0; done < table_blocks; done += chunk_blocks) {
+        uint32_t count = table_blocks - done < chunk_blocks ? table_blocks - done : chunk_blocks;
+        device_write(device, (inode_table_start + done) * block_size, chunk, count * block_size);
+        if (done == 0) {
+            memset(chunk, 0, block_size); // Later chunks are empty
+            omnifs_seal_block(chunk, block_size);
+        }
+    }
     
-    device_write(device, block_size * 3, inode_table, inode_table_size);
-    memory_free(inode_table);
+    // No block starts out shared; empty sealed blocks serve for any table
+    for (uint32_t done = 0; done < refcount_blocks; done += chunk_blocks) {
+        uint32_t count = refcount_blocks - done < chunk_blocks ? refcount_blocks - done : chunk_blocks;
+        device_write(device, (refcount_start + done) * block_size, chunk, count * block_size);
+    }
+    memory_free(chunk);
+    
+    if (journal_blocks > 0 &&
+        omnifs_journal_format(device, block_size, journal_start, journal_blocks) != OMNIOS_SUCCESS) {
+        return OMNIOS_ERROR_IO;
+    }
     
     console_print("OmniFS formatting completed\n");
     return OMNIOS_SUCCESS;
@@ -199,32 +587,205 @@ int omnifs_mount(const char* device) {
     }
     
     // Verify magic number
-    if (g_superblock->magic != 0x494E4D4F) {
+    if (g_superblock->magic != OMNIFS_MAGIC) {
         console_print("Invalid OmniFS magic number\n");
         memory_free(g_superblock);
         return OMNIOS_ERROR_GENERIC;
     }
     
-    // Load block bitmap
+    // Version 1 images keep their block pointers and stay mountable
+    if (g_superblock->version < OMNIFS_VERSION_POINTERS || g_superblock->version > OMNIFS_VERSION_CURRENT ||
+        omnifs_inode_size() < OMNIFS_INODE_SIZE_V2 || omnifs_inode_size() > sizeof(omnifs_inode_t)) {
+        console_print("Unsupported OmniFS version %d\n", g_superblock->version);
+        memory_free(g_superblock);
+        return OMNIOS_ERROR_GENERIC;
+    }
+    
+    // All further block I/O goes through the buffer cache
+    g_device = device;
+    bcache_init(device, g_superblock->block_size, BCACHE_DEFAULT_BUFFERS);
+    bcache_set_flush_hook(omnifs_periodic_flush);
+    bcache_set_sync_lock(omnifs_enter_exclusive, omnifs_leave_exclusive);
+    bcache_set_checksums(omnifs_uses_checksums());
+    
+    // Replay before anything reads metadata; the superblock may be among
+    // the replayed blocks
+    g_journaled = omnifs_uses_extents() && g_superblock->journal_blocks > 0;
+    int result = OMNIOS_SUCCESS;
+    if (g_journaled) {
+        result = omnifs_journal_open(device, g_superblock->block_size, g_superblock->journal_start,
+                                     g_superblock->journal_blocks);
+        if (result != OMNIOS_SUCCESS) {
+            console_print("OmniFS journal replay failed\n");
+        } else {
+            omnifs_journal_set_commit_hook(omnifs_commit_wanted);
+        }
+    }
+    __atomic_store_n(&g_commit_wanted, 0, __ATOMIC_RELAXED);
+    
+    // Reread it through the cache, which checks it on version 5
+    if (result == OMNIOS_SUCCESS && (g_journaled || omnifs_uses_checksums())) {
+        result = omnifs_read_region(0, g_superblock, sizeof(omnifs_superblock_t));
+        if (result != OMNIOS_SUCCESS) {
+            console_print("OmniFS superblock is damaged\n");
+        }
+    }
+    
+    if (result != OMNIOS_SUCCESS) {
+        if (g_journaled) {
+            omnifs_journal_close();
+            g_journaled = false;
+        }
+        bcache_shutdown();
+        memory_free(g_superblock);
+        g_superblock = NULL;
+        g_device = NULL;
+        return result;
+    }
+    
+    omnifs_extent_init(g_superblock->block_size, omnifs_allocate_block_near);
+    omnifs_dir_init(g_superblock->block_size, omnifs_uses_extents());
+    omnifs_dcache_init(OMNIFS_DCACHE_DEFAULT_ENTRIES);
+    memset(g_readahead, 0, sizeof(g_readahead));
+    
+    // Load block bitmap, padded to whole words for scanning
     uint32_t bitmap_size = (g_superblock->total_blocks + 7) / 8;
-    g_block_bitmap = memory_allocate(bitmap_size);
-    device_read(device, g_superblock->block_size, g_block_bitmap, bitmap_size);
+    g_block_bitmap = memory_allocate(OMNIFS_BITMAP_BYTES(g_superblock->total_blocks));
+    memset(g_block_bitmap, 0, OMNIFS_BITMAP_BYTES(g_superblock->total_blocks));
+    result = omnifs_read_region(g_superblock->block_bitmap, g_block_bitmap, bitmap_size);
     
     // Load inode bitmap
     uint32_t inode_bitmap_size = (g_superblock->inode_count + 7) / 8;
-    g_inode_bitmap = memory_allocate(inode_bitmap_size);
-    device_read(device, g_superblock->block_size * 2, g_inode_bitmap, inode_bitmap_size);
+    g_inode_bitmap = memory_allocate(OMNIFS_BITMAP_BYTES(g_superblock->inode_count));
+    memset(g_inode_bitmap, 0, OMNIFS_BITMAP_BYTES(g_superblock->inode_count));
+    if (result == OMNIOS_SUCCESS) {
+        result = omnifs_read_region(g_superblock->inode_bitmap, g_inode_bitmap, inode_bitmap_size);
+    }
     
-    // Load inode table
-    uint32_t inode_table_size = g_superblock->inode_count * sizeof(omnifs_inode_t);
-    g_inode_table = memory_allocate(inode_table_size);
-    device_read(device, g_superblock->block_size * 3, g_inode_table, inode_table_size);
+    // One search group per bitmap block
+    uint32_t group_shift = __builtin_ctz(g_superblock->block_size) + 3;
+    omnifs_bitmap_init(&g_block_map, g_block_bitmap, g_superblock->total_blocks,
+                       g_superblock->data_blocks, group_shift);
+    omnifs_bitmap_init(&g_inode_map, g_inode_bitmap, g_superblock->inode_count, 1, group_shift);
+    
+    // Reference counts stay resident next to the bitmaps
+    if (g_superblock->version >= OMNIFS_VERSION_REFLINK && g_superblock->refcount_blocks > 0) {
+        uint32_t refcount_size = g_superblock->total_blocks * sizeof(uint16_t);
+        g_refcounts = memory_allocate(refcount_size);
+        if (g_refcounts && result == OMNIOS_SUCCESS) {
+            result = omnifs_read_region(g_superblock->refcount_table, g_refcounts, refcount_size);
+        }
+    }
+    
+    // Inodes are read from the table as they are first used; version 5
+    // keeps them off each block's checksum
+    uint32_t inodes_per_block = omnifs_uses_checksums() ? omnifs_table_payload() / omnifs_inode_size() : 0;
+    omnifs_icache_init(g_superblock->inode_table, g_superblock->inode_count, omnifs_inode_size(),
+                       inodes_per_block, g_superblock->block_size, OMNIFS_ICACHE_DEFAULT_ENTRIES);
+    
+    // Damaged allocation tables or root inode keep the volume unmounted
+    if (result == OMNIOS_SUCCESS && omnifs_uses_checksums()) {
+        omnifs_inode_t* root = omnifs_icache_get(g_superblock->root_inode);
+        result = root ? OMNIOS_SUCCESS : OMNIOS_ERROR_IO;
+        omnifs_icache_put(root);
+    }
+    if (result != OMNIOS_SUCCESS) {
+        console_print("OmniFS metadata is damaged, not mounting\n");
+        if (g_journaled) {
+            omnifs_journal_close();
+            g_journaled = false;
+        }
+        omnifs_release_state();
+        return result;
+    }
+    
+    // Compression is recorded in inode flags, which version 3 added
+    if (omnifs_uses_inline()) {
+        omnifs_compress_init(g_superblock->block_size, omnifs_allocate_blocks, omnifs_free_block);
+    }
     
     g_omnifs_mounted = true;
     console_print("OmniFS mounted successfully\n");
     return OMNIOS_SUCCESS;
 }
 
+// Write the superblock and every dirty cached block to the device. With a
+// journal the metadata is committed first and the journal left empty.
+static int omnifs_sync_volume(void) {
+    // Delayed data gets its blocks first so it goes out with this sync
+    int result = omnifs_flush_delayed();
+    omnifs_superblock_dirty();
+    
+    int synced;
+    if (g_journaled) {
+        // Blocks a commit releases change the bitmap again, which the
+        // next commit takes along
+        do {
+            synced = omnifs_journal_commit();
+            omnifs_reclaim_blocks();
+        } while (synced == OMNIOS_SUCCESS && omnifs_journal_pending());
+        
+        if (synced == OMNIOS_SUCCESS) {
+            synced = omnifs_journal_checkpoint();
+        }
+    } else {
+        synced = bcache_sync();
+    }
+    return result != OMNIOS_SUCCESS ? result : synced;
+}
+
+int omnifs_sync(void) {
+    if (!g_omnifs_mounted) {
+        return OMNIOS_ERROR_IO;
+    }
+    
+    omnifs_enter_exclusive();
+    int result = omnifs_sync_volume();
+    omnifs_leave_exclusive();
+    return result;
+}
+
+// No other call may run while the volume is mounted or unmounted
+int omnifs_unmount(void) {
+    if (!g_omnifs_mounted) {
+        return OMNIOS_ERROR_IO;
+    }
+    
+    omnifs_enter_exclusive();
+    int result = omnifs_sync_volume();
+    if (g_journaled) {
+        int closed = omnifs_journal_close();
+        result = result != OMNIOS_SUCCESS ? result : closed;
+        g_journaled = false;
+    }
+    omnifs_release_state();
+    omnifs_leave_exclusive();
+    
+    console_print("OmniFS unmounted\n");
+    return result;
+}
+
+// Drop everything mount set up once the journal is closed
+static void omnifs_release_state(void) {
+    bcache_shutdown();
+    omnifs_dcache_shutdown();
+    omnifs_icache_shutdown();
+    omnifs_compress_shutdown();
+    
+    omnifs_bitmap_destroy(&g_block_map);
+    omnifs_bitmap_destroy(&g_inode_map);
+    memory_free(g_inode_bitmap);
+    memory_free(g_block_bitmap);
+    memory_free(g_refcounts);
+    memory_free(g_superblock);
+    g_inode_bitmap = NULL;
+    g_block_bitmap = NULL;
+    g_refcounts = NULL;
+    g_superblock = NULL;
+    g_device = NULL;
+    g_omnifs_mounted = false;
+}
+
 // .opi package support functions
 int omnifs_install_opi_package(const char* package_path) {
     console_print("Installing OPI package: %s\n", package_path);
@@ -328,7 +889,7 @@ int omnifs_register_package(const opi_package_header_t* header, const char* inst
         return OMNIOS_ERROR_IO;
     }
     
-    fprintf(db_file, "%s|%s|%s|%s|%u|%s\n",
+    fprintf(db_file, "%s|%u|%s|%s|%u|%s\n",
             header->package_name,
             header->version,
             header->description,
@@ -340,67 +901,181 @@ int omnifs_register_package(const opi_package_header_t* header, const char* inst
     return OMNIOS_SUCCESS;
 }
 
-uint32_t omnifs_find_inode(const char* path) {
-    if (!g_omnifs_mounted) {
+// Resolve one path component, answering from the dentry cache when it can
+static uint32_t omnifs_lookup_child(uint32_t parent_inode, const char* name, uint32_t len) {
+    if (len == 0 || len > 255) {
         return 0;
     }
     
-    // Start from root inode
-    uint32_t current_inode = g_superblock->root_inode;
+    // Known names resolve without touching the parent inode or any lock
+    uint32_t child;
+    if (omnifs_dcache_lookup(parent_inode, name, len, &child)) {
+        return child;
+    }
     
-    // Handle root path
-    if (strcmp(path, "/") == 0) {
-        return current_inode;
+    omnifs_inode_t* inode = omnifs_icache_get(parent_inode);
+    if (!inode) {
+        return 0;
     }
     
-    // Parse path components
-    char* path_copy = strdup(path);
-    char* token = strtok(path_copy + 1, "/"); // Skip leading slash
+    char entry_name[256];
+    memcpy(entry_name, name, len);
+    entry_name[len] = '\0';
+    
+    // Hash index when the directory has one, linear scan otherwise.
+    // Misses are cached too, so repeated existence checks stay in memory;
+    // the parent stays locked until then so a new name cannot slip past.
+    child = 0;
+    omnifs_icache_lock_shared(inode);
+    if ((inode->mode & 0xF000) == 0x4000) {
+        child = omnifs_dir_lookup(inode, entry_name);
+        omnifs_dcache_insert(parent_inode, name, len, child);
+    }
+    omnifs_icache_unlock_shared(inode);
+    omnifs_icache_put(inode);
+    return child;
+}
+
+static inline uint32_t omnifs_lookup_name(uint32_t parent_inode, const char* name) {
+    return omnifs_lookup_child(parent_inode, name, strlen(name));
+}
+
+static uint32_t omnifs_walk_path(const char* path) {
+    // Start from root inode
+    uint32_t current_inode = g_superblock->root_inode;
     
-    while (token != NULL && current_inode != 0) {
-        current_inode = omnifs_find_child_inode(current_inode, token);
-        token = strtok(NULL, "/");
+    // Walk the components in place, without copying the path
+    const char* component = path;
+    while (current_inode != 0) {
+        while (*component == '/') {
+            component++;
+        }
+        
+        if (*component == '\0') {
+            break;
+        }
+        
+        const char* end = component;
+        while (*end != '\0' && *end != '/') {
+            end++;
+        }
+        
+        current_inode = omnifs_lookup_child(current_inode, component, end - component);
+        component = end;
     }
     
-    free(path_copy);
     return current_inode;
 }
 
-uint32_t omnifs_find_child_inode(uint32_t parent_inode, const char* name) {
-    omnifs_inode_t* inode = &g_inode_table[parent_inode];
+uint32_t omnifs_find_inode(const char* path) {
+    if (!g_omnifs_mounted) {
+        return 0;
+    }
     
-    // Ensure it's a directory
-    if ((inode->mode & 0xF000) != 0x4000) {
+    omnifs_enter();
+    uint32_t number = omnifs_walk_path(path);
+    omnifs_leave();
+    return number;
+}
+
+uint32_t omnifs_find_child_inode(uint32_t parent_inode, const char* name) {
+    omnifs_enter();
+    uint32_t child = omnifs_lookup_name(parent_inode, name);
+    omnifs_leave();
+    return child;
+}
+
+// Disk block for a file block plus the length of the contiguous run it starts
+static uint32_t omnifs_map_block(omnifs_inode_t* inode, uint32_t block_index, uint32_t* run) {
+    if (inode->flags & OMNIFS_INODE_INLINE) {
+        *run = 0;
         return 0;
     }
     
-    // Search directory entries
-    uint32_t offset = 0;
-    while (offset < inode->size) {
-        omnifs_dirent_t dirent;
-        
-        if (omnifs_read_inode_data(inode, &dirent, sizeof(omnifs_dirent_t), offset) != OMNIOS_SUCCESS) {
-            break;
+    if (omnifs_uses_extents()) {
+        return omnifs_extent_map(inode, block_index, run);
+    }
+    
+    *run = 1;
+    return omnifs_get_block_number(inode, block_index);
+}
+
+// Track the file's read pattern. Reads continuing where the previous one
+// ended double the window up to one device request; once half of what
+// was read ahead is consumed, the cache is topped up to a window past the
+// current read. Reads served directly are only tracked.
+static void omnifs_readahead(omnifs_inode_t* inode, uint32_t offset, uint32_t size, bool direct) {
+    uint32_t number = omnifs_inode_number(inode);
+    uint32_t block_size = g_superblock->block_size;
+    uint32_t first = offset / block_size;
+    uint32_t last = (offset + size - 1) / block_size;
+    uint32_t file_blocks = (inode->size + block_size - 1) / block_size;
+    
+    // The stream is updated under the lock; the reads are issued after
+    spin_lock(&g_readahead_lock);
+    omnifs_readahead_t* stream = &g_readahead[number % OMNIFS_RA_STREAMS];
+    if (stream->inode != number) {
+        memset(stream, 0, sizeof(omnifs_readahead_t));
+        stream->inode = number;
+    }
+    
+    bool sequential = offset == stream->next_offset;
+    stream->next_offset = offset + size;
+    if (!sequential) {
+        stream->window = 0;
+        stream->ahead = 0;
+        spin_unlock(&g_readahead_lock);
+        return;
+    }
+    
+    stream->window = stream->window ? stream->window * 2 : OMNIFS_RA_MIN_BLOCKS;
+    if (stream->window > OMNIFS_RA_MAX_BLOCKS) {
+        stream->window = OMNIFS_RA_MAX_BLOCKS;
+    }
+    
+    if (direct || stream->ahead > last + stream->window / 2) {
+        spin_unlock(&g_readahead_lock);
+        return;
+    }
+    
+    uint32_t end = last + 1 + stream->window;
+    if (end > file_blocks) {
+        end = file_blocks;
+    }
+    uint32_t from = first > stream->ahead ? first : stream->ahead;
+    stream->ahead = end;
+    spin_unlock(&g_readahead_lock);
+    
+    // Merge mapped runs that are adjacent on disk; holes and delayed
+    // blocks are skipped
+    uint32_t start = 0;
+    uint32_t length = 0;
+    for (uint32_t index = from; index < end;) {
+        uint32_t run;
+        uint32_t physical = omnifs_map_block(inode, index, &run);
+        if (physical == 0) {
+            index++;
+            continue;
         }
         
-        if (dirent.rec_len == 0) {
-            break;
+        if (run > end - index) {
+            run = end - index;
         }
         
-        // Read entry name
-        char entry_name[256];
-        omnifs_read_inode_data(inode, entry_name, dirent.name_len, 
-                               offset + sizeof(omnifs_dirent_t));
-        entry_name[dirent.name_len] = '\0';
-        
-        if (strcmp(entry_name, name) == 0) {
-            return dirent.inode;
+        if (length > 0 && start + length != physical) {
+            bcache_read_ahead(start, length);
+            length = 0;
         }
-        
-        offset += dirent.rec_len;
+        if (length == 0) {
+            start = physical;
+        }
+        length += run;
+        index += run;
     }
     
-    return 0; // Not found
+    if (length > 0) {
+        bcache_read_ahead(start, length);
+    }
 }
 
 int omnifs_read_inode_data(omnifs_inode_t* inode, void* buffer, uint32_t size, uint32_t offset) {
@@ -408,31 +1083,85 @@ int omnifs_read_inode_data(omnifs_inode_t* inode, void* buffer, uint32_t size, u
         return OMNIOS_ERROR_GENERIC;
     }
     
+    uint32_t block_size = g_superblock->block_size;
     uint32_t bytes_to_read = (offset + size > inode->size) ? (inode->size - offset) : size;
     uint32_t bytes_read = 0;
     
+    // Small files were read along with their inode
+    if (inode->flags & OMNIFS_INODE_INLINE) {
+        memcpy(buffer, inode->inline_data + offset, bytes_to_read);
+        return OMNIOS_SUCCESS;
+    }
+    
+    // Compressed files are read a decompressed cluster at a time and
+    // clusters stored as is a block at a time, behind the usual read-ahead
+    if (inode->flags & OMNIFS_INODE_COMPRESSED) {
+        omnifs_readahead(inode, offset, bytes_to_read, false);
+        return omnifs_compress_read(inode, omnifs_inode_number(inode), buffer, bytes_to_read, offset);
+    }
+    
+    uint32_t physical_block = 0;
+    uint32_t run = 0;
+    bool directory = (inode->mode & 0xF000) == 0x4000;
+    
+    // Large reads of regular files skip the cache for their whole blocks
+    uint32_t head = (block_size - offset % block_size) % block_size;
+    bool direct = !directory && bytes_to_read > head &&
+                  (bytes_to_read - head) / block_size >= OMNIFS_DIRECT_MIN_BLOCKS;
+    omnifs_readahead(inode, offset, bytes_to_read, direct);
+    
     while (bytes_read < bytes_to_read) {
-        uint32_t block_index = (offset + bytes_read) / g_superblock->block_size;
-        uint32_t block_offset = (offset + bytes_read) % g_superblock->block_size;
-        uint32_t block_bytes = g_superblock->block_size - block_offset;
+        uint32_t block_index = (offset + bytes_read) / block_size;
+        uint32_t block_offset = (offset + bytes_read) % block_size;
+        uint32_t block_bytes = block_size - block_offset;
         
         if (block_bytes > bytes_to_read - bytes_read) {
             block_bytes = bytes_to_read - bytes_read;
         }
         
-        // Get physical block number
-        uint32_t physical_block = omnifs_get_block_number(inode, block_index);
-        if (physical_block == 0) {
-            break;
+        // One mapping lookup per contiguous run
+        if (run > 0) {
+            physical_block++;
+            run--;
+        } else {
+            physical_block = omnifs_map_block(inode, block_index, &run);
+            if (physical_block == 0) {
+                // Written but not allocated yet
+                bcache_buffer_t* delayed = bcache_find_delayed(omnifs_inode_number(inode), block_index);
+                if (!delayed) {
+                    break;
+                }
+                
+                memcpy((uint8_t*)buffer + bytes_read, delayed->data + block_offset, block_bytes);
+                bcache_release(delayed);
+                bytes_read += block_bytes;
+                continue;
+            }
+            run--;
+        }
+        
+        // Whole blocks of the run go to the caller's buffer in one request
+        uint32_t whole = (bytes_to_read - bytes_read) / block_size;
+        if (direct && block_offset == 0 && whole > 0) {
+            uint32_t count = (whole < run + 1) ? whole : run + 1;
+            if (bcache_read_direct(physical_block, count, (uint8_t*)buffer + bytes_read) != OMNIOS_SUCCESS) {
+                return OMNIOS_ERROR_IO;
+            }
+            
+            bytes_read += count * block_size;
+            physical_block += count - 1;
+            run -= count - 1;
+            continue;
         }
         
-        // Read from block
-        uint8_t* block_data = memory_allocate(g_superblock->block_size);
-        device_read("storage", physical_block * g_superblock->block_size, 
-                    block_data, g_superblock->block_size);
+        // Read from the cached block; directory blocks are checked
+        bcache_buffer_t* block = directory ? bcache_get_metadata(physical_block) : bcache_get(physical_block);
+        if (!block) {
+            return OMNIOS_ERROR_IO;
+        }
         
-        memcpy((uint8_t*)buffer + bytes_read, block_data + block_offset, block_bytes);
-        memory_free(block_data);
+        memcpy((uint8_t*)buffer + bytes_read, block->data + block_offset, block_bytes);
+        bcache_release(block);
         
         bytes_read += block_bytes;
     }
@@ -441,6 +1170,14 @@ int omnifs_read_inode_data(omnifs_inode_t* inode, void* buffer, uint32_t size, u
 }
 
 uint32_t omnifs_get_block_number(omnifs_inode_t* inode, uint32_t block_index) {
+    if (inode->flags & OMNIFS_INODE_INLINE) {
+        return 0; // No blocks
+    }
+    
+    if (omnifs_uses_extents()) {
+        return omnifs_extent_map(inode, block_index, NULL);
+    }
+    
     // Direct blocks
     if (block_index < 12) {
         return inode->direct[block_index];
@@ -456,12 +1193,13 @@ uint32_t omnifs_get_block_number(omnifs_inode_t* inode, uint32_t block_index) {
             return 0;
         }
         
-        uint32_t* indirect_block = memory_allocate(g_superblock->block_size);
-        device_read("storage", inode->indirect * g_superblock->block_size,
-                    indirect_block, g_superblock->block_size);
+        bcache_buffer_t* indirect_block = bcache_get(inode->indirect);
+        if (!indirect_block) {
+            return 0;
+        }
         
-        uint32_t block_num = indirect_block[block_index];
-        memory_free(indirect_block);
+        uint32_t block_num = ((uint32_t*)indirect_block->data)[block_index];
+        bcache_release(indirect_block);
         return block_num;
     }
     
@@ -471,95 +1209,356 @@ uint32_t omnifs_get_block_number(omnifs_inode_t* inode, uint32_t block_index) {
     return 0;
 }
 
-int omnifs_create_directory(const char* path) {
-    // Find parent directory
-    char* parent_path = strdup(path);
-    char* last_slash = strrchr(parent_path, '/');
-    if (!last_slash) {
-        free(parent_path);
-        return OMNIOS_ERROR_GENERIC;
+// Add name for child to a directory the caller holds exclusively. The
+// dentry cache learns the name before the directory is unlocked.
+static int omnifs_dir_link(omnifs_inode_t* parent, const char* name, uint32_t child, uint8_t file_type) {
+    uint32_t parent_inode = omnifs_inode_number(parent);
+    
+    int result = OMNIOS_ERROR_PERMISSION; // Snapshots take no new names
+    if (!(parent->flags & OMNIFS_INODE_READONLY)) {
+        result = omnifs_dir_add(parent, name, child, file_type);
+        omnifs_inode_dirty(parent);
     }
     
-    *last_slash = '\0';
-    char* dir_name = last_slash + 1;
+    // The new name replaces any cached negative entry
+    if (result == OMNIOS_SUCCESS) {
+        omnifs_dcache_insert(parent_inode, name, strlen(name), child);
+    } else {
+        omnifs_dcache_invalidate(parent_inode, name, strlen(name));
+    }
+    return result;
+}
+
+static int omnifs_link_child(uint32_t parent_inode, const char* name, uint32_t child, uint8_t file_type) {
+    omnifs_inode_t* parent = omnifs_icache_get(parent_inode);
+    if (!parent) {
+        return OMNIOS_ERROR_IO;
+    }
     
-    uint32_t parent_inode = omnifs_find_inode(parent_path);
+    omnifs_icache_lock_exclusive(parent);
+    int result = omnifs_dir_link(parent, name, child, file_type);
+    omnifs_icache_unlock_exclusive(parent);
+    omnifs_icache_put(parent);
+    return result;
+}
+
+// New empty inode of the given mode, named by the last component of path.
+// The parent stays locked from the name check to the new entry, so two
+// threads cannot both create the same name.
+static int omnifs_create_node(const char* path, uint16_t mode, uint8_t file_type) {
+    const char* name;
+    uint32_t parent_inode = omnifs_find_parent(path, &name);
     if (parent_inode == 0) {
-        free(parent_path);
         return OMNIOS_ERROR_NOT_FOUND;
     }
     
-    // Allocate new inode
-    uint32_t new_inode = omnifs_allocate_inode();
-    if (new_inode == 0) {
-        free(parent_path);
-        return OMNIOS_ERROR_MEMORY;
+    omnifs_inode_t* parent = omnifs_icache_get(parent_inode);
+    if (!parent) {
+        return OMNIOS_ERROR_IO;
+    }
+    omnifs_icache_lock_exclusive(parent);
+    
+    int result = OMNIOS_SUCCESS;
+    uint32_t new_inode = 0;
+    if ((parent->mode & 0xF000) != 0x4000) {
+        result = OMNIOS_ERROR_NOT_FOUND;
+    } else if (omnifs_dir_lookup(parent, name) != 0) {
+        result = OMNIOS_ERROR_GENERIC; // Already exists
+    } else if ((new_inode = omnifs_allocate_inode()) == 0) {
+        result = OMNIOS_ERROR_MEMORY;
+    }
+    
+    // Nobody else can reach the inode before it is linked
+    omnifs_inode_t* inode = new_inode ? omnifs_icache_get(new_inode) : NULL;
+    if (new_inode && !inode) {
+        result = OMNIOS_ERROR_IO;
+    }
+    if (inode) {
+        inode->mode = mode;
+        inode->uid = 0;
+        inode->gid = 0;
+        inode->size = 0;
+        inode->atime = inode->mtime = inode->ctime = get_current_time();
+        inode->blocks = 0;
+        omnifs_inode_init_data(inode);
+        omnifs_inode_dirty(inode);
+        omnifs_icache_put(inode);
+        
+        result = omnifs_dir_link(parent, name, new_inode, file_type);
+        if (result != OMNIOS_SUCCESS) {
+            omnifs_release_inode(new_inode, 0);
+        }
+    }
+    
+    omnifs_icache_unlock_exclusive(parent);
+    omnifs_icache_put(parent);
+    return result;
+}
+
+int omnifs_create_directory(const char* path) {
+    if (!g_omnifs_mounted) {
+        return OMNIOS_ERROR_IO;
+    }
+    
+    omnifs_enter();
+    int result = omnifs_create_node(path, 0x41ED, OMNIFS_FILE_TYPE_DIR); // Directory with 755 permissions
+    omnifs_leave();
+    return result;
+}
+
+// Empty regular file at path; mode holds the permission bits
+int omnifs_create_file(const char* path, uint32_t mode) {
+    if (!g_omnifs_mounted) {
+        return OMNIOS_ERROR_IO;
     }
     
-    // Initialize directory inode
-    omnifs_inode_t* inode = &g_inode_table[new_inode];
-    inode->mode = 0x41ED; // Directory with 755 permissions
-    inode->uid = 0; // Current user ID
-    inode->gid = 0; // Current group ID
-    inode->size = 0;
-    inode->atime = inode->mtime = inode->ctime = get_current_time();
-    inode->blocks = 0;
+    omnifs_enter();
+    int result = omnifs_create_node(path, 0x8000 | (mode & 0x0FFF), OMNIFS_FILE_TYPE_REG);
+    omnifs_leave();
+    return result;
+}
+
+// Many threads may read one file at once; a writer has it to itself
+int omnifs_read_file(const char* path, void* buffer, uint32_t size, uint32_t offset) {
+    if (!g_omnifs_mounted) {
+        return OMNIOS_ERROR_IO;
+    }
     
-    // Add directory entry to parent
-    omnifs_add_directory_entry(parent_inode, dir_name, new_inode, OMNIFS_FILE_TYPE_DIR);
+    omnifs_enter();
+    uint32_t number = omnifs_walk_path(path);
+    omnifs_inode_t* inode = number ? omnifs_icache_get(number) : NULL;
+    if (!inode) {
+        omnifs_leave();
+        return number ? OMNIOS_ERROR_IO : OMNIOS_ERROR_NOT_FOUND;
+    }
     
-    free(parent_path);
-    return OMNIOS_SUCCESS;
+    int result = OMNIOS_ERROR_GENERIC;
+    omnifs_icache_lock_shared(inode);
+    if ((inode->mode & 0xF000) != 0x4000) {
+        result = omnifs_read_inode_data(inode, buffer, size, offset);
+    }
+    omnifs_icache_unlock_shared(inode);
+    omnifs_icache_put(inode);
+    omnifs_leave();
+    return result;
 }
 
-uint32_t omnifs_allocate_inode(void) {
-    for (uint32_t i = 1; i < g_superblock->inode_count; i++) {
-        uint32_t byte_index = i / 8;
-        uint32_t bit_index = i % 8;
-        
-        if (!(g_inode_bitmap[byte_index] & (1 << bit_index))) {
-            // Mark inode as used
-            g_inode_bitmap[byte_index] |= (1 << bit_index);
-            g_superblock->free_inodes--;
-            return i;
+// Write to a regular file, growing it when the data ends past its size
+int omnifs_write_file(const char* path, const void* buffer, uint32_t size, uint32_t offset) {
+    if (!g_omnifs_mounted) {
+        return OMNIOS_ERROR_IO;
+    }
+    
+    omnifs_enter();
+    uint32_t number = omnifs_walk_path(path);
+    omnifs_inode_t* inode = number ? omnifs_icache_get(number) : NULL;
+    if (!inode) {
+        omnifs_leave();
+        return number ? OMNIOS_ERROR_IO : OMNIOS_ERROR_NOT_FOUND;
+    }
+    
+    int result = OMNIOS_ERROR_GENERIC;
+    omnifs_icache_lock_exclusive(inode);
+    if ((inode->mode & 0xF000) != 0x4000) {
+        result = omnifs_write_inode_data(inode, buffer, size, offset);
+    }
+    if (result == OMNIOS_SUCCESS) {
+        if (offset + size > inode->size) {
+            inode->size = offset + size;
         }
+        inode->mtime = get_current_time();
+        omnifs_inode_dirty(inode);
+    }
+    omnifs_icache_unlock_exclusive(inode);
+    omnifs_icache_put(inode);
+    omnifs_leave();
+    return result;
+}
+
+uint32_t omnifs_allocate_inode(void) {
+    uint32_t inode = omnifs_bitmap_alloc(&g_inode_map, 0);
+    if (inode == 0) {
+        return 0; // No free inodes
     }
     
-    return 0; // No free inodes
+    omnifs_write_metadata(g_superblock->inode_bitmap, g_inode_bitmap, inode / 8, 1, &g_table_lock);
+    spin_lock(&g_space_lock);
+    g_superblock->free_inodes--;
+    spin_unlock(&g_space_lock);
+    omnifs_superblock_dirty();
+    return inode;
 }
 
 int omnifs_add_directory_entry(uint32_t parent_inode, const char* name, 
                                uint32_t child_inode, uint8_t file_type) {
-    omnifs_inode_t* parent = &g_inode_table[parent_inode];
-    
-    // Calculate entry size
-    uint16_t name_len = strlen(name);
-    uint16_t rec_len = sizeof(omnifs_dirent_t) + name_len;
-    rec_len = (rec_len + 3) & ~3; // Align to 4 bytes
-    
-    // Create directory entry
-    omnifs_dirent_t* entry = memory_allocate(rec_len);
-    entry->inode = child_inode;
-    entry->rec_len = rec_len;
-    entry->name_len = name_len;
-    entry->file_type = file_type;
-    memcpy(entry->name, name, name_len);
-    
-    // Append to directory
-    omnifs_write_inode_data(parent, entry, rec_len, parent->size);
-    parent->size += rec_len;
-    
-    memory_free(entry);
+    omnifs_enter();
+    int result = omnifs_link_child(parent_inode, name, child_inode, file_type);
+    omnifs_leave();
+    return result;
+}
+
+// Keep delayed data from crowding everything else out of the cache: this
+// file's own data goes first, other files' only if that was not enough.
+// A file another thread has locked is left to that thread.
+static void omnifs_limit_delayed(omnifs_inode_t* inode) {
+    bcache_stats_t cache;
+    bcache_get_stats(&cache);
+    if (cache.delayed_buffers < cache.capacity / 2) {
+        return;
+    }
+    
+    uint32_t number = omnifs_inode_number(inode);
+    omnifs_flush_inode(inode);
+    bcache_get_stats(&cache);
+    
+    uint32_t owner;
+    while (cache.delayed_buffers >= cache.capacity / 2 &&
+           (owner = bcache_next_delayed_owner()) != 0 && owner != number) {
+        omnifs_inode_t* other = omnifs_icache_get(owner);
+        if (!other) {
+            break;
+        }
+        if (!omnifs_icache_trylock_exclusive(other)) {
+            omnifs_icache_put(other);
+            break;
+        }
+        
+        int result = omnifs_flush_inode(other);
+        omnifs_icache_unlock_exclusive(other);
+        omnifs_icache_put(other);
+        if (result != OMNIOS_SUCCESS) {
+            break;
+        }
+        bcache_get_stats(&cache);
+    }
+}
+
+// Copy data into the delayed buffer for an unallocated file block
+static int omnifs_write_delayed(omnifs_inode_t* inode, uint32_t block_index, uint32_t block_offset,
+                                const uint8_t* data, uint32_t size) {
+    uint32_t number = omnifs_inode_number(inode);
+    bool created;
+    bcache_buffer_t* block = bcache_get_delayed(number, block_index, &created);
+    if (!block) {
+        return OMNIOS_ERROR_IO;
+    }
+    
+    if (created) {
+        if (!omnifs_reserve_delayed()) {
+            bcache_discard_delayed(block);
+            bcache_release(block);
+            return OMNIOS_ERROR_MEMORY; // Would not fit at flush time
+        }
+        
+        // A compressed cluster is rewritten whole, so the rest of the
+        // block must hold its stored contents
+        if ((inode->flags & OMNIFS_INODE_COMPRESSED) && size < g_superblock->block_size &&
+            omnifs_compress_fill(inode, number, block_index, block->data) != OMNIOS_SUCCESS) {
+            bcache_discard_delayed(block);
+            bcache_release(block);
+            omnifs_unreserve_delayed(1);
+            return OMNIOS_ERROR_IO;
+        }
+    }
+    
+    memcpy(block->data + block_offset, data, size);
+    bcache_release(block);
     return OMNIOS_SUCCESS;
 }
 
+// Trade a shared block of a file for a private delayed copy, which gets
+// a block of its own at flush like new data. A write about to cover the
+// whole block skips copying it.
+static int omnifs_unshare_block(omnifs_inode_t* inode, uint32_t block_index, uint32_t physical, bool overwrite) {
+    if (!omnifs_reserve_delayed()) {
+        return OMNIOS_ERROR_MEMORY;
+    }
+    
+    bool created;
+    bcache_buffer_t* copy = bcache_get_delayed(omnifs_inode_number(inode), block_index, &created);
+    if (!copy) {
+        omnifs_unreserve_delayed(1);
+        return OMNIOS_ERROR_IO;
+    }
+    
+    if (!overwrite) {
+        bcache_buffer_t* shared = bcache_get(physical);
+        if (!shared) {
+            bcache_discard_delayed(copy);
+            bcache_release(copy);
+            omnifs_unreserve_delayed(1);
+            return OMNIOS_ERROR_IO;
+        }
+        memcpy(copy->data, shared->data, g_superblock->block_size);
+        bcache_release(shared);
+    }
+    
+    if (!created) {
+        omnifs_unreserve_delayed(1);
+    }
+    bcache_release(copy);
+    
+    int result = omnifs_extent_remove(inode, block_index, 1);
+    if (result != OMNIOS_SUCCESS) {
+        return result;
+    }
+    omnifs_free_block(physical);
+    inode->blocks--;
+    omnifs_inode_dirty(inode);
+    return OMNIOS_SUCCESS;
+}
+
+// Move inline contents out to block storage once a write no longer fits
+static int omnifs_promote_inline(omnifs_inode_t* inode) {
+    // Space is checked first so a failed promotion leaves the inode intact
+    spin_lock(&g_space_lock);
+    bool full = g_superblock->free_blocks <= g_delayed_blocks;
+    spin_unlock(&g_space_lock);
+    if (full) {
+        return OMNIOS_ERROR_MEMORY;
+    }
+    
+    uint8_t data[OMNIFS_INLINE_SIZE];
+    uint32_t size = inode->size < OMNIFS_INLINE_SIZE ? inode->size : OMNIFS_INLINE_SIZE;
+    memcpy(data, inode->inline_data, size);
+    
+    inode->flags &= ~OMNIFS_INODE_INLINE;
+    memset(inode->inline_data, 0, sizeof(inode->inline_data));
+    omnifs_extent_init_root(inode);
+    omnifs_inode_dirty(inode);
+    
+    return size ? omnifs_write_inode_data(inode, data, size, 0) : OMNIOS_SUCCESS;
+}
+
+// Write size bytes at offset: inline data in place, other files through
+// delayed buffers or newly allocated extents, copying shared blocks first
 int omnifs_write_inode_data(omnifs_inode_t* inode, const void* buffer, 
                             uint32_t size, uint32_t offset) {
-    // Simplified write implementation
-    // In a full implementation, this would handle block allocation,
-    // indirect blocks, and proper data writing
+    if (inode->flags & OMNIFS_INODE_READONLY) {
+        return OMNIOS_ERROR_PERMISSION; // Snapshot
+    }
+    
+    // Inline contents change with the inode, which is journaled
+    if (inode->flags & OMNIFS_INODE_INLINE) {
+        if (size <= OMNIFS_INLINE_SIZE && offset <= OMNIFS_INLINE_SIZE - size) {
+            memcpy(inode->inline_data + offset, buffer, size);
+            omnifs_inode_dirty(inode);
+            return OMNIOS_SUCCESS;
+        }
+        
+        int result = omnifs_promote_inline(inode);
+        if (result != OMNIOS_SUCCESS) {
+            return result;
+        }
+    }
     
     uint32_t bytes_written = 0;
+    bool inode_changed = false;
+    bool directory = (inode->mode & 0xF000) == 0x4000;
+    uint32_t previous_block = 0;
+    uint32_t fresh_start = 0;     // File blocks [fresh_start, fresh_end) were
+    uint32_t fresh_end = 0;       // allocated by this write from fresh_physical
+    uint32_t fresh_physical = 0;
     
     while (bytes_written < size) {
         uint32_t block_index = (offset + bytes_written) / g_superblock->block_size;
@@ -571,50 +1570,751 @@ int omnifs_write_inode_data(omnifs_inode_t* inode, const void* buffer,
         }
         
         // Allocate block if needed
-        if (block_index < 12 && inode->direct[block_index] == 0) {
-            inode->direct[block_index] = omnifs_allocate_block();
-            if (inode->direct[block_index] == 0) {
-                return OMNIOS_ERROR_MEMORY;
+        bool new_block = false;
+        uint32_t physical_block;
+        if (omnifs_delays_allocation(inode)) {
+            // A flush may map this very block, so it comes before the lookup
+            omnifs_limit_delayed(inode);
+            
+            // Compressed blocks are never rewritten in place
+            physical_block = 0;
+            if (!(inode->flags & OMNIFS_INODE_COMPRESSED)) {
+                physical_block = omnifs_extent_map(inode, block_index, NULL);
+            }
+            
+            // A block shared with a clone is copied on its first write
+            if (physical_block != 0 && omnifs_block_shared(physical_block)) {
+                int result = omnifs_unshare_block(inode, block_index, physical_block,
+                                                  block_bytes == g_superblock->block_size);
+                if (result != OMNIOS_SUCCESS) {
+                    return result;
+                }
+                physical_block = 0;
+            }
+            if (physical_block == 0) {
+                // Buffer the data by file block; the disk blocks are chosen
+                // at flush, once the whole run is known
+                int result = omnifs_write_delayed(inode, block_index, block_offset,
+                                                  (const uint8_t*)buffer + bytes_written, block_bytes);
+                if (result != OMNIOS_SUCCESS) {
+                    return result;
+                }
+                
+                bytes_written += block_bytes;
+                continue;
+            }
+        } else if (omnifs_uses_extents() && block_index >= fresh_start && block_index < fresh_end) {
+            physical_block = fresh_physical + (block_index - fresh_start);
+            new_block = true;
+        } else if (omnifs_uses_extents()) {
+            physical_block = omnifs_extent_map(inode, block_index, NULL);
+            if (physical_block == 0) {
+                // Place the blocks right after their predecessor so the
+                // extent grows instead of a new one starting
+                if (previous_block == 0 && block_index > 0) {
+                    previous_block = omnifs_extent_map(inode, block_index - 1, NULL);
+                }
+                
+                // One contiguous run for every unmapped block up to the
+                // end of this write
+                uint32_t last_index = (offset + size - 1) / g_superblock->block_size;
+                uint32_t count = 1;
+                while (block_index + count <= last_index && count < OMNIFS_EXTENT_MAX_LENGTH &&
+                       omnifs_extent_map(inode, block_index + count, NULL) == 0) {
+                    count++;
+                }
+                
+                physical_block = omnifs_allocate_blocks(previous_block ? previous_block + 1 : 0, &count);
+                if (physical_block == 0) {
+                    return OMNIOS_ERROR_MEMORY;
+                }
+                
+                if (omnifs_extent_insert(inode, block_index, physical_block, count) != OMNIOS_SUCCESS) {
+                    for (uint32_t i = 0; i < count; i++) {
+                        omnifs_free_block(physical_block + i);
+                    }
+                    return OMNIOS_ERROR_MEMORY;
+                }
+                inode->blocks += count;
+                inode_changed = true;
+                new_block = true;
+                
+                fresh_start = block_index;
+                fresh_end = block_index + count;
+                fresh_physical = physical_block;
+            }
+        } else {
+            if (block_index < OMNIFS_DIRECT_BLOCKS && inode->direct[block_index] == 0) {
+                inode->direct[block_index] = omnifs_allocate_block();
+                if (inode->direct[block_index] == 0) {
+                    return OMNIOS_ERROR_MEMORY;
+                }
+                inode->blocks++;
+                inode_changed = true;
+                new_block = true;
             }
-            inode->blocks++;
+            
+            physical_block = omnifs_get_block_number(inode, block_index);
         }
         
-        uint32_t physical_block = omnifs_get_block_number(inode, block_index);
         if (physical_block == 0) {
             return OMNIOS_ERROR_IO;
         }
+        previous_block = physical_block;
         
-        // Read-modify-write block
-        uint8_t* block_data = memory_allocate(g_superblock->block_size);
-        device_read("storage", physical_block * g_superblock->block_size,
-                    block_data, g_superblock->block_size);
+        // Fresh blocks and whole-block writes skip the read; partial
+        // writes modify the cached copy, written back on sync
+        bool whole = new_block || block_bytes == g_superblock->block_size;
+        bcache_buffer_t* block = whole ? bcache_get_new(physical_block) :
+                                 directory ? bcache_get_metadata(physical_block) : bcache_get(physical_block);
+        if (!block) {
+            return OMNIOS_ERROR_IO;
+        }
         
-        memcpy(block_data + block_offset, (uint8_t*)buffer + bytes_written, block_bytes);
+        if (new_block && block_bytes < g_superblock->block_size) {
+            memset(block->data, 0, g_superblock->block_size);
+        }
         
-        device_write("storage", physical_block * g_superblock->block_size,
-                     block_data, g_superblock->block_size);
+        memcpy(block->data + block_offset, (uint8_t*)buffer + bytes_written, block_bytes);
+        if (directory) {
+            bcache_mark_metadata(block); // Directory blocks are journaled
+        } else {
+            bcache_mark_dirty(block);
+        }
+        bcache_release(block);
         
-        memory_free(block_data);
         bytes_written += block_bytes;
     }
     
+    if (inode_changed) {
+        omnifs_inode_dirty(inode);
+    }
+    
     return OMNIOS_SUCCESS;
 }
 
 uint32_t omnifs_allocate_block(void) {
-    for (uint32_t i = g_superblock->data_blocks; i < g_superblock->total_blocks; i++) {
-        uint32_t byte_index = i / 8;
-        uint32_t bit_index = i % 8;
+    return omnifs_allocate_block_near(0);
+}
+
+// Give an inode's delayed buffers their disk blocks. Consecutive file
+// blocks get one contiguous run after the block preceding them, and each
+// run is written with a single device request. The caller has the inode
+// locked exclusively or holds the whole volume.
+static int omnifs_flush_inode(omnifs_inode_t* inode) {
+    uint32_t number = omnifs_inode_number(inode);
+    bcache_buffer_t* buffers[OMNIFS_FLUSH_BATCH];
+    int result = OMNIOS_SUCCESS;
+    uint32_t count;
+    
+    while (result == OMNIOS_SUCCESS &&
+           (count = bcache_collect_delayed(number, buffers, OMNIFS_FLUSH_BATCH)) > 0) {
+        // Sort by file block
+        for (uint32_t i = 1; i < count; i++) {
+            bcache_buffer_t* buffer = buffers[i];
+            uint32_t j = i;
+            while (j > 0 && buffers[j - 1]->block > buffer->block) {
+                buffers[j] = buffers[j - 1];
+                j--;
+            }
+            buffers[j] = buffer;
+        }
         
-        if (!(g_block_bitmap[byte_index] & (1 << bit_index))) {
-            // Mark block as used
-            g_block_bitmap[byte_index] |= (1 << bit_index);
-            g_superblock->free_blocks--;
-            return i;
+        if (inode->flags & OMNIFS_INODE_COMPRESSED) {
+            // Whole clusters are rebuilt, compressed and placed anew
+            uint32_t written = 0;
+            result = omnifs_compress_flush(inode, buffers, count, &written);
+            omnifs_unreserve_delayed(written);
+        } else {
+            for (uint32_t i = 0; i < count && result == OMNIOS_SUCCESS;) {
+                uint32_t length = 1;
+                while (i + length < count && length < OMNIFS_EXTENT_MAX_LENGTH &&
+                       buffers[i + length]->block == buffers[i + length - 1]->block + 1) {
+                    length++;
+                }
+            
+                uint32_t logical = buffers[i]->block;
+                uint32_t previous = logical ? omnifs_extent_map(inode, logical - 1, NULL) : 0;
+                uint32_t start = omnifs_allocate_blocks(previous ? previous + 1 : 0, &length);
+                if (start == 0) {
+                    result = OMNIOS_ERROR_MEMORY;
+                    break;
+                }
+            
+                if (omnifs_extent_insert(inode, logical, start, length) != OMNIOS_SUCCESS) {
+                    for (uint32_t k = 0; k < length; k++) {
+                        omnifs_free_block(start + k);
+                    }
+                    result = OMNIOS_ERROR_MEMORY;
+                    break;
+                }
+            
+                for (uint32_t k = 0; k < length; k++) {
+                    if (bcache_assign_block(buffers[i + k], start + k) != OMNIOS_SUCCESS) {
+                        result = OMNIOS_ERROR_IO;
+                    }
+                }
+            
+                inode->blocks += length;
+                omnifs_unreserve_delayed(length);
+                if (bcache_write_run(start, length) != OMNIOS_SUCCESS) {
+                    result = OMNIOS_ERROR_IO;
+                }
+                i += length;
+            }
+        }
+        
+        for (uint32_t i = 0; i < count; i++) {
+            bcache_release(buffers[i]);
+        }
+    }
+    
+    omnifs_inode_dirty(inode);
+    return result;
+}
+
+static int omnifs_flush_delayed_inode(uint32_t number) {
+    omnifs_inode_t* inode = omnifs_icache_get(number);
+    if (!inode) {
+        return OMNIOS_ERROR_IO;
+    }
+    
+    int result = omnifs_flush_inode(inode);
+    omnifs_icache_put(inode);
+    return result;
+}
+
+// Every file's delayed data; the caller holds the volume exclusively
+int omnifs_flush_delayed(void) {
+    uint32_t owner;
+    while ((owner = bcache_next_delayed_owner()) != 0) {
+        int result = omnifs_flush_delayed_inode(owner);
+        if (result != OMNIOS_SUCCESS) {
+            return result;
         }
     }
     
-    return 0; // No free blocks
+    return OMNIOS_SUCCESS;
+}
+
+// Group commit: everything changed since the last commit goes to the
+// journal together once the oldest change has waited long enough. The
+// cache calls this with the volume held exclusively.
+static void omnifs_periodic_flush(void) {
+    omnifs_flush_delayed();
+    if (g_journaled) {
+        omnifs_journal_commit();
+    }
+}
+
+// First free block at or after goal; goal 0 continues where the last
+// allocation ended
+uint32_t omnifs_allocate_block_near(uint32_t goal) {
+    uint32_t count = 1;
+    return omnifs_allocate_blocks(goal, &count);
+}
+
+// Up to *count contiguous blocks near goal; *count receives the number
+// actually allocated, which is less only when no long enough run is free
+uint32_t omnifs_allocate_blocks(uint32_t goal, uint32_t* count) {
+    uint32_t start = omnifs_bitmap_alloc_run(&g_block_map, goal, count);
+    if (start == 0) {
+        return 0; // No free blocks
+    }
+    
+    uint32_t first_byte = start / 8;
+    uint32_t last_byte = (start + *count - 1) / 8;
+    omnifs_write_metadata(g_superblock->block_bitmap, g_block_bitmap, first_byte, last_byte - first_byte + 1,
+                          &g_table_lock);
+    spin_lock(&g_space_lock);
+    g_superblock->free_blocks -= *count;
+    spin_unlock(&g_space_lock);
+    omnifs_superblock_dirty();
+    return start;
+}
+
+void omnifs_free_block(uint32_t block) {
+    if (block < g_superblock->data_blocks || block >= g_superblock->total_blocks ||
+        !omnifs_bitmap_test(&g_block_map, block)) {
+        return; // Reserved or already free
+    }
+    
+    // A shared block only loses this owner
+    bool shared = false;
+    if (g_refcounts) {
+        spin_lock(&g_refcount_lock);
+        shared = g_refcounts[block] > 0;
+        if (shared) {
+            g_refcounts[block]--;
+        }
+        spin_unlock(&g_refcount_lock);
+    }
+    if (shared) {
+        omnifs_write_metadata(g_superblock->refcount_table, g_refcounts, block * sizeof(uint16_t),
+                              sizeof(uint16_t), &g_refcount_lock);
+        return;
+    }
+    
+    // A block with copies in the journal waits for its revoke to commit
+    bcache_invalidate(block);
+    if (g_journaled && omnifs_journal_revoke(block)) {
+        return;
+    }
+    
+    if (omnifs_bitmap_free(&g_block_map, block, 1)) {
+        omnifs_write_metadata(g_superblock->block_bitmap, g_block_bitmap, block / 8, 1, &g_table_lock);
+        spin_lock(&g_space_lock);
+        g_superblock->free_blocks++;
+        spin_unlock(&g_space_lock);
+        omnifs_superblock_dirty();
+    }
+}
+
+// Free an inode and everything it holds. A directory's children are
+// freed first, except keep, whose entry the caller has moved elsewhere.
+static int omnifs_release_inode(uint32_t number, uint32_t keep) {
+    omnifs_inode_t* inode = omnifs_icache_get(number);
+    if (!inode) {
+        return OMNIOS_ERROR_IO;
+    }
+    
+    int result = OMNIOS_SUCCESS;
+    if ((inode->mode & 0xF000) == 0x4000) {
+        omnifs_dir_entry_t batch[OMNIFS_LIST_BATCH];
+        uint32_t cookie = 0;
+        int count;
+        while ((count = omnifs_dir_read(inode, &cookie, batch, OMNIFS_LIST_BATCH)) > 0) {
+            for (int i = 0; i < count && result == OMNIOS_SUCCESS; i++) {
+                if (batch[i].inode != keep) {
+                    result = omnifs_release_inode(batch[i].inode, keep);
+                }
+            }
+            if (result != OMNIOS_SUCCESS) {
+                break;
+            }
+        }
+        if (count < 0) {
+            result = count;
+        }
+    }
+    
+    // Buffered data never reaches the disk
+    bcache_buffer_t* buffers[OMNIFS_FLUSH_BATCH];
+    uint32_t count;
+    while ((count = bcache_collect_delayed(number, buffers, OMNIFS_FLUSH_BATCH)) > 0) {
+        for (uint32_t i = 0; i < count; i++) {
+            bcache_discard_delayed(buffers[i]);
+            bcache_release(buffers[i]);
+        }
+        omnifs_unreserve_delayed(count);
+    }
+    
+    // Shared blocks only lose this owner
+    if (result == OMNIOS_SUCCESS && omnifs_uses_extents() && !(inode->flags & OMNIFS_INODE_INLINE)) {
+        result = omnifs_extent_free(inode, omnifs_free_block);
+    }
+    
+    // A damaged inode keeps its blocks rather than risk freeing them twice
+    if (result != OMNIOS_SUCCESS) {
+        omnifs_icache_put(inode);
+        return result;
+    }
+    
+    memset(inode, 0, sizeof(omnifs_inode_t));
+    omnifs_inode_dirty(inode);
+    omnifs_icache_put(inode);
+    omnifs_dcache_invalidate_inode(number);
+    omnifs_compress_forget(number);
+    
+    if (omnifs_bitmap_free(&g_inode_map, number, 1)) {
+        omnifs_write_metadata(g_superblock->inode_bitmap, g_inode_bitmap, number / 8, 1, &g_table_lock);
+        spin_lock(&g_space_lock);
+        g_superblock->free_inodes++;
+        spin_unlock(&g_space_lock);
+        omnifs_superblock_dirty();
+    }
+    return OMNIOS_SUCCESS;
+}
+
+// Map every block of from into to as well, as one more owner of each
+static int omnifs_clone_blocks(omnifs_inode_t* from, omnifs_inode_t* to) {
+    uint32_t block_size = g_superblock->block_size;
+    uint32_t file_blocks = (from->size + block_size - 1) / block_size;
+    
+    for (uint32_t logical = 0; logical < file_blocks;) {
+        uint32_t run;
+        uint16_t flags = 0;
+        uint32_t start = omnifs_extent_lookup(from, logical, &run, &flags);
+        if (start == 0) {
+            logical++;
+            continue;
+        }
+        
+        if (!omnifs_share_blocks(start, run)) {
+            return OMNIOS_ERROR_MEMORY;
+        }
+        
+        int result = omnifs_extent_insert_flags(to, logical, start, run, flags);
+        if (result != OMNIOS_SUCCESS) {
+            for (uint32_t i = 0; i < run; i++) {
+                omnifs_free_block(start + i);
+            }
+            return result;
+        }
+        to->blocks += run;
+        logical += run;
+    }
+    
+    return OMNIOS_SUCCESS;
+}
+
+// Copy inode source into a new inode. File data is shared with the
+// source; directories get entries of their own naming clones of their
+// children, skip left out. flags are added to every copy. Delayed data
+// must have been flushed.
+static int omnifs_clone_inode(uint32_t source, uint32_t skip, uint32_t flags, uint32_t* clone) {
+    uint32_t number = omnifs_allocate_inode();
+    if (number == 0) {
+        return OMNIOS_ERROR_MEMORY;
+    }
+    
+    omnifs_inode_t* from = omnifs_icache_get(source);
+    omnifs_inode_t* to = omnifs_icache_get(number);
+    if (!from || !to) {
+        omnifs_icache_put(from);
+        omnifs_icache_put(to);
+        omnifs_release_inode(number, 0);
+        return OMNIOS_ERROR_IO;
+    }
+    
+    *to = *from;
+    to->flags = from->flags & (OMNIFS_INODE_INLINE | OMNIFS_INODE_COMPRESSED);
+    to->blocks = 0;
+    
+    int result = OMNIOS_SUCCESS;
+    if ((from->mode & 0xF000) == 0x4000) {
+        to->size = 0;
+        omnifs_inode_init_data(to);
+        
+        omnifs_dir_entry_t batch[OMNIFS_LIST_BATCH];
+        uint32_t cookie = 0;
+        int count;
+        while (result == OMNIOS_SUCCESS && (count = omnifs_dir_read(from, &cookie, batch, OMNIFS_LIST_BATCH)) > 0) {
+            for (int i = 0; i < count && result == OMNIOS_SUCCESS; i++) {
+                uint32_t child;
+                if (batch[i].inode == skip) {
+                    continue;
+                }
+                
+                result = omnifs_clone_inode(batch[i].inode, skip, flags, &child);
+                if (result == OMNIOS_SUCCESS) {
+                    result = omnifs_dir_add(to, batch[i].name, child, batch[i].file_type);
+                    if (result != OMNIOS_SUCCESS) {
+                        omnifs_release_inode(child, 0);
+                    }
+                }
+            }
+        }
+        if (result == OMNIOS_SUCCESS && count < 0) {
+            result = count;
+        }
+    } else if (!(from->flags & OMNIFS_INODE_INLINE)) {
+        omnifs_extent_init_root(to);
+        result = omnifs_clone_blocks(from, to);
+    }
+    
+    to->flags |= flags;
+    omnifs_inode_dirty(to);
+    omnifs_icache_put(to);
+    omnifs_icache_put(from);
+    
+    if (result != OMNIOS_SUCCESS) {
+        omnifs_release_inode(number, 0);
+        return result;
+    }
+    *clone = number;
+    return OMNIOS_SUCCESS;
+}
+
+static inline uint8_t omnifs_file_type(uint32_t number) {
+    omnifs_inode_t* inode = omnifs_icache_get(number);
+    uint8_t type = (inode && (inode->mode & 0xF000) == 0x4000) ? OMNIFS_FILE_TYPE_DIR : OMNIFS_FILE_TYPE_REG;
+    omnifs_icache_put(inode);
+    return type;
+}
+
+// Directory holding the last component of path, which *name points at
+static uint32_t omnifs_find_parent(const char* path, const char** name) {
+    const char* slash = strrchr(path, '/');
+    if (!slash || slash[1] == '\0' || strlen(slash + 1) > OMNIFS_DIR_NAME_MAX) {
+        return 0;
+    }
+    
+    char* parent_path = strdup(path);
+    if (!parent_path) {
+        return 0;
+    }
+    parent_path[slash - path] = '\0';
+    
+    uint32_t parent = omnifs_walk_path(parent_path);
+    free(parent_path);
+    *name = slash + 1;
+    return parent;
+}
+
+// Copy source to the new path target in O(metadata): files share every
+// block with the source until one side writes it, and directories are
+// cloned with everything below them
+static int omnifs_clone_locked(const char* source, const char* target) {
+    if (!omnifs_uses_reflinks()) {
+        return OMNIOS_ERROR_PERMISSION; // No reference counts before version 4
+    }
+    
+    const char* name;
+    uint32_t source_inode = omnifs_walk_path(source);
+    uint32_t parent = omnifs_find_parent(target, &name);
+    if (source_inode == 0 || parent == 0) {
+        return OMNIOS_ERROR_NOT_FOUND;
+    }
+    if (omnifs_lookup_name(parent, name) != 0) {
+        return OMNIOS_ERROR_GENERIC; // Target exists
+    }
+    
+    int result = omnifs_flush_delayed();
+    uint32_t clone;
+    if (result == OMNIOS_SUCCESS) {
+        result = omnifs_clone_inode(source_inode, 0, 0, &clone);
+    }
+    if (result != OMNIOS_SUCCESS) {
+        return result;
+    }
+    
+    result = omnifs_link_child(parent, name, clone, omnifs_file_type(clone));
+    if (result != OMNIOS_SUCCESS) {
+        omnifs_release_inode(clone, 0);
+    }
+    return result;
+}
+
+int omnifs_clone(const char* source, const char* target) {
+    if (!g_omnifs_mounted) {
+        return OMNIOS_ERROR_IO;
+    }
+    
+    omnifs_enter_exclusive();
+    int result = omnifs_clone_locked(source, target);
+    omnifs_leave_exclusive();
+    return result;
+}
+
+// Swap what two paths name, e.g. a staged clone and the tree it replaces.
+// Both entries change in one journal transaction, so after a crash either
+// both names point at their old inodes or both at the new ones.
+static int omnifs_exchange_locked(const char* first, const char* second) {
+    // Neither may contain the other
+    uint32_t first_len = strlen(first);
+    uint32_t second_len = strlen(second);
+    uint32_t shorter = first_len < second_len ? first_len : second_len;
+    if (strncmp(first, second, shorter) == 0 &&
+        (first_len == second_len || (first_len < second_len ? second[shorter] : first[shorter]) == '/')) {
+        return OMNIOS_ERROR_GENERIC;
+    }
+    
+    const char* first_name;
+    const char* second_name;
+    uint32_t first_parent = omnifs_find_parent(first, &first_name);
+    uint32_t second_parent = omnifs_find_parent(second, &second_name);
+    uint32_t first_inode = first_parent ? omnifs_lookup_name(first_parent, first_name) : 0;
+    uint32_t second_inode = second_parent ? omnifs_lookup_name(second_parent, second_name) : 0;
+    if (first_inode == 0 || second_inode == 0) {
+        return OMNIOS_ERROR_NOT_FOUND;
+    }
+    
+    omnifs_inode_t* first_dir = omnifs_icache_get(first_parent);
+    omnifs_inode_t* second_dir = omnifs_icache_get(second_parent);
+    if (!first_dir || !second_dir) {
+        omnifs_icache_put(first_dir);
+        omnifs_icache_put(second_dir);
+        return OMNIOS_ERROR_IO;
+    }
+    
+    // Start from an empty transaction so both changes fit in the next one
+    if (g_journaled) {
+        omnifs_journal_commit();
+    }
+    
+    int result = omnifs_dir_set(first_dir, first_name, second_inode, omnifs_file_type(second_inode));
+    if (result == OMNIOS_SUCCESS) {
+        result = omnifs_dir_set(second_dir, second_name, first_inode, omnifs_file_type(first_inode));
+        if (result != OMNIOS_SUCCESS) {
+            omnifs_dir_set(first_dir, first_name, first_inode, omnifs_file_type(first_inode));
+        }
+    }
+    omnifs_inode_dirty(first_dir);
+    omnifs_inode_dirty(second_dir);
+    omnifs_icache_put(first_dir);
+    omnifs_icache_put(second_dir);
+    
+    omnifs_dcache_invalidate(first_parent, first_name, strlen(first_name));
+    omnifs_dcache_invalidate(second_parent, second_name, strlen(second_name));
+    return result;
+}
+
+int omnifs_exchange(const char* first, const char* second) {
+    if (!g_omnifs_mounted) {
+        return OMNIOS_ERROR_IO;
+    }
+    
+    omnifs_enter_exclusive();
+    int result = omnifs_exchange_locked(first, second);
+    omnifs_leave_exclusive();
+    return result;
+}
+
+// Directory of snapshots in the root, created on first use when create is set
+static uint32_t omnifs_snapshot_dir(bool create) {
+    uint32_t dir = omnifs_lookup_name(g_superblock->root_inode, OMNIFS_SNAPSHOT_DIR);
+    if (dir == 0 && create &&
+        omnifs_create_node("/" OMNIFS_SNAPSHOT_DIR, 0x41ED, OMNIFS_FILE_TYPE_DIR) == OMNIOS_SUCCESS) {
+        dir = omnifs_lookup_name(g_superblock->root_inode, OMNIFS_SNAPSHOT_DIR);
+    }
+    return dir;
+}
+
+static bool omnifs_snapshot_name_valid(const char* name) {
+    uint32_t len = strlen(name);
+    return len > 0 && len <= OMNIFS_DIR_NAME_MAX && !strchr(name, '/');
+}
+
+// Freeze the whole volume as /.snapshots/name, a read-only clone of the
+// root taken once all buffered data is on disk
+static int omnifs_snapshot_create_locked(const char* name) {
+    if (!omnifs_uses_reflinks()) {
+        return OMNIOS_ERROR_PERMISSION;
+    }
+    if (!omnifs_snapshot_name_valid(name)) {
+        return OMNIOS_ERROR_GENERIC;
+    }
+    
+    uint32_t dir = omnifs_snapshot_dir(true);
+    if (dir == 0) {
+        return OMNIOS_ERROR_IO;
+    }
+    if (omnifs_lookup_name(dir, name) != 0) {
+        return OMNIOS_ERROR_GENERIC;
+    }
+    
+    int result = omnifs_flush_delayed();
+    uint32_t snapshot;
+    if (result == OMNIOS_SUCCESS) {
+        result = omnifs_clone_inode(g_superblock->root_inode, dir, OMNIFS_INODE_READONLY, &snapshot);
+    }
+    if (result != OMNIOS_SUCCESS) {
+        return result;
+    }
+    
+    result = omnifs_link_child(dir, name, snapshot, OMNIFS_FILE_TYPE_DIR);
+    if (result != OMNIOS_SUCCESS) {
+        omnifs_release_inode(snapshot, 0);
+        return result;
+    }
+    return omnifs_sync_volume();
+}
+
+int omnifs_snapshot_create(const char* name) {
+    if (!g_omnifs_mounted) {
+        return OMNIOS_ERROR_IO;
+    }
+    
+    omnifs_enter_exclusive();
+    int result = omnifs_snapshot_create_locked(name);
+    omnifs_leave_exclusive();
+    return result;
+}
+
+// Roll the volume back to a snapshot. A writable clone of it becomes the
+// new root in a single superblock update; the old tree is freed after.
+static int omnifs_snapshot_restore_locked(const char* name) {
+    uint32_t dir = omnifs_snapshot_dir(false);
+    uint32_t snapshot = dir && omnifs_snapshot_name_valid(name) ? omnifs_lookup_name(dir, name) : 0;
+    if (snapshot == 0) {
+        return OMNIOS_ERROR_NOT_FOUND;
+    }
+    
+    int result = omnifs_flush_delayed();
+    uint32_t root;
+    if (result == OMNIOS_SUCCESS) {
+        result = omnifs_clone_inode(snapshot, 0, 0, &root);
+    }
+    if (result != OMNIOS_SUCCESS) {
+        return result;
+    }
+    
+    // The snapshots carry over into the restored tree
+    result = omnifs_link_child(root, OMNIFS_SNAPSHOT_DIR, dir, OMNIFS_FILE_TYPE_DIR);
+    if (result == OMNIOS_SUCCESS) {
+        result = omnifs_sync_volume();
+    }
+    if (result != OMNIOS_SUCCESS) {
+        omnifs_release_inode(root, dir);
+        return result;
+    }
+    
+    uint32_t old_root = g_superblock->root_inode;
+    g_superblock->root_inode = root;
+    omnifs_superblock_dirty();
+    result = omnifs_sync_volume();
+    if (result != OMNIOS_SUCCESS) {
+        return result;
+    }
+    
+    omnifs_release_inode(old_root, dir);
+    return omnifs_sync_volume();
+}
+
+int omnifs_snapshot_restore(const char* name) {
+    if (!g_omnifs_mounted) {
+        return OMNIOS_ERROR_IO;
+    }
+    
+    omnifs_enter_exclusive();
+    int result = omnifs_snapshot_restore_locked(name);
+    omnifs_leave_exclusive();
+    return result;
+}
+
+// Drop a snapshot; blocks it shared with the live tree stay in use there
+static int omnifs_snapshot_delete_locked(const char* name) {
+    uint32_t dir = omnifs_snapshot_dir(false);
+    uint32_t snapshot = dir && omnifs_snapshot_name_valid(name) ? omnifs_lookup_name(dir, name) : 0;
+    if (snapshot == 0) {
+        return OMNIOS_ERROR_NOT_FOUND;
+    }
+    
+    omnifs_inode_t* inode = omnifs_icache_get(dir);
+    if (!inode) {
+        return OMNIOS_ERROR_IO;
+    }
+    int result = omnifs_dir_set(inode, name, 0, 0);
+    omnifs_inode_dirty(inode);
+    omnifs_icache_put(inode);
+    omnifs_dcache_invalidate(dir, name, strlen(name));
+    
+    if (result == OMNIOS_SUCCESS) {
+        result = omnifs_release_inode(snapshot, 0);
+    }
+    return result;
+}
+
+int omnifs_snapshot_delete(const char* name) {
+    if (!g_omnifs_mounted) {
+        return OMNIOS_ERROR_IO;
+    }
+    
+    omnifs_enter_exclusive();
+    int result = omnifs_snapshot_delete_locked(name);
+    omnifs_leave_exclusive();
+    return result;
 }
 
 // External device I/O functions (implemented by storage driver)
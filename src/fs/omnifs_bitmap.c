@@ -0,0 +1,291 @@
+/*
+ * OmniOS 2.0 OmniFS Allocation Bitmaps
+ * Searches skip whole groups with no free bits, then test 32 bits at a
+ * time and pick the bit with ctz. Groups are word aligned, so every word
+ * belongs to exactly one group.
+ *
+ * Searches take no locks. Each group has a spinlock that guards changes
+ * to its words and free count; an allocation locks the groups under the
+ * run it found, in ascending order, and searches again if another thread
+ * took part of the run in the meantime.
+ */
+
+#include "omnios.h"
+#include "kernel/memory.h"
+#include "fs/omnifs_bitmap.h"
+
+static inline uint32_t bitmap_word(const omnifs_bitmap_t* bitmap, uint32_t index) {
+    return __atomic_load_n(&bitmap->words[index], __ATOMIC_RELAXED);
+}
+
+static inline uint32_t bitmap_group_free(const omnifs_bitmap_t* bitmap, uint32_t group) {
+    return __atomic_load_n(&bitmap->group_free[group], __ATOMIC_RELAXED);
+}
+
+// Lock or unlock the groups holding bits [start, start + count)
+static void bitmap_lock_range(omnifs_bitmap_t* bitmap, uint32_t start, uint32_t count, bool lock) {
+    uint32_t last = (start + count - 1) >> bitmap->group_shift;
+    for (uint32_t group = start >> bitmap->group_shift; group <= last; group++) {
+        if (lock) {
+            spin_lock(&bitmap->group_locks[group]);
+        } else {
+            spin_unlock(&bitmap->group_locks[group]);
+        }
+    }
+}
+
+static inline uint32_t bitmap_group_bits(const omnifs_bitmap_t* bitmap) {
+    return 1u << bitmap->group_shift;
+}
+
+// Set or clear count bits from start, keeping the free counts in step.
+// The caller holds the locks of the groups involved.
+static uint32_t bitmap_update(omnifs_bitmap_t* bitmap, uint32_t start, uint32_t count, bool used) {
+    uint32_t changed_total = 0;
+    
+    while (count > 0) {
+        uint32_t shift = start % 32;
+        uint32_t length = (32 - shift < count) ? 32 - shift : count;
+        uint32_t mask = (length == 32 ? ~0u : (1u << length) - 1) << shift;
+        uint32_t* word = &bitmap->words[start / 32];
+        uint32_t* group_free = &bitmap->group_free[start >> bitmap->group_shift];
+        
+        uint32_t changed = __builtin_popcount(used ? (~*word & mask) : (*word & mask));
+        if (used) {
+            __atomic_store_n(word, *word | mask, __ATOMIC_RELAXED);
+            __atomic_store_n(group_free, *group_free - changed, __ATOMIC_RELAXED);
+            __atomic_sub_fetch(&bitmap->free, changed, __ATOMIC_RELAXED);
+        } else {
+            __atomic_store_n(word, *word & ~mask, __ATOMIC_RELAXED);
+            __atomic_store_n(group_free, *group_free + changed, __ATOMIC_RELAXED);
+            __atomic_add_fetch(&bitmap->free, changed, __ATOMIC_RELAXED);
+        }
+        
+        changed_total += changed;
+        start += length;
+        count -= length;
+    }
+    
+    return changed_total;
+}
+
+// First clear bit in [from, limit), or limit
+static uint32_t bitmap_find_clear(const omnifs_bitmap_t* bitmap, uint32_t from, uint32_t limit) {
+    while (from < limit) {
+        uint32_t group = from >> bitmap->group_shift;
+        uint32_t group_end = (group + 1) << bitmap->group_shift;
+        if (bitmap_group_free(bitmap, group) == 0) {
+            from = group_end;
+            continue;
+        }
+        
+        if (group_end > limit) {
+            group_end = limit;
+        }
+        
+        while (from < group_end) {
+            uint32_t word = ~bitmap_word(bitmap, from / 32) & (~0u << (from % 32));
+            if (word) {
+                uint32_t bit = (from & ~31u) + __builtin_ctz(word);
+                return bit < limit ? bit : limit;
+            }
+            from = (from & ~31u) + 32;
+        }
+    }
+    
+    return limit;
+}
+
+// First set bit in [from, limit), or limit
+static uint32_t bitmap_find_set(const omnifs_bitmap_t* bitmap, uint32_t from, uint32_t limit) {
+    while (from < limit) {
+        uint32_t group = from >> bitmap->group_shift;
+        uint32_t group_end = (group + 1) << bitmap->group_shift;
+        if (bitmap_group_free(bitmap, group) == bitmap_group_bits(bitmap)) {
+            from = group_end;
+            continue;
+        }
+        
+        if (group_end > limit) {
+            group_end = limit;
+        }
+        
+        while (from < group_end) {
+            uint32_t word = bitmap_word(bitmap, from / 32) & (~0u << (from % 32));
+            if (word) {
+                uint32_t bit = (from & ~31u) + __builtin_ctz(word);
+                return bit < limit ? bit : limit;
+            }
+            from = (from & ~31u) + 32;
+        }
+    }
+    
+    return limit;
+}
+
+// First run of want clear bits starting in [from, limit). When there is
+// none, *partial receives the first shorter run if it is still unset.
+static uint32_t bitmap_find_run(const omnifs_bitmap_t* bitmap, uint32_t from, uint32_t limit, uint32_t want,
+                                uint32_t* partial, uint32_t* partial_length) {
+    while (from < limit) {
+        uint32_t start = bitmap_find_clear(bitmap, from, limit);
+        if (start >= limit) {
+            break;
+        }
+        
+        uint32_t end = start + want < bitmap->size ? start + want : bitmap->size;
+        end = bitmap_find_set(bitmap, start, end);
+        if (end - start >= want) {
+            return start;
+        }
+        
+        if (*partial == 0) {
+            *partial = start;
+            *partial_length = end - start;
+        }
+        from = end;
+    }
+    
+    return 0;
+}
+
+int omnifs_bitmap_init(omnifs_bitmap_t* bitmap, uint8_t* bits, uint32_t size, uint32_t first,
+                       uint32_t group_shift) {
+    if (first == 0 || first >= size || group_shift < 5) {
+        return OMNIOS_ERROR_GENERIC;
+    }
+    
+    bitmap->words = (uint32_t*)bits;
+    bitmap->size = size;
+    bitmap->first = first;
+    bitmap->hint = first;
+    bitmap->group_shift = group_shift;
+    bitmap->groups = (size + bitmap_group_bits(bitmap) - 1) >> group_shift;
+    bitmap->group_free = memory_allocate(bitmap->groups * sizeof(uint32_t));
+    bitmap->group_locks = memory_allocate(bitmap->groups * sizeof(spinlock_t));
+    if (!bitmap->group_free || !bitmap->group_locks) {
+        omnifs_bitmap_destroy(bitmap);
+        return OMNIOS_ERROR_MEMORY;
+    }
+    memset(bitmap->group_locks, 0, bitmap->groups * sizeof(spinlock_t));
+    
+    // Reserved bits and the tail of the last word never come free
+    for (uint32_t bit = 0; bit < first; bit++) {
+        bitmap->words[bit / 32] |= 1u << (bit % 32);
+    }
+    if (size % 32) {
+        bitmap->words[size / 32] |= ~0u << (size % 32);
+    }
+    
+    bitmap->free = 0;
+    memset(bitmap->group_free, 0, bitmap->groups * sizeof(uint32_t));
+    for (uint32_t i = 0; i < (size + 31) / 32; i++) {
+        uint32_t clear = 32 - __builtin_popcount(bitmap->words[i]);
+        bitmap->group_free[(i * 32) >> group_shift] += clear;
+        bitmap->free += clear;
+    }
+    
+    return OMNIOS_SUCCESS;
+}
+
+void omnifs_bitmap_destroy(omnifs_bitmap_t* bitmap) {
+    memory_free(bitmap->group_free);
+    memory_free(bitmap->group_locks);
+    bitmap->group_free = NULL;
+    bitmap->group_locks = NULL;
+    bitmap->words = NULL;
+}
+
+// Bits [start, start + count) are all clear; the caller holds their groups
+static bool bitmap_range_clear(const omnifs_bitmap_t* bitmap, uint32_t start, uint32_t count) {
+    while (count > 0) {
+        uint32_t shift = start % 32;
+        uint32_t length = (32 - shift < count) ? 32 - shift : count;
+        uint32_t mask = (length == 32 ? ~0u : (1u << length) - 1) << shift;
+        if (bitmap->words[start / 32] & mask) {
+            return false;
+        }
+        start += length;
+        count -= length;
+    }
+    
+    return true;
+}
+
+uint32_t omnifs_bitmap_alloc_run(omnifs_bitmap_t* bitmap, uint32_t goal, uint32_t* count) {
+    uint32_t wanted = *count;
+    if (goal < bitmap->first || goal >= bitmap->size) {
+        goal = __atomic_load_n(&bitmap->hint, __ATOMIC_RELAXED);
+    }
+    
+    while (wanted > 0 && __atomic_load_n(&bitmap->free, __ATOMIC_RELAXED) > 0) {
+        // From the goal to the end, then wrap around to the start
+        uint32_t want = wanted;
+        uint32_t partial = 0;
+        uint32_t partial_length = 0;
+        uint32_t start = bitmap_find_run(bitmap, goal, bitmap->size, want, &partial, &partial_length);
+        if (start == 0) {
+            start = bitmap_find_run(bitmap, bitmap->first, goal, want, &partial, &partial_length);
+        }
+        
+        if (start == 0) {
+            if (partial == 0) {
+                break;
+            }
+            start = partial;
+            want = partial_length;
+        }
+        
+        // The search saw no locks: claim the run only if it is still free
+        bitmap_lock_range(bitmap, start, want, true);
+        bool claimed = bitmap_range_clear(bitmap, start, want);
+        if (claimed) {
+            bitmap_update(bitmap, start, want, true);
+        }
+        bitmap_lock_range(bitmap, start, want, false);
+        
+        if (claimed) {
+            __atomic_store_n(&bitmap->hint, start + want < bitmap->size ? start + want : bitmap->first,
+                             __ATOMIC_RELAXED);
+            *count = want;
+            return start;
+        }
+    }
+    
+    *count = 0;
+    return 0;
+}
+
+uint32_t omnifs_bitmap_alloc(omnifs_bitmap_t* bitmap, uint32_t goal) {
+    uint32_t count = 1;
+    return omnifs_bitmap_alloc_run(bitmap, goal, &count);
+}
+
+uint32_t omnifs_bitmap_free(omnifs_bitmap_t* bitmap, uint32_t start, uint32_t count) {
+    if (start < bitmap->first || start >= bitmap->size) {
+        return 0;
+    }
+    
+    if (count > bitmap->size - start) {
+        count = bitmap->size - start;
+    }
+    
+    // One group at a time; a free needs no run to stay intact
+    uint32_t freed = 0;
+    while (count > 0) {
+        uint32_t group_end = ((start >> bitmap->group_shift) + 1) << bitmap->group_shift;
+        uint32_t length = group_end - start < count ? group_end - start : count;
+        
+        spin_lock(&bitmap->group_locks[start >> bitmap->group_shift]);
+        freed += bitmap_update(bitmap, start, length, false);
+        spin_unlock(&bitmap->group_locks[start >> bitmap->group_shift]);
+        start += length;
+        count -= length;
+    }
+    
+    return freed;
+}
+
+bool omnifs_bitmap_test(const omnifs_bitmap_t* bitmap, uint32_t bit) {
+    return bit >= bitmap->size || (bitmap_word(bitmap, bit / 32) & (1u << (bit % 32))) != 0;
+}
@@ -0,0 +1,470 @@
+/*
+ * OmniOS 2.0 OmniFS Compressed Files
+ * Writes to a compressed file wait in delayed buffers like any other
+ * file data. At write-back every cluster they touch is rebuilt from its
+ * stored copy and the buffers, compressed with the LZ codec and written
+ * to newly allocated blocks; the old blocks are freed only afterwards, so
+ * the journal never sees them reused before the new mapping commits.
+ * Reads decompress whole clusters into a one-cluster cache, so a run of
+ * small sequential reads decompresses each cluster once. Clusters that
+ * did not compress are stored as is and read a block at a time. A
+ * spinlock guards the cached cluster. Stored blocks are copied out of the
+ * buffer cache before it is taken, so no device I/O happens under it,
+ * and each flush rebuilds its clusters in buffers of its own.
+ */
+
+#include "omnios.h"
+#include "kernel/memory.h"
+#include "kernel/lz.h"
+#include "kernel/sync.h"
+#include "fs/omnifs_compress.h"
+#include "fs/omnifs_extent.h"
+
+#define CLUSTER_HEADER_SIZE     sizeof(omnifs_cluster_header_t)
+
+// Contiguous stored blocks of a cluster
+typedef struct {
+    uint32_t logical;
+    uint32_t start;
+    uint32_t count;
+} cluster_run_t;
+
+// Private buffers of one flush, so clusters are rebuilt without the lock
+typedef struct {
+    uint8_t* plain;
+    uint8_t* stored;
+    lz_workspace_t* workspace;
+} cluster_work_t;
+
+static uint32_t g_block_size = 4096;
+static uint32_t g_cluster_size = 0;       // Bytes
+static omnifs_compress_alloc_t g_allocate = NULL;
+static omnifs_compress_free_t g_release = NULL;
+static uint8_t* g_plain = NULL;           // Cluster contents
+static uint32_t g_cached_owner = 0;       // Whose stored cluster g_plain holds, 0 for none
+static uint32_t g_cached_cluster = 0;
+static omnifs_compress_stats_t g_stats;
+static spinlock_t g_lock = SPINLOCK_INIT;
+
+int omnifs_compress_init(uint32_t block_size, omnifs_compress_alloc_t allocate, omnifs_compress_free_t release) {
+    omnifs_compress_shutdown();
+    
+    g_block_size = block_size;
+    g_cluster_size = OMNIFS_CLUSTER_BLOCKS * block_size;
+    g_allocate = allocate;
+    g_release = release;
+    memset(&g_stats, 0, sizeof(g_stats));
+    
+    g_plain = memory_allocate(g_cluster_size);
+    if (!g_plain) {
+        omnifs_compress_shutdown();
+        return OMNIOS_ERROR_MEMORY;
+    }
+    
+    return OMNIOS_SUCCESS;
+}
+
+void omnifs_compress_shutdown(void) {
+    memory_free(g_plain);
+    g_plain = NULL;
+    g_cached_owner = 0;
+}
+
+// Stored runs of a cluster; returns how many, *blocks receiving their total
+static uint32_t cluster_runs(omnifs_inode_t* inode, uint32_t base, cluster_run_t* runs, uint32_t* blocks,
+                             uint16_t* flags) {
+    uint32_t count = 0;
+    *blocks = 0;
+    *flags = 0;
+
+    for (uint32_t i = 0; i < OMNIFS_CLUSTER_BLOCKS;) {
+        uint32_t run;
+        uint16_t run_flags = 0;
+        uint32_t physical = omnifs_extent_lookup(inode, base + i, &run, &run_flags);
+        if (physical == 0) {
+            i++;
+            continue;
+        }
+        
+        if (run > OMNIFS_CLUSTER_BLOCKS - i) {
+            run = OMNIFS_CLUSTER_BLOCKS - i;
+        }
+        
+        runs[count].logical = base + i;
+        runs[count].start = physical;
+        runs[count].count = run;
+        count++;
+        *blocks += run;
+        *flags |= run_flags;
+        i += run;
+    }
+    
+    return count;
+}
+
+// Stored blocks of a cluster copied into image by their place in it,
+// holes as zeros. Blocks are read with no lock held and pinned one at a
+// time.
+static int cluster_fetch(omnifs_inode_t* inode, uint32_t base, uint8_t* image, uint32_t* blocks,
+                         uint16_t* flags) {
+    memset(image, 0, g_cluster_size);
+    
+    cluster_run_t runs[OMNIFS_CLUSTER_BLOCKS];
+    uint32_t count = cluster_runs(inode, base, runs, blocks, flags);
+    for (uint32_t i = 0; i < count; i++) {
+        bcache_read_ahead(runs[i].start, runs[i].count);
+        for (uint32_t j = 0; j < runs[i].count; j++) {
+            bcache_buffer_t* buffer = bcache_get(runs[i].start + j);
+            if (!buffer) {
+                return OMNIOS_ERROR_IO;
+            }
+            
+            memcpy(image + (runs[i].logical - base + j) * g_block_size, buffer->data, g_block_size);
+            bcache_release(buffer);
+        }
+    }
+    
+    return OMNIOS_SUCCESS;
+}
+
+// Contents of a fetched cluster into plain. Past the data a compressed
+// cluster holds everything reads as zeros, whatever plain held before.
+static bool cluster_decode(const uint8_t* image, uint32_t blocks, uint16_t flags, uint8_t* plain) {
+    if (!(flags & OMNIFS_EXTENT_COMPRESSED)) {
+        memcpy(plain, image, g_cluster_size);
+        return true;
+    }
+    
+    const omnifs_cluster_header_t* header = (const omnifs_cluster_header_t*)image;
+    if (header->magic != OMNIFS_CLUSTER_MAGIC || header->length > blocks * g_block_size - CLUSTER_HEADER_SIZE ||
+        header->size > g_cluster_size ||
+        lz_decompress(image + CLUSTER_HEADER_SIZE, header->length, plain, header->size) != header->size) {
+        return false;
+    }
+    
+    memset(plain + header->size, 0, g_cluster_size - header->size);
+    return true;
+}
+
+// Copy from the cached cluster of owner with the lock held; false when
+// another cluster is cached
+static bool cluster_cached(uint32_t owner, uint32_t cluster, uint8_t* data, uint32_t offset, uint32_t bytes) {
+    if (g_cached_owner != owner || g_cached_cluster != cluster) {
+        return false;
+    }
+    
+    memcpy(data, g_plain + offset, bytes);
+    g_stats.cache_hits++;
+    return true;
+}
+
+// bytes of file block from offset on as stored. A compressed cluster's
+// data always starts at its first block, which tells the two kinds
+// apart. Blocks of raw clusters are read on their own, so random reads of
+// data that did not compress cost one block each; compressed clusters
+// are loaded whole.
+static int cluster_read_block(omnifs_inode_t* inode, uint32_t owner, uint32_t block, uint8_t* data,
+                              uint32_t offset, uint32_t bytes) {
+    uint16_t flags = 0;
+    uint32_t physical = omnifs_extent_lookup(inode, block - block % OMNIFS_CLUSTER_BLOCKS, NULL, &flags);
+    if (physical == 0 || !(flags & OMNIFS_EXTENT_COMPRESSED)) {
+        physical = omnifs_extent_map(inode, block, NULL);
+        if (physical == 0) {
+            memset(data, 0, bytes);
+            return OMNIOS_SUCCESS;
+        }
+        
+        bcache_buffer_t* buffer = bcache_get(physical);
+        if (!buffer) {
+            return OMNIOS_ERROR_IO;
+        }
+        
+        memcpy(data, buffer->data + offset, bytes);
+        bcache_release(buffer);
+        return OMNIOS_SUCCESS;
+    }
+    
+    uint32_t cluster = block / OMNIFS_CLUSTER_BLOCKS;
+    offset += (block % OMNIFS_CLUSTER_BLOCKS) * g_block_size;
+    spin_lock(&g_lock);
+    bool hit = cluster_cached(owner, cluster, data, offset, bytes);
+    spin_unlock(&g_lock);
+    if (hit) {
+        return OMNIOS_SUCCESS;
+    }
+    
+    uint8_t* image = memory_allocate(g_cluster_size);
+    uint32_t blocks;
+    uint16_t stored_flags;
+    if (!image) {
+        return OMNIOS_ERROR_MEMORY;
+    }
+    if (cluster_fetch(inode, cluster * OMNIFS_CLUSTER_BLOCKS, image, &blocks, &stored_flags) != OMNIOS_SUCCESS) {
+        memory_free(image);
+        return OMNIOS_ERROR_IO;
+    }
+    
+    // Another thread may have cached it while the blocks were read
+    bool ok = true;
+    spin_lock(&g_lock);
+    if (!cluster_cached(owner, cluster, data, offset, bytes)) {
+        g_cached_owner = 0;
+        ok = cluster_decode(image, blocks, stored_flags, g_plain);
+        if (ok) {
+            g_stats.clusters_loaded++;
+            g_cached_owner = owner;
+            g_cached_cluster = cluster;
+            memcpy(data, g_plain + offset, bytes);
+        }
+    }
+    spin_unlock(&g_lock);
+    memory_free(image);
+    
+    return ok ? OMNIOS_SUCCESS : OMNIOS_ERROR_IO;
+}
+
+int omnifs_compress_read(omnifs_inode_t* inode, uint32_t owner, void* buffer, uint32_t size, uint32_t offset) {
+    uint32_t done = 0;
+    
+    while (done < size) {
+        uint32_t block = (offset + done) / g_block_size;
+        uint32_t block_offset = (offset + done) % g_block_size;
+        uint32_t bytes = g_block_size - block_offset;
+        if (bytes > size - done) {
+            bytes = size - done;
+        }
+        
+        bcache_buffer_t* delayed = bcache_find_delayed(owner, block);
+        if (delayed) {
+            memcpy((uint8_t*)buffer + done, delayed->data + block_offset, bytes);
+            bcache_release(delayed);
+        } else if (cluster_read_block(inode, owner, block, (uint8_t*)buffer + done, block_offset, bytes) !=
+                   OMNIOS_SUCCESS) {
+            return OMNIOS_ERROR_IO;
+        }
+        done += bytes;
+    }
+    
+    return OMNIOS_SUCCESS;
+}
+
+int omnifs_compress_fill(omnifs_inode_t* inode, uint32_t owner, uint32_t block, uint8_t* data) {
+    return cluster_read_block(inode, owner, block, data, 0, g_block_size);
+}
+
+// Block after the stored data nearest before the cluster, where its new
+// blocks would continue the file
+static uint32_t cluster_goal(omnifs_inode_t* inode, uint32_t base, const cluster_run_t* old, uint32_t old_count) {
+    for (uint32_t logical = base; logical > 0 && base - logical < OMNIFS_CLUSTER_BLOCKS; logical--) {
+        uint32_t physical = omnifs_extent_map(inode, logical - 1, NULL);
+        if (physical != 0) {
+            return physical + 1;
+        }
+    }
+    
+    return old_count > 0 ? old[0].start : 0;
+}
+
+static void cluster_release(const cluster_run_t* runs, uint32_t count) {
+    for (uint32_t i = 0; i < count; i++) {
+        for (uint32_t j = 0; j < runs[i].count; j++) {
+            g_release(runs[i].start + j);
+        }
+    }
+}
+
+static int cluster_write(omnifs_inode_t* inode, uint32_t cluster, bcache_buffer_t** buffers, uint32_t count,
+                         const cluster_work_t* work) {
+    uint32_t owner = buffers[0]->owner;
+    uint32_t base = cluster * OMNIFS_CLUSTER_BLOCKS;
+    uint8_t* plain = work->plain;
+    
+    // The stored contents, from the cache or the disk
+    spin_lock(&g_lock);
+    bool hit = cluster_cached(owner, cluster, plain, 0, g_cluster_size);
+    spin_unlock(&g_lock);
+    if (!hit) {
+        uint32_t blocks;
+        uint16_t flags;
+        if (cluster_fetch(inode, base, work->stored, &blocks, &flags) != OMNIOS_SUCCESS ||
+            !cluster_decode(work->stored, blocks, flags, plain)) {
+            return OMNIOS_ERROR_IO;
+        }
+        
+        if (blocks > 0) {
+            spin_lock(&g_lock);
+            g_stats.clusters_loaded++;
+            spin_unlock(&g_lock);
+        }
+    }
+    
+    // Newer data over the stored contents
+    uint32_t cluster_start = base * g_block_size;
+    uint32_t length = 0;
+    if (inode->size > cluster_start) {
+        length = (inode->size - cluster_start < g_cluster_size) ? inode->size - cluster_start : g_cluster_size;
+    }
+    
+    for (uint32_t i = 0; i < count; i++) {
+        uint32_t index = buffers[i]->block - base;
+        memcpy(plain + index * g_block_size, buffers[i]->data, g_block_size);
+        if ((index + 1) * g_block_size > length) {
+            length = (index + 1) * g_block_size; // Written ahead of the size update
+        }
+    }
+    
+    // Compressed only when that saves at least a block
+    uint32_t raw_blocks = (length + g_block_size - 1) / g_block_size;
+    uint32_t blocks = raw_blocks;
+    uint16_t flags = 0;
+    const uint8_t* image = plain;
+    uint32_t packed = 0;
+    if (raw_blocks > 1) {
+        packed = lz_compress(plain, length, work->stored + CLUSTER_HEADER_SIZE,
+                             (raw_blocks - 1) * g_block_size - CLUSTER_HEADER_SIZE, work->workspace);
+    }
+    
+    if (packed > 0) {
+        omnifs_cluster_header_t* header = (omnifs_cluster_header_t*)work->stored;
+        header->magic = OMNIFS_CLUSTER_MAGIC;
+        header->length = packed;
+        header->size = length;
+        
+        blocks = (CLUSTER_HEADER_SIZE + packed + g_block_size - 1) / g_block_size;
+        memset(work->stored + CLUSTER_HEADER_SIZE + packed, 0, blocks * g_block_size - CLUSTER_HEADER_SIZE - packed);
+        flags = OMNIFS_EXTENT_COMPRESSED;
+        image = work->stored;
+    }
+    
+    cluster_run_t old[OMNIFS_CLUSTER_BLOCKS];
+    uint32_t old_blocks;
+    uint16_t old_flags;
+    uint32_t old_count = cluster_runs(inode, base, old, &old_blocks, &old_flags);
+    
+    // New blocks first, so the old ones cannot be among them
+    cluster_run_t runs[OMNIFS_CLUSTER_BLOCKS];
+    uint32_t run_count = 0;
+    uint32_t goal = cluster_goal(inode, base, old, old_count);
+    for (uint32_t done = 0; done < blocks;) {
+        uint32_t run = blocks - done;
+        uint32_t start = g_allocate ? g_allocate(goal, &run) : 0;
+        if (start == 0) {
+            cluster_release(runs, run_count);
+            return OMNIOS_ERROR_MEMORY;
+        }
+        
+        runs[run_count].logical = base + done;
+        runs[run_count].start = start;
+        runs[run_count].count = run;
+        run_count++;
+        goal = start + run;
+        done += run;
+    }
+    
+    // Each run goes to the device as one request, before the mapping
+    // changes, so a failure leaves the cluster as it was
+    int result = OMNIOS_SUCCESS;
+    for (uint32_t i = 0; i < run_count && result == OMNIOS_SUCCESS; i++) {
+        for (uint32_t j = 0; j < runs[i].count; j++) {
+            bcache_buffer_t* buffer = bcache_get_new(runs[i].start + j);
+            if (!buffer) {
+                result = OMNIOS_ERROR_IO;
+                break;
+            }
+            
+            memcpy(buffer->data, image + (runs[i].logical - base + j) * g_block_size, g_block_size);
+            bcache_mark_dirty(buffer);
+            bcache_release(buffer);
+        }
+        
+        if (result == OMNIOS_SUCCESS) {
+            result = bcache_write_run(runs[i].start, runs[i].count);
+        }
+    }
+    
+    if (result == OMNIOS_SUCCESS) {
+        result = omnifs_extent_remove(inode, base, OMNIFS_CLUSTER_BLOCKS);
+        for (uint32_t i = 0; i < run_count && result == OMNIOS_SUCCESS; i++) {
+            result = omnifs_extent_insert_flags(inode, runs[i].logical, runs[i].start, runs[i].count, flags);
+        }
+        
+        // Put the old mapping back
+        if (result != OMNIOS_SUCCESS) {
+            omnifs_extent_remove(inode, base, OMNIFS_CLUSTER_BLOCKS);
+            for (uint32_t i = 0; i < old_count; i++) {
+                omnifs_extent_insert_flags(inode, old[i].logical, old[i].start, old[i].count, old_flags);
+            }
+        }
+    }
+    
+    if (result != OMNIOS_SUCCESS) {
+        cluster_release(runs, run_count);
+        return result;
+    }
+    
+    cluster_release(old, old_count);
+    inode->blocks = inode->blocks + blocks - old_blocks;
+    
+    for (uint32_t i = 0; i < count; i++) {
+        bcache_discard_delayed(buffers[i]);
+    }
+    
+    // Cache what the cluster now decompresses to
+    spin_lock(&g_lock);
+    g_stats.clusters_written++;
+    g_stats.clusters_compressed += (flags & OMNIFS_EXTENT_COMPRESSED) ? 1 : 0;
+    g_stats.bytes_written += length;
+    g_stats.bytes_stored += blocks * g_block_size;
+    memcpy(g_plain, plain, g_cluster_size);
+    g_cached_owner = owner;
+    g_cached_cluster = cluster;
+    spin_unlock(&g_lock);
+    return OMNIOS_SUCCESS;
+}
+
+int omnifs_compress_flush(omnifs_inode_t* inode, bcache_buffer_t** buffers, uint32_t count, uint32_t* written) {
+    if (!g_plain) {
+        return OMNIOS_ERROR_GENERIC;
+    }
+    
+    cluster_work_t work;
+    work.plain = memory_allocate(g_cluster_size);
+    work.stored = memory_allocate(g_cluster_size);
+    work.workspace = memory_allocate(sizeof(lz_workspace_t));
+    int result = (work.plain && work.stored && work.workspace) ? OMNIOS_SUCCESS : OMNIOS_ERROR_MEMORY;
+    
+    for (uint32_t i = 0; i < count && result == OMNIOS_SUCCESS;) {
+        uint32_t cluster = buffers[i]->block / OMNIFS_CLUSTER_BLOCKS;
+        uint32_t length = 1;
+        while (i + length < count && buffers[i + length]->block / OMNIFS_CLUSTER_BLOCKS == cluster) {
+            length++;
+        }
+        
+        result = cluster_write(inode, cluster, &buffers[i], length, &work);
+        if (result != OMNIOS_SUCCESS) {
+            break;
+        }
+
+        *written += length;
+        i += length;
+    }
+    
+    memory_free(work.plain);
+    memory_free(work.stored);
+    memory_free(work.workspace);
+    return result;
+}
+
+void omnifs_compress_forget(uint32_t owner) {
+    spin_lock(&g_lock);
+    if (g_cached_owner == owner) {
+        g_cached_owner = 0;
+    }
+    spin_unlock(&g_lock);
+}
+
+void omnifs_compress_get_stats(omnifs_compress_stats_t* stats) {
+    spin_lock(&g_lock);
+    *stats = g_stats;
+    spin_unlock(&g_lock);
+}
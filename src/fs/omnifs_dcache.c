@@ -0,0 +1,256 @@
+/*
+ * OmniOS 2.0 OmniFS Dentry Cache
+ * Fixed pool of entries hashed by parent inode and name hash, recycled
+ * by a clock that gives recently hit entries a second chance. Path
+ * resolution probes here before reading directories.
+ *
+ * Lookups take no locks: each bucket has a sequence counter that writers
+ * bump around every change to its chain, and a lookup that overlapped
+ * one starts again. Entries are never freed while the cache is up, so a
+ * walk that strays onto a recycled entry only reads stale fields, which
+ * the counter then rejects. Writers serialize on a spinlock.
+ */
+
+#include "omnios.h"
+#include "kernel/memory.h"
+#include "kernel/sync.h"
+#include "fs/omnifs_dcache.h"
+#include "fs/omnifs_dir.h"
+
+#define DCACHE_HASH_BUCKETS     512     // Power of two
+#define DCACHE_READ_ATTEMPTS    4       // Lookups racing writers this often read the directory
+
+typedef struct dcache_entry {
+    uint32_t parent;          // 0 while the entry is unused
+    uint32_t inode;           // 0 for a negative entry
+    uint32_t hash;
+    uint8_t name_len;
+    uint8_t referenced;       // Hit since the clock hand last passed
+    char name[OMNIFS_DCACHE_NAME_MAX];
+    struct dcache_entry* hash_next;
+} dcache_entry_t;
+
+// Cache state
+static dcache_entry_t* g_entries = NULL;
+static uint32_t g_max_entries = 0;
+static uint32_t g_hand = 0;          // Next entry the clock considers
+static dcache_entry_t* g_hash[DCACHE_HASH_BUCKETS];
+static seqcount_t g_sequence[DCACHE_HASH_BUCKETS];
+static spinlock_t g_lock = SPINLOCK_INIT;
+static omnifs_dcache_stats_t g_stats;
+
+// Fields lookups read without the lock go through these
+#define DCACHE_LOAD(field)          __atomic_load_n(&(field), __ATOMIC_RELAXED)
+#define DCACHE_STORE(field, value)  __atomic_store_n(&(field), (value), __ATOMIC_RELAXED)
+#define DCACHE_COUNT(counter)       __atomic_add_fetch(&(counter), 1, __ATOMIC_RELAXED)
+
+static inline uint32_t dcache_bucket(uint32_t parent, uint32_t hash) {
+    return ((hash ^ (parent * 2654435761u)) >> 7) & (DCACHE_HASH_BUCKETS - 1);
+}
+
+static bool dcache_matches(dcache_entry_t* entry, uint32_t parent, uint32_t hash, const char* name, uint32_t len) {
+    if (DCACHE_LOAD(entry->parent) != parent || DCACHE_LOAD(entry->hash) != hash ||
+        DCACHE_LOAD(entry->name_len) != len) {
+        return false;
+    }
+    
+    for (uint32_t i = 0; i < len; i++) {
+        if (DCACHE_LOAD(entry->name[i]) != name[i]) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Under the lock; no lookup of the bucket can trust what it read meanwhile
+static dcache_entry_t* dcache_find(uint32_t parent, uint32_t hash, const char* name, uint32_t len) {
+    for (dcache_entry_t* entry = g_hash[dcache_bucket(parent, hash)]; entry; entry = entry->hash_next) {
+        if (dcache_matches(entry, parent, hash, name, len)) {
+            return entry;
+        }
+    }
+    
+    return NULL;
+}
+
+// Unhash an entry; the clock reuses it on its next pass
+static void dcache_drop(dcache_entry_t* entry) {
+    uint32_t bucket = dcache_bucket(entry->parent, entry->hash);
+    dcache_entry_t** link = &g_hash[bucket];
+    while (*link && *link != entry) {
+        link = &(*link)->hash_next;
+    }
+    
+    seq_write_begin(&g_sequence[bucket]);
+    if (*link) {
+        DCACHE_STORE(*link, entry->hash_next);
+    }
+    DCACHE_STORE(entry->parent, 0);
+    seq_write_end(&g_sequence[bucket]);
+    
+    g_stats.entries--;
+    if (entry->inode == 0) {
+        g_stats.negative_entries--;
+    }
+}
+
+// Second chance: referenced entries lose the bit and are passed over once
+static dcache_entry_t* dcache_victim(void) {
+    for (;;) {
+        dcache_entry_t* entry = &g_entries[g_hand];
+        g_hand = (g_hand + 1) % g_max_entries;
+        if (entry->parent == 0 || !__atomic_exchange_n(&entry->referenced, 0, __ATOMIC_RELAXED)) {
+            return entry;
+        }
+    }
+}
+
+int omnifs_dcache_init(uint32_t max_entries) {
+    omnifs_dcache_shutdown();
+    
+    g_max_entries = max_entries ? max_entries : OMNIFS_DCACHE_DEFAULT_ENTRIES;
+    g_entries = memory_allocate(g_max_entries * sizeof(dcache_entry_t));
+    if (!g_entries) {
+        g_max_entries = 0;
+        return OMNIOS_ERROR_MEMORY;
+    }
+    
+    memset(g_entries, 0, g_max_entries * sizeof(dcache_entry_t));
+    memset(g_hash, 0, sizeof(g_hash));
+    memset(g_sequence, 0, sizeof(g_sequence));
+    memset(&g_stats, 0, sizeof(g_stats));
+    g_hand = 0;
+    return OMNIOS_SUCCESS;
+}
+
+void omnifs_dcache_shutdown(void) {
+    memory_free(g_entries);
+    g_entries = NULL;
+    g_max_entries = 0;
+    memset(g_hash, 0, sizeof(g_hash));
+}
+
+bool omnifs_dcache_lookup(uint32_t parent, const char* name, uint32_t len, uint32_t* inode) {
+    if (!g_entries || len > OMNIFS_DCACHE_NAME_MAX) {
+        return false;
+    }
+    
+    uint32_t hash = omnifs_dir_hash(name, len);
+    uint32_t bucket = dcache_bucket(parent, hash);
+    for (uint32_t attempt = 0; attempt < DCACHE_READ_ATTEMPTS; attempt++) {
+        uint32_t sequence = seq_read_begin(&g_sequence[bucket]);
+        
+        // Bounded, as a recycled entry can lead into another chain
+        dcache_entry_t* found = NULL;
+        uint32_t child = 0;
+        uint32_t steps = 0;
+        for (dcache_entry_t* entry = DCACHE_LOAD(g_hash[bucket]); entry && steps < g_max_entries;
+             entry = DCACHE_LOAD(entry->hash_next), steps++) {
+            if (dcache_matches(entry, parent, hash, name, len)) {
+                found = entry;
+                child = DCACHE_LOAD(entry->inode);
+                break;
+            }
+        }
+        
+        if (seq_read_retry(&g_sequence[bucket], sequence)) {
+            continue;
+        }
+        
+        if (!found) {
+            break;
+        }
+        
+        if (!DCACHE_LOAD(found->referenced)) {
+            DCACHE_STORE(found->referenced, 1);
+        }
+        DCACHE_COUNT(g_stats.hits);
+        if (child == 0) {
+            DCACHE_COUNT(g_stats.negative_hits);
+        }
+        *inode = child;
+        return true;
+    }
+    
+    DCACHE_COUNT(g_stats.misses);
+    return false;
+}
+
+void omnifs_dcache_insert(uint32_t parent, const char* name, uint32_t len, uint32_t inode) {
+    if (!g_entries || len == 0 || len > OMNIFS_DCACHE_NAME_MAX) {
+        return;
+    }
+    
+    uint32_t hash = omnifs_dir_hash(name, len);
+    spin_lock(&g_lock);
+    dcache_entry_t* entry = dcache_find(parent, hash, name, len);
+    if (entry) {
+        dcache_drop(entry);
+    }
+    
+    entry = dcache_victim();
+    if (entry->parent) {
+        dcache_drop(entry);
+    }
+    
+    // Filled in before it is published, so only walks that strayed onto
+    // it see the change, and their buckets' counters catch that
+    DCACHE_STORE(entry->inode, inode);
+    DCACHE_STORE(entry->hash, hash);
+    DCACHE_STORE(entry->name_len, (uint8_t)len);
+    DCACHE_STORE(entry->referenced, 0);
+    for (uint32_t i = 0; i < len; i++) {
+        DCACHE_STORE(entry->name[i], name[i]);
+    }
+    
+    uint32_t bucket = dcache_bucket(parent, hash);
+    seq_write_begin(&g_sequence[bucket]);
+    DCACHE_STORE(entry->parent, parent);
+    DCACHE_STORE(entry->hash_next, g_hash[bucket]);
+    DCACHE_STORE(g_hash[bucket], entry);
+    seq_write_end(&g_sequence[bucket]);
+    
+    g_stats.entries++;
+    if (inode == 0) {
+        g_stats.negative_entries++;
+    }
+    spin_unlock(&g_lock);
+}
+
+void omnifs_dcache_invalidate(uint32_t parent, const char* name, uint32_t len) {
+    if (!g_entries || len > OMNIFS_DCACHE_NAME_MAX) {
+        return;
+    }
+    
+    spin_lock(&g_lock);
+    dcache_entry_t* entry = dcache_find(parent, omnifs_dir_hash(name, len), name, len);
+    if (entry) {
+        dcache_drop(entry);
+        g_stats.invalidations++;
+    }
+    spin_unlock(&g_lock);
+}
+
+void omnifs_dcache_invalidate_inode(uint32_t inode) {
+    spin_lock(&g_lock);
+    for (uint32_t i = 0; i < g_max_entries; i++) {
+        dcache_entry_t* entry = &g_entries[i];
+        if (entry->parent && (entry->parent == inode || entry->inode == inode)) {
+            dcache_drop(entry);
+            g_stats.invalidations++;
+        }
+    }
+    spin_unlock(&g_lock);
+}
+
+void omnifs_dcache_get_stats(omnifs_dcache_stats_t* stats) {
+    spin_lock(&g_lock);
+    stats->entries = g_stats.entries;
+    stats->negative_entries = g_stats.negative_entries;
+    stats->invalidations = g_stats.invalidations;
+    spin_unlock(&g_lock);
+    
+    stats->hits = DCACHE_LOAD(g_stats.hits);
+    stats->negative_hits = DCACHE_LOAD(g_stats.negative_hits);
+    stats->misses = DCACHE_LOAD(g_stats.misses);
+}
@@ -0,0 +1,774 @@
+/*
+ * OmniOS 2.0 OmniFS Directories
+ * Small directories are a packed list of dirents, held in the inode
+ * itself while they fit on version 3. Once one outgrows its first block
+ * it is converted to an index of name hashes: block 0 holds the root, up
+ * to two more index levels sit below it, and each leaf is a block of
+ * dirents, so a lookup reads one block per level.
+ */
+
+#include "omnios.h"
+#include "kernel/memory.h"
+#include "fs/omnifs_dir.h"
+#include "fs/bcache.h"
+
+#define DIRENT_HEADER_SIZE      sizeof(omnifs_dirent_t)
+#define DIRENT_SIZE(name_len)   ((DIRENT_HEADER_SIZE + (name_len) + 3) & ~3)
+#define DIRENT_NAME_MAX         OMNIFS_DIR_NAME_MAX
+
+// Directory data access (implemented by omnifs.c)
+extern int omnifs_read_inode_data(omnifs_inode_t* inode, void* buffer, uint32_t size, uint32_t offset);
+extern int omnifs_write_inode_data(omnifs_inode_t* inode, const void* buffer, uint32_t size, uint32_t offset);
+extern uint32_t omnifs_get_block_number(omnifs_inode_t* inode, uint32_t block_index);
+
+// One index node on the path from the root to a leaf
+typedef struct {
+    bcache_buffer_t* buffer;
+    omnifs_dx_node_t* node;
+    uint32_t position;        // Entry followed to the next level
+} dx_frame_t;
+
+typedef struct {
+    dx_frame_t frames[OMNIFS_DX_MAX_DEPTH];
+    uint32_t depth;
+} dx_path_t;
+
+// Live record of a leaf being split
+typedef struct {
+    uint32_t hash;
+    uint16_t offset;
+    uint16_t size;
+} dx_record_t;
+
+static uint32_t g_block_size = 4096;
+static bool g_hashed = false;
+
+void omnifs_dir_init(uint32_t block_size, bool hashed) {
+    g_block_size = block_size;
+    g_hashed = hashed;
+}
+
+// FNV-1a; bit 0 is left for OMNIFS_DX_CONTINUED
+uint32_t omnifs_dir_hash(const char* name, uint32_t len) {
+    uint32_t hash = 2166136261u;
+    for (uint32_t i = 0; i < len; i++) {
+        hash = (hash ^ (uint8_t)name[i]) * 16777619u;
+    }
+    
+    return hash & ~OMNIFS_DX_CONTINUED;
+}
+
+static bcache_buffer_t* dir_block(omnifs_inode_t* dir, uint32_t block) {
+    uint32_t physical = omnifs_get_block_number(dir, block);
+    return physical ? bcache_get_metadata(physical) : NULL;
+}
+
+// Append one block with the given contents; returns its directory block number
+static uint32_t dir_append_block(omnifs_inode_t* dir, const uint8_t* data) {
+    uint32_t block = dir->size / g_block_size;
+    if (omnifs_write_inode_data(dir, data, g_block_size, block * g_block_size) != OMNIOS_SUCCESS) {
+        return 0;
+    }
+    
+    dir->size += g_block_size;
+    return block;
+}
+
+static inline omnifs_dx_entry_t* dx_entries(omnifs_dx_node_t* node) {
+    return (omnifs_dx_entry_t*)(node + 1);
+}
+
+// New nodes stop short of the block checksum; older ones may fill the block
+static inline uint32_t dx_limit(void) {
+    return (g_block_size - sizeof(omnifs_dx_node_t) - OMNIFS_CHECKSUM_SIZE) / sizeof(omnifs_dx_entry_t);
+}
+
+static void dx_init_node(omnifs_dx_node_t* node) {
+    memset(node, 0, g_block_size);
+    node->rec_len = g_block_size;
+    node->magic = OMNIFS_DX_MAGIC;
+    node->hash_version = OMNIFS_DX_HASH_FNV1A;
+    node->limit = dx_limit();
+}
+
+static bool dx_node_valid(const omnifs_dx_node_t* node) {
+    return node->inode == 0 && node->magic == OMNIFS_DX_MAGIC &&
+           node->hash_version == OMNIFS_DX_HASH_FNV1A &&
+           node->count > 0 && node->count <= node->limit &&
+           node->limit <= (g_block_size - sizeof(omnifs_dx_node_t)) / sizeof(omnifs_dx_entry_t);
+}
+
+// Last entry whose hash is <= hash; entry 0 has no lower bound
+static uint32_t dx_search(omnifs_dx_node_t* node, uint32_t hash) {
+    omnifs_dx_entry_t* entries = dx_entries(node);
+    uint32_t low = 1;
+    uint32_t high = node->count;
+    
+    while (low < high) {
+        uint32_t middle = (low + high) / 2;
+        if (entries[middle].hash > hash) {
+            high = middle;
+        } else {
+            low = middle + 1;
+        }
+    }
+    
+    return low - 1;
+}
+
+static void dx_insert_entry(omnifs_dx_node_t* node, uint32_t position, uint32_t hash, uint32_t block) {
+    omnifs_dx_entry_t* entries = dx_entries(node);
+    memmove(&entries[position + 1], &entries[position], (node->count - position) * sizeof(omnifs_dx_entry_t));
+    entries[position].hash = hash;
+    entries[position].block = block;
+    node->count++;
+}
+
+static void dx_release(dx_path_t* path) {
+    for (uint32_t i = 0; i < path->depth; i++) {
+        bcache_release(path->frames[i].buffer);
+    }
+    path->depth = 0;
+}
+
+// Walk the index to the leaf that would hold hash, pinning the index
+// blocks on the way. Returns the leaf block, 0 if the index is damaged.
+static uint32_t dx_probe(omnifs_inode_t* dir, uint32_t hash, dx_path_t* path) {
+    uint32_t blocks = dir->size / g_block_size;
+    uint32_t levels = 0;
+    uint32_t block = 0;
+    path->depth = 0;
+    
+    do {
+        bcache_buffer_t* buffer = dir_block(dir, block);
+        if (!buffer) {
+            break;
+        }
+        
+        dx_frame_t* frame = &path->frames[path->depth++];
+        frame->buffer = buffer;
+        frame->node = (omnifs_dx_node_t*)buffer->data;
+        if (!dx_node_valid(frame->node)) {
+            break;
+        }
+        
+        if (path->depth == 1) {
+            levels = frame->node->levels;
+            if (levels >= OMNIFS_DX_MAX_DEPTH) {
+                break;
+            }
+        }
+        
+        frame->position = dx_search(frame->node, hash);
+        block = dx_entries(frame->node)[frame->position].block;
+        if (block == 0 || block >= blocks) {
+            break;
+        }
+        
+        if (path->depth > levels) {
+            return block;
+        }
+    } while (true);
+    
+    dx_release(path);
+    return 0;
+}
+
+// Leaf following the current one when it continues the run of hash
+static uint32_t dx_next_leaf(omnifs_inode_t* dir, dx_path_t* path, uint32_t hash) {
+    int level = (int)path->depth - 1;
+    while (level >= 0 && path->frames[level].position + 1 >= path->frames[level].node->count) {
+        level--;
+    }
+    
+    if (level < 0) {
+        return 0;
+    }
+    
+    dx_frame_t* frame = &path->frames[level];
+    frame->position++;
+    omnifs_dx_entry_t* entry = &dx_entries(frame->node)[frame->position];
+    if (entry->hash != (hash | OMNIFS_DX_CONTINUED)) {
+        return 0;
+    }
+    
+    // Descend along the leftmost entries of the following subtree
+    uint32_t block = entry->block;
+    for (uint32_t i = level + 1; i < path->depth; i++) {
+        bcache_buffer_t* buffer = dir_block(dir, block);
+        if (!buffer) {
+            return 0;
+        }
+        
+        bcache_release(path->frames[i].buffer);
+        path->frames[i].buffer = buffer;
+        path->frames[i].node = (omnifs_dx_node_t*)buffer->data;
+        path->frames[i].position = 0;
+        if (!dx_node_valid(path->frames[i].node)) {
+            return 0;
+        }
+        block = dx_entries(path->frames[i].node)[0].block;
+    }
+    
+    return block;
+}
+
+static omnifs_dirent_t* leaf_find(uint8_t* data, const char* name, uint32_t len) {
+    uint32_t offset = 0;
+    while (offset + DIRENT_HEADER_SIZE <= g_block_size) {
+        omnifs_dirent_t* entry = (omnifs_dirent_t*)(data + offset);
+        if (entry->rec_len < DIRENT_HEADER_SIZE || offset + entry->rec_len > g_block_size) {
+            break;
+        }
+        
+        if (entry->inode && entry->name_len == len && memcmp(entry->name, name, len) == 0) {
+            return entry;
+        }
+        offset += entry->rec_len;
+    }
+    
+    return NULL;
+}
+
+// Place a record in the first slack large enough; false when the leaf is
+// full. The slack of the last record keeps the block checksum.
+static bool leaf_insert(uint8_t* data, const char* name, uint32_t len, uint32_t child, uint8_t file_type) {
+    uint32_t needed = DIRENT_SIZE(len);
+    uint32_t offset = 0;
+    
+    while (offset + DIRENT_HEADER_SIZE <= g_block_size) {
+        omnifs_dirent_t* entry = (omnifs_dirent_t*)(data + offset);
+        if (entry->rec_len < DIRENT_HEADER_SIZE || offset + entry->rec_len > g_block_size) {
+            break;
+        }
+        
+        uint32_t used = entry->inode ? DIRENT_SIZE(entry->name_len) : 0;
+        uint32_t room = entry->rec_len;
+        if (offset + entry->rec_len == g_block_size) {
+            room -= OMNIFS_CHECKSUM_SIZE;
+        }
+        if (room >= used + needed) {
+            if (used) {
+                omnifs_dirent_t* next = (omnifs_dirent_t*)(data + offset + used);
+                next->rec_len = entry->rec_len - used;
+                entry->rec_len = used;
+                entry = next;
+            }
+            
+            entry->inode = child;
+            entry->name_len = len;
+            entry->file_type = file_type;
+            memcpy(entry->name, name, len);
+            return true;
+        }
+        offset += entry->rec_len;
+    }
+    
+    return false;
+}
+
+// Pack records into out; the last one spans the rest of the block
+static void leaf_pack(uint8_t* out, const uint8_t* in, const dx_record_t* records, uint32_t count) {
+    omnifs_dirent_t* last = NULL;
+    uint32_t offset = 0;
+    
+    memset(out, 0, g_block_size);
+    for (uint32_t i = 0; i < count; i++) {
+        memcpy(out + offset, in + records[i].offset, records[i].size);
+        last = (omnifs_dirent_t*)(out + offset);
+        last->rec_len = records[i].size;
+        offset += records[i].size;
+    }
+    
+    if (last) {
+        last->rec_len += g_block_size - offset;
+    } else {
+        ((omnifs_dirent_t*)out)->rec_len = g_block_size;
+    }
+}
+
+// Move the upper half of a full leaf, by hash, into a new block
+static int dx_split_leaf(omnifs_inode_t* dir, dx_path_t* path, bcache_buffer_t* leaf) {
+    uint32_t max_records = g_block_size / DIRENT_SIZE(1);
+    dx_record_t* records = memory_allocate(max_records * sizeof(dx_record_t));
+    uint8_t* halves = memory_allocate(2 * g_block_size);
+    if (!records || !halves) {
+        memory_free(records);
+        memory_free(halves);
+        return OMNIOS_ERROR_MEMORY;
+    }
+    
+    uint32_t count = 0;
+    uint32_t offset = 0;
+    while (offset + DIRENT_HEADER_SIZE <= g_block_size && count < max_records) {
+        omnifs_dirent_t* entry = (omnifs_dirent_t*)(leaf->data + offset);
+        if (entry->rec_len < DIRENT_HEADER_SIZE || offset + entry->rec_len > g_block_size) {
+            break;
+        }
+        
+        if (entry->inode) {
+            dx_record_t record = { omnifs_dir_hash(entry->name, entry->name_len), offset,
+                                   DIRENT_SIZE(entry->name_len) };
+            
+            // Insertion sort; leaves hold at most a few hundred records
+            uint32_t i = count++;
+            while (i > 0 && records[i - 1].hash > record.hash) {
+                records[i] = records[i - 1];
+                i--;
+            }
+            records[i] = record;
+        }
+        offset += entry->rec_len;
+    }
+    
+    if (count < 2) {
+        memory_free(records);
+        memory_free(halves);
+        return OMNIOS_ERROR_GENERIC;
+    }
+    
+    // Names sharing a hash may straddle the split; flag the new leaf so
+    // lookups continue into it
+    uint32_t split = count / 2;
+    uint32_t split_hash = records[split].hash;
+    if (split_hash == records[split - 1].hash) {
+        split_hash |= OMNIFS_DX_CONTINUED;
+    }
+    
+    leaf_pack(halves, leaf->data, records, split);
+    leaf_pack(halves + g_block_size, leaf->data, records + split, count - split);
+    
+    uint32_t block = dir_append_block(dir, halves + g_block_size);
+    if (block != 0) {
+        memcpy(leaf->data, halves, g_block_size);
+        bcache_mark_metadata(leaf);
+        
+        dx_frame_t* parent = &path->frames[path->depth - 1];
+        dx_insert_entry(parent->node, parent->position + 1, split_hash, block);
+        bcache_mark_metadata(parent->buffer);
+    }
+    
+    memory_free(records);
+    memory_free(halves);
+    return block ? OMNIOS_SUCCESS : OMNIOS_ERROR_IO;
+}
+
+// Split a full index node below the root; its parent has room
+static int dx_split_node(omnifs_inode_t* dir, dx_path_t* path, uint32_t level) {
+    omnifs_dx_node_t* node = path->frames[level].node;
+    dx_frame_t* parent = &path->frames[level - 1];
+    
+    uint8_t* data = memory_allocate(g_block_size);
+    if (!data) {
+        return OMNIOS_ERROR_MEMORY;
+    }
+    
+    uint32_t keep = node->count / 2;
+    omnifs_dx_node_t* sibling = (omnifs_dx_node_t*)data;
+    dx_init_node(sibling);
+    sibling->count = node->count - keep;
+    memcpy(dx_entries(sibling), &dx_entries(node)[keep], sibling->count * sizeof(omnifs_dx_entry_t));
+    
+    uint32_t block = dir_append_block(dir, data);
+    memory_free(data);
+    if (block == 0) {
+        return OMNIOS_ERROR_IO;
+    }
+    
+    dx_insert_entry(parent->node, parent->position + 1, dx_entries(node)[keep].hash, block);
+    node->count = keep;
+    bcache_mark_metadata(path->frames[level].buffer);
+    bcache_mark_metadata(parent->buffer);
+    return OMNIOS_SUCCESS;
+}
+
+// Move the full root's entries into a new node one level down
+static int dx_grow_root(omnifs_inode_t* dir, dx_path_t* path) {
+    omnifs_dx_node_t* root = path->frames[0].node;
+    if (root->levels + 1 >= OMNIFS_DX_MAX_DEPTH) {
+        return OMNIOS_ERROR_MEMORY; // Directory is full
+    }
+    
+    uint8_t* data = memory_allocate(g_block_size);
+    if (!data) {
+        return OMNIOS_ERROR_MEMORY;
+    }
+    
+    omnifs_dx_node_t* child = (omnifs_dx_node_t*)data;
+    dx_init_node(child);
+    child->count = root->count;
+    memcpy(dx_entries(child), dx_entries(root), root->count * sizeof(omnifs_dx_entry_t));
+    
+    uint32_t block = dir_append_block(dir, data);
+    memory_free(data);
+    if (block == 0) {
+        return OMNIOS_ERROR_IO;
+    }
+    
+    root->count = 1;
+    root->levels++;
+    dx_entries(root)[0].hash = 0;
+    dx_entries(root)[0].block = block;
+    bcache_mark_metadata(path->frames[0].buffer);
+    return OMNIOS_SUCCESS;
+}
+
+// Turn a one-block linear directory into a root and a single leaf
+static int dx_build(omnifs_inode_t* dir) {
+    uint8_t* data = memory_allocate(2 * g_block_size);
+    if (!data) {
+        return OMNIOS_ERROR_MEMORY;
+    }
+    
+    uint8_t* leaf = data + g_block_size;
+    memset(leaf, 0, g_block_size);
+    if (dir->size && omnifs_read_inode_data(dir, leaf, dir->size, 0) != OMNIOS_SUCCESS) {
+        memory_free(data);
+        return OMNIOS_ERROR_IO;
+    }
+    
+    // Keep the whole records and let the last one span the block
+    omnifs_dirent_t* last = NULL;
+    uint32_t offset = 0;
+    while (offset + DIRENT_HEADER_SIZE <= dir->size) {
+        omnifs_dirent_t* entry = (omnifs_dirent_t*)(leaf + offset);
+        if (entry->rec_len < DIRENT_HEADER_SIZE || offset + entry->rec_len > dir->size) {
+            break;
+        }
+        last = entry;
+        offset += entry->rec_len;
+    }
+    
+    if (last) {
+        last->rec_len = g_block_size - (uint32_t)((uint8_t*)last - leaf);
+    } else {
+        memset(leaf, 0, g_block_size);
+        ((omnifs_dirent_t*)leaf)->rec_len = g_block_size;
+    }
+    
+    omnifs_dx_node_t* root = (omnifs_dx_node_t*)data;
+    dx_init_node(root);
+    root->count = 1;
+    dx_entries(root)[0].hash = 0;
+    dx_entries(root)[0].block = 1;
+    
+    // Leaf first: until the root is written the directory still reads as linear
+    int result = omnifs_write_inode_data(dir, leaf, g_block_size, g_block_size);
+    if (result == OMNIOS_SUCCESS) {
+        result = omnifs_write_inode_data(dir, root, g_block_size, 0);
+    }
+    
+    memory_free(data);
+    if (result != OMNIOS_SUCCESS) {
+        return result;
+    }
+    
+    dir->size = 2 * g_block_size;
+    return OMNIOS_SUCCESS;
+}
+
+static int dx_add(omnifs_inode_t* dir, const char* name, uint32_t len, uint32_t child, uint8_t file_type) {
+    uint32_t hash = omnifs_dir_hash(name, len);
+    
+    // Every retry follows a split or a new index level, so this is bounded
+    for (int attempt = 0; attempt < 2 * OMNIFS_DX_MAX_DEPTH + 2; attempt++) {
+        dx_path_t path;
+        uint32_t block = dx_probe(dir, hash, &path);
+        if (block == 0) {
+            return OMNIOS_ERROR_IO;
+        }
+        
+        bcache_buffer_t* leaf = dir_block(dir, block);
+        if (!leaf) {
+            dx_release(&path);
+            return OMNIOS_ERROR_IO;
+        }
+        
+        int result;
+        if (leaf_insert(leaf->data, name, len, child, file_type)) {
+            bcache_mark_metadata(leaf);
+            result = OMNIOS_SUCCESS;
+        } else {
+            // Make room in the parent first: split the topmost of the full
+            // nodes ending at the bottom index level, or deepen the index
+            int level = (int)path.depth - 1;
+            if (path.frames[level].node->count < path.frames[level].node->limit) {
+                result = dx_split_leaf(dir, &path, leaf);
+            } else {
+                while (level > 0 && path.frames[level - 1].node->count >= path.frames[level - 1].node->limit) {
+                    level--;
+                }
+                result = level == 0 ? dx_grow_root(dir, &path) : dx_split_node(dir, &path, level);
+            }
+            
+            if (result == OMNIOS_SUCCESS) {
+                result = 1; // Retry the insert
+            }
+        }
+        
+        bcache_release(leaf);
+        dx_release(&path);
+        if (result <= 0) {
+            return result;
+        }
+    }
+    
+    return OMNIOS_ERROR_GENERIC;
+}
+
+static bool dx_lookup(omnifs_inode_t* dir, const char* name, uint32_t len, uint32_t* child) {
+    uint32_t hash = omnifs_dir_hash(name, len);
+    dx_path_t path;
+    uint32_t block = dx_probe(dir, hash, &path);
+    if (block == 0) {
+        return false;
+    }
+    
+    bool ok = true;
+    *child = 0;
+    while (block != 0) {
+        bcache_buffer_t* leaf = dir_block(dir, block);
+        if (!leaf) {
+            ok = false;
+            break;
+        }
+        
+        omnifs_dirent_t* entry = leaf_find(leaf->data, name, len);
+        if (entry) {
+            *child = entry->inode;
+        }
+        bcache_release(leaf);
+        
+        if (entry) {
+            break;
+        }
+        block = dx_next_leaf(dir, &path, hash);
+    }
+    
+    dx_release(&path);
+    return ok;
+}
+
+// Walks the records of a directory in offset order, pinning each block
+// once. Inline directories are read from the inode; linear directories
+// may split records across blocks, and those are copied out whole.
+typedef struct {
+    omnifs_inode_t* dir;
+    uint32_t offset;          // Record the cursor is on
+    bcache_buffer_t* buffer;
+    uint32_t buffer_block;
+    uint8_t copy[DIRENT_HEADER_SIZE + DIRENT_NAME_MAX] __attribute__((aligned(4)));
+} dir_cursor_t;
+
+static void cursor_init(dir_cursor_t* cursor, omnifs_inode_t* dir, uint32_t offset) {
+    cursor->dir = dir;
+    cursor->offset = offset;
+    cursor->buffer = NULL;
+    cursor->buffer_block = 0;
+}
+
+static void cursor_release(dir_cursor_t* cursor) {
+    bcache_release(cursor->buffer);
+    cursor->buffer = NULL;
+}
+
+// Record at the cursor; NULL at the end, on a read error or a damaged record
+static omnifs_dirent_t* cursor_entry(dir_cursor_t* cursor) {
+    omnifs_inode_t* dir = cursor->dir;
+    uint32_t offset = cursor->offset;
+    if (offset + DIRENT_HEADER_SIZE > dir->size) {
+        return NULL;
+    }
+    
+    omnifs_dirent_t* entry;
+    if (dir->flags & OMNIFS_INODE_INLINE) {
+        entry = (omnifs_dirent_t*)(dir->inline_data + offset);
+    } else {
+        uint32_t block = offset / g_block_size;
+        uint32_t in_block = offset % g_block_size;
+        
+        if (!cursor->buffer || cursor->buffer_block != block) {
+            cursor_release(cursor);
+            cursor->buffer = dir_block(dir, block);
+            cursor->buffer_block = block;
+            if (!cursor->buffer) {
+                return NULL;
+            }
+        }
+        
+        entry = (omnifs_dirent_t*)(cursor->buffer->data + in_block);
+        uint32_t available = g_block_size - in_block;
+        if (available < DIRENT_HEADER_SIZE || available < DIRENT_HEADER_SIZE + entry->name_len) {
+            if (omnifs_read_inode_data(dir, cursor->copy, sizeof(cursor->copy), offset) != OMNIOS_SUCCESS) {
+                return NULL;
+            }
+            entry = (omnifs_dirent_t*)cursor->copy;
+        }
+    }
+    
+    if (entry->rec_len == 0 || offset + DIRENT_HEADER_SIZE + entry->name_len > dir->size) {
+        return NULL;
+    }
+    return entry;
+}
+
+// Scan every record; works on both layouts since index blocks read as
+// unused records
+static uint32_t linear_lookup(omnifs_inode_t* dir, const char* name, uint32_t len) {
+    dir_cursor_t cursor;
+    cursor_init(&cursor, dir, 0);
+    uint32_t child = 0;
+    
+    omnifs_dirent_t* entry;
+    while ((entry = cursor_entry(&cursor)) != NULL) {
+        if (entry->inode && entry->name_len == len && memcmp(entry->name, name, len) == 0) {
+            child = entry->inode;
+            break;
+        }
+        cursor.offset += entry->rec_len;
+    }
+    
+    cursor_release(&cursor);
+    return child;
+}
+
+static int linear_add(omnifs_inode_t* dir, const char* name, uint32_t len, uint32_t child, uint8_t file_type) {
+    uint16_t rec_len = DIRENT_SIZE(len);
+    omnifs_dirent_t* entry = memory_allocate(rec_len);
+    if (!entry) {
+        return OMNIOS_ERROR_MEMORY;
+    }
+    
+    memset(entry, 0, rec_len);
+    entry->inode = child;
+    entry->rec_len = rec_len;
+    entry->name_len = len;
+    entry->file_type = file_type;
+    memcpy(entry->name, name, len);
+    
+    // Append to directory
+    int result = omnifs_write_inode_data(dir, entry, rec_len, dir->size);
+    if (result == OMNIOS_SUCCESS) {
+        dir->size += rec_len;
+    }
+    
+    memory_free(entry);
+    return result;
+}
+
+bool omnifs_dir_is_indexed(omnifs_inode_t* dir) {
+    if (dir->size < 2 * g_block_size) {
+        return false;
+    }
+    
+    bcache_buffer_t* buffer = dir_block(dir, 0);
+    if (!buffer) {
+        return false;
+    }
+    
+    omnifs_dx_node_t* root = (omnifs_dx_node_t*)buffer->data;
+    bool indexed = dx_node_valid(root) && root->levels < OMNIFS_DX_MAX_DEPTH;
+    bcache_release(buffer);
+    return indexed;
+}
+
+uint32_t omnifs_dir_lookup(omnifs_inode_t* dir, const char* name) {
+    uint32_t len = strlen(name);
+    if (len == 0 || len > DIRENT_NAME_MAX) {
+        return 0;
+    }
+    
+    uint32_t child;
+    if (dir->size >= 2 * g_block_size && dx_lookup(dir, name, len, &child)) {
+        return child;
+    }
+    
+    return linear_lookup(dir, name, len);
+}
+
+int omnifs_dir_add(omnifs_inode_t* dir, const char* name, uint32_t child, uint8_t file_type) {
+    uint32_t len = strlen(name);
+    if (len == 0 || len > DIRENT_NAME_MAX) {
+        return OMNIOS_ERROR_GENERIC;
+    }
+    
+    if (omnifs_dir_is_indexed(dir)) {
+        return dx_add(dir, name, len, child, file_type);
+    }
+    
+    // Index a directory the moment it would spill into a second block or
+    // over the checksum ending its first
+    if (g_hashed && dir->size <= g_block_size &&
+        dir->size + DIRENT_SIZE(len) > g_block_size - OMNIFS_CHECKSUM_SIZE) {
+        int result = dx_build(dir);
+        if (result != OMNIOS_SUCCESS) {
+            return result;
+        }
+        return dx_add(dir, name, len, child, file_type);
+    }
+    
+    return linear_add(dir, name, len, child, file_type);
+}
+
+int omnifs_dir_set(omnifs_inode_t* dir, const char* name, uint32_t child, uint8_t file_type) {
+    uint32_t len = strlen(name);
+    if (len == 0 || len > DIRENT_NAME_MAX) {
+        return OMNIOS_ERROR_GENERIC;
+    }
+    
+    // A linear scan finds the record's offset in either layout
+    dir_cursor_t cursor;
+    cursor_init(&cursor, dir, 0);
+    omnifs_dirent_t* entry;
+    while ((entry = cursor_entry(&cursor)) != NULL) {
+        if (entry->inode && entry->name_len == len && memcmp(entry->name, name, len) == 0) {
+            break;
+        }
+        cursor.offset += entry->rec_len;
+    }
+    
+    if (!entry) {
+        cursor_release(&cursor);
+        return OMNIOS_ERROR_NOT_FOUND;
+    }
+    
+    // Rewrite the header through the data path so the change is journaled
+    omnifs_dirent_t header = *entry;
+    cursor_release(&cursor);
+    header.inode = child;
+    header.file_type = file_type;
+    return omnifs_write_inode_data(dir, &header, DIRENT_HEADER_SIZE, cursor.offset);
+}
+
+int omnifs_dir_read(omnifs_inode_t* dir, uint32_t* cookie, omnifs_dir_entry_t* entries, uint32_t max_entries) {
+    dir_cursor_t cursor;
+    cursor_init(&cursor, dir, *cookie);
+    uint32_t count = 0;
+    
+    omnifs_dirent_t* entry = NULL;
+    while (count < max_entries && (entry = cursor_entry(&cursor)) != NULL) {
+        cursor.offset += entry->rec_len;
+        
+        // Free space and index blocks
+        if (entry->inode == 0) {
+            continue;
+        }
+        
+        omnifs_dir_entry_t* out = &entries[count++];
+        out->inode = entry->inode;
+        out->next = cursor.offset;
+        out->file_type = entry->file_type;
+        out->name_len = entry->name_len;
+        memcpy(out->name, entry->name, entry->name_len);
+        out->name[entry->name_len] = '\0';
+    }
+    
+    cursor_release(&cursor);
+    *cookie = cursor.offset;
+    
+    // Stopped short of the end without returning anything
+    if (count == 0 && !entry && cursor.offset + DIRENT_HEADER_SIZE <= dir->size) {
+        return OMNIOS_ERROR_IO;
+    }
+    return (int)count;
+}
@@ -0,0 +1,418 @@
+/*
+ * OmniOS 2.0 OmniFS Extent Trees
+ * B+tree of extents keyed by file block. The inode holds a four-entry
+ * root; a full root moves into a block and the tree gains a level.
+ */
+
+#include "omnios.h"
+#include "fs/omnifs_extent.h"
+#include "fs/bcache.h"
+
+// Leaf and index entries share one size so nodes can be shifted generically
+#define EXTENT_ENTRY_SIZE       sizeof(omnifs_extent_t)
+
+typedef char extent_entry_size_check[(sizeof(omnifs_extent_t) == sizeof(omnifs_extent_index_t)) ? 1 : -1];
+
+static uint32_t g_block_size = 4096;
+static omnifs_extent_alloc_t g_allocate = NULL;
+
+static inline omnifs_extent_header_t* extent_root(omnifs_inode_t* inode) {
+    return (omnifs_extent_header_t*)inode->extent_root;
+}
+
+static inline uint8_t* extent_entries(omnifs_extent_header_t* node) {
+    return (uint8_t*)(node + 1);
+}
+
+static inline uint32_t extent_key(omnifs_extent_header_t* node, int index) {
+    return *(uint32_t*)(extent_entries(node) + index * EXTENT_ENTRY_SIZE);
+}
+
+// Last entry whose key is <= logical, -1 when logical precedes them all
+static int extent_search(omnifs_extent_header_t* node, uint32_t logical) {
+    int low = 0;
+    int high = (int)node->entries - 1;
+    int found = -1;
+    
+    while (low <= high) {
+        int middle = (low + high) / 2;
+        if (extent_key(node, middle) <= logical) {
+            found = middle;
+            low = middle + 1;
+        } else {
+            high = middle - 1;
+        }
+    }
+    
+    return found;
+}
+
+// Insert a leaf or index record in key order; the node must have room
+static void extent_node_insert(omnifs_extent_header_t* node, const void* record) {
+    uint8_t* entries = extent_entries(node);
+    int position = extent_search(node, *(const uint32_t*)record) + 1;
+    
+    memmove(entries + (position + 1) * EXTENT_ENTRY_SIZE, entries + position * EXTENT_ENTRY_SIZE,
+            (node->entries - position) * EXTENT_ENTRY_SIZE);
+    memcpy(entries + position * EXTENT_ENTRY_SIZE, record, EXTENT_ENTRY_SIZE);
+    node->entries++;
+}
+
+static bcache_buffer_t* extent_new_node(uint32_t goal, uint16_t depth, uint32_t* block) {
+    *block = g_allocate ? g_allocate(goal) : 0;
+    if (*block == 0) {
+        return NULL;
+    }
+    
+    bcache_buffer_t* buffer = bcache_get_new(*block);
+    if (!buffer) {
+        return NULL;
+    }
+    
+    memset(buffer->data, 0, g_block_size);
+    omnifs_extent_header_t* node = (omnifs_extent_header_t*)buffer->data;
+    node->magic = OMNIFS_EXTENT_MAGIC;
+    node->max = (g_block_size - sizeof(omnifs_extent_header_t) - OMNIFS_CHECKSUM_SIZE) / EXTENT_ENTRY_SIZE;
+    node->depth = depth;
+    return buffer;
+}
+
+// Root is full: move its entries into a new block one level down, then insert there
+static int extent_grow_root(omnifs_extent_header_t* root, const void* record, uint32_t goal) {
+    uint32_t block;
+    bcache_buffer_t* buffer = extent_new_node(goal, root->depth, &block);
+    if (!buffer) {
+        return OMNIOS_ERROR_MEMORY;
+    }
+    
+    omnifs_extent_header_t* child = (omnifs_extent_header_t*)buffer->data;
+    memcpy(extent_entries(child), extent_entries(root), root->entries * EXTENT_ENTRY_SIZE);
+    child->entries = root->entries;
+    extent_node_insert(child, record);
+    bcache_mark_metadata(buffer);
+    bcache_release(buffer);
+    
+    omnifs_extent_index_t* index = (omnifs_extent_index_t*)extent_entries(root);
+    index->logical = 0; // The first child covers everything below its siblings
+    index->block = block;
+    index->reserved = 0;
+    root->entries = 1;
+    root->depth++;
+    return OMNIOS_SUCCESS;
+}
+
+// Full block node: move the upper half (nothing when appending) to a new
+// sibling, insert the record on its side and report the sibling upwards
+static int extent_split(omnifs_extent_header_t* node, const void* record, uint32_t goal,
+                        omnifs_extent_index_t* sibling_entry) {
+    uint32_t block;
+    bcache_buffer_t* buffer = extent_new_node(goal, node->depth, &block);
+    if (!buffer) {
+        return OMNIOS_ERROR_MEMORY;
+    }
+    
+    omnifs_extent_header_t* sibling = (omnifs_extent_header_t*)buffer->data;
+    uint32_t key = *(const uint32_t*)record;
+    uint32_t keep = (key > extent_key(node, node->entries - 1)) ? node->entries : node->entries / 2;
+    
+    sibling->entries = node->entries - keep;
+    memcpy(extent_entries(sibling), extent_entries(node) + keep * EXTENT_ENTRY_SIZE,
+           sibling->entries * EXTENT_ENTRY_SIZE);
+    node->entries = keep;
+    
+    if (sibling->entries == 0 || key >= extent_key(sibling, 0)) {
+        extent_node_insert(sibling, record);
+    } else {
+        extent_node_insert(node, record);
+    }
+    
+    sibling_entry->logical = extent_key(sibling, 0);
+    sibling_entry->block = block;
+    sibling_entry->reserved = 0;
+    
+    bcache_mark_metadata(buffer);
+    bcache_release(buffer);
+    return OMNIOS_SUCCESS;
+}
+
+// Add a record to a node that may be full
+static int extent_add_record(omnifs_extent_header_t* node, bool root, const void* record, uint32_t goal,
+                             omnifs_extent_index_t* sibling_entry, bool* split) {
+    if (node->entries < node->max) {
+        extent_node_insert(node, record);
+        return OMNIOS_SUCCESS;
+    }
+    
+    if (root) {
+        return extent_grow_root(node, record, goal);
+    }
+    
+    *split = true;
+    return extent_split(node, record, goal, sibling_entry);
+}
+
+static int extent_insert_node(omnifs_extent_header_t* node, bool root, const omnifs_extent_t* extent,
+                              omnifs_extent_index_t* sibling_entry, bool* split) {
+    int index = extent_search(node, extent->logical);
+    
+    if (node->depth == 0) {
+        if (index >= 0) {
+            omnifs_extent_t* previous = &((omnifs_extent_t*)extent_entries(node))[index];
+            if (extent->logical < previous->logical + previous->length) {
+                return OMNIOS_ERROR_GENERIC; // Already mapped
+            }
+            
+            // Extend the preceding extent when the new run continues it
+            if (previous->logical + previous->length == extent->logical &&
+                previous->start + previous->length == extent->start &&
+                previous->flags == extent->flags &&
+                (uint32_t)previous->length + extent->length <= OMNIFS_EXTENT_MAX_LENGTH) {
+                previous->length += extent->length;
+                return OMNIOS_SUCCESS;
+            }
+        }
+        
+        return extent_add_record(node, root, extent, extent->start, sibling_entry, split);
+    }
+    
+    if (index < 0) {
+        index = 0;
+    }
+    
+    omnifs_extent_index_t* entry = &((omnifs_extent_index_t*)extent_entries(node))[index];
+    bcache_buffer_t* buffer = bcache_get_metadata(entry->block);
+    if (!buffer) {
+        return OMNIOS_ERROR_IO;
+    }
+    
+    omnifs_extent_index_t child_sibling;
+    bool child_split = false;
+    int result = extent_insert_node((omnifs_extent_header_t*)buffer->data, false, extent, &child_sibling, &child_split);
+    if (result == OMNIOS_SUCCESS) {
+        bcache_mark_metadata(buffer);
+    }
+    bcache_release(buffer);
+    
+    if (result != OMNIOS_SUCCESS || !child_split) {
+        return result;
+    }
+    
+    return extent_add_record(node, root, &child_sibling, child_sibling.block, sibling_entry, split);
+}
+
+void omnifs_extent_init(uint32_t block_size, omnifs_extent_alloc_t allocate) {
+    g_block_size = block_size;
+    g_allocate = allocate;
+}
+
+void omnifs_extent_init_root(omnifs_inode_t* inode) {
+    memset(inode->extent_root, 0, OMNIFS_EXTENT_ROOT_SIZE);
+    omnifs_extent_header_t* root = extent_root(inode);
+    root->magic = OMNIFS_EXTENT_MAGIC;
+    root->max = OMNIFS_EXTENT_ROOT_ENTRIES;
+}
+
+// Walk index levels down to the leaf that would hold logical, holding
+// only the current node's buffer. *buffer receives the leaf's buffer, NULL
+// when the leaf is the root; returns NULL for a damaged tree.
+static omnifs_extent_header_t* extent_find_leaf(omnifs_inode_t* inode, uint32_t logical, bcache_buffer_t** buffer) {
+    omnifs_extent_header_t* node = extent_root(inode);
+    *buffer = NULL;
+    
+    if (node->magic != OMNIFS_EXTENT_MAGIC) {
+        return NULL;
+    }
+    
+    while (node->depth > 0) {
+        int index = extent_search(node, logical);
+        uint32_t child = ((omnifs_extent_index_t*)extent_entries(node))[index < 0 ? 0 : index].block;
+        
+        bcache_release(*buffer);
+        *buffer = bcache_get_metadata(child);
+        if (!*buffer) {
+            return NULL;
+        }
+        
+        node = (omnifs_extent_header_t*)(*buffer)->data;
+        if (node->magic != OMNIFS_EXTENT_MAGIC) {
+            bcache_release(*buffer);
+            *buffer = NULL;
+            return NULL;
+        }
+    }
+    
+    return node;
+}
+
+uint32_t omnifs_extent_lookup(const omnifs_inode_t* inode, uint32_t logical, uint32_t* run, uint16_t* flags) {
+    bcache_buffer_t* buffer;
+    omnifs_extent_header_t* node = extent_find_leaf((omnifs_inode_t*)inode, logical, &buffer);
+    uint32_t physical = 0;
+    
+    if (!node) {
+        return 0;
+    }
+    
+    int index = extent_search(node, logical);
+    if (index >= 0) {
+        omnifs_extent_t* extent = &((omnifs_extent_t*)extent_entries(node))[index];
+        uint32_t offset = logical - extent->logical;
+        if (offset < extent->length) {
+            physical = extent->start + offset;
+            if (run) {
+                *run = extent->length - offset;
+            }
+            if (flags) {
+                *flags = extent->flags;
+            }
+        }
+    }
+    
+    bcache_release(buffer);
+    return physical;
+}
+
+uint32_t omnifs_extent_map(const omnifs_inode_t* inode, uint32_t logical, uint32_t* run) {
+    return omnifs_extent_lookup(inode, logical, run, NULL);
+}
+
+int omnifs_extent_insert(omnifs_inode_t* inode, uint32_t logical, uint32_t start, uint32_t count) {
+    return omnifs_extent_insert_flags(inode, logical, start, count, 0);
+}
+
+int omnifs_extent_insert_flags(omnifs_inode_t* inode, uint32_t logical, uint32_t start, uint32_t count,
+                               uint16_t flags) {
+    omnifs_extent_header_t* root = extent_root(inode);
+    if (root->magic != OMNIFS_EXTENT_MAGIC) {
+        return OMNIOS_ERROR_GENERIC;
+    }
+    
+    // Runs longer than one extent can describe go in as several extents
+    while (count > 0) {
+        omnifs_extent_t extent;
+        extent.logical = logical;
+        extent.start = start;
+        extent.length = (count > OMNIFS_EXTENT_MAX_LENGTH) ? OMNIFS_EXTENT_MAX_LENGTH : count;
+        extent.flags = flags;
+        
+        omnifs_extent_index_t unused;
+        bool split = false;
+        int result = extent_insert_node(root, true, &extent, &unused, &split);
+        if (result != OMNIOS_SUCCESS) {
+            return result;
+        }
+        
+        logical += extent.length;
+        start += extent.length;
+        count -= extent.length;
+    }
+    
+    return OMNIOS_SUCCESS;
+}
+
+// Unmap [logical, logical + count), which lies inside a single extent
+static int extent_remove_run(omnifs_inode_t* inode, uint32_t logical, uint32_t count) {
+    bcache_buffer_t* buffer;
+    omnifs_extent_header_t* node = extent_find_leaf(inode, logical, &buffer);
+    if (!node) {
+        return OMNIOS_ERROR_IO;
+    }
+    
+    int index = extent_search(node, logical);
+    omnifs_extent_t* extent = &((omnifs_extent_t*)extent_entries(node))[index < 0 ? 0 : index];
+    uint32_t end = logical + count;
+    uint32_t extent_end = extent->logical + extent->length;
+    if (index < 0 || logical < extent->logical || end > extent_end) {
+        bcache_release(buffer);
+        return OMNIOS_ERROR_GENERIC;
+    }
+    
+    // Cutting the middle out leaves a tail to insert as its own extent.
+    // Keys only grow, so the index entries above stay valid lower bounds.
+    omnifs_extent_t tail = { end, extent->start + (end - extent->logical), (uint16_t)(extent_end - end),
+                             extent->flags };
+    if (logical > extent->logical) {
+        extent->length = logical - extent->logical;
+    } else if (end < extent_end) {
+        *extent = tail;
+        tail.length = 0;
+    } else {
+        uint8_t* entries = extent_entries(node);
+        memmove(entries + index * EXTENT_ENTRY_SIZE, entries + (index + 1) * EXTENT_ENTRY_SIZE,
+                (node->entries - index - 1) * EXTENT_ENTRY_SIZE);
+        node->entries--;
+    }
+    
+    if (buffer) {
+        bcache_mark_metadata(buffer);
+        bcache_release(buffer);
+    }
+    
+    return tail.length ? omnifs_extent_insert_flags(inode, tail.logical, tail.start, tail.length, tail.flags)
+                       : OMNIOS_SUCCESS;
+}
+
+int omnifs_extent_remove(omnifs_inode_t* inode, uint32_t logical, uint32_t count) {
+    uint32_t end = logical + count;
+    while (logical < end) {
+        uint32_t run;
+        if (omnifs_extent_map(inode, logical, &run) == 0) {
+            logical++;
+            continue;
+        }
+        
+        if (run > end - logical) {
+            run = end - logical;
+        }
+        
+        int result = extent_remove_run(inode, logical, run);
+        if (result != OMNIOS_SUCCESS) {
+            return result;
+        }
+        logical += run;
+    }
+    
+    return OMNIOS_SUCCESS;
+}
+
+// Free the blocks a node maps and, below an index node, the child nodes
+static int extent_free_node(omnifs_extent_header_t* node, omnifs_extent_free_t release) {
+    if (node->magic != OMNIFS_EXTENT_MAGIC) {
+        return OMNIOS_ERROR_IO;
+    }
+    
+    if (node->depth == 0) {
+        omnifs_extent_t* extents = (omnifs_extent_t*)extent_entries(node);
+        for (uint32_t i = 0; i < node->entries; i++) {
+            for (uint32_t j = 0; j < extents[i].length; j++) {
+                release(extents[i].start + j);
+            }
+        }
+        return OMNIOS_SUCCESS;
+    }
+    
+    omnifs_extent_index_t* children = (omnifs_extent_index_t*)extent_entries(node);
+    for (uint32_t i = 0; i < node->entries; i++) {
+        bcache_buffer_t* buffer = bcache_get_metadata(children[i].block);
+        if (!buffer) {
+            return OMNIOS_ERROR_IO;
+        }
+        
+        int result = extent_free_node((omnifs_extent_header_t*)buffer->data, release);
+        bcache_release(buffer);
+        if (result != OMNIOS_SUCCESS) {
+            return result;
+        }
+        release(children[i].block);
+    }
+    
+    return OMNIOS_SUCCESS;
+}
+
+int omnifs_extent_free(omnifs_inode_t* inode, omnifs_extent_free_t release) {
+    int result = extent_free_node(extent_root(inode), release);
+    if (result == OMNIOS_SUCCESS) {
+        omnifs_extent_init_root(inode);
+    }
+    return result;
+}
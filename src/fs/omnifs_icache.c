@@ -0,0 +1,276 @@
+/*
+ * OmniOS 2.0 OmniFS Inode Cache
+ * Fixed pool of inodes hashed by number and recycled in LRU order. A miss
+ * reads the inode from its inode table block through the buffer cache,
+ * so neighbouring inodes cost no further device reads; changes are
+ * written straight back into that block.
+ *
+ * A spinlock guards the hash, the LRU list and pins. Each entry also
+ * carries the inode's reader/writer lock, which only threads pinning it
+ * can hold, so eviction never meets a locked inode.
+ */
+
+#include "omnios.h"
+#include "kernel/memory.h"
+#include "kernel/sync.h"
+#include "fs/omnifs_icache.h"
+#include "fs/bcache.h"
+
+#define ICACHE_HASH_BUCKETS     256     // Power of two
+
+typedef struct icache_entry {
+    omnifs_inode_t inode;     // First, so an inode pointer is its entry
+    uint32_t number;          // 0 while the entry is unused
+    uint32_t refcount;
+    bool loading;             // Being read from the table; holders wait
+    rwlock_t lock;
+    struct icache_entry* hash_next;
+    struct icache_entry* lru_prev;
+    struct icache_entry* lru_next;
+} icache_entry_t;
+
+// Cache state
+static icache_entry_t* g_entries = NULL;
+static uint32_t g_max_entries = 0;
+static uint32_t g_table_block = 0;
+static uint32_t g_inode_count = 0;
+static uint32_t g_inode_size = 0;      // On-disk record, may be shorter than omnifs_inode_t
+static uint32_t g_per_block = 0;       // Records per table block, 0 when packed across blocks
+static uint32_t g_block_size = 0;
+static icache_entry_t* g_hash[ICACHE_HASH_BUCKETS];
+static icache_entry_t g_lru;         // Sentinel: next is most recent, prev least recent
+static omnifs_icache_stats_t g_stats;
+static spinlock_t g_lock = SPINLOCK_INIT;
+
+static inline uint32_t icache_bucket(uint32_t number) {
+    return (number * 2654435761u >> 24) & (ICACHE_HASH_BUCKETS - 1);
+}
+
+static void icache_lru_unlink(icache_entry_t* entry) {
+    entry->lru_prev->lru_next = entry->lru_next;
+    entry->lru_next->lru_prev = entry->lru_prev;
+}
+
+static void icache_lru_push_front(icache_entry_t* entry) {
+    entry->lru_prev = &g_lru;
+    entry->lru_next = g_lru.lru_next;
+    g_lru.lru_next->lru_prev = entry;
+    g_lru.lru_next = entry;
+}
+
+static void icache_hash_remove(icache_entry_t* entry) {
+    icache_entry_t** link = &g_hash[icache_bucket(entry->number)];
+    while (*link && *link != entry) {
+        link = &(*link)->hash_next;
+    }
+    
+    if (*link) {
+        *link = entry->hash_next;
+    }
+    entry->hash_next = NULL;
+}
+
+// Move an inode between memory and the table; packed inodes may straddle blocks
+static int icache_transfer(uint32_t number, omnifs_inode_t* inode, bool write) {
+    uint32_t offset = number * g_inode_size;
+    if (g_per_block) {
+        offset = (number / g_per_block) * g_block_size + (number % g_per_block) * g_inode_size;
+    }
+    uint32_t done = 0;
+    
+    while (done < g_inode_size) {
+        uint32_t block_offset = (offset + done) % g_block_size;
+        uint32_t bytes = g_block_size - block_offset;
+        if (bytes > g_inode_size - done) {
+            bytes = g_inode_size - done;
+        }
+        
+        bcache_buffer_t* buffer = bcache_get_metadata(g_table_block + (offset + done) / g_block_size);
+        if (!buffer) {
+            return OMNIOS_ERROR_IO;
+        }
+        
+        if (write) {
+            memcpy(buffer->data + block_offset, (uint8_t*)inode + done, bytes);
+            bcache_mark_metadata(buffer);
+        } else {
+            memcpy((uint8_t*)inode + done, buffer->data + block_offset, bytes);
+        }
+        bcache_release(buffer);
+        done += bytes;
+    }
+    
+    return OMNIOS_SUCCESS;
+}
+
+int omnifs_icache_init(uint32_t table_block, uint32_t inode_count, uint32_t inode_size,
+                       uint32_t per_block, uint32_t block_size, uint32_t max_entries) {
+    if (inode_size == 0 || inode_size > sizeof(omnifs_inode_t) || per_block * inode_size > block_size) {
+        return OMNIOS_ERROR_GENERIC;
+    }
+    
+    if (g_entries) {
+        omnifs_icache_shutdown();
+    }
+    
+    g_max_entries = max_entries ? max_entries : OMNIFS_ICACHE_DEFAULT_ENTRIES;
+    g_entries = memory_allocate(g_max_entries * sizeof(icache_entry_t));
+    if (!g_entries) {
+        return OMNIOS_ERROR_MEMORY;
+    }
+    
+    g_table_block = table_block;
+    g_inode_count = inode_count;
+    g_inode_size = inode_size;
+    g_per_block = per_block;
+    g_block_size = block_size;
+    memset(g_entries, 0, g_max_entries * sizeof(icache_entry_t));
+    memset(g_hash, 0, sizeof(g_hash));
+    memset(&g_stats, 0, sizeof(g_stats));
+    
+    g_lru.lru_next = &g_lru;
+    g_lru.lru_prev = &g_lru;
+    for (uint32_t i = 0; i < g_max_entries; i++) {
+        icache_lru_push_front(&g_entries[i]);
+    }
+    
+    return OMNIOS_SUCCESS;
+}
+
+void omnifs_icache_shutdown(void) {
+    memory_free(g_entries);
+    g_entries = NULL;
+    g_max_entries = 0;
+    memset(g_hash, 0, sizeof(g_hash));
+}
+
+omnifs_inode_t* omnifs_icache_get(uint32_t number) {
+    if (!g_entries || number == 0 || number >= g_inode_count) {
+        return NULL;
+    }
+    
+    spin_lock(&g_lock);
+    icache_entry_t* entry = g_hash[icache_bucket(number)];
+    while (entry && entry->number != number) {
+        entry = entry->hash_next;
+    }
+    
+    bool load = false;
+    if (entry) {
+        g_stats.hits++;
+    } else {
+        g_stats.misses++;
+        
+        // Least recently used entry nobody holds
+        entry = g_lru.lru_prev;
+        while (entry != &g_lru && entry->refcount > 0) {
+            entry = entry->lru_prev;
+        }
+        if (entry == &g_lru) {
+            spin_unlock(&g_lock);
+            return NULL;
+        }
+        
+        if (entry->number != 0) {
+            icache_hash_remove(entry);
+            g_stats.entries--;
+            g_stats.evictions++;
+        }
+        
+        // Claimed while loading, so other threads wait instead of reading too
+        uint32_t bucket = icache_bucket(number);
+        entry->number = number;
+        entry->loading = true;
+        entry->hash_next = g_hash[bucket];
+        g_hash[bucket] = entry;
+        g_stats.entries++;
+        load = true;
+    }
+    
+    if (entry->refcount++ == 0) {
+        g_stats.pinned++;
+    }
+    icache_lru_unlink(entry);
+    icache_lru_push_front(entry);
+    spin_unlock(&g_lock);
+    
+    if (load) {
+        // Fields past a short record read as zero
+        memset(&entry->inode, 0, sizeof(omnifs_inode_t));
+        bool ok = icache_transfer(number, &entry->inode, false) == OMNIOS_SUCCESS;
+        
+        spin_lock(&g_lock);
+        entry->loading = false;
+        if (!ok) {
+            icache_hash_remove(entry);
+            entry->number = 0;
+            g_stats.entries--;
+        }
+        spin_unlock(&g_lock);
+    } else {
+        for (;;) {
+            spin_lock(&g_lock);
+            bool loading = entry->loading;
+            spin_unlock(&g_lock);
+            if (!loading) {
+                break;
+            }
+            SYNC_WAIT();
+        }
+    }
+    
+    // The load failed, here or in the thread that started it
+    if (entry->number != number) {
+        omnifs_icache_put(&entry->inode);
+        return NULL;
+    }
+    return &entry->inode;
+}
+
+void omnifs_icache_put(omnifs_inode_t* inode) {
+    icache_entry_t* entry = (icache_entry_t*)inode;
+    if (!entry) {
+        return;
+    }
+    
+    spin_lock(&g_lock);
+    if (entry->refcount > 0 && --entry->refcount == 0) {
+        g_stats.pinned--;
+    }
+    spin_unlock(&g_lock);
+}
+
+void omnifs_icache_lock_shared(omnifs_inode_t* inode) {
+    rw_read_lock(&((icache_entry_t*)inode)->lock);
+}
+
+void omnifs_icache_lock_exclusive(omnifs_inode_t* inode) {
+    rw_write_lock(&((icache_entry_t*)inode)->lock);
+}
+
+bool omnifs_icache_trylock_exclusive(omnifs_inode_t* inode) {
+    return rw_write_trylock(&((icache_entry_t*)inode)->lock);
+}
+
+void omnifs_icache_unlock_shared(omnifs_inode_t* inode) {
+    rw_read_unlock(&((icache_entry_t*)inode)->lock);
+}
+
+void omnifs_icache_unlock_exclusive(omnifs_inode_t* inode) {
+    rw_write_unlock(&((icache_entry_t*)inode)->lock);
+}
+
+uint32_t omnifs_icache_number(const omnifs_inode_t* inode) {
+    return ((const icache_entry_t*)inode)->number;
+}
+
+int omnifs_icache_dirty(const omnifs_inode_t* inode) {
+    const icache_entry_t* entry = (const icache_entry_t*)inode;
+    return icache_transfer(entry->number, (omnifs_inode_t*)inode, true);
+}
+
+void omnifs_icache_get_stats(omnifs_icache_stats_t* stats) {
+    spin_lock(&g_lock);
+    *stats = g_stats;
+    spin_unlock(&g_lock);
+}
@@ -0,0 +1,545 @@
+/*
+ * OmniOS 2.0 OmniFS Metadata Journal
+ * Metadata blocks changed by any number of operations are held in the
+ * buffer cache and written to the journal together as one transaction:
+ * a descriptor, the block copies, then a commit block in its own request.
+ * Once committed they may go home in any order; a checkpoint writes them
+ * all and empties the journal. Mount replays committed transactions.
+ * Freed blocks with copies in the journal stay allocated until a commit
+ * has carried their revokes, so replay can never reach a new owner.
+ */
+
+#include "omnios.h"
+#include "kernel/memory.h"
+#include "kernel/sync.h"
+#include "fs/omnifs_format.h"
+#include "fs/omnifs_journal.h"
+#include "fs/bcache.h"
+
+#define JOURNAL_IO_BLOCKS       32      // Journal blocks per device request
+#define JOURNAL_NO_BLOCK        0xFFFFFFFF
+
+// External device I/O functions (implemented by storage driver)
+extern int device_read(const char* device, uint32_t offset, void* buffer, uint32_t size);
+extern int device_write(const char* device, uint32_t offset, const void* buffer, uint32_t size);
+
+typedef struct {
+    uint32_t block;
+    uint32_t sequence;        // Transaction that freed it
+} journal_revoke_t;
+
+// Journal state
+static const char* g_device = NULL;
+static uint32_t g_block_size = 0;
+static uint32_t g_start = 0;
+static uint32_t g_blocks = 0;
+static uint32_t g_sequence = 0;      // Next transaction
+static uint32_t g_head = 0;          // Journal block it starts at
+static uint32_t g_limit = 0;         // Blocks per transaction
+static uint32_t g_revoke_capacity = 0;
+static uint8_t* g_io = NULL;         // Staging for JOURNAL_IO_BLOCKS blocks
+static bcache_buffer_t** g_buffers = NULL;
+static uint32_t* g_revoked = NULL;   // Freed blocks, those already committed first
+static uint32_t g_revoked_count = 0;
+static uint32_t g_released = 0;      // Leading g_revoked entries whose revokes are committed
+static spinlock_t g_revoke_lock = SPINLOCK_INIT; // Revokes come from concurrent operations
+static omnifs_journal_hook_t g_commit_hook = NULL;
+static uint32_t* g_logged = NULL;    // Home blocks with copies since the last checkpoint
+static uint32_t g_logged_mask = 0;
+static bool g_open = false;
+static omnifs_journal_stats_t g_stats;
+
+static inline uint32_t journal_descriptor_capacity(uint32_t block_size) {
+    return (block_size - sizeof(omnifs_journal_descriptor_t)) / sizeof(uint32_t);
+}
+
+static int journal_io(bool write, uint32_t block, void* data, uint32_t count) {
+    uint32_t offset = (g_start + block) * g_block_size;
+    return write ? device_write(g_device, offset, data, count * g_block_size) :
+                   device_read(g_device, offset, data, count * g_block_size);
+}
+
+static bool journal_header_valid(const omnifs_journal_header_t* header, uint32_t type, uint32_t sequence) {
+    return header->magic == OMNIFS_JOURNAL_MAGIC && header->type == type && header->sequence == sequence;
+}
+
+static void journal_header_set(void* block, uint32_t type, uint32_t sequence) {
+    memset(block, 0, g_block_size);
+    omnifs_journal_header_t* header = (omnifs_journal_header_t*)block;
+    header->magic = OMNIFS_JOURNAL_MAGIC;
+    header->type = type;
+    header->sequence = sequence;
+}
+
+// The superblock names the first transaction replay should look for;
+// anything older left in the area no longer matches
+static int journal_write_super(uint32_t sequence) {
+    journal_header_set(g_io, OMNIFS_JOURNAL_SUPER, sequence);
+    ((omnifs_journal_super_t*)g_io)->blocks = g_blocks;
+    return journal_io(true, 0, g_io, 1);
+}
+
+static bool journal_logged(uint32_t block) {
+    for (uint32_t slot = (block * 2654435761u) & g_logged_mask; g_logged[slot] != JOURNAL_NO_BLOCK;
+         slot = (slot + 1) & g_logged_mask) {
+        if (g_logged[slot] == block) {
+            return true;
+        }
+    }
+    
+    return false;
+}
+
+static void journal_note_logged(uint32_t block) {
+    uint32_t slot = (block * 2654435761u) & g_logged_mask;
+    while (g_logged[slot] != JOURNAL_NO_BLOCK && g_logged[slot] != block) {
+        slot = (slot + 1) & g_logged_mask;
+    }
+    g_logged[slot] = block;
+}
+
+static bool journal_revoked(const journal_revoke_t* revokes, uint32_t count, uint32_t block, uint32_t sequence) {
+    for (uint32_t i = 0; i < count; i++) {
+        if (revokes[i].block == block && revokes[i].sequence >= sequence) {
+            return true;
+        }
+    }
+    
+    return false;
+}
+
+// Copy committed transactions from sequence on into the buffer cache, newest
+// copy last, and write them home. The first pass finds where the committed
+// run ends and which blocks were revoked along the way.
+static int journal_replay(uint32_t sequence) {
+    omnifs_journal_descriptor_t* descriptor = memory_allocate(g_block_size);
+    if (!descriptor) {
+        return OMNIOS_ERROR_MEMORY;
+    }
+    
+    uint32_t capacity = journal_descriptor_capacity(g_block_size);
+    journal_revoke_t* revokes = NULL;
+    uint32_t revoke_count = 0;
+    uint32_t revoke_capacity = 0;
+    uint32_t head = 1;
+    uint32_t end = sequence;
+    int result = OMNIOS_SUCCESS;
+    
+    while (head + 1 < g_blocks) {
+        if (journal_io(false, head, descriptor, 1) != OMNIOS_SUCCESS ||
+            !journal_header_valid(&descriptor->header, OMNIFS_JOURNAL_DESCRIPTOR, end) ||
+            descriptor->count + descriptor->revoked > capacity) {
+            break;
+        }
+        
+        uint32_t commit = head + 1 + descriptor->count;
+        if (commit >= g_blocks || journal_io(false, commit, g_io, 1) != OMNIOS_SUCCESS ||
+            !journal_header_valid((omnifs_journal_header_t*)g_io, OMNIFS_JOURNAL_COMMIT, end)) {
+            break; // Torn transaction: the crash came before its commit
+        }
+        
+        if (revoke_count + descriptor->revoked > revoke_capacity) {
+            uint32_t grown = (revoke_capacity + descriptor->revoked) * 2;
+            journal_revoke_t* list = memory_allocate(grown * sizeof(journal_revoke_t));
+            if (!list) {
+                result = OMNIOS_ERROR_MEMORY;
+                break;
+            }
+            if (revokes) {
+                memcpy(list, revokes, revoke_count * sizeof(journal_revoke_t));
+                memory_free(revokes);
+            }
+            revokes = list;
+            revoke_capacity = grown;
+        }
+        
+        for (uint32_t i = 0; i < descriptor->revoked; i++) {
+            revokes[revoke_count].block = descriptor->blocks[descriptor->count + i];
+            revokes[revoke_count].sequence = end;
+            revoke_count++;
+        }
+        
+        head = commit + 1;
+        end++;
+    }
+    
+    head = 1;
+    for (uint32_t current = sequence; result == OMNIOS_SUCCESS && current != end; current++) {
+        if (journal_io(false, head, descriptor, 1) != OMNIOS_SUCCESS) {
+            result = OMNIOS_ERROR_IO;
+            break;
+        }
+        
+        for (uint32_t done = 0; done < descriptor->count && result == OMNIOS_SUCCESS;) {
+            uint32_t chunk = descriptor->count - done;
+            if (chunk > JOURNAL_IO_BLOCKS) {
+                chunk = JOURNAL_IO_BLOCKS;
+            }
+            
+            if (journal_io(false, head + 1 + done, g_io, chunk) != OMNIOS_SUCCESS) {
+                result = OMNIOS_ERROR_IO;
+                break;
+            }
+            
+            for (uint32_t i = 0; i < chunk; i++) {
+                uint32_t home = descriptor->blocks[done + i];
+                if (journal_revoked(revokes, revoke_count, home, current)) {
+                    continue;
+                }
+                
+                bcache_buffer_t* buffer = bcache_get_new(home);
+                if (!buffer) {
+                    result = OMNIOS_ERROR_IO;
+                    break;
+                }
+                memcpy(buffer->data, g_io + i * g_block_size, g_block_size);
+                bcache_mark_dirty(buffer);
+                bcache_release(buffer);
+                g_stats.replayed_blocks++;
+            }
+            done += chunk;
+        }
+        
+        head += descriptor->count + 2;
+        g_stats.replayed_transactions++;
+    }
+    
+    memory_free(revokes);
+    memory_free(descriptor);
+    
+    // Home blocks must be current before the superblock retires the journal
+    if (result == OMNIOS_SUCCESS && end != sequence) {
+        result = bcache_sync();
+        if (result == OMNIOS_SUCCESS) {
+            result = journal_write_super(end);
+        }
+    }
+    
+    g_sequence = end;
+    return result;
+}
+
+static void journal_release(void) {
+    bcache_set_journaling(0, NULL);
+    memory_free(g_io);
+    memory_free(g_buffers);
+    memory_free(g_revoked);
+    memory_free(g_logged);
+    g_io = NULL;
+    g_buffers = NULL;
+    g_revoked = NULL;
+    g_logged = NULL;
+    g_revoked_count = 0;
+    g_released = 0;
+    g_commit_hook = NULL;
+    g_open = false;
+}
+
+static void journal_commit_hook(void) {
+    if (g_commit_hook) {
+        g_commit_hook();
+    } else {
+        omnifs_journal_commit();
+    }
+}
+
+int omnifs_journal_format(const char* device, uint32_t block_size, uint32_t start, uint32_t blocks) {
+    uint8_t* area = memory_allocate(2 * block_size);
+    if (!area) {
+        return OMNIOS_ERROR_MEMORY;
+    }
+    
+    // An empty journal whose first transaction is 1; block 1 is cleared so
+    // stale device contents cannot pass for it
+    memset(area, 0, 2 * block_size);
+    omnifs_journal_super_t* super = (omnifs_journal_super_t*)area;
+    super->header.magic = OMNIFS_JOURNAL_MAGIC;
+    super->header.type = OMNIFS_JOURNAL_SUPER;
+    super->header.sequence = 1;
+    super->blocks = blocks;
+    
+    int result = device_write(device, start * block_size, area, 2 * block_size);
+    memory_free(area);
+    return result;
+}
+
+int omnifs_journal_open(const char* device, uint32_t block_size, uint32_t start, uint32_t blocks) {
+    if (g_open) {
+        omnifs_journal_close();
+    }
+    
+    uint32_t capacity = journal_descriptor_capacity(block_size);
+    if (blocks < OMNIFS_JOURNAL_MIN_BLOCKS || capacity < 2) {
+        return OMNIOS_ERROR_GENERIC;
+    }
+    
+    g_device = device;
+    g_block_size = block_size;
+    g_start = start;
+    g_blocks = blocks;
+    memset(&g_stats, 0, sizeof(g_stats));
+    
+    // A transaction may hold a quarter of the cache, and two of them fit
+    // in the journal so one can always follow a checkpoint
+    bcache_stats_t cache;
+    bcache_get_stats(&cache);
+    g_limit = cache.capacity / 4;
+    if (g_limit > (blocks - 1) / 2 - 2) {
+        g_limit = (blocks - 1) / 2 - 2;
+    }
+    if (g_limit > capacity / 2) {
+        g_limit = capacity / 2;
+    }
+    g_revoke_capacity = capacity - g_limit;
+    
+    uint32_t slots = 1;
+    while (slots < 2 * blocks) {
+        slots <<= 1;
+    }
+    g_logged_mask = slots - 1;
+    
+    g_io = memory_allocate(JOURNAL_IO_BLOCKS * block_size);
+    g_buffers = memory_allocate(g_limit * sizeof(bcache_buffer_t*));
+    g_revoked = memory_allocate(g_revoke_capacity * sizeof(uint32_t));
+    g_logged = memory_allocate(slots * sizeof(uint32_t));
+    if (!g_io || !g_buffers || !g_revoked || !g_logged) {
+        journal_release();
+        return OMNIOS_ERROR_MEMORY;
+    }
+    memset(g_logged, 0xFF, slots * sizeof(uint32_t));
+    g_revoked_count = 0;
+    g_released = 0;
+    g_head = 1;
+    
+    omnifs_journal_super_t* super = (omnifs_journal_super_t*)g_io;
+    int result = journal_io(false, 0, g_io, 1);
+    if (result == OMNIOS_SUCCESS &&
+        (!journal_header_valid(&super->header, OMNIFS_JOURNAL_SUPER, super->header.sequence) ||
+         super->blocks != blocks)) {
+        console_print("OmniFS journal superblock is invalid\n");
+        result = OMNIOS_ERROR_GENERIC;
+    }
+    if (result == OMNIOS_SUCCESS) {
+        result = journal_replay(super->header.sequence);
+    }
+    
+    if (result != OMNIOS_SUCCESS) {
+        journal_release(); // The journal stays on disk for the next attempt
+        return result;
+    }
+    
+    if (g_stats.replayed_transactions > 0) {
+        console_print("OmniFS journal: replayed %d transactions (%d blocks)\n",
+                      g_stats.replayed_transactions, g_stats.replayed_blocks);
+    }
+    
+    g_open = true;
+    bcache_set_journaling(g_limit, journal_commit_hook);
+    return OMNIOS_SUCCESS;
+}
+
+int omnifs_journal_close(void) {
+    if (!g_open) {
+        return OMNIOS_SUCCESS;
+    }
+    
+    int result = omnifs_journal_commit();
+    if (result == OMNIOS_SUCCESS) {
+        result = omnifs_journal_checkpoint();
+    }
+    
+    journal_release();
+    return result;
+}
+
+int omnifs_journal_commit(void) {
+    if (!g_open) {
+        return OMNIOS_SUCCESS;
+    }
+    
+    uint32_t count = bcache_collect_metadata(g_buffers, g_limit);
+    if (count == 0 && g_revoked_count == g_released) {
+        return OMNIOS_SUCCESS;
+    }
+    
+    // Commits keep held blocks under the limit and checkpoint early
+    // enough, so this only fails after write errors
+    if (g_head + count + 2 > g_blocks) {
+        for (uint32_t i = 0; i < count; i++) {
+            bcache_release(g_buffers[i]);
+        }
+        return OMNIOS_ERROR_IO;
+    }
+    
+    omnifs_journal_descriptor_t* descriptor = (omnifs_journal_descriptor_t*)g_io;
+    journal_header_set(descriptor, OMNIFS_JOURNAL_DESCRIPTOR, g_sequence);
+    descriptor->count = count;
+    for (uint32_t i = 0; i < count; i++) {
+        descriptor->blocks[i] = g_buffers[i]->block;
+    }
+    
+    // Revoked blocks are still allocated, so none of them can be among the
+    // copies; whatever does not fit waits for the next transaction
+    spin_lock(&g_revoke_lock);
+    uint32_t revoked = g_revoked_count - g_released;
+    if (revoked > journal_descriptor_capacity(g_block_size) - count) {
+        revoked = journal_descriptor_capacity(g_block_size) - count;
+    }
+    memcpy(&descriptor->blocks[count], &g_revoked[g_released], revoked * sizeof(uint32_t));
+    descriptor->revoked = revoked;
+    spin_unlock(&g_revoke_lock);
+    
+    // Descriptor and copies in as few requests as the staging buffer allows
+    int result = OMNIOS_SUCCESS;
+    uint32_t position = g_head;
+    uint32_t staged = 1;
+    for (uint32_t i = 0; i < count && result == OMNIOS_SUCCESS; i++) {
+        if (staged == JOURNAL_IO_BLOCKS) {
+            result = journal_io(true, position, g_io, staged);
+            position += staged;
+            staged = 0;
+        }
+        memcpy(g_io + staged * g_block_size, g_buffers[i]->data, g_block_size);
+        staged++;
+    }
+    if (result == OMNIOS_SUCCESS) {
+        result = journal_io(true, position, g_io, staged);
+        position += staged;
+    }
+    
+    // The commit block goes out only after the rest of the transaction
+    if (result == OMNIOS_SUCCESS) {
+        journal_header_set(g_io, OMNIFS_JOURNAL_COMMIT, g_sequence);
+        result = journal_io(true, position, g_io, 1);
+    }
+    
+    for (uint32_t i = 0; i < count; i++) {
+        if (result == OMNIOS_SUCCESS) {
+            journal_note_logged(g_buffers[i]->block);
+            bcache_commit_metadata(g_buffers[i]);
+        }
+        bcache_release(g_buffers[i]);
+    }
+    
+    if (result != OMNIOS_SUCCESS) {
+        return OMNIOS_ERROR_IO; // Still held; the next commit retries
+    }
+    
+    g_head = position + 1;
+    g_sequence++;
+    spin_lock(&g_revoke_lock);
+    g_released += revoked;
+    spin_unlock(&g_revoke_lock);
+    g_stats.commits++;
+    g_stats.logged_blocks += count;
+    
+    // Keep room for a full transaction after this one. The transaction is
+    // on disk either way; a checkpoint refused while blocks are held is
+    // tried again after the next commit.
+    if (g_head + g_limit + 2 > g_blocks) {
+        omnifs_journal_checkpoint();
+    }
+    return OMNIOS_SUCCESS;
+}
+
+int omnifs_journal_checkpoint(void) {
+    if (!g_open) {
+        return OMNIOS_SUCCESS;
+    }
+    
+    // Held blocks may have older copies in the journal that are not home
+    bcache_stats_t cache;
+    bcache_get_stats(&cache);
+    if (cache.journal_buffers > 0 || g_revoked_count > g_released) {
+        return OMNIOS_ERROR_GENERIC;
+    }
+    
+    int result = bcache_sync();
+    if (result == OMNIOS_SUCCESS) {
+        result = journal_write_super(g_sequence);
+    }
+    if (result != OMNIOS_SUCCESS) {
+        return result;
+    }
+    
+    g_head = 1;
+    memset(g_logged, 0xFF, (g_logged_mask + 1) * sizeof(uint32_t));
+    g_stats.checkpoints++;
+    return OMNIOS_SUCCESS;
+}
+
+bool omnifs_journal_revoke(uint32_t block) {
+    if (!g_open) {
+        return false;
+    }
+    
+    spin_lock(&g_revoke_lock);
+    
+    // Only blocks with copies in the journal could be replayed over a new owner
+    if (!journal_logged(block)) {
+        spin_unlock(&g_revoke_lock);
+        return false;
+    }
+    
+    for (uint32_t i = g_released; i < g_revoked_count; i++) {
+        if (g_revoked[i] == block) {
+            spin_unlock(&g_revoke_lock);
+            return true;
+        }
+    }
+    
+    if (g_revoked_count == g_revoke_capacity) {
+        uint32_t* list = memory_allocate(2 * g_revoke_capacity * sizeof(uint32_t));
+        if (!list) {
+            // Left allocated for fsck rather than risk replay over a new owner
+            spin_unlock(&g_revoke_lock);
+            return true;
+        }
+        memcpy(list, g_revoked, g_revoked_count * sizeof(uint32_t));
+        memory_free(g_revoked);
+        g_revoked = list;
+        g_revoke_capacity *= 2;
+    }
+    
+    g_revoked[g_revoked_count++] = block;
+    g_stats.revoked_blocks++;
+    spin_unlock(&g_revoke_lock);
+    return true;
+}
+
+uint32_t omnifs_journal_reclaim(uint32_t* blocks, uint32_t max) {
+    if (!g_open) {
+        return 0;
+    }
+    
+    spin_lock(&g_revoke_lock);
+    uint32_t count = g_released < max ? g_released : max;
+    memcpy(blocks, g_revoked, count * sizeof(uint32_t));
+    memmove(g_revoked, g_revoked + count, (g_revoked_count - count) * sizeof(uint32_t));
+    g_revoked_count -= count;
+    g_released -= count;
+    spin_unlock(&g_revoke_lock);
+    return count;
+}
+
+bool omnifs_journal_pending(void) {
+    if (!g_open) {
+        return false;
+    }
+    
+    spin_lock(&g_revoke_lock);
+    bool revokes = g_revoked_count > g_released;
+    spin_unlock(&g_revoke_lock);
+    
+    bcache_stats_t cache;
+    bcache_get_stats(&cache);
+    return revokes || cache.journal_buffers > 0;
+}
+
+void omnifs_journal_set_commit_hook(omnifs_journal_hook_t hook) {
+    g_commit_hook = hook;
+}
+
+void omnifs_journal_get_stats(omnifs_journal_stats_t* stats) {
+    *stats = g_stats;
+}
@@ -0,0 +1,143 @@
+/*
+ * OmniOS 2.0 Buffer Cache
+ * Hashed, LRU-evicted write-back cache of file system blocks. Every call
+ * may come from several threads at once; a buffer's data belongs to
+ * whoever the file system's own locking lets change it.
+ */
+
+#ifndef FS_BCACHE_H
+#define FS_BCACHE_H
+
+#include "omnios.h"
+
+#define BCACHE_DEFAULT_BUFFERS  256     // 1MB of 4KB blocks
+#define BCACHE_DIRTY_EXPIRE     5000    // Ticks a block may stay dirty before periodic write-back
+#define BCACHE_MAX_IO_BLOCKS    32      // Adjacent blocks merged into one device request
+
+// Buffer flags
+#define BCACHE_VALID            0x0001  // Data matches (or supersedes) the disk block
+#define BCACHE_DIRTY            0x0002  // Must be written back before reuse
+#define BCACHE_DELAYED          0x0004  // File data without a disk block yet; never evicted
+#define BCACHE_JOURNAL          0x0008  // Metadata not yet committed to the journal; held in memory
+#define BCACHE_SEAL             0x0010  // Checksummed metadata changed since its CRC was computed
+#define BCACHE_VERIFIED         0x0020  // Checksum matched, or the contents are our own
+#define BCACHE_LOADING          0x0040  // Being read from the device; others wait for it
+
+typedef struct bcache_buffer {
+    uint32_t block;                   // Disk block, or file block when delayed
+    uint32_t owner;                   // Inode of a delayed buffer, 0 otherwise
+    uint8_t* data;
+    uint16_t flags;
+    uint16_t refcount;                // Holders between get and release
+    uint32_t dirty_since;             // Tick of the first unsynced change
+    struct bcache_buffer* hash_next;
+    struct bcache_buffer* lru_prev;   // LRU list, most recently used first
+    struct bcache_buffer* lru_next;
+} bcache_buffer_t;
+
+typedef struct {
+    uint32_t buffers;         // Buffers allocated
+    uint32_t dirty_buffers;
+    uint32_t hits;
+    uint32_t misses;
+    uint32_t delayed_buffers; // Buffered file data awaiting allocation
+    uint32_t journal_buffers; // Metadata awaiting a journal commit
+    uint32_t capacity;        // Buffer limit
+    uint32_t writebacks;      // Blocks written to the device
+    uint32_t write_requests;  // device_write calls carrying them
+    uint32_t read_requests;   // device_read calls
+    uint32_t readahead_blocks;
+    uint32_t direct_blocks;   // Read straight into callers' buffers
+    uint32_t evictions;
+    uint32_t read_errors;
+    uint32_t checksum_errors; // Metadata blocks that failed verification
+    uint32_t checksums_computed; // Blocks sealed on their way out
+} bcache_stats_t;
+
+int bcache_init(const char* device, uint32_t block_size, uint32_t max_buffers);
+
+// Writes back dirty blocks; delayed buffers must be allocated and held
+// metadata committed beforehand
+void bcache_shutdown(void);
+
+// Pin a block, reading it from the device on a miss
+bcache_buffer_t* bcache_get(uint32_t block);
+
+// Pin a block the caller will overwrite completely; a miss skips the read
+bcache_buffer_t* bcache_get_new(uint32_t block);
+
+// Pin a metadata block. With checksums on, a block read from the device
+// must match its CRC32C before first use; NULL when it does not.
+bcache_buffer_t* bcache_get_metadata(uint32_t block);
+
+void bcache_mark_dirty(bcache_buffer_t* buffer);
+void bcache_release(bcache_buffer_t* buffer);
+
+// Forget a block that was freed; pending changes are discarded
+void bcache_invalidate(uint32_t block);
+
+// Bring [block, block + count) into the cache ahead of use. Blocks already
+// cached are skipped; each stretch of missing ones is one device request.
+int bcache_read_ahead(uint32_t block, uint32_t count);
+
+// Copy count blocks into buffer without caching them: cached blocks come
+// from the cache, the rest straight from the device
+int bcache_read_direct(uint32_t block, uint32_t count, void* buffer);
+
+// Write back every dirty block, or only those dirty for BCACHE_DIRTY_EXPIRE.
+// Adjacent blocks go out in a single device request.
+int bcache_sync(void);
+void bcache_periodic_sync(uint32_t now);
+
+// Write back the dirty blocks in [block, block + count)
+int bcache_write_run(uint32_t block, uint32_t count);
+
+// Delayed allocation: buffers keyed by (inode, file block) that hold
+// written data until the file system gives them a disk block. A new
+// buffer starts zeroed; *created tells the caller it must reserve space.
+bcache_buffer_t* bcache_get_delayed(uint32_t owner, uint32_t block, bool* created);
+bcache_buffer_t* bcache_find_delayed(uint32_t owner, uint32_t block);
+
+// Pin up to max delayed buffers of owner, oldest first
+uint32_t bcache_collect_delayed(uint32_t owner, bcache_buffer_t** buffers, uint32_t max);
+
+// Owner of the oldest delayed buffer, 0 when there is none
+uint32_t bcache_next_delayed_owner(void);
+
+// Give a delayed buffer its disk block; it stays dirty until written
+int bcache_assign_block(bcache_buffer_t* buffer, uint32_t block);
+
+// Drop a delayed buffer whose data went to disk in another form; the
+// caller still releases it
+void bcache_discard_delayed(bcache_buffer_t* buffer);
+
+// Metadata journaling. While enabled, blocks marked as metadata are held
+// back from the device until the journal has committed a copy; reaching
+// limit held blocks calls commit. Disabled, marking them only dirties them.
+typedef void (*bcache_flush_t)(void);
+void bcache_set_journaling(uint32_t limit, bcache_flush_t commit);
+void bcache_mark_metadata(bcache_buffer_t* buffer);
+
+// Pin up to max held metadata buffers for a commit, their checksums
+// brought up to date
+uint32_t bcache_collect_metadata(bcache_buffer_t** buffers, uint32_t max);
+
+// The journal has a copy: the block goes home with ordinary write-back
+void bcache_commit_metadata(bcache_buffer_t* buffer);
+
+// Metadata checksums. While enabled, every block marked as metadata ends
+// in a CRC32C of the rest of the block, computed just before the block is
+// written to the device or the journal rather than on every change.
+void bcache_set_checksums(bool enable);
+
+// Called by periodic sync once delayed data or held metadata has waited
+// BCACHE_DIRTY_EXPIRE
+void bcache_set_flush_hook(bcache_flush_t flush);
+
+// Periodic sync runs between lock and unlock, so a file system that
+// changes blocks from several threads can keep them still meanwhile
+void bcache_set_sync_lock(bcache_flush_t lock, bcache_flush_t unlock);
+
+void bcache_get_stats(bcache_stats_t* stats);
+
+#endif /* FS_BCACHE_H */
@@ -0,0 +1,46 @@
+/*
+ * OmniOS 2.0 OmniFS Allocation Bitmaps
+ * Word-at-a-time free space search with next-fit hints and per-group
+ * free counts and locks, shared by the block and inode bitmaps
+ */
+
+#ifndef FS_OMNIFS_BITMAP_H
+#define FS_OMNIFS_BITMAP_H
+
+#include "omnios.h"
+#include "kernel/sync.h"
+
+// Bytes to allocate for a bitmap of bits entries; scanning reads whole words
+#define OMNIFS_BITMAP_BYTES(bits) ((((bits) + 31) / 32) * 4)
+
+typedef struct {
+    uint32_t* words;          // On-disk bitmap, 1 = in use
+    uint32_t size;            // Bits tracked
+    uint32_t first;           // Lowest bit handed out, at least 1
+    uint32_t hint;            // Next-fit position for requests without a goal
+    uint32_t free;            // Free bits from first up
+    uint32_t group_shift;     // log2 of the bits in a group
+    uint32_t groups;
+    uint32_t* group_free;     // Free bits per group; full groups are skipped
+    spinlock_t* group_locks;  // Guard each group's words and free count
+} omnifs_bitmap_t;
+
+// bits must hold OMNIFS_BITMAP_BYTES(size) bytes. Bits below first and
+// the padding past size are marked in use.
+int omnifs_bitmap_init(omnifs_bitmap_t* bitmap, uint8_t* bits, uint32_t size, uint32_t first,
+                       uint32_t group_shift);
+void omnifs_bitmap_destroy(omnifs_bitmap_t* bitmap);
+
+// Allocate up to *count contiguous bits, preferring a full run at or after
+// goal (0: continue from the hint). Falls back to the first shorter run
+// and stores its length in *count. Returns the first bit, 0 when full.
+// Safe to call from several threads at once, as is omnifs_bitmap_free.
+uint32_t omnifs_bitmap_alloc_run(omnifs_bitmap_t* bitmap, uint32_t goal, uint32_t* count);
+uint32_t omnifs_bitmap_alloc(omnifs_bitmap_t* bitmap, uint32_t goal);
+
+// Returns the number of bits that were in use
+uint32_t omnifs_bitmap_free(omnifs_bitmap_t* bitmap, uint32_t start, uint32_t count);
+
+bool omnifs_bitmap_test(const omnifs_bitmap_t* bitmap, uint32_t bit);
+
+#endif /* FS_OMNIFS_BITMAP_H */
@@ -0,0 +1,50 @@
+/*
+ * OmniOS 2.0 OmniFS Compressed Files
+ * Cluster compression at write-back and decompression on read for files
+ * flagged OMNIFS_INODE_COMPRESSED
+ */
+
+#ifndef FS_OMNIFS_COMPRESS_H
+#define FS_OMNIFS_COMPRESS_H
+
+#include "fs/omnifs_format.h"
+#include "fs/bcache.h"
+
+// Up to *count contiguous blocks near goal, *count receiving how many; 0
+// when the device is full
+typedef uint32_t (*omnifs_compress_alloc_t)(uint32_t goal, uint32_t* count);
+typedef void (*omnifs_compress_free_t)(uint32_t block);
+
+typedef struct {
+    uint32_t clusters_written;
+    uint32_t clusters_compressed;     // Written compressed rather than as is
+    uint64_t bytes_written;           // File data in the clusters written
+    uint64_t bytes_stored;            // Size of the blocks they took
+    uint32_t clusters_loaded;         // Read back from disk
+    uint32_t cache_hits;              // Served by the decompressed cluster
+} omnifs_compress_stats_t;
+
+int omnifs_compress_init(uint32_t block_size, omnifs_compress_alloc_t allocate, omnifs_compress_free_t release);
+void omnifs_compress_shutdown(void);
+
+// Read bytes of a compressed file. Delayed buffers of owner, the inode's
+// number, hold newer data than the disk and take precedence.
+int omnifs_compress_read(omnifs_inode_t* inode, uint32_t owner, void* buffer, uint32_t size, uint32_t offset);
+
+// Stored contents of file block, for a new delayed buffer that a write
+// will only partly cover
+int omnifs_compress_fill(omnifs_inode_t* inode, uint32_t owner, uint32_t block, uint8_t* data);
+
+// Write back delayed buffers of one inode, sorted by file block. Each
+// cluster they touch is rebuilt from disk and the buffers, compressed and
+// written to new blocks before its old ones are freed; a cluster that
+// fails keeps its old blocks and mapping. Buffers written are discarded
+// and counted in *written; the caller releases them all.
+int omnifs_compress_flush(omnifs_inode_t* inode, bcache_buffer_t** buffers, uint32_t count, uint32_t* written);
+
+// Drop cached data of an inode that is being freed
+void omnifs_compress_forget(uint32_t owner);
+
+void omnifs_compress_get_stats(omnifs_compress_stats_t* stats);
+
+#endif /* FS_OMNIFS_COMPRESS_H */
@@ -0,0 +1,41 @@
+/*
+ * OmniOS 2.0 OmniFS Dentry Cache
+ * In-memory (parent inode, name) -> inode map, including names known
+ * to be absent
+ */
+
+#ifndef FS_OMNIFS_DCACHE_H
+#define FS_OMNIFS_DCACHE_H
+
+#include "omnios.h"
+
+#define OMNIFS_DCACHE_DEFAULT_ENTRIES 1024
+#define OMNIFS_DCACHE_NAME_MAX  47      // Longer names are looked up uncached
+
+typedef struct {
+    uint32_t entries;         // Entries holding a name
+    uint32_t negative_entries;
+    uint64_t hits;
+    uint64_t negative_hits;   // Hits that answered "does not exist"
+    uint64_t misses;
+    uint64_t invalidations;
+} omnifs_dcache_stats_t;
+
+int omnifs_dcache_init(uint32_t max_entries);
+void omnifs_dcache_shutdown(void);
+
+// True when the cache knows the answer; *inode is 0 for a negative entry
+bool omnifs_dcache_lookup(uint32_t parent, const char* name, uint32_t len, uint32_t* inode);
+
+// Record the result of a directory lookup or a new entry (inode 0: absent)
+void omnifs_dcache_insert(uint32_t parent, const char* name, uint32_t len, uint32_t inode);
+
+// Forget one name; call on create, delete and rename
+void omnifs_dcache_invalidate(uint32_t parent, const char* name, uint32_t len);
+
+// Forget every entry under or pointing at inode, before it is freed
+void omnifs_dcache_invalidate_inode(uint32_t inode);
+
+void omnifs_dcache_get_stats(omnifs_dcache_stats_t* stats);
+
+#endif /* FS_OMNIFS_DCACHE_H */
@@ -0,0 +1,50 @@
+/*
+ * OmniOS 2.0 OmniFS Directories
+ * Name lookup, insertion and listing for linear and hash-indexed
+ * directories
+ */
+
+#ifndef FS_OMNIFS_DIR_H
+#define FS_OMNIFS_DIR_H
+
+#include "fs/omnifs_format.h"
+
+#define OMNIFS_DIR_NAME_MAX     255
+
+// A directory record decoded for listing
+typedef struct {
+    uint32_t inode;
+    uint32_t next;            // Cookie resuming just after this entry
+    uint8_t file_type;
+    uint8_t name_len;
+    char name[OMNIFS_DIR_NAME_MAX + 1];  // NUL terminated
+} omnifs_dir_entry_t;
+
+// hashed enables the index for directories that outgrow one block
+void omnifs_dir_init(uint32_t block_size, bool hashed);
+
+// Name hash used by the index; the low bit is always clear
+uint32_t omnifs_dir_hash(const char* name, uint32_t len);
+
+bool omnifs_dir_is_indexed(omnifs_inode_t* dir);
+
+// Inode number of name in dir, 0 when absent. Indexed directories whose
+// index does not check out are scanned linearly instead.
+uint32_t omnifs_dir_lookup(omnifs_inode_t* dir, const char* name);
+
+// Add an entry; updates dir->size but leaves writing the inode to the caller
+int omnifs_dir_add(omnifs_inode_t* dir, const char* name, uint32_t child, uint8_t file_type);
+
+// Point an existing entry at another inode in place, so the name never
+// goes missing; child 0 removes the name, its record becoming free space.
+// OMNIOS_ERROR_NOT_FOUND when there is no such entry.
+int omnifs_dir_set(omnifs_inode_t* dir, const char* name, uint32_t child, uint8_t file_type);
+
+// Decode up to max_entries live records starting at *cookie (0 for the
+// first call), reading each directory block once, and advance *cookie
+// past them. Returns the number decoded, 0 at the end. Offsets stay valid
+// while the directory only grows, except that splitting a hashed leaf
+// moves names another caller may see twice or miss.
+int omnifs_dir_read(omnifs_inode_t* dir, uint32_t* cookie, omnifs_dir_entry_t* entries, uint32_t max_entries);
+
+#endif /* FS_OMNIFS_DIR_H */
@@ -0,0 +1,38 @@
+/*
+ * OmniOS 2.0 OmniFS Extent Trees
+ * Logical to physical block mapping for version 2 inodes
+ */
+
+#ifndef FS_OMNIFS_EXTENT_H
+#define FS_OMNIFS_EXTENT_H
+
+#include "fs/omnifs_format.h"
+
+// Allocates one block for a tree node, preferably near goal; 0 when full
+typedef uint32_t (*omnifs_extent_alloc_t)(uint32_t goal);
+typedef void (*omnifs_extent_free_t)(uint32_t block);
+
+void omnifs_extent_init(uint32_t block_size, omnifs_extent_alloc_t allocate);
+void omnifs_extent_init_root(omnifs_inode_t* inode);
+
+// Disk block backing a file block, 0 for a hole. When run is given it
+// receives the number of contiguous mapped blocks starting there.
+uint32_t omnifs_extent_map(const omnifs_inode_t* inode, uint32_t logical, uint32_t* run);
+
+// omnifs_extent_map that also reports the extent's OMNIFS_EXTENT_* flags
+uint32_t omnifs_extent_lookup(const omnifs_inode_t* inode, uint32_t logical, uint32_t* run, uint16_t* flags);
+
+// Map count blocks from logical to start; merges with a preceding
+// contiguous extent with the same flags and grows the tree as needed
+int omnifs_extent_insert(omnifs_inode_t* inode, uint32_t logical, uint32_t start, uint32_t count);
+int omnifs_extent_insert_flags(omnifs_inode_t* inode, uint32_t logical, uint32_t start, uint32_t count,
+                               uint16_t flags);
+
+// Unmap whatever is mapped in [logical, logical + count). The blocks are
+// not freed; callers look them up first. Emptied nodes stay in the tree.
+int omnifs_extent_remove(omnifs_inode_t* inode, uint32_t logical, uint32_t count);
+
+// Free every mapped block and every tree node, leaving an empty root
+int omnifs_extent_free(omnifs_inode_t* inode, omnifs_extent_free_t release);
+
+#endif /* FS_OMNIFS_EXTENT_H */
@@ -0,0 +1,213 @@
+/*
+ * OmniOS 2.0 OmniFS On-Disk Format
+ * Superblock, inode, directory entry, extent tree, directory index,
+ * compressed cluster, block reference count, checksum and journal layouts
+ */
+
+#ifndef FS_OMNIFS_FORMAT_H
+#define FS_OMNIFS_FORMAT_H
+
+#include "omnios.h"
+
+#define OMNIFS_MAGIC            0x494E4D4F  // 'OMNI'
+#define OMNIFS_VERSION_POINTERS 1           // Direct/indirect block pointers
+#define OMNIFS_VERSION_EXTENTS  2           // Extent trees in the inode
+#define OMNIFS_VERSION_INLINE   3           // 256-byte inodes holding small files
+#define OMNIFS_VERSION_REFLINK  4           // Shared blocks: clones and snapshots
+#define OMNIFS_VERSION_CHECKSUMS 5          // CRC32C closing every metadata block
+#define OMNIFS_VERSION_CURRENT  OMNIFS_VERSION_CHECKSUMS
+
+#define OMNIFS_DIRECT_BLOCKS    12
+
+// OmniFS structures
+typedef struct {
+    uint32_t magic;           // 'OMNI'
+    uint32_t version;         // File system version
+    uint32_t block_size;      // Block size in bytes
+    uint32_t total_blocks;    // Total number of blocks
+    uint32_t free_blocks;     // Number of free blocks
+    uint32_t inode_count;     // Total number of inodes
+    uint32_t free_inodes;     // Number of free inodes
+    uint32_t root_inode;      // Root directory inode
+    uint32_t block_bitmap;    // Block bitmap location
+    uint32_t inode_bitmap;    // Inode bitmap location
+    uint32_t inode_table;     // Inode table location
+    uint32_t data_blocks;     // First data block
+    uint32_t journal_start;   // Metadata journal location
+    uint32_t journal_blocks;  // Journal size, 0 when there is none
+    uint32_t inode_size;      // Bytes per inode table record, 0 before version 3
+    uint32_t refcount_table;  // Block reference counts, version 4
+    uint32_t refcount_blocks; // Their size, 0 before version 4
+    uint8_t reserved[448];    // Reserved space
+} omnifs_superblock_t;
+
+// Extent tree node header; entries follow it. The root node lives in the
+// inode, deeper nodes fill whole blocks.
+typedef struct {
+    uint16_t magic;           // OMNIFS_EXTENT_MAGIC
+    uint16_t entries;         // Entries in use
+    uint16_t max;             // Capacity of this node
+    uint16_t depth;           // 0 = leaf (extents), otherwise index entries
+} omnifs_extent_header_t;
+
+// Leaf entry: a run of logically and physically contiguous blocks
+typedef struct {
+    uint32_t logical;         // First file block
+    uint32_t start;           // First disk block
+    uint16_t length;          // Blocks in the run
+    uint16_t flags;           // OMNIFS_EXTENT_*
+} omnifs_extent_t;
+
+// Extent flags
+#define OMNIFS_EXTENT_COMPRESSED 0x0001     // Blocks hold a compressed cluster
+
+// Index entry: child node covering file blocks from logical onwards
+typedef struct {
+    uint32_t logical;
+    uint32_t block;           // Disk block holding the child node
+    uint32_t reserved;
+} omnifs_extent_index_t;
+
+#define OMNIFS_EXTENT_MAGIC     0xE7E7
+#define OMNIFS_EXTENT_MAX_LENGTH 0xFFFF
+#define OMNIFS_EXTENT_ROOT_SIZE 60          // Bytes of the inode block map
+#define OMNIFS_EXTENT_ROOT_ENTRIES \
+    ((OMNIFS_EXTENT_ROOT_SIZE - sizeof(omnifs_extent_header_t)) / sizeof(omnifs_extent_t))
+
+// Versions 1 and 2 store inodes up to the end of the block map; version 3
+// records are whole inodes, and the block map space plus the rest of the
+// record holds the contents of small files and directories
+#define OMNIFS_INODE_SIZE_V2    92
+#define OMNIFS_INODE_SIZE       256
+#define OMNIFS_INLINE_SIZE      220         // Inode minus the fields around inline_data
+
+// Inode flags
+#define OMNIFS_INODE_INLINE     0x0001      // Contents live in inline_data, no blocks
+#define OMNIFS_INODE_COMPRESSED 0x0002      // Data stored in compressed clusters
+#define OMNIFS_INODE_READONLY   0x0004      // Snapshot member; writes are refused
+
+typedef struct {
+    uint32_t mode;            // File type and permissions
+    uint32_t uid;             // User ID
+    uint32_t gid;             // Group ID
+    uint32_t size;            // File size in bytes
+    uint32_t atime;           // Access time
+    uint32_t mtime;           // Modification time
+    uint32_t ctime;           // Creation time
+    uint32_t blocks;          // Number of blocks used
+    union {
+        struct {              // Version 1
+            uint32_t direct[OMNIFS_DIRECT_BLOCKS]; // Direct block pointers
+            uint32_t indirect;        // Indirect block pointer
+            uint32_t double_indirect; // Double indirect block pointer
+            uint32_t triple_indirect; // Triple indirect block pointer
+        };
+        uint8_t extent_root[OMNIFS_EXTENT_ROOT_SIZE]; // Version 2: extent tree root
+        uint8_t inline_data[OMNIFS_INLINE_SIZE];      // Version 3: small file contents
+    };
+    uint32_t flags;           // OMNIFS_INODE_*, version 3
+} omnifs_inode_t;
+
+typedef struct {
+    uint32_t inode;           // Inode number
+    uint16_t rec_len;         // Record length
+    uint8_t name_len;         // Name length
+    uint8_t file_type;        // File type
+    char name[];              // File name (variable length)
+} omnifs_dirent_t;
+
+// Hashed directories (version 2). Directory block 0 becomes the index
+// root once entries outgrow it; leaves hold ordinary dirents that never
+// cross a block and whose last record spans the rest of the block.
+#define OMNIFS_DX_MAGIC         0x58444D4F  // 'OMDX'
+#define OMNIFS_DX_HASH_FNV1A    1
+#define OMNIFS_DX_MAX_DEPTH     3           // Index levels, root included
+#define OMNIFS_DX_CONTINUED     1           // Hash bit: run continues from previous leaf
+
+// Index node header. It reads as an unused dirent spanning the block, so
+// linear scans of an indexed directory step over index blocks.
+typedef struct {
+    uint32_t inode;           // 0
+    uint16_t rec_len;         // Block size
+    uint8_t name_len;         // 0
+    uint8_t file_type;        // 0
+    uint32_t magic;           // OMNIFS_DX_MAGIC
+    uint8_t hash_version;     // OMNIFS_DX_HASH_*
+    uint8_t levels;           // Root only: index levels below the root
+    uint16_t count;           // Entries in use
+    uint16_t limit;           // Entries that fit in the block
+    uint16_t reserved;
+} omnifs_dx_node_t;
+
+// Child covering hashes from hash up to the next entry; entry 0 starts at 0
+typedef struct {
+    uint32_t hash;
+    uint32_t block;           // Directory-relative block number
+} omnifs_dx_entry_t;
+
+// Compressed files (version 3) are stored a cluster of file blocks at a
+// time. A cluster that compresses by at least one block is written as a
+// header and LZ data over the first blocks of its range, mapped by extents
+// flagged OMNIFS_EXTENT_COMPRESSED; any other cluster is stored as is.
+// The extent tree thereby indexes every cluster, so a read decompresses
+// only the clusters it touches.
+#define OMNIFS_CLUSTER_BLOCKS   8
+#define OMNIFS_CLUSTER_MAGIC    0x5A4C4D4F  // 'OMLZ'
+
+typedef struct {
+    uint32_t magic;           // OMNIFS_CLUSTER_MAGIC
+    uint32_t length;          // Compressed bytes after the header
+    uint32_t size;            // Bytes they expand to; the rest of the cluster is zero
+} omnifs_cluster_header_t;
+
+// Block reference counts (version 4). One 16-bit count per device block
+// of the owners it has besides the first, so blocks never cloned read 0
+// and the table only changes when blocks are shared. Freeing a shared
+// block drops one count; the bitmap bit clears once no owner is left.
+// Extent tree and directory blocks always have a single owner.
+#define OMNIFS_REFCOUNT_MAX     0xFFFF
+
+// Read-only snapshots of the root live in this root directory, which is
+// left out of the snapshots themselves
+#define OMNIFS_SNAPSHOT_DIR     ".snapshots"
+
+// Metadata checksums (version 5). The last four bytes of every metadata
+// block hold the CRC32C of the rest of it: the superblock's block, the
+// bitmaps and reference counts, the inode table, extent nodes and
+// directory blocks. Tables store OMNIFS_CHECKSUM_SIZE fewer bytes per
+// block, inode table blocks hold whole inodes only, extent and index
+// nodes are sized to stop short of the checksum, and in directory leaves
+// it sits in the slack of the last record. Journal blocks are not covered.
+#define OMNIFS_CHECKSUM_SIZE    4
+
+// Metadata journal. Block 0 of the area is the journal superblock; each
+// transaction follows from block 1 as a descriptor, copies of the blocks
+// it names, and a commit block. Only transactions whose commit block made
+// it to disk are replayed.
+#define OMNIFS_JOURNAL_MAGIC    0x4C4A4D4F  // 'OMJL'
+#define OMNIFS_JOURNAL_SUPER    1
+#define OMNIFS_JOURNAL_DESCRIPTOR 2
+#define OMNIFS_JOURNAL_COMMIT   3
+
+// Opens every journal control block
+typedef struct {
+    uint32_t magic;           // OMNIFS_JOURNAL_MAGIC
+    uint32_t type;            // OMNIFS_JOURNAL_*
+    uint32_t sequence;        // Transaction; the superblock holds the next to replay
+} omnifs_journal_header_t;
+
+typedef struct {
+    omnifs_journal_header_t header;
+    uint32_t blocks;          // Size of the journal area
+} omnifs_journal_super_t;
+
+// Home block numbers of the copies that follow, then blocks freed by the
+// transaction whose older copies must not be replayed
+typedef struct {
+    omnifs_journal_header_t header;
+    uint32_t count;           // Logged blocks
+    uint32_t revoked;         // Revoked blocks after them
+    uint32_t blocks[];
+} omnifs_journal_descriptor_t;
+
+#endif /* FS_OMNIFS_FORMAT_H */
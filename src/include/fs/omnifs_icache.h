@@ -0,0 +1,52 @@
+/*
+ * OmniOS 2.0 OmniFS Inode Cache
+ * Inodes loaded on demand from the on-disk inode table
+ */
+
+#ifndef FS_OMNIFS_ICACHE_H
+#define FS_OMNIFS_ICACHE_H
+
+#include "fs/omnifs_format.h"
+
+#define OMNIFS_ICACHE_DEFAULT_ENTRIES 256
+
+typedef struct {
+    uint32_t entries;         // Entries holding an inode
+    uint32_t pinned;          // Entries between get and put
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t evictions;
+} omnifs_icache_stats_t;
+
+// The table holds inode_count records of inode_size bytes from block
+// table_block on; older formats use records shorter than omnifs_inode_t.
+// per_block records start each block, or 0 when records run on across
+// block boundaries.
+int omnifs_icache_init(uint32_t table_block, uint32_t inode_count, uint32_t inode_size,
+                       uint32_t per_block, uint32_t block_size, uint32_t max_entries);
+void omnifs_icache_shutdown(void);
+
+// Pin inode number, reading it through the buffer cache on a miss. NULL
+// for an invalid number, a read error or when every entry is pinned.
+omnifs_inode_t* omnifs_icache_get(uint32_t number);
+void omnifs_icache_put(omnifs_inode_t* inode);
+
+// Number of a pinned inode
+uint32_t omnifs_icache_number(const omnifs_inode_t* inode);
+
+// Reader/writer lock of a pinned inode: shared to read the inode and what
+// it maps, exclusive to change them. Threads lock a parent directory
+// before its children and unrelated inodes in ascending number order.
+void omnifs_icache_lock_shared(omnifs_inode_t* inode);
+void omnifs_icache_lock_exclusive(omnifs_inode_t* inode);
+bool omnifs_icache_trylock_exclusive(omnifs_inode_t* inode);
+void omnifs_icache_unlock_shared(omnifs_inode_t* inode);
+void omnifs_icache_unlock_exclusive(omnifs_inode_t* inode);
+
+// Copy a changed inode into its table block, which is journaled and
+// written back with the other metadata
+int omnifs_icache_dirty(const omnifs_inode_t* inode);
+
+void omnifs_icache_get_stats(omnifs_icache_stats_t* stats);
+
+#endif /* FS_OMNIFS_ICACHE_H */
@@ -0,0 +1,61 @@
+/*
+ * OmniOS 2.0 OmniFS Metadata Journal
+ * Write-ahead log of metadata blocks with group commit and mount-time
+ * replay
+ */
+
+#ifndef FS_OMNIFS_JOURNAL_H
+#define FS_OMNIFS_JOURNAL_H
+
+#include "omnios.h"
+
+#define OMNIFS_JOURNAL_DEFAULT_BLOCKS 1024  // 4MB of 4KB blocks
+#define OMNIFS_JOURNAL_MIN_BLOCKS     64
+
+typedef struct {
+    uint32_t commits;
+    uint32_t logged_blocks;   // Block copies written to the journal
+    uint32_t revoked_blocks;
+    uint32_t checkpoints;     // Times the journal was emptied
+    uint32_t replayed_transactions;
+    uint32_t replayed_blocks;
+} omnifs_journal_stats_t;
+
+// Write an empty journal into [start, start + blocks)
+int omnifs_journal_format(const char* device, uint32_t block_size, uint32_t start, uint32_t blocks);
+
+// Replay committed transactions into the buffer cache, write them home
+// and start holding metadata. Call after bcache_init, before reading any
+// metadata.
+int omnifs_journal_open(const char* device, uint32_t block_size, uint32_t start, uint32_t blocks);
+
+// Commit and checkpoint, then stop journaling
+int omnifs_journal_close(void);
+
+// Write every held metadata block to the journal as one transaction
+int omnifs_journal_commit(void);
+
+// Write committed blocks home and empty the journal
+int omnifs_journal_checkpoint(void);
+
+// A freed block: keep older journal copies of it from being replayed.
+// True when it has such copies; it must then stay allocated until
+// omnifs_journal_reclaim hands it back after the revoke is committed.
+bool omnifs_journal_revoke(uint32_t block);
+
+// Up to max revoked blocks whose revokes are committed, for the caller
+// to free
+uint32_t omnifs_journal_reclaim(uint32_t* blocks, uint32_t max);
+
+// Held metadata or revokes are waiting for a commit
+bool omnifs_journal_pending(void);
+
+// Called instead of committing when held blocks reach the limit, for a
+// file system that must pick a moment when no operation is changing
+// them; NULL commits at once
+typedef void (*omnifs_journal_hook_t)(void);
+void omnifs_journal_set_commit_hook(omnifs_journal_hook_t hook);
+
+void omnifs_journal_get_stats(omnifs_journal_stats_t* stats);
+
+#endif /* FS_OMNIFS_JOURNAL_H */
@@ -0,0 +1,25 @@
+/*
+ * OmniOS 2.0 CRC32C
+ * Castagnoli CRC for metadata checksums, using the SSE4.2 crc32
+ * instruction when the CPU has it
+ */
+
+#ifndef KERNEL_CRC32C_H
+#define KERNEL_CRC32C_H
+
+#include "omnios.h"
+
+// Pick the implementation; crc32c calls it on first use
+void crc32c_init(void);
+
+// Extend crc, 0 to start, over length bytes. Results chain:
+// crc32c(crc32c(0, a, n), b, m) is the CRC of a followed by b.
+uint32_t crc32c(uint32_t crc, const void* data, uint32_t length);
+
+// Slicing-by-8 tables, whatever the CPU supports; for comparison
+uint32_t crc32c_software(uint32_t crc, const void* data, uint32_t length);
+
+// The crc32 instruction is in use
+bool crc32c_hardware(void);
+
+#endif /* KERNEL_CRC32C_H */
@@ -0,0 +1,33 @@
+/*
+ * OmniOS 2.0 LZ Codec
+ * Byte-oriented LZ77 compressor for pages and file clusters
+ */
+
+#ifndef KERNEL_LZ_H
+#define KERNEL_LZ_H
+
+#include "omnios.h"
+
+#define LZ_MAX_INPUT            65536   // Match offsets and the hash table are 16-bit
+#define LZ_HASH_BITS            12
+#define LZ_HASH_ENTRIES         (1 << LZ_HASH_BITS)
+
+// Scratch table for lz_compress, kept by the caller so the codec needs no
+// large stack frame and stays reentrant
+typedef struct {
+    uint16_t table[LZ_HASH_ENTRIES];
+} lz_workspace_t;
+
+// Worst case output for incompressible input
+#define LZ_COMPRESS_BOUND(n)    ((n) + (n) / 255 + 16)
+
+// Returns the compressed length, or 0 when the output does not fit in capacity
+uint32_t lz_compress(const uint8_t* source, uint32_t length, uint8_t* destination,
+                     uint32_t capacity, lz_workspace_t* workspace);
+
+// Returns the decompressed length, or 0 on malformed input or overflow.
+// Bytes of destination past that length, up to capacity, may be changed.
+uint32_t lz_decompress(const uint8_t* source, uint32_t length, uint8_t* destination,
+                       uint32_t capacity);
+
+#endif /* KERNEL_LZ_H */
@@ -0,0 +1,87 @@
+/*
+ * OmniOS 2.0 Memory Management Interface
+ * Kernel heap and slab caches
+ */
+
+#ifndef KERNEL_MEMORY_H
+#define KERNEL_MEMORY_H
+
+#include "omnios.h"
+
+// Slab size classes (16 B - 2 KB, powers of two)
+#define MEMORY_SLAB_MIN_SIZE    16
+#define MEMORY_SLAB_MAX_SIZE    2048
+#define MEMORY_SLAB_CLASSES     8
+
+// Per-class slab statistics
+typedef struct {
+    uint32_t object_size;     // Object size served by this class
+    uint32_t slabs;           // Pages currently owned by the class
+    uint32_t objects_in_use;  // Live objects
+    uint32_t hits;            // Allocations served from an existing slab
+    uint32_t misses;          // Allocations that needed a new slab page
+} memory_slab_stats_t;
+
+// Request size histogram: bucket 0 is <= 16 B, bucket i is <= 16 << i,
+// the last bucket counts everything larger
+#define MEMORY_HISTOGRAM_BUCKETS 18
+
+// Allocator statistics snapshot (see memory_get_stats)
+typedef struct {
+    uint32_t total_memory;
+    uint32_t free_memory;
+    uint32_t used_memory;
+    uint32_t heap_used;           // Bytes handed out by heap and slabs
+    uint32_t heap_free;           // Free bytes inside heap regions and slabs
+    uint32_t heap_regions;
+    uint32_t heap_free_blocks;    // Free blocks in the heap bins
+    uint32_t heap_largest_free;   // Largest free heap block payload
+    uint32_t heap_fragmentation;  // 100 - largest free / total free, percent
+    uint32_t page_largest_free;   // Largest free buddy block in bytes
+    uint32_t page_fragmentation;  // Free frames in blocks smaller than a heap region, percent
+    uint32_t allocations;
+    uint32_t frees;
+    uint32_t failed_allocations;
+    uint32_t reclaimed_pages;     // Frames freed by the reclaim handler
+    uint32_t live_allocations;    // MEMORY_TRACKING builds only
+    uint32_t live_bytes;          // MEMORY_TRACKING builds only
+    uint32_t size_histogram[MEMORY_HISTOGRAM_BUCKETS];
+} memory_stats_t;
+
+// Initialization
+int memory_init(const boot_memory_map_t* memory_map);
+uint32_t detect_memory(const boot_memory_map_t* memory_map);
+
+// Kernel heap
+void* memory_allocate(uint32_t size);
+void* memory_allocate_tagged(uint32_t size, const char* tag);
+void memory_free(void* ptr);
+void* memory_allocate_aligned(uint32_t size, uint32_t alignment);
+
+// Statistics
+uint32_t memory_get_total(void);
+uint32_t memory_get_free(void);
+uint32_t memory_get_used(void);
+int memory_get_slab_stats(memory_slab_stats_t* stats, int max_classes);
+void memory_get_stats(memory_stats_t* stats);
+
+// Reclaim handler: frees up to the requested number of page frames (for
+// example by compressing cold pages) and returns how many it freed.
+// Allocations retry once after it ran.
+typedef uint32_t (*memory_reclaim_t)(uint32_t pages);
+void memory_set_reclaim_handler(memory_reclaim_t handler);
+uint32_t memory_reclaim(uint32_t pages);
+
+void memory_dump_stats(void);
+void memory_dump_live_allocations(uint32_t max_entries);
+
+// Leak tracking: with MEMORY_TRACKING every allocation records its call
+// site and joins a live list that memory_dump_live_allocations prints.
+// Without it the tag is ignored and allocations carry no extra header.
+#ifdef MEMORY_TRACKING
+#define MEMORY_STRINGIFY_(x)    #x
+#define MEMORY_STRINGIFY(x)     MEMORY_STRINGIFY_(x)
+#define memory_allocate(size)   memory_allocate_tagged((size), __FILE__ ":" MEMORY_STRINGIFY(__LINE__))
+#endif
+
+#endif /* KERNEL_MEMORY_H */
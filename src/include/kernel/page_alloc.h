@@ -0,0 +1,58 @@
+/*
+ * OmniOS 2.0 Physical Page Frame Allocator
+ * Buddy allocator over the BIOS E820 memory map
+ */
+
+#ifndef KERNEL_PAGE_ALLOC_H
+#define KERNEL_PAGE_ALLOC_H
+
+#include "omnios.h"
+
+#define PAGE_MAX_ORDER          10      // Largest block: 2^10 pages (4MB)
+#define PAGE_ORDER_COUNT        (PAGE_MAX_ORDER + 1)
+
+// Frame flags
+#define PAGE_FRAME_RESERVED     0x0001  // Firmware, kernel image or frame table
+#define PAGE_FRAME_FREE         0x0002  // Head of a free buddy block
+#define PAGE_FRAME_SLAB         0x0004  // Owned by a kernel heap slab cache
+#define PAGE_FRAME_HEAP         0x0008  // Head of a kernel heap region
+#define PAGE_FRAME_ALIGNED      0x0010  // Head of a memory_allocate_aligned block
+
+// Per-frame descriptor
+typedef struct page_frame {
+    struct page_frame* next;  // Free list / slab partial list link
+    struct page_frame* prev;
+    void* free_objects;       // Slab: embedded free object list
+    uint16_t flags;
+    uint16_t in_use;          // Slab: allocated objects
+    uint8_t order;            // Block order when this frame heads a block
+    uint8_t slab_class;       // Slab: owning size class
+    uint16_t refcount;        // Mappings sharing an order-0 frame (copy-on-write)
+} page_frame_t;
+
+// Allocator statistics
+typedef struct {
+    uint32_t total_frames;    // Frames covered by the frame table
+    uint32_t usable_frames;   // Frames handed to the allocator at boot
+    uint32_t free_frames;     // Frames currently free
+    uint32_t free_blocks[PAGE_ORDER_COUNT]; // Free blocks per order
+} page_alloc_stats_t;
+
+int page_alloc_init(const boot_memory_map_t* memory_map);
+uint32_t page_alloc(uint32_t order);
+void page_free(uint32_t address, uint32_t order);
+
+void page_frame_get(uint32_t address);
+void page_frame_put(uint32_t address);
+uint16_t page_frame_refcount(uint32_t address);
+
+page_frame_t* page_frame_of(uint32_t address);
+uint32_t page_frame_address(const page_frame_t* frame);
+uint32_t page_order_for_size(uint32_t size);
+
+uint32_t page_alloc_get_free_frames(void);
+uint32_t page_alloc_get_total_frames(void);
+uint32_t page_alloc_get_usable_frames(void);
+void page_alloc_get_stats(page_alloc_stats_t* stats);
+
+#endif /* KERNEL_PAGE_ALLOC_H */
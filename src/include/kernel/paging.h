@@ -0,0 +1,86 @@
+/*
+ * OmniOS 2.0 Paging Interface
+ * Kernel address-space layout and page mapping API
+ */
+
+#ifndef KERNEL_PAGING_H
+#define KERNEL_PAGING_H
+
+#include "omnios.h"
+
+// Virtual address-space layout
+//   0x00000000 - 0x3FFFFFFF  Identity map of physical RAM (kernel, heap)
+//   0x40000000 - 0xBFFFFFFF  User space, per address space
+//   0xC0000000 - 0xEFFFFFFF  Higher-half alias of physical RAM
+//   0xF0000000 - 0xF0FFFFFF  Kernel demand-zero window (module images)
+#define KERNEL_IDENTITY_LIMIT   0x40000000
+#define USER_SPACE_BASE         0x40000000
+#define USER_SPACE_END          0xC0000000
+#define KERNEL_VIRTUAL_BASE     0xC0000000
+#define KERNEL_LAZY_BASE        0xF0000000
+#define KERNEL_LAZY_SIZE        0x01000000
+
+#define LARGE_PAGE_SIZE         0x400000
+#define PAGE_ENTRIES            1024
+
+#define PHYS_TO_HIGHER_HALF(a)  ((uint32_t)(a) + KERNEL_VIRTUAL_BASE)
+#define HIGHER_HALF_TO_PHYS(a)  ((uint32_t)(a) - KERNEL_VIRTUAL_BASE)
+
+// Page directory / page table entry flags
+#define PAGE_PRESENT            0x001
+#define PAGE_WRITABLE           0x002
+#define PAGE_USER               0x004
+#define PAGE_WRITE_THROUGH      0x008
+#define PAGE_CACHE_DISABLE      0x010
+#define PAGE_ACCESSED           0x020
+#define PAGE_DIRTY              0x040
+#define PAGE_LARGE              0x080   // PDE maps a 4MB page (PSE)
+#define PAGE_GLOBAL             0x100
+#define PAGE_ANONYMOUS          0x200   // Software: demand-zero page owned by the address space
+#define PAGE_COW                0x400   // Software: shared read-only, copy on write fault
+#define PAGE_SWAPPED            0x800   // Software: not present, frame field holds a compressed swap slot
+#define PAGE_FLAGS_MASK         0xFFF
+
+// Page fault counters
+typedef struct {
+    uint32_t page_faults;         // All #PF exceptions
+    uint32_t demand_zero_faults;  // Resolved by mapping a zeroed frame
+    uint32_t cow_faults;          // Resolved by copying or reclaiming a shared frame
+    uint32_t unresolved_faults;   // Fatal or permission faults
+    uint32_t swap_in_faults;      // Resolved by decompressing a swapped-out page
+    uint32_t pages_swapped_out;   // Cold pages moved to the compressed store
+    uint64_t swap_in_cycles;      // Total TSC cycles spent in swap-in faults
+    uint32_t swap_in_max_cycles;  // Slowest swap-in fault
+} paging_fault_stats_t;
+
+int init_paging(void);
+bool paging_large_pages_enabled(void);
+uint32_t* paging_kernel_directory(void);
+uint32_t* paging_current_directory(void);
+
+// Address spaces share the kernel identity and higher-half mappings
+uint32_t* paging_create_address_space(void);
+void paging_destroy_address_space(uint32_t* directory);
+void paging_switch_address_space(uint32_t* directory);
+
+// Copy-on-write clone: anonymous pages are shared read-only until written
+uint32_t* paging_clone_address_space(uint32_t* source);
+
+int paging_map(uint32_t* directory, uint32_t virtual_address, uint32_t physical_address, uint32_t flags);
+int paging_map_large(uint32_t* directory, uint32_t virtual_address, uint32_t physical_address, uint32_t flags);
+int paging_unmap(uint32_t* directory, uint32_t virtual_address);
+uint32_t paging_translate(uint32_t* directory, uint32_t virtual_address);
+
+// Demand-zero mappings: frames are allocated and zeroed on first touch
+int paging_map_lazy(uint32_t* directory, uint32_t virtual_address, uint32_t size, uint32_t flags);
+uint32_t paging_kernel_reserve(uint32_t size);
+void paging_kernel_release(uint32_t address, uint32_t size);
+int paging_handle_fault(uint32_t fault_address, uint32_t error_code);
+void paging_page_fault_handler(uint32_t error_code);
+void paging_get_fault_stats(paging_fault_stats_t* stats);
+
+// Compressed swap: move up to pages cold anonymous pages into zram,
+// returns the number of frames freed (memory_reclaim_t handler)
+uint32_t paging_reclaim(uint32_t pages);
+
+#endif /* KERNEL_PAGING_H */
@@ -0,0 +1,137 @@
+/*
+ * OmniOS 2.0 Locks
+ * Spinlocks, reader/writer locks and sequence counters built on the
+ * compiler's atomic builtins. The kernel itself runs on one CPU without
+ * preemption, so they never wait there; they keep shared code correct
+ * when it runs on several threads, as the host tools do.
+ */
+
+#ifndef KERNEL_SYNC_H
+#define KERNEL_SYNC_H
+
+#include "omnios.h"
+
+typedef struct {
+    uint32_t locked;
+} spinlock_t;
+
+// Writers take precedence: a waiting writer holds back new readers
+typedef struct {
+    uint32_t readers;
+    uint32_t writer;          // Held or wanted by a writer
+} rwlock_t;
+
+// Odd while a writer is changing the data it guards
+typedef struct {
+    uint32_t sequence;
+} seqcount_t;
+
+#define SPINLOCK_INIT           { 0 }
+#define RWLOCK_INIT             { 0, 0 }
+#define SEQCOUNT_INIT           { 0 }
+
+static inline void cpu_relax(void) {
+    __builtin_ia32_pause();
+}
+
+// What a waiting thread does between attempts. Builds whose lock holders
+// can be preempted, like the host tools, define it to yield the CPU.
+#ifndef SYNC_WAIT
+#define SYNC_WAIT()             cpu_relax()
+#endif
+
+static inline bool spin_trylock(spinlock_t* lock) {
+    return !__atomic_exchange_n(&lock->locked, 1, __ATOMIC_ACQUIRE);
+}
+
+static inline void spin_lock(spinlock_t* lock) {
+    while (!spin_trylock(lock)) {
+        while (__atomic_load_n(&lock->locked, __ATOMIC_RELAXED)) {
+            SYNC_WAIT();
+        }
+    }
+}
+
+static inline void spin_unlock(spinlock_t* lock) {
+    __atomic_store_n(&lock->locked, 0, __ATOMIC_RELEASE);
+}
+
+static inline bool rw_read_trylock(rwlock_t* lock) {
+    if (__atomic_load_n(&lock->writer, __ATOMIC_RELAXED)) {
+        return false;
+    }
+    
+    __atomic_add_fetch(&lock->readers, 1, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&lock->writer, __ATOMIC_SEQ_CST)) {
+        __atomic_sub_fetch(&lock->readers, 1, __ATOMIC_RELEASE);
+        return false;
+    }
+    return true;
+}
+
+static inline void rw_read_lock(rwlock_t* lock) {
+    while (!rw_read_trylock(lock)) {
+        SYNC_WAIT();
+    }
+}
+
+static inline void rw_read_unlock(rwlock_t* lock) {
+    __atomic_sub_fetch(&lock->readers, 1, __ATOMIC_RELEASE);
+}
+
+static inline bool rw_write_trylock(rwlock_t* lock) {
+    uint32_t none = 0;
+    if (!__atomic_compare_exchange_n(&lock->writer, &none, 1, false, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED)) {
+        return false;
+    }
+    
+    if (__atomic_load_n(&lock->readers, __ATOMIC_SEQ_CST)) {
+        __atomic_store_n(&lock->writer, 0, __ATOMIC_RELEASE);
+        return false;
+    }
+    return true;
+}
+
+static inline void rw_write_lock(rwlock_t* lock) {
+    uint32_t none = 0;
+    while (!__atomic_compare_exchange_n(&lock->writer, &none, 1, false, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED)) {
+        none = 0;
+        SYNC_WAIT();
+    }
+    
+    // New readers back off from here on; wait out the ones inside
+    while (__atomic_load_n(&lock->readers, __ATOMIC_ACQUIRE)) {
+        SYNC_WAIT();
+    }
+}
+
+static inline void rw_write_unlock(rwlock_t* lock) {
+    __atomic_store_n(&lock->writer, 0, __ATOMIC_RELEASE);
+}
+
+// Readers copy what they need between begin and retry, and start over
+// when retry says a writer was active meanwhile
+static inline uint32_t seq_read_begin(const seqcount_t* seq) {
+    uint32_t sequence;
+    while ((sequence = __atomic_load_n(&seq->sequence, __ATOMIC_ACQUIRE)) & 1) {
+        SYNC_WAIT();
+    }
+    return sequence;
+}
+
+static inline bool seq_read_retry(const seqcount_t* seq, uint32_t sequence) {
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    return __atomic_load_n(&seq->sequence, __ATOMIC_RELAXED) != sequence;
+}
+
+// Writers exclude each other with a lock of their own
+static inline void seq_write_begin(seqcount_t* seq) {
+    __atomic_store_n(&seq->sequence, seq->sequence + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+static inline void seq_write_end(seqcount_t* seq) {
+    __atomic_store_n(&seq->sequence, seq->sequence + 1, __ATOMIC_RELEASE);
+}
+
+#endif /* KERNEL_SYNC_H */
@@ -0,0 +1,41 @@
+/*
+ * OmniOS 2.0 Compressed RAM Swap
+ * LZ-compressed in-memory store for cold anonymous pages
+ */
+
+#ifndef KERNEL_ZRAM_H
+#define KERNEL_ZRAM_H
+
+#include "omnios.h"
+
+#define ZRAM_MAX_SLOTS          0xFFFFF         // Slot numbers live in the PTE frame field
+#define ZRAM_MAX_STORED_SIZE    (PAGE_SIZE * 3 / 4) // Pages that compress worse stay resident
+
+// Store statistics
+typedef struct {
+    uint32_t capacity;            // Slots available
+    uint32_t stored_pages;        // Slots in use
+    uint32_t same_filled_pages;   // Stored as a single repeated word, no data
+    uint32_t compressed_bytes;    // Data held for the stored pages
+    uint32_t compression_ratio;   // Stored page bytes / compressed bytes, percent
+    uint32_t page_outs;           // Pages compressed into the store
+    uint32_t page_ins;            // Pages decompressed out of the store
+    uint32_t rejected_pages;      // Incompressible or out of space
+} zram_stats_t;
+
+int zram_init(uint32_t max_pages);
+bool zram_enabled(void);
+
+// Compress a page into a new slot; returns the slot, 0 if it was not stored
+uint32_t zram_store(uint32_t page);
+
+// Decompress a slot into a page and drop one reference to it
+int zram_load(uint32_t slot, uint32_t page);
+
+// Slot references, one per PTE that names the slot
+void zram_slot_get(uint32_t slot);
+void zram_slot_put(uint32_t slot);
+
+void zram_get_stats(zram_stats_t* stats);
+
+#endif /* KERNEL_ZRAM_H */
@@ -54,16 +54,46 @@ typedef struct {
     uint32_t free_memory;
     uint32_t active_processes;
     uint32_t uptime;
+    uint32_t page_faults;
+    uint32_t demand_zero_faults;
+    uint32_t cow_faults;
+    uint32_t largest_free_block;
+    uint32_t heap_fragmentation;
+    uint32_t swapped_pages;
+    uint32_t swap_compression_ratio;
+    uint32_t swap_in_latency;     // Average swap-in fault, TSC cycles
     bool gui_enabled;
     char current_user[32];
 } system_state_t;
 
+// BIOS E820 memory map handed over by stage 2
+#define BOOT_E820_MAP_ADDRESS   0x0500
+#define BOOT_E820_MAX_ENTRIES   32
+#define E820_TYPE_USABLE        1
+#define E820_TYPE_RESERVED      2
+#define E820_TYPE_ACPI_RECLAIM  3
+#define E820_TYPE_ACPI_NVS      4
+#define E820_TYPE_BAD           5
+
+typedef struct __attribute__((packed)) {
+    uint64_t base;
+    uint64_t length;
+    uint32_t type;
+    uint32_t acpi_attributes;
+} e820_entry_t;
+
+typedef struct __attribute__((packed)) {
+    uint32_t count;
+    e820_entry_t entries[BOOT_E820_MAX_ENTRIES];
+} boot_memory_map_t;
+
 // Function prototypes for core system functions
 int omnios_init(void);
 int omnios_shutdown(void);
 int load_module(const char* module_name);
 int unload_module(const char* module_name);
 system_state_t* get_system_state(void);
+int kernel_command(const char* command);
 
 // Error codes
 #define OMNIOS_SUCCESS          0
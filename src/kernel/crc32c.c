@@ -0,0 +1,143 @@
+/*
+ * OmniOS 2.0 CRC32C
+ * Reflected Castagnoli polynomial. The software path folds eight bytes
+ * per step through eight 256-entry tables; CPUs with SSE4.2 run the
+ * crc32 instruction on 8 (x86-64) or 4 byte words instead.
+ */
+
+#include "omnios.h"
+#include "kernel/crc32c.h"
+
+#define CRC32C_POLY             0x82F63B78  // Reflected 0x1EDC6F41
+#define CPUID_FEATURE_SSE42     (1 << 20)   // ECX of leaf 1
+#define EFLAGS_ID               (1 << 21)
+
+typedef uint32_t (*crc32c_update_t)(uint32_t crc, const void* data, uint32_t length);
+
+static uint32_t g_table[8][256];
+static crc32c_update_t g_update = NULL;
+
+static inline uint32_t crc32c_read32(const uint8_t* p) {
+    uint32_t value;
+    __builtin_memcpy(&value, p, sizeof(value));
+    return value;
+}
+
+uint32_t crc32c_software(uint32_t crc, const void* data, uint32_t length) {
+    const uint8_t* p = data;
+    crc = ~crc;
+    
+    while (length >= 8) {
+        uint32_t low = crc32c_read32(p) ^ crc;
+        uint32_t high = crc32c_read32(p + 4);
+        crc = g_table[7][low & 0xFF] ^ g_table[6][(low >> 8) & 0xFF] ^
+              g_table[5][(low >> 16) & 0xFF] ^ g_table[4][low >> 24] ^
+              g_table[3][high & 0xFF] ^ g_table[2][(high >> 8) & 0xFF] ^
+              g_table[1][(high >> 16) & 0xFF] ^ g_table[0][high >> 24];
+        p += 8;
+        length -= 8;
+    }
+    
+    while (length--) {
+        crc = g_table[0][(crc ^ *p++) & 0xFF] ^ (crc >> 8);
+    }
+    return ~crc;
+}
+
+#if defined(__i386__) || defined(__x86_64__)
+static uint32_t crc32c_sse42(uint32_t crc, const void* data, uint32_t length) {
+    const uint8_t* p = data;
+    crc = ~crc;
+
+#if defined(__x86_64__)
+    uint64_t wide = crc;
+    while (length >= 8) {
+        uint64_t word;
+        __builtin_memcpy(&word, p, sizeof(word));
+        __asm__("crc32q %1, %0" : "+r"(wide) : "rm"(word));
+        p += 8;
+        length -= 8;
+    }
+    crc = (uint32_t)wide;
+#endif
+
+    while (length >= 4) {
+        uint32_t word = crc32c_read32(p);
+        __asm__("crc32l %1, %0" : "+r"(crc) : "rm"(word));
+        p += 4;
+        length -= 4;
+    }
+    
+    while (length--) {
+        uint8_t byte = *p++;
+        __asm__("crc32b %1, %0" : "+r"(crc) : "rm"(byte));
+    }
+    return ~crc;
+}
+
+static bool crc32c_cpu_has_sse42(void) {
+#if defined(__i386__)
+    uint32_t before, after;
+    
+    // CPUID exists when the EFLAGS.ID bit can be toggled
+    __asm__ volatile("pushfl\n\t"
+                     "pushfl\n\t"
+                     "popl %0\n\t"
+                     "movl %0, %1\n\t"
+                     "xorl %2, %0\n\t"
+                     "pushl %0\n\t"
+                     "popfl\n\t"
+                     "pushfl\n\t"
+                     "popl %0\n\t"
+                     "popfl"
+                     : "=&r"(after), "=&r"(before)
+                     : "i"(EFLAGS_ID));
+    if (((after ^ before) & EFLAGS_ID) == 0) {
+        return false;
+    }
+#endif
+
+    uint32_t eax, ebx, ecx, edx;
+    __asm__ volatile("cpuid" : "=a"(eax), "=b"(ebx), "=c"(ecx), "=d"(edx) : "a"(1), "c"(0));
+    return (ecx & CPUID_FEATURE_SSE42) != 0;
+}
+#endif
+
+void crc32c_init(void) {
+    for (uint32_t i = 0; i < 256; i++) {
+        uint32_t crc = i;
+        for (int bit = 0; bit < 8; bit++) {
+            crc = (crc & 1) ? (crc >> 1) ^ CRC32C_POLY : crc >> 1;
+        }
+        g_table[0][i] = crc;
+    }
+    
+    // Table k advances a byte through k further zero bytes
+    for (uint32_t i = 0; i < 256; i++) {
+        for (int k = 1; k < 8; k++) {
+            uint32_t previous = g_table[k - 1][i];
+            g_table[k][i] = (previous >> 8) ^ g_table[0][previous & 0xFF];
+        }
+    }
+    
+    g_update = crc32c_software;
+#if defined(__i386__) || defined(__x86_64__)
+    if (crc32c_cpu_has_sse42()) {
+        g_update = crc32c_sse42;
+    }
+#endif
+}
+
+uint32_t crc32c(uint32_t crc, const void* data, uint32_t length) {
+    if (!g_update) {
+        crc32c_init();
+    }
+    return g_update(crc, data, length);
+}
+
+bool crc32c_hardware(void) {
+    if (!g_update) {
+        crc32c_init();
+    }
+    return g_update != crc32c_software;
+}
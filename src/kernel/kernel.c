@@ -5,12 +5,17 @@
 
 #include "omnios.h"
 #include "kernel/memory.h"
+#include "kernel/paging.h"
+#include "kernel/zram.h"
+#include "fs/bcache.h"
 #include "kernel/process.h"
 #include "kernel/drivers.h"
 #include "kernel/syscalls.h"
 #include "ui/ui_framework.h"
 #include "security/security.h"
 
+#define KERNEL_LEAK_REPORT_ENTRIES 32 // Live allocations listed by memleaks
+
 // Kernel signature (must match bootloader check)
 const uint32_t kernel_signature __attribute__((section(".signature"))) = 0x4E524B4F; // "OKRN"
 
@@ -28,10 +33,15 @@ void kernel_main(void) {
     kernel_print_banner();
     
     // Initialize memory management
-    if (memory_init() != OMNIOS_SUCCESS) {
+    if (memory_init((const boot_memory_map_t*)BOOT_E820_MAP_ADDRESS) != OMNIOS_SUCCESS) {
         kernel_panic("Memory initialization failed");
     }
     
+    // Compressed swap for cold anonymous pages, a quarter of RAM uncompressed
+    if (zram_init(memory_get_total() / PAGE_SIZE / 4) == OMNIOS_SUCCESS) {
+        memory_set_reclaim_handler(paging_reclaim);
+    }
+    
     // Initialize process management
     if (process_init() != OMNIOS_SUCCESS) {
         kernel_panic("Process initialization failed");
@@ -253,16 +263,53 @@ system_state_t* get_system_state(void) {
     return &g_system_state;
 }
 
+// Built-in commands the shell passes to the kernel by name
+int kernel_command(const char* command) {
+    if (strcmp(command, "meminfo") == 0) {
+        memory_dump_stats();
+        return OMNIOS_SUCCESS;
+    }
+    
+    if (strcmp(command, "memleaks") == 0) {
+        memory_dump_live_allocations(KERNEL_LEAK_REPORT_ENTRIES);
+        return OMNIOS_SUCCESS;
+    }
+    
+    return OMNIOS_ERROR_NOT_FOUND;
+}
+
 void update_system_stats(void) {
     static uint32_t last_update = 0;
     uint32_t current_time = timer_get_ticks();
     
     // Update every second
     if (current_time - last_update >= 1000) {
-        g_system_state.free_memory = memory_get_free();
+        paging_fault_stats_t fault_stats;
+        paging_get_fault_stats(&fault_stats);
+        
+        memory_stats_t memory_stats;
+        memory_get_stats(&memory_stats);
+        
+        zram_stats_t zram_stats;
+        zram_get_stats(&zram_stats);
+        
+        g_system_state.free_memory = memory_stats.free_memory;
+        g_system_state.largest_free_block = memory_stats.heap_largest_free > memory_stats.page_largest_free ?
+                                            memory_stats.heap_largest_free : memory_stats.page_largest_free;
+        g_system_state.heap_fragmentation = memory_stats.heap_fragmentation;
+        g_system_state.page_faults = fault_stats.page_faults;
+        g_system_state.demand_zero_faults = fault_stats.demand_zero_faults;
+        g_system_state.cow_faults = fault_stats.cow_faults;
+        g_system_state.swapped_pages = zram_stats.stored_pages;
+        g_system_state.swap_compression_ratio = zram_stats.compression_ratio;
+        g_system_state.swap_in_latency = fault_stats.swap_in_faults ?
+            (uint32_t)(fault_stats.swap_in_cycles / fault_stats.swap_in_faults) : 0;
         g_system_state.active_processes = process_get_count();
         g_system_state.uptime = current_time / 1000;
         last_update = current_time;
+        
+        // Write back file system blocks that have been dirty for too long
+        bcache_periodic_sync(current_time);
     }
 }
 
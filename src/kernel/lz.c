@@ -0,0 +1,227 @@
+/*
+ * OmniOS 2.0 LZ Codec
+ * Greedy single-probe LZ77 with LZ4-style sequences:
+ *   token (literal length << 4 | match length - 4), [length bytes],
+ *   literals, 16-bit little-endian offset, [length bytes]
+ * The last sequence carries literals only.
+ */
+
+#include "omnios.h"
+#include "kernel/lz.h"
+
+#define LZ_MIN_MATCH            4
+#define LZ_MAX_OFFSET           65535
+#define LZ_NIBBLE_MAX           15
+#define LZ_SKIP_SHIFT           5       // Step faster through incompressible data
+#define LZ_SHORT_COPY           16      // Literal runs copied as one fixed-size block
+
+static inline uint32_t lz_read32(const uint8_t* p) {
+    uint32_t value;
+    __builtin_memcpy(&value, p, sizeof(value));
+    return value;
+}
+
+static inline uint32_t lz_hash(uint32_t sequence) {
+    return (sequence * 2654435761u) >> (32 - LZ_HASH_BITS);
+}
+
+// Emit the 255-run extension of a length that overflowed its nibble
+static inline uint8_t* lz_write_length(uint8_t* out, uint8_t* out_end, uint32_t length) {
+    while (length >= 255) {
+        if (out >= out_end) {
+            return NULL;
+        }
+        *out++ = 255;
+        length -= 255;
+    }
+    
+    if (out >= out_end) {
+        return NULL;
+    }
+    *out++ = (uint8_t)length;
+    return out;
+}
+
+static uint8_t* lz_write_sequence(uint8_t* out, uint8_t* out_end, const uint8_t* literals,
+                                  uint32_t literal_length, uint32_t offset, uint32_t match_length) {
+    if (out >= out_end) {
+        return NULL;
+    }
+    
+    uint8_t* token = out++;
+    *token = (uint8_t)((literal_length < LZ_NIBBLE_MAX ? literal_length : LZ_NIBBLE_MAX) << 4);
+    if (literal_length >= LZ_NIBBLE_MAX) {
+        out = lz_write_length(out, out_end, literal_length - LZ_NIBBLE_MAX);
+        if (!out) {
+            return NULL;
+        }
+    }
+    
+    if ((uint32_t)(out_end - out) < literal_length) {
+        return NULL;
+    }
+    __builtin_memcpy(out, literals, literal_length);
+    out += literal_length;
+    
+    if (match_length == 0) {
+        return out; // Final literal run
+    }
+    
+    if (out_end - out < 2) {
+        return NULL;
+    }
+    *out++ = (uint8_t)offset;
+    *out++ = (uint8_t)(offset >> 8);
+    
+    match_length -= LZ_MIN_MATCH;
+    *token |= (uint8_t)(match_length < LZ_NIBBLE_MAX ? match_length : LZ_NIBBLE_MAX);
+    if (match_length >= LZ_NIBBLE_MAX) {
+        out = lz_write_length(out, out_end, match_length - LZ_NIBBLE_MAX);
+    }
+    
+    return out;
+}
+
+uint32_t lz_compress(const uint8_t* source, uint32_t length, uint8_t* destination,
+                     uint32_t capacity, lz_workspace_t* workspace) {
+    if (length == 0 || length > LZ_MAX_INPUT) {
+        return 0;
+    }
+    
+    uint8_t* out = destination;
+    uint8_t* out_end = destination + capacity;
+    uint32_t anchor = 0;
+    uint32_t position = 1;
+    
+    // Stale entries are harmless: every candidate is verified before use
+    memset(workspace->table, 0, sizeof(workspace->table));
+    if (length >= LZ_MIN_MATCH) {
+        workspace->table[lz_hash(lz_read32(source))] = 0;
+    }
+    
+    while (position + LZ_MIN_MATCH <= length) {
+        uint32_t sequence = lz_read32(source + position);
+        uint32_t hash = lz_hash(sequence);
+        uint32_t candidate = workspace->table[hash];
+        workspace->table[hash] = (uint16_t)position;
+        
+        if (candidate >= position || position - candidate > LZ_MAX_OFFSET ||
+            lz_read32(source + candidate) != sequence) {
+            position += 1 + ((position - anchor) >> LZ_SKIP_SHIFT);
+            continue;
+        }
+        
+        // Extend backwards over pending literals, then forwards
+        while (position > anchor && candidate > 0 && source[position - 1] == source[candidate - 1]) {
+            position--;
+            candidate--;
+        }
+        
+        uint32_t match_length = LZ_MIN_MATCH;
+        while (position + match_length < length && source[candidate + match_length] == source[position + match_length]) {
+            match_length++;
+        }
+        
+        out = lz_write_sequence(out, out_end, source + anchor, position - anchor,
+                                position - candidate, match_length);
+        if (!out) {
+            return 0;
+        }
+        
+        position += match_length;
+        anchor = position;
+        
+        // Seed the table inside the match so the next one can chain off it
+        if (position + LZ_MIN_MATCH <= length) {
+            workspace->table[lz_hash(lz_read32(source + position - 2))] = (uint16_t)(position - 2);
+        }
+    }
+    
+    out = lz_write_sequence(out, out_end, source + anchor, length - anchor, 0, 0);
+    return out ? (uint32_t)(out - destination) : 0;
+}
+
+uint32_t lz_decompress(const uint8_t* source, uint32_t length, uint8_t* destination,
+                       uint32_t capacity) {
+    const uint8_t* in = source;
+    const uint8_t* in_end = source + length;
+    uint8_t* out = destination;
+    uint8_t* out_end = destination + capacity;
+    
+    while (in < in_end) {
+        uint8_t token = *in++;
+        
+        uint32_t literal_length = token >> 4;
+        if (literal_length == LZ_NIBBLE_MAX) {
+            uint8_t byte;
+            do {
+                if (in >= in_end) {
+                    return 0;
+                }
+                byte = *in++;
+                literal_length += byte;
+            } while (byte == 255);
+        }
+        
+        if ((uint32_t)(in_end - in) < literal_length || (uint32_t)(out_end - out) < literal_length) {
+            return 0;
+        }
+        if (literal_length <= LZ_SHORT_COPY && in_end - in >= LZ_SHORT_COPY && out_end - out >= LZ_SHORT_COPY) {
+            __builtin_memcpy(out, in, LZ_SHORT_COPY); // Fixed size, so inlined
+        } else {
+            __builtin_memcpy(out, in, literal_length);
+        }
+        in += literal_length;
+        out += literal_length;
+        
+        if (in == in_end) {
+            break; // Final literal run
+        }
+        
+        if (in_end - in < 2) {
+            return 0;
+        }
+        uint32_t offset = in[0] | ((uint32_t)in[1] << 8);
+        in += 2;
+        
+        uint32_t match_length = (token & LZ_NIBBLE_MAX) + LZ_MIN_MATCH;
+        if ((token & LZ_NIBBLE_MAX) == LZ_NIBBLE_MAX) {
+            uint8_t byte;
+            do {
+                if (in >= in_end) {
+                    return 0;
+                }
+                byte = *in++;
+                match_length += byte;
+            } while (byte == 255);
+        }
+        
+        if (offset == 0 || offset > (uint32_t)(out - destination) ||
+            (uint32_t)(out_end - out) < match_length) {
+            return 0;
+        }
+        
+        // Words when each one is read before it is overwritten, running
+        // past the end of the match if the output has room; bytes for
+        // short offsets, where overlapping matches replicate runs
+        const uint8_t* match = out - offset;
+        uint32_t i = 0;
+        if (offset >= sizeof(uint64_t)) {
+            uint32_t words = match_length & ~(uint32_t)(sizeof(uint64_t) - 1);
+            if ((uint32_t)(out_end - out) >= match_length + sizeof(uint64_t)) {
+                words = match_length;
+            }
+            for (; i < words; i += sizeof(uint64_t)) {
+                uint64_t word;
+                __builtin_memcpy(&word, match + i, sizeof(word));
+                __builtin_memcpy(out + i, &word, sizeof(word));
+            }
+        }
+        for (; i < match_length; i++) {
+            out[i] = match[i];
+        }
+        out += match_length;
+    }
+    
+    return (uint32_t)(out - destination);
+}
@@ -1,60 +1,145 @@
 /*
  * OmniOS 2.0 Memory Management
- * Physical and virtual memory management with paging
+ * Physical and virtual memory management with paging. One spinlock
+ * guards the heap bins, the slab caches, the counters and the live
+ * allocation list; it is dropped while the reclaim handler runs, since
+ * that allocates too.
  */
 
 #include "omnios.h"
 #include "kernel/memory.h"
+#include "kernel/page_alloc.h"
+#include "kernel/paging.h"
+#include "kernel/sync.h"
 
-// Memory management structures
-typedef struct memory_block {
-    uint32_t address;
-    uint32_t size;
-    bool allocated;
-    struct memory_block* next;
-} memory_block_t;
+// memory.c defines the untagged entry point itself
+#undef memory_allocate
+
+// Heap block layout (boundary tags):
+//   [header][payload ...][footer]
+// Header and footer both carry the block size with the allocated bit in
+// bit 0, so a block can reach both physical neighbours in O(1). Free blocks
+// keep their bin links at the start of the payload.
+typedef struct {
+    uint32_t size;            // Block size including tags, bit 0 = allocated, bit 1 = tracked
+    uint32_t magic;           // HEAP_BLOCK_MAGIC for live heap blocks
+} heap_header_t;
 
+typedef struct {
+    uint32_t size;            // Copy of the header size word
+} heap_footer_t;
+
+typedef struct heap_free_block {
+    heap_header_t header;
+    struct heap_free_block* next; // Next free block in the same bin
+    struct heap_free_block* prev; // Previous free block in the same bin
+} heap_free_block_t;
+
+#define HEAP_BLOCK_MAGIC        0x48454150 // "HEAP"
+#define HEAP_ALLOCATED          0x1
+#define HEAP_TRACKED            0x2 // Payload starts with a memory_track_t
+#define HEAP_FLAGS              (HEAP_ALLOCATED | HEAP_TRACKED)
+#define HEAP_ALIGNMENT          8
+#define HEAP_BIN_COUNT          24
+#define HEAP_OVERHEAD           (sizeof(heap_header_t) + sizeof(heap_footer_t))
+#define HEAP_MIN_BLOCK          ((sizeof(heap_free_block_t) + sizeof(heap_footer_t) + \
+                                  HEAP_ALIGNMENT - 1) & ~(HEAP_ALIGNMENT - 1))
+#define HEAP_PROLOGUE_SIZE      ((HEAP_OVERHEAD + HEAP_ALIGNMENT - 1) & ~(HEAP_ALIGNMENT - 1))
+#define HEAP_REGION_ORDER       6 // Heap grows in 256KB regions from the page allocator
+
+#ifdef MEMORY_TRACKING
+// Header in front of every tracked allocation, linked into the live list.
+// Tracked heap blocks set HEAP_TRACKED in their block header. Tracking
+// builds keep aligned requests off the slabs, so every slab object is
+// tracked.
+typedef struct memory_track {
+    uint32_t size;            // Requested size
+    const char* tag;          // Allocation site
+    struct memory_track* next;
+    struct memory_track* prev;
+    heap_header_t guard;      // Where an untracked block's header would be
+} memory_track_t;
+
+#define MEMORY_TRACK_MAGIC      0x4D54524B // "MTRK"
+#define MEMORY_TRACK_SIZE       sizeof(memory_track_t)
+#endif
+
+// Memory management structures
 typedef struct {
     uint32_t total_memory;
-    uint32_t free_memory;
-    uint32_t used_memory;
-    memory_block_t* free_list;
-    memory_block_t* used_list;
+    uint32_t free_memory;     // Free bytes inside heap regions and slab pages
+    uint32_t used_memory;     // Bytes handed out by the heap and slab caches
+    uint32_t heap_regions;    // Regions currently owned by the heap
+    uint32_t allocations;     // Successful allocation calls
+    uint32_t frees;           // Free calls with a non-NULL pointer
+    uint32_t failed_allocations;
+    uint32_t reclaimed_pages; // Frames freed by the reclaim handler
+    uint32_t size_histogram[MEMORY_HISTOGRAM_BUCKETS];
+    heap_free_block_t* bins[HEAP_BIN_COUNT]; // Segregated free lists by size
+    uint32_t bin_map;                        // Bit i set when bins[i] is non-empty
 } memory_manager_t;
 
+// Slab cache; slab pages are order-0 frames described by their page_frame_t
+typedef struct {
+    uint32_t object_size;
+    uint32_t objects_per_slab;
+    page_frame_t* partial;    // Pages with at least one free object
+    memory_slab_stats_t stats;
+} slab_cache_t;
+
 static memory_manager_t g_memory_manager;
-static uint32_t g_kernel_heap_start;
-static uint32_t g_kernel_heap_end;
+static spinlock_t g_heap_lock = SPINLOCK_INIT;
+
+// Slab allocator state
+static slab_cache_t g_slab_caches[MEMORY_SLAB_CLASSES];
 
-// Page directory and tables for virtual memory
-static uint32_t* page_directory;
-static uint32_t* page_tables[1024];
+static void slab_init(void);
+static void* slab_allocate(uint32_t size);
+static void slab_free(page_frame_t* page, void* ptr);
 
-int memory_init(void) {
+static void heap_add_region(uint32_t start, uint32_t end);
+static void* heap_allocate(uint32_t size);
+static void* heap_allocate_aligned(uint32_t size, uint32_t alignment);
+static void heap_free(void* ptr);
+static void* memory_allocate_aligned_untracked(uint32_t size, uint32_t alignment);
+
+// Called when memory runs out (compressed swap page-out)
+static memory_reclaim_t g_reclaim_handler = NULL;
+static bool g_reclaiming = false;
+
+#ifdef MEMORY_TRACKING
+static memory_track_t* g_live_allocations;
+static uint32_t g_live_count;
+static uint32_t g_live_bytes;
+#endif
+
+int memory_init(const boot_memory_map_t* memory_map) {
     console_print("Initializing memory management...\n");
     
     // Detect available memory
-    uint32_t total_memory = detect_memory();
+    uint32_t total_memory = detect_memory(memory_map);
     console_print("Total memory: %d MB\n", total_memory / (1024 * 1024));
     
+    // Build the physical page allocator from the E820 map
+    if (page_alloc_init(memory_map) != OMNIOS_SUCCESS) {
+        return OMNIOS_ERROR_MEMORY;
+    }
+    
     // Initialize memory manager
     g_memory_manager.total_memory = total_memory;
-    g_memory_manager.free_memory = total_memory - 0x100000; // Reserve first 1MB
-    g_memory_manager.used_memory = 0x100000;
-    g_memory_manager.free_list = NULL;
-    g_memory_manager.used_list = NULL;
-    
-    // Set up kernel heap (1MB - 16MB)
-    g_kernel_heap_start = 0x100000;
-    g_kernel_heap_end = 0x1000000;
-    
-    // Initialize free list with kernel heap
-    memory_block_t* initial_block = (memory_block_t*)g_kernel_heap_start;
-    initial_block->address = g_kernel_heap_start + sizeof(memory_block_t);
-    initial_block->size = g_kernel_heap_end - g_kernel_heap_start - sizeof(memory_block_t);
-    initial_block->allocated = false;
-    initial_block->next = NULL;
-    g_memory_manager.free_list = initial_block;
+    g_memory_manager.free_memory = 0;
+    g_memory_manager.used_memory = 0;
+    g_memory_manager.heap_regions = 0;
+    g_memory_manager.allocations = 0;
+    g_memory_manager.frees = 0;
+    g_memory_manager.failed_allocations = 0;
+    g_memory_manager.reclaimed_pages = 0;
+    memset(g_memory_manager.size_histogram, 0, sizeof(g_memory_manager.size_histogram));
+    memset(g_memory_manager.bins, 0, sizeof(g_memory_manager.bins));
+    g_memory_manager.bin_map = 0;
+    
+    // Slab and heap pages are taken from the page allocator on demand
+    slab_init();
     
     // Initialize paging
     if (init_paging() != OMNIOS_SUCCESS) {
@@ -65,105 +150,183 @@ int memory_init(void) {
     return OMNIOS_SUCCESS;
 }
 
-uint32_t detect_memory(void) {
-    // Use BIOS memory map (simplified)
-    // In real implementation, this would parse the memory map from bootloader
-    return 64 * 1024 * 1024; // Assume 64MB for now
+uint32_t detect_memory(const boot_memory_map_t* memory_map) {
+    if (!memory_map || memory_map->count == 0) {
+        return 64 * 1024 * 1024; // No E820 map, assume 64MB
+    }
+    
+    // Sum usable E820 ranges below 4GB
+    uint64_t total = 0;
+    for (uint32_t i = 0; i < memory_map->count && i < BOOT_E820_MAX_ENTRIES; i++) {
+        const e820_entry_t* entry = &memory_map->entries[i];
+        if (entry->type != E820_TYPE_USABLE || entry->base >= 0x100000000ULL) {
+            continue;
+        }
+        
+        uint64_t end = entry->base + entry->length;
+        if (end > 0x100000000ULL) {
+            end = 0x100000000ULL;
+        }
+        total += end - entry->base;
+    }
+    
+    return (total > 0xFFFFFFFFULL) ? 0xFFFFFFFF : (uint32_t)total;
 }
 
-int init_paging(void) {
-    console_print("Setting up paging...\n");
+static void* memory_allocate_untracked(uint32_t size) {
+    // Small objects are served by the slab caches in O(1)
+    if (size <= MEMORY_SLAB_MAX_SIZE) {
+        void* object = slab_allocate(size);
+        if (object) {
+            return object;
+        }
+    }
     
-    // Allocate page directory
-    page_directory = (uint32_t*)memory_allocate_aligned(PAGE_SIZE, PAGE_SIZE);
-    if (!page_directory) {
-        return OMNIOS_ERROR_MEMORY;
+    return heap_allocate(size);
+}
+
+static void memory_free_untracked(void* ptr) {
+    // Objects on slab pages go back to their slab
+    page_frame_t* frame = page_frame_of((uint32_t)ptr);
+    if (frame && (frame->flags & PAGE_FRAME_SLAB)) {
+        slab_free(frame, ptr);
+        return;
+    }
+    
+    // Whole-page aligned allocations go straight back to the page allocator
+    if (frame && (frame->flags & PAGE_FRAME_ALIGNED)) {
+        if (page_frame_address(frame) == (uint32_t)ptr) {
+            frame->flags &= ~PAGE_FRAME_ALIGNED;
+            g_memory_manager.used_memory -= (uint32_t)PAGE_SIZE << frame->order;
+            page_free((uint32_t)ptr, frame->order);
+        }
+        return;
     }
     
-    // Clear page directory
-    memset(page_directory, 0, PAGE_SIZE);
+    heap_free(ptr);
+}
+
+// Histogram bucket i counts requests of (2^(i+3), 2^(i+4)] bytes
+static inline int memory_histogram_bucket(uint32_t size) {
+    if (size <= 16) {
+        return 0;
+    }
+    
+    int bucket = (32 - __builtin_clz(size - 1)) - 4;
+    return (bucket >= MEMORY_HISTOGRAM_BUCKETS) ? MEMORY_HISTOGRAM_BUCKETS - 1 : bucket;
+}
+
+#ifdef MEMORY_TRACKING
+static void* memory_track(void* block, uint32_t size, const char* tag) {
+    if (!block) {
+        return NULL;
+    }
+    
+    page_frame_t* frame = page_frame_of((uint32_t)block);
+    if (!frame || !(frame->flags & PAGE_FRAME_SLAB)) {
+        ((heap_header_t*)block - 1)->size |= HEAP_TRACKED;
+    }
+    
+    memory_track_t* record = (memory_track_t*)block;
+    record->guard.size = 0;
+    record->guard.magic = MEMORY_TRACK_MAGIC;
+    record->size = size;
+    record->tag = tag ? tag : "untagged";
+    record->prev = NULL;
+    record->next = g_live_allocations;
+    if (g_live_allocations) {
+        g_live_allocations->prev = record;
+    }
+    g_live_allocations = record;
+    
+    g_live_count++;
+    g_live_bytes += size;
+    return (uint8_t*)block + MEMORY_TRACK_SIZE;
+}
+
+static void* memory_untrack(void* ptr) {
+    // Whole-page aligned allocations are never tracked, slab objects always
+    page_frame_t* frame = page_frame_of((uint32_t)ptr);
+    if (frame && (frame->flags & PAGE_FRAME_ALIGNED)) {
+        return ptr;
+    }
     
-    // Identity map first 4MB (kernel space)
-    for (int i = 0; i < 1024; i++) {
-        // Allocate page table
-        page_tables[0] = (uint32_t*)memory_allocate_aligned(PAGE_SIZE, PAGE_SIZE);
-        if (!page_tables[0]) {
-            return OMNIOS_ERROR_MEMORY;
+    // Only the allocation's own bytes are read: right before ptr sits
+    // either an untracked block's header or the record's guard
+    memory_track_t* record = (memory_track_t*)((uint8_t*)ptr - MEMORY_TRACK_SIZE);
+    if (!frame || !(frame->flags & PAGE_FRAME_SLAB)) {
+        if (((heap_header_t*)ptr - 1)->magic != MEMORY_TRACK_MAGIC) {
+            return ptr;
         }
         
-        // Map pages
-        for (int j = 0; j < 1024; j++) {
-            uint32_t address = (i * 1024 + j) * PAGE_SIZE;
-            page_tables[0][j] = address | 0x003; // Present, writable
+        heap_header_t* header = (heap_header_t*)record - 1;
+        if (!(header->size & HEAP_TRACKED)) {
+            return ptr;
         }
-        
-        // Add page table to directory
-        page_directory[i] = (uint32_t)page_tables[0] | 0x003;
-        
-        // Only map first 4MB for now
-        if (i == 0) break;
+        header->size &= ~HEAP_TRACKED;
     }
     
-    // Enable paging
-    enable_paging((uint32_t)page_directory);
+    if (record->prev) {
+        record->prev->next = record->next;
+    } else {
+        g_live_allocations = record->next;
+    }
     
-    console_print("Paging enabled\n");
-    return OMNIOS_SUCCESS;
+    if (record->next) {
+        record->next->prev = record->prev;
+    }
+    
+    record->guard.magic = 0;
+    g_live_count--;
+    g_live_bytes -= record->size;
+    return record;
 }
+#endif
 
 void* memory_allocate(uint32_t size) {
+    return memory_allocate_tagged(size, NULL);
+}
+
+void* memory_allocate_tagged(uint32_t size, const char* tag) {
     if (size == 0) {
         return NULL;
     }
     
-    // Align size to 4-byte boundary
-    size = (size + 3) & ~3;
-    
-    // Find suitable free block
-    memory_block_t* current = g_memory_manager.free_list;
-    memory_block_t* prev = NULL;
-    
-    while (current) {
-        if (current->size >= size) {
-            // Found suitable block
-            void* allocated_ptr = (void*)current->address;
-            
-            // If block is larger than needed, split it
-            if (current->size > size + sizeof(memory_block_t)) {
-                memory_block_t* new_block = (memory_block_t*)(current->address + size);
-                new_block->address = current->address + size + sizeof(memory_block_t);
-                new_block->size = current->size - size - sizeof(memory_block_t);
-                new_block->allocated = false;
-                new_block->next = current->next;
-                
-                current->size = size;
-                current->next = new_block;
-            }
-            
-            // Remove from free list
-            if (prev) {
-                prev->next = current->next;
-            } else {
-                g_memory_manager.free_list = current->next;
-            }
-            
-            // Add to used list
-            current->allocated = true;
-            current->next = g_memory_manager.used_list;
-            g_memory_manager.used_list = current;
-            
-            // Update statistics
-            g_memory_manager.free_memory -= size;
-            g_memory_manager.used_memory += size;
-            
-            return allocated_ptr;
+#ifdef MEMORY_TRACKING
+    uint32_t block_size = size + MEMORY_TRACK_SIZE;
+#else
+    uint32_t block_size = size;
+#endif
+    
+    spin_lock(&g_heap_lock);
+    g_memory_manager.size_histogram[memory_histogram_bucket(size)]++;
+    void* block = memory_allocate_untracked(block_size);
+    
+    // Out of memory: let the reclaim handler free frames, then retry once
+    if (!block) {
+        spin_unlock(&g_heap_lock);
+        uint32_t reclaimed = memory_reclaim(block_size / PAGE_SIZE + 1);
+        spin_lock(&g_heap_lock);
+        if (reclaimed > 0) {
+            block = memory_allocate_untracked(block_size);
         }
-        
-        prev = current;
-        current = current->next;
     }
     
-    return NULL; // No suitable block found
+#ifdef MEMORY_TRACKING
+    void* ptr = memory_track(block, size, tag);
+#else
+    (void)tag;
+    void* ptr = block;
+#endif
+    
+    if (ptr) {
+        g_memory_manager.allocations++;
+    } else {
+        g_memory_manager.failed_allocations++;
+    }
+    spin_unlock(&g_heap_lock);
+    
+    return ptr;
 }
 
 void memory_free(void* ptr) {
@@ -171,37 +334,15 @@ void memory_free(void* ptr) {
         return;
     }
     
-    // Find block in used list
-    memory_block_t* current = g_memory_manager.used_list;
-    memory_block_t* prev = NULL;
+    spin_lock(&g_heap_lock);
+    g_memory_manager.frees++;
     
-    while (current) {
-        if ((void*)current->address == ptr) {
-            // Remove from used list
-            if (prev) {
-                prev->next = current->next;
-            } else {
-                g_memory_manager.used_list = current->next;
-            }
-            
-            // Add to free list
-            current->allocated = false;
-            current->next = g_memory_manager.free_list;
-            g_memory_manager.free_list = current;
-            
-            // Update statistics
-            g_memory_manager.free_memory += current->size;
-            g_memory_manager.used_memory -= current->size;
-            
-            // Coalesce adjacent free blocks
-            coalesce_free_blocks();
-            
-            return;
-        }
-        
-        prev = current;
-        current = current->next;
-    }
+#ifdef MEMORY_TRACKING
+    ptr = memory_untrack(ptr);
+#endif
+    
+    memory_free_untracked(ptr);
+    spin_unlock(&g_heap_lock);
 }
 
 void* memory_allocate_aligned(uint32_t size, uint32_t alignment) {
@@ -209,46 +350,631 @@ void* memory_allocate_aligned(uint32_t size, uint32_t alignment) {
         return NULL; // Alignment must be power of 2
     }
     
-    // Allocate extra space for alignment
-    uint32_t total_size = size + alignment - 1;
-    void* ptr = memory_allocate(total_size);
-    if (!ptr) {
+    if (size == 0) {
         return NULL;
     }
     
-    // Calculate aligned address
-    uint32_t aligned_addr = ((uint32_t)ptr + alignment - 1) & ~(alignment - 1);
+    spin_lock(&g_heap_lock);
+    void* ptr = memory_allocate_aligned_untracked(size, alignment);
+    spin_unlock(&g_heap_lock);
     
-    return (void*)aligned_addr;
+    if (!ptr && memory_reclaim((size > alignment ? size : alignment) / PAGE_SIZE + 1) > 0) {
+        spin_lock(&g_heap_lock);
+        ptr = memory_allocate_aligned_untracked(size, alignment);
+        spin_unlock(&g_heap_lock);
+    }
+    
+    return ptr;
+}
+
+void memory_set_reclaim_handler(memory_reclaim_t handler) {
+    spin_lock(&g_heap_lock);
+    g_reclaim_handler = handler;
+    spin_unlock(&g_heap_lock);
 }
 
-void coalesce_free_blocks(void) {
-    memory_block_t* current = g_memory_manager.free_list;
+uint32_t memory_reclaim(uint32_t pages) {
+    // The handler allocates too; a nested shortage, or one on another
+    // thread while it runs, must not recurse into it
+    spin_lock(&g_heap_lock);
+    memory_reclaim_t handler = g_reclaiming ? NULL : g_reclaim_handler;
+    g_reclaiming = handler != NULL;
+    spin_unlock(&g_heap_lock);
+    if (!handler) {
+        return 0;
+    }
     
-    while (current && current->next) {
-        // Check if current block is adjacent to next block
-        if (current->address + current->size == (uint32_t)current->next) {
-            // Merge blocks
-            memory_block_t* next_block = current->next;
-            current->size += next_block->size + sizeof(memory_block_t);
-            current->next = next_block->next;
-        } else {
-            current = current->next;
+    uint32_t reclaimed = handler(pages);
+    
+    spin_lock(&g_heap_lock);
+    g_reclaiming = false;
+    g_memory_manager.reclaimed_pages += reclaimed;
+    spin_unlock(&g_heap_lock);
+    return reclaimed;
+}
+
+static void* memory_allocate_aligned_untracked(uint32_t size, uint32_t alignment) {
+    // Page-aligned objects (page tables, DMA buffers) take whole buddy
+    // blocks, which are naturally aligned to their own size
+    if (alignment >= PAGE_SIZE) {
+        uint32_t order = page_order_for_size(size > alignment ? size : alignment);
+        if (((uint32_t)PAGE_SIZE << order) < size || ((uint32_t)PAGE_SIZE << order) < alignment) {
+            return NULL;
         }
+        
+        uint32_t address = page_alloc(order);
+        if (!address) {
+            return NULL;
+        }
+        
+        page_frame_of(address)->flags |= PAGE_FRAME_ALIGNED;
+        g_memory_manager.used_memory += (uint32_t)PAGE_SIZE << order;
+        return (void*)address;
     }
+    
+    // Slab objects are aligned to their power-of-two class size. Tracking
+    // builds leave the slabs to tracked objects, see memory_untrack.
+#ifndef MEMORY_TRACKING
+    if (size <= MEMORY_SLAB_MAX_SIZE && alignment <= MEMORY_SLAB_MAX_SIZE) {
+        void* object = slab_allocate(size > alignment ? size : alignment);
+        if (object) {
+            return object;
+        }
+    }
+#endif
+    
+    if (alignment <= HEAP_ALIGNMENT) {
+        return heap_allocate(size);
+    }
+    
+    return heap_allocate_aligned(size, alignment);
 }
 
 uint32_t memory_get_total(void) {
     return g_memory_manager.total_memory;
 }
 
+static uint32_t memory_get_free_locked(void) {
+    return page_alloc_get_free_frames() * PAGE_SIZE + g_memory_manager.free_memory;
+}
+
 uint32_t memory_get_free(void) {
-    return g_memory_manager.free_memory;
+    spin_lock(&g_heap_lock);
+    uint32_t free = memory_get_free_locked();
+    spin_unlock(&g_heap_lock);
+    return free;
 }
 
 uint32_t memory_get_used(void) {
-    return g_memory_manager.used_memory;
+    return g_memory_manager.total_memory - memory_get_free();
+}
+
+void memory_get_stats(memory_stats_t* stats) {
+    memset(stats, 0, sizeof(memory_stats_t));
+    
+    spin_lock(&g_heap_lock);
+    stats->total_memory = g_memory_manager.total_memory;
+    stats->free_memory = memory_get_free_locked();
+    stats->used_memory = stats->total_memory - stats->free_memory;
+    stats->heap_used = g_memory_manager.used_memory;
+    stats->heap_free = g_memory_manager.free_memory;
+    stats->heap_regions = g_memory_manager.heap_regions;
+    stats->allocations = g_memory_manager.allocations;
+    stats->frees = g_memory_manager.frees;
+    stats->failed_allocations = g_memory_manager.failed_allocations;
+    stats->reclaimed_pages = g_memory_manager.reclaimed_pages;
+    memcpy(stats->size_histogram, g_memory_manager.size_histogram, sizeof(stats->size_histogram));
+    
+    // Walk the heap bins; only paid for when somebody asks
+    uint32_t binned_bytes = 0;
+    for (int i = 0; i < HEAP_BIN_COUNT; i++) {
+        for (heap_free_block_t* block = g_memory_manager.bins[i]; block; block = block->next) {
+            uint32_t payload = block->header.size - HEAP_OVERHEAD;
+            stats->heap_free_blocks++;
+            binned_bytes += payload;
+            if (payload > stats->heap_largest_free) {
+                stats->heap_largest_free = payload;
+            }
+        }
+    }
+    
+    if (binned_bytes > 0) {
+        stats->heap_fragmentation = 100 - (uint32_t)((uint64_t)stats->heap_largest_free * 100 / binned_bytes);
+    }
+    
+    // Page-level view: free frames stranded in blocks too small for a heap region
+    page_alloc_stats_t page_stats;
+    page_alloc_get_stats(&page_stats);
+    uint32_t stranded_frames = 0;
+    for (int order = PAGE_MAX_ORDER; order >= 0; order--) {
+        if (page_stats.free_blocks[order] > 0 && stats->page_largest_free == 0) {
+            stats->page_largest_free = (uint32_t)PAGE_SIZE << order;
+        }
+        
+        if (order < HEAP_REGION_ORDER) {
+            stranded_frames += page_stats.free_blocks[order] << order;
+        }
+    }
+    
+    if (page_stats.free_frames > 0) {
+        stats->page_fragmentation = (uint32_t)((uint64_t)stranded_frames * 100 / page_stats.free_frames);
+    }
+    
+#ifdef MEMORY_TRACKING
+    stats->live_allocations = g_live_count;
+    stats->live_bytes = g_live_bytes;
+#endif
+    spin_unlock(&g_heap_lock);
+}
+
+void memory_dump_stats(void) {
+    memory_stats_t stats;
+    memory_get_stats(&stats);
+    
+    console_print("Memory: %d KB total, %d KB free, %d KB used\n",
+                  stats.total_memory / 1024, stats.free_memory / 1024, stats.used_memory / 1024);
+    console_print("Heap: %d KB used, %d KB free in %d regions\n",
+                  stats.heap_used / 1024, stats.heap_free / 1024, stats.heap_regions);
+    console_print("Heap free blocks: %d, largest %d bytes, fragmentation %d%%\n",
+                  stats.heap_free_blocks, stats.heap_largest_free, stats.heap_fragmentation);
+    console_print("Pages: largest free block %d KB, fragmentation %d%%\n",
+                  stats.page_largest_free / 1024, stats.page_fragmentation);
+    console_print("Calls: %d allocations, %d frees, %d failed, %d pages reclaimed\n",
+                  stats.allocations, stats.frees, stats.failed_allocations, stats.reclaimed_pages);
+    
+    console_print("Size histogram:\n");
+    for (int i = 0; i < MEMORY_HISTOGRAM_BUCKETS; i++) {
+        if (stats.size_histogram[i] == 0) {
+            continue;
+        }
+        
+        if (i == MEMORY_HISTOGRAM_BUCKETS - 1) {
+            console_print("  > %d: %d\n", 8 << i, stats.size_histogram[i]);
+        } else {
+            console_print("  <= %d: %d\n", 16 << i, stats.size_histogram[i]);
+        }
+    }
+    
+    memory_slab_stats_t slabs[MEMORY_SLAB_CLASSES];
+    int classes = memory_get_slab_stats(slabs, MEMORY_SLAB_CLASSES);
+    console_print("Slab caches:\n");
+    for (int i = 0; i < classes; i++) {
+        console_print("  %d B: %d slabs, %d live, %d hits, %d misses\n",
+                      slabs[i].object_size, slabs[i].slabs, slabs[i].objects_in_use,
+                      slabs[i].hits, slabs[i].misses);
+    }
+}
+
+void memory_dump_live_allocations(uint32_t max_entries) {
+#ifdef MEMORY_TRACKING
+    spin_lock(&g_heap_lock);
+    console_print("Live allocations: %d (%d bytes)\n", g_live_count, g_live_bytes);
+    
+    uint32_t shown = 0;
+    for (memory_track_t* record = g_live_allocations; record && shown < max_entries; record = record->next) {
+        console_print("  %x  %d bytes  %s\n",
+                      (uint32_t)record + MEMORY_TRACK_SIZE, record->size, record->tag);
+        shown++;
+    }
+    
+    if (shown < g_live_count) {
+        console_print("  ... %d more\n", g_live_count - shown);
+    }
+    spin_unlock(&g_heap_lock);
+#else
+    (void)max_entries;
+    console_print("Allocation tracking disabled (build with MEMORY_TRACKING)\n");
+#endif
+}
+
+int memory_get_slab_stats(memory_slab_stats_t* stats, int max_classes) {
+    int count = 0;
+    
+    spin_lock(&g_heap_lock);
+    for (int i = 0; i < MEMORY_SLAB_CLASSES && count < max_classes; i++) {
+        stats[count++] = g_slab_caches[i].stats;
+    }
+    spin_unlock(&g_heap_lock);
+    
+    return count;
 }
 
-// Assembly function to enable paging
-extern void enable_paging(uint32_t page_directory_address);
+// Boundary-tag heap
+// Free blocks live in power-of-two size bins; a bitmap of non-empty bins
+// finds a candidate bin with one bit scan. Freed blocks are merged with
+// both physical neighbours immediately, so no two free blocks are ever
+// adjacent and fragmentation stays bounded under long-running churn.
+
+static inline heap_footer_t* heap_footer(heap_header_t* header) {
+    return (heap_footer_t*)((uint8_t*)header + (header->size & ~HEAP_FLAGS)
+                            - sizeof(heap_footer_t));
+}
+
+static inline heap_header_t* heap_next_block(heap_header_t* header) {
+    return (heap_header_t*)((uint8_t*)header + (header->size & ~HEAP_FLAGS));
+}
+
+static inline heap_header_t* heap_prev_block(heap_header_t* header) {
+    heap_footer_t* prev_footer = (heap_footer_t*)((uint8_t*)header - sizeof(heap_footer_t));
+    return (heap_header_t*)((uint8_t*)header - (prev_footer->size & ~HEAP_FLAGS));
+}
+
+static inline void heap_set_block(heap_header_t* header, uint32_t size, bool allocated) {
+    header->size = size | (allocated ? HEAP_ALLOCATED : 0);
+    header->magic = HEAP_BLOCK_MAGIC;
+    heap_footer(header)->size = header->size;
+}
+
+static inline int heap_bin_index(uint32_t size) {
+    // Bin i holds blocks of [2^(i+4), 2^(i+5)) bytes
+    int index = (31 - __builtin_clz(size)) - 4;
+    if (index < 0) {
+        return 0;
+    }
+    return (index >= HEAP_BIN_COUNT) ? HEAP_BIN_COUNT - 1 : index;
+}
+
+static void heap_bin_insert(heap_free_block_t* block) {
+    int index = heap_bin_index(block->header.size);
+    
+    block->prev = NULL;
+    block->next = g_memory_manager.bins[index];
+    if (block->next) {
+        block->next->prev = block;
+    }
+    g_memory_manager.bins[index] = block;
+    g_memory_manager.bin_map |= (1u << index);
+}
+
+static void heap_bin_remove(heap_free_block_t* block) {
+    int index = heap_bin_index(block->header.size & ~HEAP_FLAGS);
+    
+    if (block->prev) {
+        block->prev->next = block->next;
+    } else {
+        g_memory_manager.bins[index] = block->next;
+    }
+    
+    if (block->next) {
+        block->next->prev = block->prev;
+    }
+    
+    if (!g_memory_manager.bins[index]) {
+        g_memory_manager.bin_map &= ~(1u << index);
+    }
+}
+
+static void heap_add_region(uint32_t start, uint32_t end) {
+    start = (start + HEAP_ALIGNMENT - 1) & ~(HEAP_ALIGNMENT - 1);
+    end &= ~(HEAP_ALIGNMENT - 1);
+    
+    // Prologue (allocated, header + footer) and epilogue (allocated header)
+    // fence the region so coalescing never walks off either end
+    heap_header_t* prologue = (heap_header_t*)start;
+    heap_set_block(prologue, HEAP_PROLOGUE_SIZE, true);
+    
+    heap_header_t* epilogue = (heap_header_t*)(end - sizeof(heap_header_t));
+    epilogue->size = HEAP_ALLOCATED;
+    epilogue->magic = HEAP_BLOCK_MAGIC;
+    
+    heap_header_t* block = heap_next_block(prologue);
+    uint32_t size = (uint32_t)epilogue - (uint32_t)block;
+    heap_set_block(block, size, false);
+    heap_bin_insert((heap_free_block_t*)block);
+    
+    g_memory_manager.free_memory += size;
+}
+
+static bool heap_grow(uint32_t block_size) {
+    // Region must hold the block plus prologue and epilogue
+    uint32_t needed = block_size + HEAP_PROLOGUE_SIZE + sizeof(heap_header_t);
+    uint32_t min_order = page_order_for_size(needed);
+    uint32_t order = (min_order < HEAP_REGION_ORDER) ? HEAP_REGION_ORDER : min_order;
+    
+    if (((uint32_t)PAGE_SIZE << min_order) < needed) {
+        return false; // Larger than the biggest buddy block
+    }
+    
+    // Under memory pressure settle for the smallest region that fits
+    uint32_t region = page_alloc(order);
+    while (!region && order > min_order) {
+        region = page_alloc(--order);
+    }
+    
+    if (!region) {
+        return false;
+    }
+    
+    page_frame_of(region)->flags |= PAGE_FRAME_HEAP;
+    heap_add_region(region, region + ((uint32_t)PAGE_SIZE << order));
+    g_memory_manager.heap_regions++;
+    return true;
+}
+
+// Give a completely free region back to the page allocator
+static bool heap_release_region(heap_header_t* block) {
+    uint32_t region = (uint32_t)block - HEAP_PROLOGUE_SIZE;
+    if ((region & (PAGE_SIZE - 1)) != 0 || g_memory_manager.heap_regions <= 1) {
+        return false;
+    }
+    
+    page_frame_t* frame = page_frame_of(region);
+    heap_header_t* next = heap_next_block(block);
+    if (!frame || !(frame->flags & PAGE_FRAME_HEAP) || (next->size & ~HEAP_FLAGS) != 0) {
+        return false; // Block does not span a whole region
+    }
+    
+    g_memory_manager.free_memory -= block->size & ~HEAP_FLAGS;
+    g_memory_manager.heap_regions--;
+    page_free(region, frame->order);
+    return true;
+}
+
+static heap_free_block_t* heap_find_fit(uint32_t size) {
+    int index = heap_bin_index(size);
+    
+    // Blocks in the request's own bin may still be too small; check them first
+    for (heap_free_block_t* block = g_memory_manager.bins[index]; block; block = block->next) {
+        if (block->header.size >= size) {
+            return block;
+        }
+    }
+    
+    // Any block in a larger bin fits
+    uint32_t larger = (index + 1 < HEAP_BIN_COUNT) ? g_memory_manager.bin_map & ~((2u << index) - 1) : 0;
+    if (larger == 0) {
+        return NULL;
+    }
+    
+    return g_memory_manager.bins[__builtin_ctz(larger)];
+}
+
+// Mark block_size bytes of a free span allocated, returning the tail to the bins
+static void* heap_carve(heap_header_t* header, uint32_t span, uint32_t block_size) {
+    // Split off the tail if it can hold a free block of its own
+    uint32_t remaining = span - block_size;
+    if (remaining >= HEAP_MIN_BLOCK) {
+        heap_set_block(header, block_size, true);
+        heap_header_t* tail = heap_next_block(header);
+        heap_set_block(tail, remaining, false);
+        heap_bin_insert((heap_free_block_t*)tail);
+    } else {
+        block_size = span;
+        heap_set_block(header, block_size, true);
+    }
+    
+    // Update statistics
+    g_memory_manager.free_memory -= block_size;
+    g_memory_manager.used_memory += block_size;
+    
+    return (uint8_t*)header + sizeof(heap_header_t);
+}
+
+static void* heap_allocate(uint32_t size) {
+    // Payload plus tags, rounded to the heap alignment
+    uint32_t block_size = (size + HEAP_OVERHEAD + HEAP_ALIGNMENT - 1) & ~(HEAP_ALIGNMENT - 1);
+    if (block_size < HEAP_MIN_BLOCK) {
+        block_size = HEAP_MIN_BLOCK;
+    }
+    
+    heap_free_block_t* block = heap_find_fit(block_size);
+    if (!block) {
+        // Grow the heap with a new region from the page allocator
+        if (!heap_grow(block_size)) {
+            return NULL;
+        }
+        block = heap_find_fit(block_size);
+    }
+    
+    heap_bin_remove(block);
+    return heap_carve(&block->header, block->header.size, block_size);
+}
+
+static void* heap_allocate_aligned(uint32_t size, uint32_t alignment) {
+    uint32_t block_size = (size + HEAP_OVERHEAD + HEAP_ALIGNMENT - 1) & ~(HEAP_ALIGNMENT - 1);
+    if (block_size < HEAP_MIN_BLOCK) {
+        block_size = HEAP_MIN_BLOCK;
+    }
+    
+    // Search with enough slack to place an aligned payload and a leading
+    // free fragment; the slack itself is returned to the bins below
+    uint32_t search_size = block_size + alignment + HEAP_MIN_BLOCK;
+    heap_free_block_t* block = heap_find_fit(search_size);
+    if (!block) {
+        if (!heap_grow(search_size)) {
+            return NULL;
+        }
+        block = heap_find_fit(search_size);
+    }
+    
+    heap_bin_remove(block);
+    
+    uint32_t start = (uint32_t)block;
+    uint32_t total = block->header.size;
+    
+    // First aligned payload whose leading gap is empty or a valid free block
+    uint32_t payload = (start + sizeof(heap_header_t) + alignment - 1) & ~(alignment - 1);
+    uint32_t lead = payload - sizeof(heap_header_t) - start;
+    if (lead != 0 && lead < HEAP_MIN_BLOCK) {
+        payload = (start + sizeof(heap_header_t) + HEAP_MIN_BLOCK + alignment - 1) & ~(alignment - 1);
+        lead = payload - sizeof(heap_header_t) - start;
+    }
+    
+    if (lead != 0) {
+        heap_set_block((heap_header_t*)start, lead, false);
+        heap_bin_insert((heap_free_block_t*)start);
+    }
+    
+    return heap_carve((heap_header_t*)(start + lead), total - lead, block_size);
+}
+
+static void heap_free(void* ptr) {
+    heap_header_t* header = (heap_header_t*)((uint8_t*)ptr - sizeof(heap_header_t));
+    
+    // Reject pointers that are not the start of a live heap block
+    if (header->magic != HEAP_BLOCK_MAGIC || !(header->size & HEAP_ALLOCATED)) {
+        return;
+    }
+    
+    uint32_t size = header->size & ~HEAP_FLAGS;
+    g_memory_manager.free_memory += size;
+    g_memory_manager.used_memory -= size;
+    
+    // Merge with the following block
+    heap_header_t* next = heap_next_block(header);
+    if (!(next->size & HEAP_ALLOCATED)) {
+        heap_bin_remove((heap_free_block_t*)next);
+        size += next->size;
+    }
+    
+    // Merge with the preceding block
+    heap_footer_t* prev_footer = (heap_footer_t*)((uint8_t*)header - sizeof(heap_footer_t));
+    if (!(prev_footer->size & HEAP_ALLOCATED)) {
+        heap_header_t* prev = heap_prev_block(header);
+        heap_bin_remove((heap_free_block_t*)prev);
+        size += prev->size;
+        header = prev;
+    }
+    
+    heap_set_block(header, size, false);
+    if (heap_release_region(header)) {
+        return;
+    }
+    heap_bin_insert((heap_free_block_t*)header);
+}
+
+// Slab allocator
+// Size classes are powers of two from 16 bytes to 2KB. Each class owns
+// order-0 page frames from page_alloc, flagged PAGE_FRAME_SLAB; objects
+// are handed out from an embedded free list, so allocation and free never
+// walk the heap.
+
+static void slab_init(void) {
+    for (int i = 0; i < MEMORY_SLAB_CLASSES; i++) {
+        slab_cache_t* cache = &g_slab_caches[i];
+        cache->object_size = MEMORY_SLAB_MIN_SIZE << i;
+        cache->objects_per_slab = PAGE_SIZE / cache->object_size;
+        cache->partial = NULL;
+        memset(&cache->stats, 0, sizeof(memory_slab_stats_t));
+        cache->stats.object_size = cache->object_size;
+    }
+}
+
+static inline int slab_class_index(uint32_t size) {
+    if (size <= MEMORY_SLAB_MIN_SIZE) {
+        return 0;
+    }
+    
+    // Round up to the next power of two and rebase at 16 bytes
+    return (32 - __builtin_clz(size - 1)) - 4;
+}
+
+static void slab_unlink_partial(slab_cache_t* cache, page_frame_t* page) {
+    if (page->prev) {
+        page->prev->next = page->next;
+    } else {
+        cache->partial = page->next;
+    }
+    
+    if (page->next) {
+        page->next->prev = page->prev;
+    }
+    
+    page->next = NULL;
+    page->prev = NULL;
+}
+
+static void slab_push_partial(slab_cache_t* cache, page_frame_t* page) {
+    page->prev = NULL;
+    page->next = cache->partial;
+    if (cache->partial) {
+        cache->partial->prev = page;
+    }
+    cache->partial = page;
+}
+
+static page_frame_t* slab_grow(slab_cache_t* cache, int class_index) {
+    uint32_t address = page_alloc(0);
+    if (!address) {
+        return NULL;
+    }
+    
+    // Thread every object of the page onto its free list
+    uint8_t* base = (uint8_t*)address;
+    void* head = NULL;
+    for (int i = cache->objects_per_slab - 1; i >= 0; i--) {
+        void** object = (void**)(base + i * cache->object_size);
+        *object = head;
+        head = object;
+    }
+    
+    page_frame_t* page = page_frame_of(address);
+    page->flags |= PAGE_FRAME_SLAB;
+    page->free_objects = head;
+    page->in_use = 0;
+    page->slab_class = class_index;
+    slab_push_partial(cache, page);
+    
+    cache->stats.slabs++;
+    g_memory_manager.free_memory += PAGE_SIZE;
+    return page;
+}
+
+static void* slab_allocate(uint32_t size) {
+    int class_index = slab_class_index(size);
+    slab_cache_t* cache = &g_slab_caches[class_index];
+    
+    page_frame_t* page = cache->partial;
+    if (page) {
+        cache->stats.hits++;
+    } else {
+        cache->stats.misses++;
+        page = slab_grow(cache, class_index);
+        if (!page) {
+            return NULL; // Out of pages, caller falls back to the heap
+        }
+    }
+    
+    void** object = (void**)page->free_objects;
+    page->free_objects = *object;
+    page->in_use++;
+    
+    // Full pages leave the partial list until an object is freed
+    if (!page->free_objects) {
+        slab_unlink_partial(cache, page);
+    }
+    
+    cache->stats.objects_in_use++;
+    g_memory_manager.free_memory -= cache->object_size;
+    g_memory_manager.used_memory += cache->object_size;
+    
+    return object;
+}
+
+static void slab_free(page_frame_t* page, void* ptr) {
+    slab_cache_t* cache = &g_slab_caches[page->slab_class];
+    bool was_full = (page->free_objects == NULL);
+    
+    void** object = (void**)ptr;
+    *object = page->free_objects;
+    page->free_objects = object;
+    page->in_use--;
+    
+    cache->stats.objects_in_use--;
+    g_memory_manager.free_memory += cache->object_size;
+    g_memory_manager.used_memory -= cache->object_size;
+    
+    if (was_full) {
+        slab_push_partial(cache, page);
+    }
+    
+    // Return empty pages to the page allocator, but keep one per class to avoid thrashing
+    if (page->in_use == 0 && (page->prev || page->next)) {
+        slab_unlink_partial(cache, page);
+        page->flags &= ~PAGE_FRAME_SLAB;
+        page->free_objects = NULL;
+        cache->stats.slabs--;
+        g_memory_manager.free_memory -= PAGE_SIZE;
+        page_free(page_frame_address(page), 0);
+    }
+}
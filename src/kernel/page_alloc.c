@@ -0,0 +1,363 @@
+/*
+ * OmniOS 2.0 Physical Page Frame Allocator
+ * Binary buddy allocator (orders 0-10) built from the BIOS E820 map. A
+ * spinlock guards the free lists and frame reference counts; the heap
+ * takes it nested inside its own lock.
+ */
+
+#include "omnios.h"
+#include "kernel/page_alloc.h"
+#include "kernel/paging.h"
+#include "kernel/sync.h"
+
+#define PAGE_ALLOC_LOW_LIMIT    0x100000    // Conventional memory stays reserved
+#define PAGE_ALLOC_FALLBACK_END 0x4000000   // 64MB when no E820 map is available
+
+// Frame table and buddy free lists
+static page_frame_t* g_frames = NULL;
+static uint32_t g_frame_count = 0;
+static uint32_t g_usable_frames = 0;
+static uint32_t g_free_frames = 0;
+static page_frame_t* g_free_lists[PAGE_ORDER_COUNT];
+static uint32_t g_free_blocks[PAGE_ORDER_COUNT];
+static spinlock_t g_page_lock = SPINLOCK_INIT;
+
+static void free_list_push(page_frame_t* frame, uint32_t order) {
+    frame->flags = PAGE_FRAME_FREE;
+    frame->order = order;
+    frame->prev = NULL;
+    frame->next = g_free_lists[order];
+    if (frame->next) {
+        frame->next->prev = frame;
+    }
+    g_free_lists[order] = frame;
+    g_free_blocks[order]++;
+}
+
+static void free_list_remove(page_frame_t* frame, uint32_t order) {
+    if (frame->prev) {
+        frame->prev->next = frame->next;
+    } else {
+        g_free_lists[order] = frame->next;
+    }
+    
+    if (frame->next) {
+        frame->next->prev = frame->prev;
+    }
+    
+    frame->next = NULL;
+    frame->prev = NULL;
+    frame->flags &= ~PAGE_FRAME_FREE;
+    g_free_blocks[order]--;
+}
+
+// Mark frames overlapping [base, base + length) with the given reservation state
+static void mark_range(uint64_t base, uint64_t length, bool reserved) {
+    uint64_t start;
+    uint64_t end = base + length;
+    
+    if (reserved) {
+        // Reserve every frame the range touches
+        start = base & ~(uint64_t)(PAGE_SIZE - 1);
+        end = (end + PAGE_SIZE - 1) & ~(uint64_t)(PAGE_SIZE - 1);
+    } else {
+        // Only frames entirely inside the range are usable
+        start = (base + PAGE_SIZE - 1) & ~(uint64_t)(PAGE_SIZE - 1);
+        end &= ~(uint64_t)(PAGE_SIZE - 1);
+        if (start < PAGE_ALLOC_LOW_LIMIT) {
+            start = PAGE_ALLOC_LOW_LIMIT;
+        }
+    }
+    
+    uint64_t limit = (uint64_t)g_frame_count * PAGE_SIZE;
+    if (end > limit) {
+        end = limit;
+    }
+    
+    for (uint64_t address = start; address < end; address += PAGE_SIZE) {
+        page_frame_t* frame = &g_frames[address / PAGE_SIZE];
+        if (reserved) {
+            frame->flags |= PAGE_FRAME_RESERVED;
+        } else {
+            frame->flags &= ~PAGE_FRAME_RESERVED;
+        }
+    }
+}
+
+// Hand a run of available frames to the free lists as maximal aligned blocks
+static void release_run(uint32_t first, uint32_t end) {
+    uint32_t pfn = first;
+    
+    while (pfn < end) {
+        uint32_t order = PAGE_MAX_ORDER;
+        while (order > 0 && ((pfn & ((1u << order) - 1)) != 0 || pfn + (1u << order) > end)) {
+            order--;
+        }
+        
+        free_list_push(&g_frames[pfn], order);
+        g_free_frames += 1u << order;
+        pfn += 1u << order;
+    }
+}
+
+int page_alloc_init(const boot_memory_map_t* memory_map) {
+    static boot_memory_map_t fallback_map;
+    
+    // Without an E820 map fall back to the historical 64MB assumption
+    if (!memory_map || memory_map->count == 0) {
+        console_print("No E820 memory map, assuming 64MB\n");
+        memset(&fallback_map, 0, sizeof(fallback_map));
+        fallback_map.count = 1;
+        fallback_map.entries[0].base = PAGE_ALLOC_LOW_LIMIT;
+        fallback_map.entries[0].length = PAGE_ALLOC_FALLBACK_END - PAGE_ALLOC_LOW_LIMIT;
+        fallback_map.entries[0].type = E820_TYPE_USABLE;
+        memory_map = &fallback_map;
+    }
+    
+    uint32_t count = memory_map->count;
+    if (count > BOOT_E820_MAX_ENTRIES) {
+        count = BOOT_E820_MAX_ENTRIES;
+    }
+    
+    // Size the frame table by the highest usable address the kernel can
+    // reach through its identity map
+    uint64_t highest = 0;
+    for (uint32_t i = 0; i < count; i++) {
+        const e820_entry_t* entry = &memory_map->entries[i];
+        uint64_t end = entry->base + entry->length;
+        if (entry->type == E820_TYPE_USABLE && end > highest) {
+            highest = end;
+        }
+    }
+    
+    if (highest > KERNEL_IDENTITY_LIMIT) {
+        highest = KERNEL_IDENTITY_LIMIT;
+    }
+    
+    g_frame_count = (uint32_t)(highest / PAGE_SIZE);
+    uint32_t table_size = (g_frame_count * sizeof(page_frame_t) + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1);
+    
+    // Place the frame table at the start of the first usable region that holds it
+    uint32_t table_address = 0;
+    for (uint32_t i = 0; i < count && table_address == 0; i++) {
+        const e820_entry_t* entry = &memory_map->entries[i];
+        if (entry->type != E820_TYPE_USABLE) {
+            continue;
+        }
+        
+        uint64_t start = (entry->base + PAGE_SIZE - 1) & ~(uint64_t)(PAGE_SIZE - 1);
+        uint64_t end = entry->base + entry->length;
+        if (start < PAGE_ALLOC_LOW_LIMIT) {
+            start = PAGE_ALLOC_LOW_LIMIT;
+        }
+        
+        if (start + table_size <= end && start + table_size <= highest) {
+            table_address = (uint32_t)start;
+        }
+    }
+    
+    if (table_address == 0) {
+        console_print("No room for the page frame table\n");
+        return OMNIOS_ERROR_MEMORY;
+    }
+    
+    g_frames = (page_frame_t*)table_address;
+    memset(g_frames, 0, table_size);
+    memset(g_free_lists, 0, sizeof(g_free_lists));
+    memset(g_free_blocks, 0, sizeof(g_free_blocks));
+    g_free_frames = 0;
+    
+    // Everything starts reserved; usable ranges are opened up, then
+    // firmware ranges and the frame table itself are closed again
+    for (uint32_t i = 0; i < g_frame_count; i++) {
+        g_frames[i].flags = PAGE_FRAME_RESERVED;
+    }
+    
+    for (uint32_t i = 0; i < count; i++) {
+        const e820_entry_t* entry = &memory_map->entries[i];
+        if (entry->type == E820_TYPE_USABLE) {
+            mark_range(entry->base, entry->length, false);
+        }
+    }
+    
+    for (uint32_t i = 0; i < count; i++) {
+        const e820_entry_t* entry = &memory_map->entries[i];
+        if (entry->type != E820_TYPE_USABLE) {
+            mark_range(entry->base, entry->length, true);
+        }
+    }
+    
+    mark_range(table_address, table_size, true);
+    
+    // Feed every run of available frames to the buddy free lists
+    uint32_t pfn = 0;
+    while (pfn < g_frame_count) {
+        if (g_frames[pfn].flags & PAGE_FRAME_RESERVED) {
+            pfn++;
+            continue;
+        }
+        
+        uint32_t run_end = pfn;
+        while (run_end < g_frame_count && !(g_frames[run_end].flags & PAGE_FRAME_RESERVED)) {
+            run_end++;
+        }
+        
+        release_run(pfn, run_end);
+        pfn = run_end;
+    }
+    
+    g_usable_frames = g_free_frames;
+    console_print("Page allocator: %d free pages (%d KB frame table)\n",
+                  g_free_frames, table_size / 1024);
+    return OMNIOS_SUCCESS;
+}
+
+uint32_t page_alloc(uint32_t order) {
+    if (order > PAGE_MAX_ORDER) {
+        return 0;
+    }
+    
+    // Smallest non-empty order that can satisfy the request
+    spin_lock(&g_page_lock);
+    uint32_t current = order;
+    while (current <= PAGE_MAX_ORDER && !g_free_lists[current]) {
+        current++;
+    }
+    
+    if (current > PAGE_MAX_ORDER) {
+        spin_unlock(&g_page_lock);
+        return 0; // Out of physical memory
+    }
+    
+    page_frame_t* frame = g_free_lists[current];
+    free_list_remove(frame, current);
+    
+    // Split down, returning the upper halves to the free lists
+    uint32_t pfn = (uint32_t)(frame - g_frames);
+    while (current > order) {
+        current--;
+        free_list_push(&g_frames[pfn + (1u << current)], current);
+    }
+    
+    frame->flags = 0;
+    frame->order = order;
+    frame->refcount = 1;
+    g_free_frames -= 1u << order;
+    spin_unlock(&g_page_lock);
+    
+    return pfn * PAGE_SIZE;
+}
+
+void page_free(uint32_t address, uint32_t order) {
+    uint32_t pfn = address / PAGE_SIZE;
+    if (pfn >= g_frame_count || order > PAGE_MAX_ORDER) {
+        return;
+    }
+    
+    spin_lock(&g_page_lock);
+    page_frame_t* frame = &g_frames[pfn];
+    if (frame->flags & (PAGE_FRAME_FREE | PAGE_FRAME_RESERVED)) {
+        spin_unlock(&g_page_lock);
+        return; // Double free or firmware memory
+    }
+    
+    frame->flags = 0;
+    frame->refcount = 0;
+    g_free_frames += 1u << order;
+    
+    // Merge with the buddy for as long as it is a free block of the same order
+    while (order < PAGE_MAX_ORDER) {
+        uint32_t buddy_pfn = pfn ^ (1u << order);
+        if (buddy_pfn + (1u << order) > g_frame_count) {
+            break;
+        }
+        
+        page_frame_t* buddy = &g_frames[buddy_pfn];
+        if (!(buddy->flags & PAGE_FRAME_FREE) || buddy->order != order) {
+            break;
+        }
+        
+        free_list_remove(buddy, order);
+        pfn &= ~(1u << order);
+        order++;
+    }
+    
+    free_list_push(&g_frames[pfn], order);
+    spin_unlock(&g_page_lock);
+}
+
+// Reference counting for frames shared between address spaces
+void page_frame_get(uint32_t address) {
+    page_frame_t* frame = page_frame_of(address);
+    if (!frame) {
+        return;
+    }
+    
+    spin_lock(&g_page_lock);
+    if (frame->refcount < 0xFFFF) {
+        frame->refcount++;
+    }
+    spin_unlock(&g_page_lock);
+}
+
+void page_frame_put(uint32_t address) {
+    page_frame_t* frame = page_frame_of(address);
+    if (!frame) {
+        return;
+    }
+    
+    spin_lock(&g_page_lock);
+    bool last = frame->refcount > 0 && --frame->refcount == 0;
+    spin_unlock(&g_page_lock);
+    if (last) {
+        page_free(address & ~(PAGE_SIZE - 1), 0);
+    }
+}
+
+uint16_t page_frame_refcount(uint32_t address) {
+    page_frame_t* frame = page_frame_of(address);
+    return frame ? frame->refcount : 0;
+}
+
+page_frame_t* page_frame_of(uint32_t address) {
+    uint32_t pfn = address / PAGE_SIZE;
+    if (!g_frames || pfn >= g_frame_count) {
+        return NULL;
+    }
+    return &g_frames[pfn];
+}
+
+uint32_t page_frame_address(const page_frame_t* frame) {
+    return (uint32_t)(frame - g_frames) * PAGE_SIZE;
+}
+
+uint32_t page_order_for_size(uint32_t size) {
+    uint32_t order = 0;
+    while (order < PAGE_MAX_ORDER && ((uint32_t)PAGE_SIZE << order) < size) {
+        order++;
+    }
+    return order;
+}
+
+uint32_t page_alloc_get_free_frames(void) {
+    return g_free_frames;
+}
+
+uint32_t page_alloc_get_total_frames(void) {
+    return g_frame_count;
+}
+
+uint32_t page_alloc_get_usable_frames(void) {
+    return g_usable_frames;
+}
+
+void page_alloc_get_stats(page_alloc_stats_t* stats) {
+    spin_lock(&g_page_lock);
+    stats->total_frames = g_frame_count;
+    stats->usable_frames = g_usable_frames;
+    stats->free_frames = g_free_frames;
+    for (int i = 0; i < PAGE_ORDER_COUNT; i++) {
+        stats->free_blocks[i] = g_free_blocks[i];
+    }
+    spin_unlock(&g_page_lock);
+}
@@ -0,0 +1,758 @@
+/*
+ * OmniOS 2.0 Paging
+ * Kernel identity/higher-half mappings and the page mapping API
+ */
+
+#include "omnios.h"
+#include "kernel/memory.h"
+#include "kernel/page_alloc.h"
+#include "kernel/paging.h"
+#include "kernel/zram.h"
+
+#define CPUID_FEATURE_PSE       (1 << 3)
+#define CPUID_FEATURE_PGE       (1 << 13)
+#define CR4_PSE                 (1 << 4)
+#define CR4_PGE                 (1 << 7)
+#define EFLAGS_ID               (1 << 21)
+#define CR0_WP                  (1 << 16)
+
+#define PDE_INDEX(a)            ((uint32_t)(a) >> 22)
+#define PTE_INDEX(a)            (((uint32_t)(a) >> 12) & 0x3FF)
+#define ENTRY_ADDRESS(e)        ((e) & ~PAGE_FLAGS_MASK)
+
+// Page fault error code bits
+#define FAULT_PROTECTION        0x1     // 0 = not present, 1 = protection violation
+#define FAULT_WRITE             0x2
+#define FAULT_USER              0x4
+
+#define KERNEL_LAZY_PAGES       (KERNEL_LAZY_SIZE / PAGE_SIZE)
+
+// Swapped-out PTEs keep the compressed store slot in the frame field
+#define SWAP_SLOT(e)            ((e) >> 12)
+#define SWAP_ENTRY(slot)        ((slot) << 12)
+
+#define PAGING_MAX_SPACES       (MAX_PROCESSES + 1)
+#define PAGING_RECLAIM_BATCH    16      // Frames freed per fault-time reclaim
+
+static uint32_t* g_kernel_directory = NULL;
+static uint32_t* g_current_directory = NULL;
+static bool g_large_pages = false;
+static bool g_global_pages = false;
+
+// Demand-zero state
+static paging_fault_stats_t g_fault_stats;
+static uint32_t g_kernel_lazy_map[KERNEL_LAZY_PAGES / 32]; // Reserved pages of the lazy window
+
+// Address spaces swept by the reclaim clock; slot 0 is the kernel directory
+static uint32_t* g_address_spaces[PAGING_MAX_SPACES];
+static uint32_t g_reclaim_space = 0;
+static uint32_t g_reclaim_address = 0;
+
+// CPU helpers
+static inline bool cpu_has_cpuid(void) {
+    uint32_t before, after;
+    
+    // CPUID exists when the EFLAGS.ID bit can be toggled
+    __asm__ volatile("pushfl\n\t"
+                     "pushfl\n\t"
+                     "popl %0\n\t"
+                     "movl %0, %1\n\t"
+                     "xorl %2, %0\n\t"
+                     "pushl %0\n\t"
+                     "popfl\n\t"
+                     "pushfl\n\t"
+                     "popl %0\n\t"
+                     "popfl"
+                     : "=&r"(after), "=&r"(before)
+                     : "i"(EFLAGS_ID));
+    return ((after ^ before) & EFLAGS_ID) != 0;
+}
+
+static inline uint32_t cpu_features(void) {
+    uint32_t eax, ebx, ecx, edx;
+    __asm__ volatile("cpuid" : "=a"(eax), "=b"(ebx), "=c"(ecx), "=d"(edx) : "a"(1), "c"(0));
+    return edx;
+}
+
+static inline uint32_t cpu_read_cr4(void) {
+    uint32_t value;
+    __asm__ volatile("movl %%cr4, %0" : "=r"(value));
+    return value;
+}
+
+static inline void cpu_write_cr4(uint32_t value) {
+    __asm__ volatile("movl %0, %%cr4" : : "r"(value) : "memory");
+}
+
+static inline void cpu_load_cr3(uint32_t value) {
+    __asm__ volatile("movl %0, %%cr3" : : "r"(value) : "memory");
+}
+
+static inline void cpu_invlpg(uint32_t address) {
+    __asm__ volatile("invlpg (%0)" : : "r"(address) : "memory");
+}
+
+static inline uint32_t cpu_read_cr0(void) {
+    uint32_t value;
+    __asm__ volatile("movl %%cr0, %0" : "=r"(value));
+    return value;
+}
+
+static inline void cpu_write_cr0(uint32_t value) {
+    __asm__ volatile("movl %0, %%cr0" : : "r"(value) : "memory");
+}
+
+static inline uint64_t cpu_read_tsc(void) {
+    uint64_t value;
+    __asm__ volatile("rdtsc" : "=A"(value));
+    return value;
+}
+
+static inline uint32_t cpu_read_cr2(void) {
+    uint32_t value;
+    __asm__ volatile("movl %%cr2, %0" : "=r"(value));
+    return value;
+}
+
+static uint32_t* paging_alloc_table(void) {
+    uint32_t table = page_alloc(0);
+    if (!table) {
+        return NULL;
+    }
+    
+    memset((void*)table, 0, PAGE_SIZE);
+    return (uint32_t*)table;
+}
+
+// Order-0 frame for a fault, reclaiming cold pages when memory is short
+static uint32_t paging_alloc_frame(void) {
+    uint32_t frame = page_alloc(0);
+    if (!frame && memory_reclaim(PAGING_RECLAIM_BATCH) > 0) {
+        frame = page_alloc(0);
+    }
+    return frame;
+}
+
+static inline void paging_invalidate(uint32_t* directory, uint32_t virtual_address) {
+    if (directory == g_current_directory) {
+        cpu_invlpg(virtual_address);
+    }
+}
+
+static inline bool paging_is_kernel_pde(uint32_t index) {
+    return index < PDE_INDEX(USER_SPACE_BASE) || index >= PDE_INDEX(KERNEL_VIRTUAL_BASE);
+}
+
+// Find the PTE for an address, optionally creating its page table
+static uint32_t* paging_get_pte(uint32_t* directory, uint32_t virtual_address, bool create, uint32_t flags) {
+    uint32_t pde_index = PDE_INDEX(virtual_address);
+    uint32_t pde = directory[pde_index];
+    
+    if (pde & PAGE_LARGE) {
+        return NULL; // Covered by a 4MB page
+    }
+    
+    if (!(pde & PAGE_PRESENT)) {
+        // Kernel tables are shared, they can only be created in the kernel directory
+        if (!create || (paging_is_kernel_pde(pde_index) && directory != g_kernel_directory)) {
+            return NULL;
+        }
+        
+        uint32_t* table = paging_alloc_table();
+        if (!table) {
+            return NULL;
+        }
+        pde = (uint32_t)table | PAGE_PRESENT | PAGE_WRITABLE | (flags & PAGE_USER);
+        directory[pde_index] = pde;
+    } else if ((flags & PAGE_USER) && !(pde & PAGE_USER)) {
+        directory[pde_index] = pde | PAGE_USER;
+    }
+    
+    return &((uint32_t*)ENTRY_ADDRESS(pde))[PTE_INDEX(virtual_address)];
+}
+
+// Drop a PTE, releasing this address space's reference on an anonymous
+// frame or compressed slot
+static void paging_release_pte(uint32_t* pte) {
+    if ((*pte & (PAGE_PRESENT | PAGE_ANONYMOUS)) == (PAGE_PRESENT | PAGE_ANONYMOUS)) {
+        page_frame_put(ENTRY_ADDRESS(*pte));
+    } else if (*pte & PAGE_SWAPPED) {
+        zram_slot_put(SWAP_SLOT(*pte));
+    }
+    *pte = 0;
+}
+
+static void paging_register_space(uint32_t* directory) {
+    for (uint32_t i = 0; i < PAGING_MAX_SPACES; i++) {
+        if (!g_address_spaces[i]) {
+            g_address_spaces[i] = directory;
+            return;
+        }
+    }
+    // Registry full: the space works but is never swapped out
+}
+
+static void paging_unregister_space(uint32_t* directory) {
+    for (uint32_t i = 0; i < PAGING_MAX_SPACES; i++) {
+        if (g_address_spaces[i] == directory) {
+            g_address_spaces[i] = NULL;
+            return;
+        }
+    }
+}
+
+int init_paging(void) {
+    console_print("Setting up paging...\n");
+    
+    // Allocate page directory
+    g_kernel_directory = paging_alloc_table();
+    if (!g_kernel_directory) {
+        return OMNIOS_ERROR_MEMORY;
+    }
+    
+    // Use 4MB pages when the CPU supports PSE
+    if (cpu_has_cpuid()) {
+        uint32_t features = cpu_features();
+        g_large_pages = (features & CPUID_FEATURE_PSE) != 0;
+        g_global_pages = (features & CPUID_FEATURE_PGE) != 0;
+    }
+    
+    // Identity map all managed RAM (at least the first 4MB), rounded to 4MB
+    uint32_t identity_end = page_alloc_get_total_frames() * PAGE_SIZE;
+    identity_end = (identity_end + LARGE_PAGE_SIZE - 1) & ~(LARGE_PAGE_SIZE - 1);
+    if (identity_end < LARGE_PAGE_SIZE) {
+        identity_end = LARGE_PAGE_SIZE;
+    }
+    if (identity_end > KERNEL_IDENTITY_LIMIT) {
+        identity_end = KERNEL_IDENTITY_LIMIT;
+    }
+    
+    // The higher-half alias stops below the kernel lazy window
+    uint32_t alias_end = identity_end;
+    if (alias_end > KERNEL_LAZY_BASE - KERNEL_VIRTUAL_BASE) {
+        alias_end = KERNEL_LAZY_BASE - KERNEL_VIRTUAL_BASE;
+    }
+    
+    uint32_t kernel_flags = PAGE_PRESENT | PAGE_WRITABLE | (g_global_pages ? PAGE_GLOBAL : 0);
+    
+    for (uint32_t physical = 0; physical < identity_end; physical += LARGE_PAGE_SIZE) {
+        uint32_t pde;
+        
+        if (g_large_pages) {
+            pde = physical | kernel_flags | PAGE_LARGE;
+        } else {
+            // Fall back to a 4KB page table per 4MB
+            uint32_t* table = paging_alloc_table();
+            if (!table) {
+                return OMNIOS_ERROR_MEMORY;
+            }
+            
+            for (int j = 0; j < PAGE_ENTRIES; j++) {
+                table[j] = (physical + j * PAGE_SIZE) | kernel_flags;
+            }
+            pde = (uint32_t)table | PAGE_PRESENT | PAGE_WRITABLE;
+        }
+        
+        // Same mapping at the identity address and in the higher half
+        g_kernel_directory[PDE_INDEX(physical)] = pde;
+        if (physical < alias_end) {
+            g_kernel_directory[PDE_INDEX(PHYS_TO_HIGHER_HALF(physical))] = pde;
+        }
+    }
+    
+    // Page tables for the lazy window exist up front so every address
+    // space shares them; the pages themselves are backed on first touch
+    for (uint32_t address = KERNEL_LAZY_BASE; address < KERNEL_LAZY_BASE + KERNEL_LAZY_SIZE;
+         address += LARGE_PAGE_SIZE) {
+        if (!paging_get_pte(g_kernel_directory, address, true, 0)) {
+            return OMNIOS_ERROR_MEMORY;
+        }
+    }
+    memset(g_kernel_lazy_map, 0, sizeof(g_kernel_lazy_map));
+    memset(&g_fault_stats, 0, sizeof(g_fault_stats));
+    memset(g_address_spaces, 0, sizeof(g_address_spaces));
+    paging_register_space(g_kernel_directory);
+    
+    if (g_large_pages) {
+        cpu_write_cr4(cpu_read_cr4() | CR4_PSE);
+    }
+    
+    // Enable paging
+    enable_paging((uint32_t)g_kernel_directory);
+    g_current_directory = g_kernel_directory;
+    
+    if (g_global_pages) {
+        cpu_write_cr4(cpu_read_cr4() | CR4_PGE);
+    }
+    
+    // Kernel writes must honour read-only PTEs for copy-on-write to work
+    cpu_write_cr0(cpu_read_cr0() | CR0_WP);
+    
+    console_print("Paging enabled: %d MB mapped with %s pages\n",
+                  identity_end / (1024 * 1024), g_large_pages ? "4MB" : "4KB");
+    return OMNIOS_SUCCESS;
+}
+
+bool paging_large_pages_enabled(void) {
+    return g_large_pages;
+}
+
+uint32_t* paging_kernel_directory(void) {
+    return g_kernel_directory;
+}
+
+uint32_t* paging_current_directory(void) {
+    return g_current_directory;
+}
+
+uint32_t* paging_create_address_space(void) {
+    uint32_t* directory = paging_alloc_table();
+    if (!directory) {
+        return NULL;
+    }
+    
+    // Kernel page tables are built once at boot, so sharing the PDEs keeps
+    // every address space in sync with the kernel mappings
+    for (uint32_t i = 0; i < PAGE_ENTRIES; i++) {
+        if (paging_is_kernel_pde(i)) {
+            directory[i] = g_kernel_directory[i];
+        }
+    }
+    
+    paging_register_space(directory);
+    return directory;
+}
+
+void paging_destroy_address_space(uint32_t* directory) {
+    if (!directory || directory == g_kernel_directory) {
+        return;
+    }
+    
+    // Free user page tables and the anonymous frames mapped through them;
+    // other frames belong to whoever mapped them
+    for (uint32_t i = PDE_INDEX(USER_SPACE_BASE); i < PDE_INDEX(USER_SPACE_END); i++) {
+        uint32_t pde = directory[i];
+        if ((pde & PAGE_PRESENT) && !(pde & PAGE_LARGE)) {
+            uint32_t* table = (uint32_t*)ENTRY_ADDRESS(pde);
+            for (int j = 0; j < PAGE_ENTRIES; j++) {
+                paging_release_pte(&table[j]);
+            }
+            page_free(ENTRY_ADDRESS(pde), 0);
+        }
+    }
+    
+    if (directory == g_current_directory) {
+        paging_switch_address_space(g_kernel_directory);
+    }
+    paging_unregister_space(directory);
+    page_free((uint32_t)directory, 0);
+}
+
+uint32_t* paging_clone_address_space(uint32_t* source) {
+    uint32_t* directory = paging_create_address_space();
+    if (!directory) {
+        return NULL;
+    }
+    
+    for (uint32_t i = PDE_INDEX(USER_SPACE_BASE); i < PDE_INDEX(USER_SPACE_END); i++) {
+        uint32_t pde = source[i];
+        if (!(pde & PAGE_PRESENT)) {
+            continue;
+        }
+        
+        // 4MB user mappings are never anonymous, share them as they are
+        if (pde & PAGE_LARGE) {
+            directory[i] = pde;
+            continue;
+        }
+        
+        uint32_t* table = paging_alloc_table();
+        if (!table) {
+            paging_destroy_address_space(directory);
+            return NULL;
+        }
+        
+        uint32_t* source_table = (uint32_t*)ENTRY_ADDRESS(pde);
+        for (int j = 0; j < PAGE_ENTRIES; j++) {
+            uint32_t pte = source_table[j];
+            
+            if ((pte & (PAGE_PRESENT | PAGE_ANONYMOUS)) == (PAGE_PRESENT | PAGE_ANONYMOUS)) {
+                // Share the frame read-only in both spaces; the first write copies it
+                if (pte & (PAGE_WRITABLE | PAGE_COW)) {
+                    pte = (pte & ~PAGE_WRITABLE) | PAGE_COW;
+                    source_table[j] = pte;
+                }
+                page_frame_get(ENTRY_ADDRESS(pte));
+            } else if (pte & PAGE_SWAPPED) {
+                zram_slot_get(SWAP_SLOT(pte)); // Both spaces page the slot back in on their own
+            }
+            
+            // Untouched demand-zero pages and foreign mappings copy verbatim
+            table[j] = pte;
+        }
+        
+        directory[i] = (uint32_t)table | (pde & PAGE_FLAGS_MASK);
+    }
+    
+    // The source lost write access to its anonymous pages
+    if (source == g_current_directory) {
+        cpu_load_cr3((uint32_t)source);
+    }
+    
+    return directory;
+}
+
+void paging_switch_address_space(uint32_t* directory) {
+    if (directory == g_current_directory) {
+        return;
+    }
+    
+    g_current_directory = directory;
+    cpu_load_cr3((uint32_t)directory);
+}
+
+int paging_map(uint32_t* directory, uint32_t virtual_address, uint32_t physical_address, uint32_t flags) {
+    uint32_t* pte = paging_get_pte(directory, virtual_address, true, flags);
+    if (!pte) {
+        return OMNIOS_ERROR_MEMORY;
+    }
+    
+    *pte = ENTRY_ADDRESS(physical_address) | (flags & PAGE_FLAGS_MASK & ~PAGE_LARGE) | PAGE_PRESENT;
+    paging_invalidate(directory, virtual_address);
+    return OMNIOS_SUCCESS;
+}
+
+int paging_map_lazy(uint32_t* directory, uint32_t virtual_address, uint32_t size, uint32_t flags) {
+    uint32_t start = virtual_address & ~(PAGE_SIZE - 1);
+    uint32_t end = (virtual_address + size + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1);
+    
+    for (uint32_t address = start; address < end; address += PAGE_SIZE) {
+        uint32_t* pte = paging_get_pte(directory, address, true, flags);
+        if (!pte) {
+            return OMNIOS_ERROR_MEMORY;
+        }
+        
+        if (*pte & (PAGE_PRESENT | PAGE_SWAPPED)) {
+            return OMNIOS_ERROR_GENERIC; // Already backed
+        }
+        
+        // Not present: the flags wait in the PTE until the first touch
+        *pte = (flags & PAGE_FLAGS_MASK & ~(PAGE_PRESENT | PAGE_LARGE)) | PAGE_ANONYMOUS;
+    }
+    
+    return OMNIOS_SUCCESS;
+}
+
+int paging_map_large(uint32_t* directory, uint32_t virtual_address, uint32_t physical_address, uint32_t flags) {
+    if (!g_large_pages) {
+        return OMNIOS_ERROR_GENERIC;
+    }
+    
+    if ((virtual_address | physical_address) & (LARGE_PAGE_SIZE - 1)) {
+        return OMNIOS_ERROR_GENERIC; // Both addresses must be 4MB aligned
+    }
+    
+    uint32_t pde_index = PDE_INDEX(virtual_address);
+    if (directory[pde_index] & PAGE_PRESENT) {
+        return OMNIOS_ERROR_GENERIC; // Already mapped
+    }
+    
+    directory[pde_index] = physical_address | (flags & PAGE_FLAGS_MASK) | PAGE_LARGE | PAGE_PRESENT;
+    paging_invalidate(directory, virtual_address);
+    return OMNIOS_SUCCESS;
+}
+
+int paging_unmap(uint32_t* directory, uint32_t virtual_address) {
+    uint32_t pde_index = PDE_INDEX(virtual_address);
+    uint32_t pde = directory[pde_index];
+    
+    if (!(pde & PAGE_PRESENT)) {
+        return OMNIOS_ERROR_NOT_FOUND;
+    }
+    
+    if (pde & PAGE_LARGE) {
+        directory[pde_index] = 0;
+        paging_invalidate(directory, virtual_address & ~(LARGE_PAGE_SIZE - 1));
+        return OMNIOS_SUCCESS;
+    }
+    
+    uint32_t* pte = &((uint32_t*)ENTRY_ADDRESS(pde))[PTE_INDEX(virtual_address)];
+    if (!(*pte & (PAGE_PRESENT | PAGE_ANONYMOUS))) {
+        return OMNIOS_ERROR_NOT_FOUND;
+    }
+    
+    paging_release_pte(pte);
+    paging_invalidate(directory, virtual_address);
+    return OMNIOS_SUCCESS;
+}
+
+uint32_t paging_translate(uint32_t* directory, uint32_t virtual_address) {
+    uint32_t pde = directory[PDE_INDEX(virtual_address)];
+    
+    if (!(pde & PAGE_PRESENT)) {
+        return 0;
+    }
+    
+    if (pde & PAGE_LARGE) {
+        return ENTRY_ADDRESS(pde) + (virtual_address & (LARGE_PAGE_SIZE - 1));
+    }
+    
+    uint32_t pte = ((uint32_t*)ENTRY_ADDRESS(pde))[PTE_INDEX(virtual_address)];
+    if (!(pte & PAGE_PRESENT)) {
+        return 0;
+    }
+    
+    return ENTRY_ADDRESS(pte) + (virtual_address & (PAGE_SIZE - 1));
+}
+
+// Demand-zero paging
+
+uint32_t paging_kernel_reserve(uint32_t size) {
+    uint32_t pages = (size + PAGE_SIZE - 1) / PAGE_SIZE;
+    uint32_t run = 0;
+    
+    if (pages == 0 || pages > KERNEL_LAZY_PAGES) {
+        return 0;
+    }
+    
+    // First fit over the window's page bitmap
+    for (uint32_t i = 0; i < KERNEL_LAZY_PAGES; i++) {
+        if (g_kernel_lazy_map[i / 32] & (1u << (i % 32))) {
+            run = 0;
+            continue;
+        }
+        
+        if (++run == pages) {
+            uint32_t first = i + 1 - pages;
+            uint32_t address = KERNEL_LAZY_BASE + first * PAGE_SIZE;
+            
+            if (paging_map_lazy(g_kernel_directory, address, size, PAGE_WRITABLE) != OMNIOS_SUCCESS) {
+                return 0;
+            }
+            
+            for (uint32_t j = first; j <= i; j++) {
+                g_kernel_lazy_map[j / 32] |= 1u << (j % 32);
+            }
+            return address;
+        }
+    }
+    
+    return 0;
+}
+
+void paging_kernel_release(uint32_t address, uint32_t size) {
+    if (address < KERNEL_LAZY_BASE || address >= KERNEL_LAZY_BASE + KERNEL_LAZY_SIZE) {
+        return;
+    }
+    
+    uint32_t first = (address - KERNEL_LAZY_BASE) / PAGE_SIZE;
+    uint32_t pages = (size + PAGE_SIZE - 1) / PAGE_SIZE;
+    
+    for (uint32_t i = first; i < first + pages && i < KERNEL_LAZY_PAGES; i++) {
+        paging_unmap(g_kernel_directory, KERNEL_LAZY_BASE + i * PAGE_SIZE);
+        g_kernel_lazy_map[i / 32] &= ~(1u << (i % 32));
+    }
+}
+
+int paging_handle_fault(uint32_t fault_address, uint32_t error_code) {
+    g_fault_stats.page_faults++;
+    
+    uint32_t* directory = g_current_directory;
+    uint32_t* pte = paging_get_pte(directory, fault_address, false, 0);
+    
+    // Swapped out: decompress the page back from the compressed store
+    if (pte && !(error_code & FAULT_PROTECTION) && (*pte & PAGE_SWAPPED)) {
+        if ((error_code & FAULT_USER) && !(*pte & PAGE_USER)) {
+            g_fault_stats.unresolved_faults++;
+            return OMNIOS_ERROR_PERMISSION;
+        }
+        
+        uint64_t start = cpu_read_tsc();
+        uint32_t frame = paging_alloc_frame();
+        if (!frame) {
+            g_fault_stats.unresolved_faults++;
+            return OMNIOS_ERROR_MEMORY;
+        }
+        
+        if (zram_load(SWAP_SLOT(*pte), frame) != OMNIOS_SUCCESS) {
+            page_free(frame, 0);
+            g_fault_stats.unresolved_faults++;
+            return OMNIOS_ERROR_IO;
+        }
+        
+        *pte = frame | (*pte & PAGE_FLAGS_MASK & ~PAGE_SWAPPED) | PAGE_PRESENT;
+        cpu_invlpg(fault_address);
+        
+        uint32_t cycles = (uint32_t)(cpu_read_tsc() - start);
+        g_fault_stats.swap_in_faults++;
+        g_fault_stats.swap_in_cycles += cycles;
+        if (cycles > g_fault_stats.swap_in_max_cycles) {
+            g_fault_stats.swap_in_max_cycles = cycles;
+        }
+        return OMNIOS_SUCCESS;
+    }
+    
+    // Demand-zero: first touch of an anonymous page that has no frame yet
+    if (pte && !(error_code & FAULT_PROTECTION) && (*pte & PAGE_ANONYMOUS) && !(*pte & PAGE_PRESENT)) {
+        if ((error_code & FAULT_USER) && !(*pte & PAGE_USER)) {
+            g_fault_stats.unresolved_faults++;
+            return OMNIOS_ERROR_PERMISSION;
+        }
+        
+        uint32_t frame = paging_alloc_frame();
+        if (!frame) {
+            g_fault_stats.unresolved_faults++;
+            return OMNIOS_ERROR_MEMORY;
+        }
+        
+        memset((void*)frame, 0, PAGE_SIZE);
+        *pte = frame | (*pte & PAGE_FLAGS_MASK) | PAGE_PRESENT;
+        cpu_invlpg(fault_address);
+        
+        g_fault_stats.demand_zero_faults++;
+        return OMNIOS_SUCCESS;
+    }
+    
+    // Copy-on-write: write to a shared anonymous page
+    if (pte && (error_code & FAULT_PROTECTION) && (error_code & FAULT_WRITE) &&
+        (*pte & (PAGE_PRESENT | PAGE_COW)) == (PAGE_PRESENT | PAGE_COW)) {
+        uint32_t old_frame = ENTRY_ADDRESS(*pte);
+        uint32_t flags = (*pte & PAGE_FLAGS_MASK & ~PAGE_COW) | PAGE_WRITABLE;
+        
+        if (page_frame_refcount(old_frame) == 1) {
+            // Last sharer keeps the frame
+            *pte = old_frame | flags;
+        } else {
+            uint32_t frame = paging_alloc_frame();
+            if (!frame) {
+                g_fault_stats.unresolved_faults++;
+                return OMNIOS_ERROR_MEMORY;
+            }
+            
+            memcpy((void*)frame, (void*)old_frame, PAGE_SIZE);
+            *pte = frame | flags;
+            page_frame_put(old_frame);
+        }
+        
+        cpu_invlpg(fault_address);
+        g_fault_stats.cow_faults++;
+        return OMNIOS_SUCCESS;
+    }
+    
+    g_fault_stats.unresolved_faults++;
+    return OMNIOS_ERROR_GENERIC;
+}
+
+// Body of a vector 14 handler, given the CPU error code. No IDT is
+// installed yet, so nothing routes page faults here and callers must not
+// touch demand-zero pages until a gate for it exists.
+void paging_page_fault_handler(uint32_t error_code) {
+    uint32_t fault_address = cpu_read_cr2();
+    
+    if (paging_handle_fault(fault_address, error_code) != OMNIOS_SUCCESS) {
+        console_print("Page fault at 0x%x (error 0x%x)\n", fault_address, error_code);
+        kernel_panic("Unhandled page fault");
+    }
+}
+
+void paging_get_fault_stats(paging_fault_stats_t* stats) {
+    *stats = g_fault_stats;
+}
+
+// Compressed swap
+
+// Clock step for one PTE: recently used pages get a second chance, cold
+// private anonymous pages move to the compressed store
+static bool paging_reclaim_pte(uint32_t* directory, uint32_t virtual_address, uint32_t* pte) {
+    uint32_t entry = *pte;
+    
+    if ((entry & (PAGE_PRESENT | PAGE_ANONYMOUS)) != (PAGE_PRESENT | PAGE_ANONYMOUS) || (entry & PAGE_COW)) {
+        return false;
+    }
+    
+    uint32_t frame = ENTRY_ADDRESS(entry);
+    if (page_frame_refcount(frame) != 1) {
+        return false; // Shared frames stay resident
+    }
+    
+    bool kernel = directory == g_kernel_directory;
+    if (entry & PAGE_ACCESSED) {
+        *pte = entry & ~PAGE_ACCESSED;
+        if (kernel) {
+            cpu_invlpg(virtual_address);
+        } else {
+            paging_invalidate(directory, virtual_address);
+        }
+        return false;
+    }
+    
+    uint32_t slot = zram_store(frame);
+    if (!slot) {
+        return false;
+    }
+    
+    *pte = SWAP_ENTRY(slot) | (entry & PAGE_FLAGS_MASK & ~(PAGE_PRESENT | PAGE_ACCESSED | PAGE_DIRTY)) | PAGE_SWAPPED;
+    if (kernel) {
+        cpu_invlpg(virtual_address); // The lazy window is shared by every directory
+    } else {
+        paging_invalidate(directory, virtual_address);
+    }
+    
+    page_frame_put(frame);
+    g_fault_stats.pages_swapped_out++;
+    return true;
+}
+
+// Continue the clock hand through one address space
+static uint32_t paging_reclaim_space(uint32_t* directory, uint32_t wanted) {
+    bool kernel = directory == g_kernel_directory;
+    uint32_t start = kernel ? KERNEL_LAZY_BASE : USER_SPACE_BASE;
+    uint32_t end = kernel ? KERNEL_LAZY_BASE + KERNEL_LAZY_SIZE : USER_SPACE_END;
+    uint32_t address = (g_reclaim_address >= start && g_reclaim_address < end) ? g_reclaim_address : start;
+    uint32_t reclaimed = 0;
+    
+    while (address < end && reclaimed < wanted) {
+        uint32_t pde = directory[PDE_INDEX(address)];
+        if (!(pde & PAGE_PRESENT) || (pde & PAGE_LARGE)) {
+            address = (address & ~(LARGE_PAGE_SIZE - 1)) + LARGE_PAGE_SIZE;
+            continue;
+        }
+        
+        uint32_t* table = (uint32_t*)ENTRY_ADDRESS(pde);
+        if (paging_reclaim_pte(directory, address, &table[PTE_INDEX(address)])) {
+            reclaimed++;
+        }
+        address += PAGE_SIZE;
+    }
+    
+    g_reclaim_address = address;
+    return reclaimed;
+}
+
+uint32_t paging_reclaim(uint32_t pages) {
+    uint32_t reclaimed = 0;
+    
+    if (!zram_enabled()) {
+        return 0;
+    }
+    
+    // Each space is visited at most twice: once to clear accessed bits,
+    // once to take the pages that stayed cold
+    for (uint32_t visit = 0; visit < 2 * PAGING_MAX_SPACES && reclaimed < pages; visit++) {
+        uint32_t* directory = g_address_spaces[g_reclaim_space];
+        if (directory) {
+            reclaimed += paging_reclaim_space(directory, pages - reclaimed);
+            if (reclaimed >= pages) {
+                break; // Resume here next time
+            }
+        }
+        
+        g_reclaim_space = (g_reclaim_space + 1) % PAGING_MAX_SPACES;
+        g_reclaim_address = 0;
+    }
+    
+    return reclaimed;
+}
+
+// Assembly function to enable paging
+extern void enable_paging(uint32_t page_directory_address);
@@ -0,0 +1,180 @@
+/*
+ * OmniOS 2.0 Compressed RAM Swap
+ * Slot table of LZ-compressed pages kept on the kernel heap
+ */
+
+#include "omnios.h"
+#include "kernel/memory.h"
+#include "kernel/lz.h"
+#include "kernel/zram.h"
+
+// Slot table entry; slot 0 is never handed out so it can mean "none"
+typedef struct {
+    union {
+        uint8_t* data;        // Compressed page
+        uint32_t fill;        // Same-filled page: the repeated word
+        uint32_t next_free;   // Free slot list link
+    };
+    uint16_t length;          // Compressed length, 0 for same-filled pages
+    uint16_t refcount;        // PTEs naming the slot, 0 when free
+} zram_slot_t;
+
+static zram_slot_t* g_slots = NULL;
+static uint32_t g_slot_count = 0;
+static uint32_t g_free_slot = 0;
+static zram_stats_t g_zram_stats;
+
+// Compression scratch, the kernel compresses one page at a time
+static lz_workspace_t g_workspace;
+static uint8_t g_buffer[LZ_COMPRESS_BOUND(PAGE_SIZE)];
+
+int zram_init(uint32_t max_pages) {
+    if (max_pages == 0) {
+        return OMNIOS_ERROR_GENERIC;
+    }
+    
+    if (max_pages > ZRAM_MAX_SLOTS - 1) {
+        max_pages = ZRAM_MAX_SLOTS - 1;
+    }
+    
+    g_slot_count = max_pages + 1;
+    g_slots = (zram_slot_t*)memory_allocate(g_slot_count * sizeof(zram_slot_t));
+    if (!g_slots) {
+        g_slot_count = 0;
+        return OMNIOS_ERROR_MEMORY;
+    }
+    
+    // Thread every slot but 0 onto the free list
+    memset(g_slots, 0, g_slot_count * sizeof(zram_slot_t));
+    for (uint32_t i = 1; i < g_slot_count; i++) {
+        g_slots[i].next_free = (i + 1 < g_slot_count) ? i + 1 : 0;
+    }
+    g_free_slot = 1;
+    
+    memset(&g_zram_stats, 0, sizeof(g_zram_stats));
+    g_zram_stats.capacity = max_pages;
+    
+    console_print("Compressed swap: %d KB of pages\n", max_pages * (PAGE_SIZE / 1024));
+    return OMNIOS_SUCCESS;
+}
+
+bool zram_enabled(void) {
+    return g_slots != NULL;
+}
+
+// Returns true and the word when the whole page repeats one 32-bit value
+static bool zram_same_filled(const uint32_t* words, uint32_t* fill) {
+    for (uint32_t i = 1; i < PAGE_SIZE / sizeof(uint32_t); i++) {
+        if (words[i] != words[0]) {
+            return false;
+        }
+    }
+    
+    *fill = words[0];
+    return true;
+}
+
+static void zram_release(uint32_t slot) {
+    zram_slot_t* entry = &g_slots[slot];
+    
+    if (entry->length > 0) {
+        memory_free(entry->data);
+        g_zram_stats.compressed_bytes -= entry->length;
+    } else {
+        g_zram_stats.same_filled_pages--;
+    }
+    
+    entry->length = 0;
+    entry->refcount = 0;
+    entry->next_free = g_free_slot;
+    g_free_slot = slot;
+    g_zram_stats.stored_pages--;
+}
+
+uint32_t zram_store(uint32_t page) {
+    if (!g_slots || g_free_slot == 0) {
+        g_zram_stats.rejected_pages++;
+        return 0;
+    }
+    
+    uint32_t fill = 0;
+    uint8_t* data = NULL;
+    uint32_t length = 0;
+    
+    if (!zram_same_filled((const uint32_t*)page, &fill)) {
+        length = lz_compress((const uint8_t*)page, PAGE_SIZE, g_buffer, ZRAM_MAX_STORED_SIZE, &g_workspace);
+        if (length == 0) {
+            g_zram_stats.rejected_pages++;
+            return 0; // Not worth storing
+        }
+        
+        data = (uint8_t*)memory_allocate(length);
+        if (!data) {
+            g_zram_stats.rejected_pages++;
+            return 0;
+        }
+        memcpy(data, g_buffer, length);
+    }
+    
+    uint32_t slot = g_free_slot;
+    zram_slot_t* entry = &g_slots[slot];
+    g_free_slot = entry->next_free;
+    
+    if (data) {
+        entry->data = data;
+        g_zram_stats.compressed_bytes += length;
+    } else {
+        entry->fill = fill;
+        g_zram_stats.same_filled_pages++;
+    }
+    entry->length = (uint16_t)length;
+    entry->refcount = 1;
+    
+    g_zram_stats.stored_pages++;
+    g_zram_stats.page_outs++;
+    return slot;
+}
+
+int zram_load(uint32_t slot, uint32_t page) {
+    if (slot == 0 || slot >= g_slot_count || g_slots[slot].refcount == 0) {
+        return OMNIOS_ERROR_NOT_FOUND;
+    }
+    
+    zram_slot_t* entry = &g_slots[slot];
+    if (entry->length == 0) {
+        uint32_t* words = (uint32_t*)page;
+        for (uint32_t i = 0; i < PAGE_SIZE / sizeof(uint32_t); i++) {
+            words[i] = entry->fill;
+        }
+    } else if (lz_decompress(entry->data, entry->length, (uint8_t*)page, PAGE_SIZE) != PAGE_SIZE) {
+        return OMNIOS_ERROR_IO;
+    }
+    
+    g_zram_stats.page_ins++;
+    zram_slot_put(slot);
+    return OMNIOS_SUCCESS;
+}
+
+void zram_slot_get(uint32_t slot) {
+    if (slot > 0 && slot < g_slot_count && g_slots[slot].refcount > 0) {
+        g_slots[slot].refcount++;
+    }
+}
+
+void zram_slot_put(uint32_t slot) {
+    if (slot == 0 || slot >= g_slot_count || g_slots[slot].refcount == 0) {
+        return;
+    }
+    
+    if (--g_slots[slot].refcount == 0) {
+        zram_release(slot);
+    }
+}
+
+void zram_get_stats(zram_stats_t* stats) {
+    *stats = g_zram_stats;
+    
+    uint32_t data_pages = g_zram_stats.stored_pages - g_zram_stats.same_filled_pages;
+    stats->compression_ratio = g_zram_stats.compressed_bytes ?
+        (uint32_t)((uint64_t)data_pages * PAGE_SIZE * 100 / g_zram_stats.compressed_bytes) : 0;
+}
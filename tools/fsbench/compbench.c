@@ -0,0 +1,445 @@
+/*
+ * OmniOS 2.0 Compressed File Benchmark
+ * Writes the same data as a plain and as a compressed file and times
+ * write-back, sequential reads and random reads of each from a cold
+ * buffer cache on a RAM disk. Reports the compression ratio and the
+ * blocks read from the device alongside the throughput. A short check
+ * first makes sure holes in compressed files read back as zeros.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <getopt.h>
+
+#include "omnios.h"
+#include "fs/bcache.h"
+#include "fs/omnifs_extent.h"
+#include "fs/omnifs_compress.h"
+
+#define DEFAULT_SIZE_MB         16
+#define DEFAULT_READS           4000
+#define DEFAULT_BUFFERS         BCACHE_DEFAULT_BUFFERS
+#define WRITE_CHUNK             65536
+#define SEQUENTIAL_CHUNK        65536
+#define RANDOM_CHUNK            HOST_FS_BLOCK_SIZE
+#define FLUSH_BATCH             64      // Delayed buffers written back at once
+#define FILE_OWNER              2       // Inode number of the compressed file
+#define HOLE_OWNER              3       // Second compressed file of the hole check
+
+// Plain file data, from host_fs.c
+extern int omnifs_read_inode_data(omnifs_inode_t* inode, void* buffer, uint32_t size, uint32_t offset);
+extern int omnifs_write_inode_data(omnifs_inode_t* inode, const void* buffer, uint32_t size, uint32_t offset);
+
+typedef struct {
+    uint32_t size;
+    uint32_t reads;
+    uint32_t buffers;
+} options_t;
+
+typedef struct {
+    uint32_t blocks;              // Data blocks the file takes
+    double write_mbs;             // Including compression and write-back
+    double sequential_mbs;
+    double random_mbs;
+    uint64_t sequential_reads;    // Blocks read from the device
+    uint64_t random_reads;
+} result_t;
+
+typedef void (*generator_t)(uint8_t* data, uint32_t size);
+
+static uint32_t g_seed = 1;
+
+static uint32_t next_random(void) {
+    g_seed = g_seed * 1103515245 + 12345;
+    return g_seed >> 8;
+}
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static double mb_per_second(uint64_t bytes, uint64_t ns) {
+    return ns ? (double)bytes / (1024.0 * 1024.0) / ((double)ns / 1e9) : 0;
+}
+
+// System log lines: repetitive text with changing numbers
+static void generate_log(uint8_t* data, uint32_t size) {
+    static const char* sources[] = { "kernel", "netd", "opkg", "sched", "usbd" };
+    static const char* events[] = { "link up", "timer expired", "package verified", "queue drained",
+                                    "device attached", "retrying request" };
+    char line[160];
+    uint32_t offset = 0;
+    
+    for (uint32_t i = 0; offset < size; i++) {
+        int length = snprintf(line, sizeof(line), "2026-10-17 %02u:%02u:%02u.%03u %s[%u]: %s id=%u\n",
+                              (i / 3600) % 24, (i / 60) % 60, i % 60, next_random() % 1000,
+                              sources[next_random() % 5], 100 + next_random() % 50,
+                              events[next_random() % 6], next_random() % 100000);
+        uint32_t bytes = (uint32_t)length < size - offset ? (uint32_t)length : size - offset;
+        memcpy(data + offset, line, bytes);
+        offset += bytes;
+    }
+}
+
+// Package payload: code-like records and strings with already packed
+// resources mixed in
+static void generate_package(uint8_t* data, uint32_t size) {
+    static const char* symbols[] = { "omnios_init", "memory_allocate", "device_read", "console_print",
+                                     "opi_verify", "net_send" };
+    uint32_t offset = 0;
+    
+    while (offset < size) {
+        uint8_t record[256];
+        uint32_t length;
+        uint32_t kind = next_random() % 8;
+        
+        if (kind == 0) {
+            length = 64 + next_random() % 192; // Packed resource
+            for (uint32_t i = 0; i < length; i++) {
+                record[i] = (uint8_t)next_random();
+            }
+        } else if (kind < 4) {
+            length = snprintf((char*)record, sizeof(record), "%s@%08x",
+                              symbols[next_random() % 6], next_random() & 0xFFF0) + 1;
+        } else {
+            // Instruction-like words: a few opcodes, small operands
+            length = 32;
+            for (uint32_t i = 0; i < length; i += 4) {
+                uint32_t word = (0x8B00 + next_random() % 16) | (next_random() % 64) << 16;
+                memcpy(record + i, &word, 4);
+            }
+        }
+        
+        if (length > size - offset) {
+            length = size - offset;
+        }
+        memcpy(data + offset, record, length);
+        offset += length;
+    }
+}
+
+static void generate_random(uint8_t* data, uint32_t size) {
+    for (uint32_t i = 0; i < size; i++) {
+        data[i] = (uint8_t)next_random();
+    }
+}
+
+static void init_inode(omnifs_inode_t* inode, uint32_t flags) {
+    memset(inode, 0, sizeof(omnifs_inode_t));
+    inode->mode = 0x81A4;
+    inode->flags = flags;
+    omnifs_extent_init_root(inode);
+}
+
+// Write back the delayed buffers of owner, in file block order
+static bool flush_compressed(omnifs_inode_t* inode, uint32_t owner) {
+    bcache_buffer_t* buffers[FLUSH_BATCH];
+    uint32_t count;
+    
+    while ((count = bcache_collect_delayed(owner, buffers, FLUSH_BATCH)) > 0) {
+        for (uint32_t i = 1; i < count; i++) {
+            bcache_buffer_t* buffer = buffers[i];
+            uint32_t j = i;
+            while (j > 0 && buffers[j - 1]->block > buffer->block) {
+                buffers[j] = buffers[j - 1];
+                j--;
+            }
+            buffers[j] = buffer;
+        }
+        
+        uint32_t written = 0;
+        int result = omnifs_compress_flush(inode, buffers, count, &written);
+        for (uint32_t i = 0; i < count; i++) {
+            bcache_release(buffers[i]);
+        }
+        if (result != OMNIOS_SUCCESS) {
+            fprintf(stderr, "compbench: write-back failed (%d)\n", result);
+            return false;
+        }
+    }
+    
+    return true;
+}
+
+static bool write_file(omnifs_inode_t* inode, const uint8_t* data, uint32_t size, bool compressed) {
+    for (uint32_t offset = 0; offset < size; offset += WRITE_CHUNK) {
+        uint32_t length = size - offset < WRITE_CHUNK ? size - offset : WRITE_CHUNK;
+        
+        if (!compressed) {
+            if (omnifs_write_inode_data(inode, data + offset, length, offset) != OMNIOS_SUCCESS) {
+                fprintf(stderr, "compbench: write failed at %u\n", offset);
+                return false;
+            }
+            inode->size = offset + length;
+            continue;
+        }
+        
+        // Chunks are whole blocks, so no buffer needs its stored contents
+        for (uint32_t done = 0; done < length; done += HOST_FS_BLOCK_SIZE) {
+            bool created;
+            uint32_t block = (offset + done) / HOST_FS_BLOCK_SIZE;
+            bcache_buffer_t* buffer = bcache_get_delayed(FILE_OWNER, block, &created);
+            if (!buffer) {
+                fprintf(stderr, "compbench: no delayed buffer for block %u\n", block);
+                return false;
+            }
+            
+            uint32_t bytes = length - done < HOST_FS_BLOCK_SIZE ? length - done : HOST_FS_BLOCK_SIZE;
+            memcpy(buffer->data, data + offset + done, bytes);
+            bcache_release(buffer);
+        }
+        inode->size = offset + length;
+        
+        bcache_stats_t stats;
+        bcache_get_stats(&stats);
+        if (stats.delayed_buffers >= FLUSH_BATCH && !flush_compressed(inode, FILE_OWNER)) {
+            return false;
+        }
+    }
+    
+    return !compressed || flush_compressed(inode, FILE_OWNER);
+}
+
+static int read_file(omnifs_inode_t* inode, void* buffer, uint32_t size, uint32_t offset, bool compressed) {
+    if (compressed) {
+        return omnifs_compress_read(inode, FILE_OWNER, buffer, size, offset);
+    }
+    return omnifs_read_inode_data(inode, buffer, size, offset);
+}
+
+// Empty both the buffer cache and the decompressed cluster
+static void drop_caches(bool compressed) {
+    host_fs_drop_cache();
+    if (compressed) {
+        omnifs_compress_init(HOST_FS_BLOCK_SIZE, host_fs_allocate_blocks, host_fs_free_block);
+    }
+}
+
+// Write into a compressed file the way the file system does: blocks only
+// partly covered start from their stored contents
+static bool write_compressed(omnifs_inode_t* inode, uint32_t owner, const uint8_t* data, uint32_t size,
+                             uint32_t offset) {
+    for (uint32_t done = 0; done < size;) {
+        uint32_t block = (offset + done) / HOST_FS_BLOCK_SIZE;
+        uint32_t block_offset = (offset + done) % HOST_FS_BLOCK_SIZE;
+        uint32_t bytes = HOST_FS_BLOCK_SIZE - block_offset;
+        if (bytes > size - done) {
+            bytes = size - done;
+        }
+        
+        bool created;
+        bcache_buffer_t* buffer = bcache_get_delayed(owner, block, &created);
+        if (!buffer) {
+            return false;
+        }
+        if (created && bytes < HOST_FS_BLOCK_SIZE &&
+            omnifs_compress_fill(inode, owner, block, buffer->data) != OMNIOS_SUCCESS) {
+            bcache_discard_delayed(buffer);
+            bcache_release(buffer);
+            return false;
+        }
+        
+        memcpy(buffer->data + block_offset, data + done, bytes);
+        bcache_release(buffer);
+        done += bytes;
+    }
+    
+    if (offset + size > inode->size) {
+        inode->size = offset + size;
+    }
+    return flush_compressed(inode, owner);
+}
+
+// A hole left by writing past the end of a compressed file must read as
+// zeros, even while the decompressed cluster of another file is cached
+static bool check_holes(void) {
+    static uint8_t other[10 * HOST_FS_BLOCK_SIZE];
+    static uint8_t file[4 * HOST_FS_BLOCK_SIZE];
+    static uint8_t expected[4 * HOST_FS_BLOCK_SIZE];
+    const uint32_t small = 5000;
+    const uint32_t tail = 3 * HOST_FS_BLOCK_SIZE;
+    const uint32_t tail_size = 10;
+    
+    host_fs_init(1024, DEFAULT_BUFFERS);
+    if (omnifs_compress_init(HOST_FS_BLOCK_SIZE, host_fs_allocate_blocks, host_fs_free_block) != OMNIOS_SUCCESS) {
+        fprintf(stderr, "compbench: cannot set up compression\n");
+        return false;
+    }
+    
+    omnifs_inode_t first;
+    omnifs_inode_t second;
+    init_inode(&first, OMNIFS_INODE_COMPRESSED);
+    init_inode(&second, OMNIFS_INODE_COMPRESSED);
+    for (uint32_t i = 0; i < sizeof(other); i++) {
+        other[i] = 'A' + i / (2 * HOST_FS_BLOCK_SIZE);
+    }
+    memset(expected, 0, sizeof(expected));
+    memset(expected, 'x', small);
+    memset(expected + tail, 'y', tail_size);
+    
+    // Leave the other file's cluster cached, then extend this one past a hole
+    bool ok = write_compressed(&first, FILE_OWNER, other, sizeof(other), 0) &&
+              write_compressed(&second, HOLE_OWNER, expected, small, 0) &&
+              omnifs_compress_read(&first, FILE_OWNER, file, sizeof(file), 0) == OMNIOS_SUCCESS &&
+              omnifs_compress_read(&second, HOLE_OWNER, file, small, 0) == OMNIOS_SUCCESS &&
+              write_compressed(&second, HOLE_OWNER, expected + tail, tail_size, tail) &&
+              bcache_sync() == OMNIOS_SUCCESS;
+    
+    for (int cold = 0; cold < 2 && ok; cold++) {
+        if (cold) {
+            drop_caches(true);
+        }
+        ok = omnifs_compress_read(&second, HOLE_OWNER, file, tail + tail_size, 0) == OMNIOS_SUCCESS &&
+             memcmp(file, expected, tail + tail_size) == 0;
+    }
+    if (!ok) {
+        fprintf(stderr, "compbench: hole in a compressed file does not read back as zeros\n");
+    }
+    
+    omnifs_compress_shutdown();
+    host_fs_shutdown();
+    return ok;
+}
+
+static bool run_case(const uint8_t* data, const options_t* options, bool compressed, result_t* result) {
+    uint32_t size = options->size;
+    host_fs_init(size / HOST_FS_BLOCK_SIZE * 2 + 1024, options->buffers);
+    if (compressed &&
+        omnifs_compress_init(HOST_FS_BLOCK_SIZE, host_fs_allocate_blocks, host_fs_free_block) != OMNIOS_SUCCESS) {
+        fprintf(stderr, "compbench: cannot set up compression\n");
+        return false;
+    }
+    
+    omnifs_inode_t inode;
+    init_inode(&inode, compressed ? OMNIFS_INODE_COMPRESSED : 0);
+    
+    uint64_t start = now_ns();
+    if (!write_file(&inode, data, size, compressed) || bcache_sync() != OMNIOS_SUCCESS) {
+        return false;
+    }
+    result->write_mbs = mb_per_second(size, now_ns() - start);
+    result->blocks = inode.blocks;
+    
+    static uint8_t chunk[SEQUENTIAL_CHUNK];
+    host_fs_stats_t before;
+    host_fs_stats_t after;
+    
+    drop_caches(compressed);
+    host_fs_get_stats(&before);
+    start = now_ns();
+    for (uint32_t offset = 0; offset < size; offset += SEQUENTIAL_CHUNK) {
+        uint32_t length = size - offset < SEQUENTIAL_CHUNK ? size - offset : SEQUENTIAL_CHUNK;
+        if (read_file(&inode, chunk, length, offset, compressed) != OMNIOS_SUCCESS ||
+            memcmp(chunk, data + offset, length) != 0) {
+            fprintf(stderr, "compbench: sequential read mismatch at %u\n", offset);
+            return false;
+        }
+    }
+    result->sequential_mbs = mb_per_second(size, now_ns() - start);
+    host_fs_get_stats(&after);
+    result->sequential_reads = after.device_reads - before.device_reads;
+    
+    drop_caches(compressed);
+    host_fs_get_stats(&before);
+    g_seed = 4321;
+    start = now_ns();
+    for (uint32_t i = 0; i < options->reads; i++) {
+        uint32_t offset = next_random() % (size / RANDOM_CHUNK) * RANDOM_CHUNK;
+        if (read_file(&inode, chunk, RANDOM_CHUNK, offset, compressed) != OMNIOS_SUCCESS ||
+            memcmp(chunk, data + offset, RANDOM_CHUNK) != 0) {
+            fprintf(stderr, "compbench: random read mismatch at %u\n", offset);
+            return false;
+        }
+    }
+    result->random_mbs = mb_per_second((uint64_t)options->reads * RANDOM_CHUNK, now_ns() - start);
+    host_fs_get_stats(&after);
+    result->random_reads = after.device_reads - before.device_reads;
+    
+    if (compressed) {
+        omnifs_compress_shutdown();
+    }
+    host_fs_shutdown();
+    return true;
+}
+
+static void usage(const char* program) {
+    fprintf(stderr, "usage: %s [-s size-mb] [-r random-reads] [-b buffers]\n", program);
+}
+
+int main(int argc, char** argv) {
+    options_t options = { DEFAULT_SIZE_MB << 20, DEFAULT_READS, DEFAULT_BUFFERS };
+    int option;
+    
+    while ((option = getopt(argc, argv, "s:r:b:h")) != -1) {
+        switch (option) {
+        case 's':
+            options.size = strtoul(optarg, NULL, 0) << 20;
+            break;
+        case 'r':
+            options.reads = strtoul(optarg, NULL, 0);
+            break;
+        case 'b':
+            options.buffers = strtoul(optarg, NULL, 0);
+            break;
+        default:
+            usage(argv[0]);
+            return option == 'h' ? 0 : 1;
+        }
+    }
+    
+    if (options.size == 0 || options.buffers == 0) {
+        usage(argv[0]);
+        return 1;
+    }
+    
+    static const struct {
+        const char* name;
+        generator_t generate;
+    } data_sets[] = {
+        { "log", generate_log },
+        { "package", generate_package },
+        { "random", generate_random },
+    };
+    
+    if (!check_holes()) {
+        return 1;
+    }
+    
+    uint8_t* data = malloc(options.size);
+    if (!data) {
+        fprintf(stderr, "compbench: cannot allocate %u bytes\n", options.size);
+        return 1;
+    }
+    
+    printf("%-8s %-10s %7s %6s %9s %9s %8s %9s %8s\n", "data", "file", "blocks", "ratio",
+           "write MB/s", "seq MB/s", "seq rd", "rand MB/s", "rand rd");
+    
+    for (uint32_t set = 0; set < sizeof(data_sets) / sizeof(data_sets[0]); set++) {
+        g_seed = set + 1;
+        data_sets[set].generate(data, options.size);
+        
+        for (int compressed = 0; compressed < 2; compressed++) {
+            result_t result;
+            if (!run_case(data, &options, compressed, &result)) {
+                free(data);
+                return 1;
+            }
+            
+            uint32_t plain_blocks = (options.size + HOST_FS_BLOCK_SIZE - 1) / HOST_FS_BLOCK_SIZE;
+            printf("%-8s %-10s %7u %6.2f %9.1f %9.1f %8llu %9.1f %8llu\n", data_sets[set].name,
+                   compressed ? "compressed" : "plain", result.blocks,
+                   result.blocks ? (double)plain_blocks / result.blocks : 0, result.write_mbs,
+                   result.sequential_mbs, (unsigned long long)result.sequential_reads, result.random_mbs,
+                   (unsigned long long)result.random_reads);
+        }
+    }
+    
+    free(data);
+    return 0;
+}
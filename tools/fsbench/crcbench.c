@@ -0,0 +1,188 @@
+/*
+ * OmniOS 2.0 Metadata Checksum Benchmark
+ * Times CRC32C over metadata-sized blocks with the crc32 instruction and
+ * with the slicing tables, then reads a set of metadata blocks from a
+ * cold buffer cache with and without verification. The cost per block is
+ * set against a modeled device read latency, since the RAM disk has none.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <getopt.h>
+
+#include "omnios.h"
+#include "fs/bcache.h"
+#include "kernel/crc32c.h"
+
+#define DEFAULT_BLOCKS          8192
+#define DEFAULT_ROUNDS          5
+#define DEFAULT_LATENCY_US      100     // A fast SSD read
+#define HASH_PASSES             64      // Times each block is hashed in the CRC runs
+
+typedef uint32_t (*checksum_t)(uint32_t crc, const void* data, uint32_t length);
+
+typedef struct {
+    uint32_t blocks;
+    uint32_t rounds;
+    uint32_t latency_us;
+} options_t;
+
+static uint32_t g_seed = 1;
+static volatile uint32_t g_sink; // Keeps the checksum calls live
+
+static uint32_t next_random(void) {
+    g_seed = g_seed * 1103515245 + 12345;
+    return g_seed >> 8;
+}
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static double mb_per_second(uint64_t bytes, uint64_t ns) {
+    return ns ? (double)bytes / (1024.0 * 1024.0) / ((double)ns / 1e9) : 0;
+}
+
+// Hash every block HASH_PASSES times
+static double time_checksum(checksum_t checksum, const uint8_t* data, uint32_t blocks) {
+    uint32_t payload = HOST_FS_BLOCK_SIZE - sizeof(uint32_t);
+    uint64_t start = now_ns();
+    
+    for (uint32_t pass = 0; pass < HASH_PASSES; pass++) {
+        for (uint32_t i = 0; i < blocks; i++) {
+            g_sink += checksum(0, data + (uint64_t)i * HOST_FS_BLOCK_SIZE, payload);
+        }
+    }
+    return mb_per_second((uint64_t)HASH_PASSES * blocks * payload, now_ns() - start);
+}
+
+// Metadata blocks 1..blocks, sealed as they are written back
+static bool write_metadata(const uint8_t* data, uint32_t blocks) {
+    bcache_set_checksums(true);
+    for (uint32_t i = 0; i < blocks; i++) {
+        bcache_buffer_t* buffer = bcache_get_new(i + 1);
+        if (!buffer) {
+            fprintf(stderr, "crcbench: no buffer for block %u\n", i + 1);
+            return false;
+        }
+        
+        memcpy(buffer->data, data + (uint64_t)i * HOST_FS_BLOCK_SIZE, HOST_FS_BLOCK_SIZE);
+        bcache_mark_metadata(buffer);
+        bcache_release(buffer);
+    }
+    return bcache_sync() == OMNIOS_SUCCESS;
+}
+
+// Read every block from a cold cache, best time of all rounds
+static uint64_t time_cold_reads(const options_t* options, bool verify) {
+    uint64_t best = UINT64_MAX;
+    
+    for (uint32_t round = 0; round < options->rounds; round++) {
+        host_fs_drop_cache();
+        bcache_set_checksums(verify);
+        
+        uint64_t start = now_ns();
+        for (uint32_t i = 0; i < options->blocks; i++) {
+            bcache_buffer_t* buffer = bcache_get_metadata(i + 1);
+            if (!buffer) {
+                fprintf(stderr, "crcbench: block %u failed verification\n", i + 1);
+                return 0;
+            }
+            bcache_release(buffer);
+        }
+        
+        uint64_t elapsed = now_ns() - start;
+        if (elapsed < best) {
+            best = elapsed;
+        }
+    }
+    return best;
+}
+
+static void usage(const char* program) {
+    fprintf(stderr, "usage: %s [-n blocks] [-r rounds] [-l latency-us]\n", program);
+}
+
+int main(int argc, char** argv) {
+    options_t options = { DEFAULT_BLOCKS, DEFAULT_ROUNDS, DEFAULT_LATENCY_US };
+    int option;
+    
+    while ((option = getopt(argc, argv, "n:r:l:h")) != -1) {
+        switch (option) {
+        case 'n':
+            options.blocks = strtoul(optarg, NULL, 0);
+            break;
+        case 'r':
+            options.rounds = strtoul(optarg, NULL, 0);
+            break;
+        case 'l':
+            options.latency_us = strtoul(optarg, NULL, 0);
+            break;
+        default:
+            usage(argv[0]);
+            return option == 'h' ? 0 : 1;
+        }
+    }
+    
+    if (options.blocks == 0 || options.rounds == 0) {
+        usage(argv[0]);
+        return 1;
+    }
+    
+    uint8_t* data = malloc((uint64_t)options.blocks * HOST_FS_BLOCK_SIZE);
+    if (!data) {
+        fprintf(stderr, "crcbench: cannot allocate %u blocks\n", options.blocks);
+        return 1;
+    }
+    for (uint64_t i = 0; i < (uint64_t)options.blocks * HOST_FS_BLOCK_SIZE; i++) {
+        data[i] = (uint8_t)next_random();
+    }
+    
+    uint32_t hashed = options.blocks < 1024 ? options.blocks : 1024; // Stays in the CPU cache
+    double software = time_checksum(crc32c_software, data, hashed);
+    double hardware = crc32c_hardware() ? time_checksum(crc32c, data, hashed) : 0;
+    
+    printf("crc32c %u byte blocks: software %.0f MB/s", HOST_FS_BLOCK_SIZE, software);
+    if (crc32c_hardware()) {
+        printf(", crc32 instruction %.0f MB/s (%.1fx)\n", hardware, software ? hardware / software : 0);
+    } else {
+        printf(", no crc32 instruction\n");
+    }
+    
+    host_fs_init(options.blocks + 16, options.blocks + 16);
+    if (!write_metadata(data, options.blocks)) {
+        free(data);
+        return 1;
+    }
+    
+    uint64_t plain = time_cold_reads(&options, false);
+    uint64_t verified = time_cold_reads(&options, true);
+    if (plain == 0 || verified == 0) {
+        free(data);
+        return 1;
+    }
+    
+    bcache_stats_t stats;
+    bcache_get_stats(&stats);
+    double plain_us = (double)plain / options.blocks / 1000.0;
+    double verified_us = (double)verified / options.blocks / 1000.0;
+    double cost_us = verified_us > plain_us ? verified_us - plain_us : 0;
+    
+    printf("%-10s %10s %10s\n", "cold read", "us/block", "MB/s");
+    printf("%-10s %10.3f %10.1f\n", "plain", plain_us, mb_per_second((uint64_t)options.blocks * HOST_FS_BLOCK_SIZE, plain));
+    printf("%-10s %10.3f %10.1f\n", "verified", verified_us,
+           mb_per_second((uint64_t)options.blocks * HOST_FS_BLOCK_SIZE, verified));
+    printf("verification: %.3f us/block, %.2f%% of a %u us device read, %u errors\n", cost_us,
+           options.latency_us ? 100.0 * cost_us / options.latency_us : 0, options.latency_us,
+           stats.checksum_errors);
+    
+    host_fs_shutdown();
+    free(data);
+    return 0;
+}
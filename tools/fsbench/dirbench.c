@@ -0,0 +1,222 @@
+/*
+ * OmniOS 2.0 Directory Lookup Benchmark
+ * Fills one directory with N entries and times name lookups and a paged
+ * listing, linear against hash-indexed, on a RAM disk through the buffer
+ * cache
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <getopt.h>
+
+#include "omnios.h"
+#include "fs/bcache.h"
+#include "fs/omnifs_extent.h"
+#include "fs/omnifs_dir.h"
+
+#define DEFAULT_LOOKUPS         20000
+#define DEFAULT_BUFFERS         BCACHE_DEFAULT_BUFFERS
+#define LINEAR_SCAN_BUDGET      200000000ULL    // Entries a linear run may compare
+#define MAX_SIZES               16
+#define LIST_PAGE               64              // Entries per omnifs_dir_read call
+
+typedef struct {
+    uint32_t lookups;
+    uint32_t buffers;
+    bool linear;
+    bool hashed;
+} options_t;
+
+typedef struct {
+    double insert_ns;
+    double hit_ns;
+    double miss_ns;
+    double list_ns;               // Per entry listed
+    double blocks_per_lookup;     // Buffer cache requests
+    double reads_per_lookup;      // Blocks fetched from the device
+    uint32_t dir_blocks;
+    bool indexed;
+} result_t;
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+// Package-style names: spread over the alphabet, varying in length
+static void entry_name(char* buffer, uint32_t index, bool present) {
+    uint32_t mix = index * 2654435761u;
+    snprintf(buffer, 64, "%s%u-%x.%s", present ? "pkg-" : "none-", index, mix >> 20,
+             (mix & 1) ? "opi" : "mod");
+}
+
+static uint64_t cache_requests(void) {
+    bcache_stats_t stats;
+    bcache_get_stats(&stats);
+    return stats.hits + stats.misses;
+}
+
+static bool run_case(uint32_t entries, bool hashed, const options_t* options, result_t* result) {
+    // Names average ~24 bytes a record; leaves settle around two thirds full
+    uint32_t blocks = 1024 + (uint32_t)((uint64_t)entries * 64 / HOST_FS_BLOCK_SIZE);
+    host_fs_init(blocks, options->buffers);
+    omnifs_dir_init(HOST_FS_BLOCK_SIZE, hashed);
+    
+    omnifs_inode_t dir;
+    memset(&dir, 0, sizeof(dir));
+    dir.mode = 0x41ED;
+    omnifs_extent_init_root(&dir);
+    
+    char name[64];
+    uint64_t start = now_ns();
+    for (uint32_t i = 0; i < entries; i++) {
+        entry_name(name, i, true);
+        if (omnifs_dir_add(&dir, name, i + 1, 1) != OMNIOS_SUCCESS) {
+            fprintf(stderr, "dirbench: add %s failed at %u entries\n", name, i);
+            return false;
+        }
+    }
+    result->insert_ns = entries ? (double)(now_ns() - start) / entries : 0;
+    bcache_sync();
+    
+    // A linear scan compares about entries/2 names per hit
+    uint32_t lookups = options->lookups;
+    if (!hashed && (uint64_t)lookups * entries > LINEAR_SCAN_BUDGET) {
+        lookups = LINEAR_SCAN_BUDGET / entries;
+        if (lookups < 50) {
+            lookups = 50;
+        }
+    }
+    
+    host_fs_stats_t before;
+    host_fs_get_stats(&before);
+    uint64_t requests = cache_requests();
+    
+    uint32_t seed = 12345;
+    start = now_ns();
+    for (uint32_t i = 0; i < lookups; i++) {
+        seed = seed * 1103515245 + 12345;
+        uint32_t index = (seed >> 8) % entries;
+        entry_name(name, index, true);
+        if (omnifs_dir_lookup(&dir, name) != index + 1) {
+            fprintf(stderr, "dirbench: lookup %s returned the wrong inode\n", name);
+            return false;
+        }
+    }
+    uint64_t hit_time = now_ns() - start;
+    
+    start = now_ns();
+    for (uint32_t i = 0; i < lookups; i++) {
+        entry_name(name, i, false);
+        if (omnifs_dir_lookup(&dir, name) != 0) {
+            fprintf(stderr, "dirbench: lookup %s found a missing name\n", name);
+            return false;
+        }
+    }
+    uint64_t miss_time = now_ns() - start;
+    
+    host_fs_stats_t after;
+    host_fs_get_stats(&after);
+    
+    // Page through the whole directory the way 'ls' does
+    static omnifs_dir_entry_t page[LIST_PAGE];
+    uint32_t cookie = 0;
+    uint32_t listed = 0;
+    int count;
+    start = now_ns();
+    while ((count = omnifs_dir_read(&dir, &cookie, page, LIST_PAGE)) > 0) {
+        listed += count;
+    }
+    uint64_t list_time = now_ns() - start;
+    if (count < 0 || listed != entries) {
+        fprintf(stderr, "dirbench: listing returned %u of %u entries\n", listed, entries);
+        return false;
+    }
+    
+    result->list_ns = entries ? (double)list_time / entries : 0;
+    result->hit_ns = (double)hit_time / lookups;
+    result->miss_ns = (double)miss_time / lookups;
+    result->blocks_per_lookup = (double)(cache_requests() - requests) / (2.0 * lookups);
+    result->reads_per_lookup = (double)(after.device_reads - before.device_reads) / (2.0 * lookups);
+    result->dir_blocks = (dir.size + HOST_FS_BLOCK_SIZE - 1) / HOST_FS_BLOCK_SIZE;
+    result->indexed = omnifs_dir_is_indexed(&dir);
+    
+    host_fs_shutdown();
+    return true;
+}
+
+static void usage(const char* program) {
+    fprintf(stderr,
+            "usage: %s [-l lookups] [-b buffers] [-m linear|hashed|both] [entries...]\n"
+            "  default entries: 10 100 1000 10000 100000\n", program);
+}
+
+int main(int argc, char** argv) {
+    options_t options = { DEFAULT_LOOKUPS, DEFAULT_BUFFERS, true, true };
+    int option;
+    
+    while ((option = getopt(argc, argv, "l:b:m:h")) != -1) {
+        switch (option) {
+        case 'l':
+            options.lookups = strtoul(optarg, NULL, 0);
+            break;
+        case 'b':
+            options.buffers = strtoul(optarg, NULL, 0);
+            break;
+        case 'm':
+            options.linear = strcmp(optarg, "hashed") != 0;
+            options.hashed = strcmp(optarg, "linear") != 0;
+            break;
+        default:
+            usage(argv[0]);
+            return option == 'h' ? 0 : 1;
+        }
+    }
+    
+    uint32_t sizes[MAX_SIZES] = { 10, 100, 1000, 10000, 100000 };
+    uint32_t count = 5;
+    if (optind < argc) {
+        count = 0;
+        while (optind < argc && count < MAX_SIZES) {
+            sizes[count++] = strtoul(argv[optind++], NULL, 0);
+        }
+    }
+    
+    if (options.lookups == 0 || options.buffers == 0) {
+        usage(argv[0]);
+        return 1;
+    }
+    
+    printf("%-8s %8s %6s %7s %10s %10s %10s %8s %9s %9s\n", "layout", "entries", "blocks", "indexed",
+           "insert ns", "hit ns", "miss ns", "list ns", "blocks/op", "reads/op");
+    
+    for (int layout = 0; layout < 2; layout++) {
+        bool hashed = layout == 1;
+        if ((hashed && !options.hashed) || (!hashed && !options.linear)) {
+            continue;
+        }
+        
+        for (uint32_t i = 0; i < count; i++) {
+            if (sizes[i] == 0) {
+                continue;
+            }
+            
+            result_t result;
+            if (!run_case(sizes[i], hashed, &options, &result)) {
+                return 1;
+            }
+            
+            printf("%-8s %8u %6u %7s %10.0f %10.0f %10.0f %8.0f %9.2f %9.2f\n", hashed ? "hashed" : "linear",
+                   sizes[i], result.dir_blocks, result.indexed ? "yes" : "no", result.insert_ns,
+                   result.hit_ns, result.miss_ns, result.list_ns, result.blocks_per_lookup,
+                   result.reads_per_lookup);
+        }
+    }
+    
+    return 0;
+}
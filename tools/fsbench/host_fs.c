@@ -0,0 +1,186 @@
+/*
+ * OmniOS 2.0 Host File System Shim
+ * Version 2 (extent mapped) inode data access over a RAM disk, matching
+ * omnifs_read_inode_data/omnifs_write_inode_data in omnifs.c
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "omnios.h"
+#include "kernel/memory.h"
+#include "fs/bcache.h"
+#include "fs/omnifs_extent.h"
+
+static uint8_t* g_disk = NULL;
+static uint32_t g_disk_blocks = 0;
+static uint32_t g_next_block = 1;
+static uint32_t g_cache_buffers = 0;
+static host_fs_stats_t g_stats;
+
+void* memory_allocate(uint32_t size) {
+    return malloc(size);
+}
+
+void* memory_allocate_aligned(uint32_t size, uint32_t alignment) {
+    void* ptr = NULL;
+    return posix_memalign(&ptr, alignment, size) == 0 ? ptr : NULL;
+}
+
+void memory_free(void* ptr) {
+    free(ptr);
+}
+
+int device_read(const char* device, uint32_t offset, void* buffer, uint32_t size) {
+    if ((uint64_t)offset + size > (uint64_t)g_disk_blocks * HOST_FS_BLOCK_SIZE) {
+        return OMNIOS_ERROR_IO;
+    }
+    
+    memcpy(buffer, g_disk + offset, size);
+    g_stats.device_reads += (size + HOST_FS_BLOCK_SIZE - 1) / HOST_FS_BLOCK_SIZE;
+    return OMNIOS_SUCCESS;
+}
+
+int device_write(const char* device, uint32_t offset, const void* buffer, uint32_t size) {
+    if ((uint64_t)offset + size > (uint64_t)g_disk_blocks * HOST_FS_BLOCK_SIZE) {
+        return OMNIOS_ERROR_IO;
+    }
+    
+    memcpy(g_disk + offset, buffer, size);
+    g_stats.device_writes += (size + HOST_FS_BLOCK_SIZE - 1) / HOST_FS_BLOCK_SIZE;
+    return OMNIOS_SUCCESS;
+}
+
+// Blocks are handed out in order and never freed
+static uint32_t host_allocate_block(uint32_t goal) {
+    if (g_next_block >= g_disk_blocks) {
+        return 0;
+    }
+    
+    g_stats.blocks_used++;
+    return g_next_block++;
+}
+
+uint32_t host_fs_allocate_blocks(uint32_t goal, uint32_t* count) {
+    if (*count == 0 || *count > g_disk_blocks - g_next_block) {
+        return 0;
+    }
+    
+    uint32_t start = g_next_block;
+    g_next_block += *count;
+    g_stats.blocks_used += *count;
+    return start;
+}
+
+void host_fs_free_block(uint32_t block) {
+    bcache_invalidate(block);
+    g_stats.blocks_used--;
+}
+
+uint32_t omnifs_get_block_number(omnifs_inode_t* inode, uint32_t block_index) {
+    return omnifs_extent_map(inode, block_index, NULL);
+}
+
+int omnifs_read_inode_data(omnifs_inode_t* inode, void* buffer, uint32_t size, uint32_t offset) {
+    if (offset >= inode->size) {
+        return OMNIOS_ERROR_GENERIC;
+    }
+    
+    uint32_t bytes_to_read = (offset + size > inode->size) ? (inode->size - offset) : size;
+    uint32_t bytes_read = 0;
+    
+    while (bytes_read < bytes_to_read) {
+        uint32_t block_offset = (offset + bytes_read) % HOST_FS_BLOCK_SIZE;
+        uint32_t block_bytes = HOST_FS_BLOCK_SIZE - block_offset;
+        if (block_bytes > bytes_to_read - bytes_read) {
+            block_bytes = bytes_to_read - bytes_read;
+        }
+        
+        uint32_t physical = omnifs_extent_map(inode, (offset + bytes_read) / HOST_FS_BLOCK_SIZE, NULL);
+        bcache_buffer_t* block = physical ? bcache_get(physical) : NULL;
+        if (!block) {
+            return OMNIOS_ERROR_IO;
+        }
+        
+        memcpy((uint8_t*)buffer + bytes_read, block->data + block_offset, block_bytes);
+        bcache_release(block);
+        bytes_read += block_bytes;
+    }
+    
+    return OMNIOS_SUCCESS;
+}
+
+int omnifs_write_inode_data(omnifs_inode_t* inode, const void* buffer, uint32_t size, uint32_t offset) {
+    uint32_t bytes_written = 0;
+    
+    while (bytes_written < size) {
+        uint32_t block_index = (offset + bytes_written) / HOST_FS_BLOCK_SIZE;
+        uint32_t block_offset = (offset + bytes_written) % HOST_FS_BLOCK_SIZE;
+        uint32_t block_bytes = HOST_FS_BLOCK_SIZE - block_offset;
+        if (block_bytes > size - bytes_written) {
+            block_bytes = size - bytes_written;
+        }
+        
+        bool new_block = false;
+        uint32_t physical = omnifs_extent_map(inode, block_index, NULL);
+        if (physical == 0) {
+            physical = host_allocate_block(0);
+            if (physical == 0 || omnifs_extent_insert(inode, block_index, physical, 1) != OMNIOS_SUCCESS) {
+                return OMNIOS_ERROR_MEMORY;
+            }
+            inode->blocks++;
+            new_block = true;
+        }
+        
+        bool whole = new_block || block_bytes == HOST_FS_BLOCK_SIZE;
+        bcache_buffer_t* block = whole ? bcache_get_new(physical) : bcache_get(physical);
+        if (!block) {
+            return OMNIOS_ERROR_IO;
+        }
+        
+        if (new_block && block_bytes < HOST_FS_BLOCK_SIZE) {
+            memset(block->data, 0, HOST_FS_BLOCK_SIZE);
+        }
+        
+        memcpy(block->data + block_offset, (const uint8_t*)buffer + bytes_written, block_bytes);
+        bcache_mark_dirty(block);
+        bcache_release(block);
+        bytes_written += block_bytes;
+    }
+    
+    return OMNIOS_SUCCESS;
+}
+
+void host_fs_init(uint32_t blocks, uint32_t cache_buffers) {
+    host_fs_shutdown();
+    
+    g_disk = calloc(blocks, HOST_FS_BLOCK_SIZE);
+    if (!g_disk) {
+        fprintf(stderr, "host_fs: cannot allocate %u block RAM disk\n", blocks);
+        exit(1);
+    }
+    
+    g_disk_blocks = blocks;
+    g_next_block = 1;
+    g_cache_buffers = cache_buffers;
+    memset(&g_stats, 0, sizeof(g_stats));
+    bcache_init(HOST_FS_DEVICE, HOST_FS_BLOCK_SIZE, cache_buffers);
+    omnifs_extent_init(HOST_FS_BLOCK_SIZE, host_allocate_block);
+}
+
+void host_fs_shutdown(void) {
+    if (g_disk) {
+        bcache_shutdown();
+        free(g_disk);
+        g_disk = NULL;
+    }
+}
+
+void host_fs_drop_cache(void) {
+    bcache_shutdown();
+    bcache_init(HOST_FS_DEVICE, HOST_FS_BLOCK_SIZE, g_cache_buffers);
+}
+
+void host_fs_get_stats(host_fs_stats_t* stats) {
+    *stats = g_stats;
+}
@@ -0,0 +1,37 @@
+/*
+ * OmniOS 2.0 Host File System Shim
+ * Forced include for building OmniFS modules as a Linux program: a RAM
+ * disk behind device_read/device_write and the inode data functions
+ * those modules take from omnifs.c
+ */
+
+#ifndef FSBENCH_HOST_FS_H
+#define FSBENCH_HOST_FS_H
+
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#define HOST_FS_BLOCK_SIZE      4096
+#define HOST_FS_DEVICE          "ram0"
+
+typedef struct {
+    uint64_t device_reads;    // Blocks read from the RAM disk
+    uint64_t device_writes;
+    uint32_t blocks_used;
+} host_fs_stats_t;
+
+// Fresh RAM disk of the given size with an empty buffer cache of cache_buffers
+void host_fs_init(uint32_t blocks, uint32_t cache_buffers);
+void host_fs_shutdown(void);
+void host_fs_get_stats(host_fs_stats_t* stats);
+
+// Write back and empty the buffer cache so later reads come from the disk
+void host_fs_drop_cache(void);
+
+// Allocator callbacks for omnifs_compress: one run of all *count blocks,
+// or 0 when the disk is full. Freed blocks are only uncounted.
+uint32_t host_fs_allocate_blocks(uint32_t goal, uint32_t* count);
+void host_fs_free_block(uint32_t block);
+
+#endif /* FSBENCH_HOST_FS_H */
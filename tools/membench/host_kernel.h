@@ -0,0 +1,16 @@
+/*
+ * OmniOS 2.0 Host Kernel Shim
+ * Forced include that lets kernel allocator sources build as a Linux program
+ */
+
+#ifndef MEMBENCH_HOST_KERNEL_H
+#define MEMBENCH_HOST_KERNEL_H
+
+#include <string.h>
+
+// Services the allocator expects from the rest of the kernel
+void console_print(const char* format, ...);
+void kernel_panic(const char* message);
+int init_paging(void);
+
+#endif /* MEMBENCH_HOST_KERNEL_H */
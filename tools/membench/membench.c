@@ -0,0 +1,556 @@
+/*
+ * OmniOS 2.0 Allocator Benchmark
+ * Replays alloc/free traces against the kernel heap on a Linux host
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+
+#include "omnios.h"
+#include "kernel/memory.h"
+
+// The kernel stores pointers in 32-bit fields, so the arena must sit below 4GB
+// and inside the kernel identity map
+#define ARENA_BASE              0x10000000
+#define ARENA_DEFAULT_MB        64
+#define ARENA_MAX_MB            512
+
+#define DEFAULT_OPS             1000000
+#define DEFAULT_INTERVAL        50000
+
+// Trace operations
+#define OP_ALLOC                0
+#define OP_FREE                 1
+
+typedef struct {
+    uint8_t type;
+    uint32_t slot;
+    uint32_t size;
+    uint32_t alignment;       // 0 for memory_allocate
+} trace_op_t;
+
+typedef struct {
+    const char* name;
+    trace_op_t* ops;
+    uint32_t count;
+    uint32_t capacity;
+    uint32_t slots;           // Highest slot number + 1
+    // Generator state: slot free stack and live slot list
+    uint32_t* free_slots;
+    uint32_t free_count;
+    uint32_t* live;
+    uint32_t live_count;
+} trace_t;
+
+typedef struct {
+    uint32_t ops;
+    uint32_t arena_mb;
+    uint32_t interval;
+    uint32_t seed;
+    bool verify;
+    bool series;
+} bench_options_t;
+
+static uint64_t g_rng_state;
+
+/* Host implementations of the kernel services used by memory.c */
+
+void console_print(const char* format, ...) {
+    va_list args;
+    va_start(args, format);
+    vfprintf(stderr, format, args);
+    va_end(args);
+}
+
+void kernel_panic(const char* message) {
+    fprintf(stderr, "KERNEL PANIC: %s\n", message);
+    abort();
+}
+
+int init_paging(void) {
+    return OMNIOS_SUCCESS;
+}
+
+/* Trace generation */
+
+static uint32_t rng_next(void) {
+    // xorshift64*, deterministic for a given seed
+    g_rng_state ^= g_rng_state >> 12;
+    g_rng_state ^= g_rng_state << 25;
+    g_rng_state ^= g_rng_state >> 27;
+    return (uint32_t)((g_rng_state * 0x2545F4914F6CDD1DULL) >> 32);
+}
+
+static uint32_t rng_range(uint32_t low, uint32_t high) {
+    return low + rng_next() % (high - low + 1);
+}
+
+static void trace_init(trace_t* trace, const char* name, uint32_t max_live) {
+    memset(trace, 0, sizeof(trace_t));
+    trace->name = name;
+    trace->free_slots = malloc(max_live * sizeof(uint32_t));
+    trace->live = malloc(max_live * sizeof(uint32_t));
+    for (uint32_t i = 0; i < max_live; i++) {
+        trace->free_slots[i] = max_live - 1 - i;
+    }
+    trace->free_count = max_live;
+}
+
+static void trace_push(trace_t* trace, uint8_t type, uint32_t slot, uint32_t size, uint32_t alignment) {
+    if (trace->count == trace->capacity) {
+        trace->capacity = trace->capacity ? trace->capacity * 2 : 4096;
+        trace->ops = realloc(trace->ops, trace->capacity * sizeof(trace_op_t));
+        if (!trace->ops) {
+            fprintf(stderr, "membench: out of host memory\n");
+            exit(1);
+        }
+    }
+    
+    trace_op_t* op = &trace->ops[trace->count++];
+    op->type = type;
+    op->slot = slot;
+    op->size = size;
+    op->alignment = alignment;
+    if (slot >= trace->slots) {
+        trace->slots = slot + 1;
+    }
+}
+
+// Allocate into a fresh slot; returns the slot or -1 when the live set is full
+static int trace_alloc(trace_t* trace, uint32_t size, uint32_t alignment) {
+    if (trace->free_count == 0) {
+        return -1;
+    }
+    
+    uint32_t slot = trace->free_slots[--trace->free_count];
+    trace->live[trace->live_count++] = slot;
+    trace_push(trace, OP_ALLOC, slot, size, alignment);
+    return (int)slot;
+}
+
+// Free the live slot at index in the live list
+static void trace_free_index(trace_t* trace, uint32_t index) {
+    uint32_t slot = trace->live[index];
+    trace->live[index] = trace->live[--trace->live_count];
+    trace->free_slots[trace->free_count++] = slot;
+    trace_push(trace, OP_FREE, slot, 0, 0);
+}
+
+static void trace_free_all(trace_t* trace) {
+    while (trace->live_count > 0) {
+        trace_free_index(trace, trace->live_count - 1);
+    }
+}
+
+static void trace_destroy(trace_t* trace) {
+    free(trace->ops);
+    free(trace->free_slots);
+    free(trace->live);
+}
+
+// OmniFS block churn: every lookup or read allocates a 4KB block buffer,
+// parses it and frees it; a bounded set of cached blocks and inode copies
+// stays live, with directory names allocated alongside
+static void generate_omnifs(trace_t* trace, uint32_t ops) {
+    trace_init(trace, "omnifs", 512);
+    
+    while (trace->count < ops) {
+        uint32_t action = rng_next() % 100;
+        
+        if (action < 55) {
+            // Transient block read
+            trace_alloc(trace, 4096, 0);
+            trace_free_index(trace, trace->live_count - 1);
+        } else if (action < 70) {
+            // Directory entry name copy, freed a little later
+            trace_alloc(trace, rng_range(8, 64), 0);
+        } else if (action < 80) {
+            // Inode copy
+            trace_alloc(trace, 92, 0);
+        } else if (action < 90) {
+            // Cached block kept around
+            trace_alloc(trace, 4096, 0);
+        } else if (trace->live_count > 0) {
+            trace_free_index(trace, rng_next() % trace->live_count);
+        }
+        
+        // Cache pressure: evict when the live set grows large
+        while (trace->live_count > 384) {
+            trace_free_index(trace, rng_next() % trace->live_count);
+        }
+    }
+    
+    trace_free_all(trace);
+}
+
+// Package extraction: a manifest plus per-file names and data buffers;
+// data is freed once written out, names and manifest at package end
+static void generate_package(trace_t* trace, uint32_t ops) {
+    trace_init(trace, "package", 1024);
+    
+    while (trace->count < ops) {
+        uint32_t package_base = trace->live_count;
+        trace_alloc(trace, rng_range(2048, 8192), 0);
+        
+        uint32_t files = rng_range(20, 200);
+        for (uint32_t i = 0; i < files && trace->free_count > 2; i++) {
+            trace_alloc(trace, rng_range(16, 128), 0);
+            
+            // File sizes spread over 64B-256KB, weighted toward small files
+            uint32_t size = 1u << rng_range(6, 18);
+            size += rng_next() % size;
+            trace_alloc(trace, size, 0);
+            trace_free_index(trace, trace->live_count - 1);
+        }
+        
+        while (trace->live_count > package_base) {
+            trace_free_index(trace, trace->live_count - 1);
+        }
+    }
+    
+    trace_free_all(trace);
+}
+
+// Random mix: mostly small objects, some page-sized and large buffers,
+// a share of aligned requests, freed in random order
+static void generate_random(trace_t* trace, uint32_t ops) {
+    trace_init(trace, "random", 4096);
+    
+    while (trace->count < ops) {
+        if (trace->live_count > 0 && (trace->free_count == 0 || rng_next() % 2 == 0)) {
+            trace_free_index(trace, rng_next() % trace->live_count);
+            continue;
+        }
+        
+        uint32_t kind = rng_next() % 100;
+        uint32_t size;
+        if (kind < 70) {
+            size = rng_range(1, 256);
+        } else if (kind < 95) {
+            size = rng_range(257, 4096);
+        } else {
+            size = rng_range(4097, 65536);
+        }
+        
+        uint32_t alignment = 0;
+        kind = rng_next() % 100;
+        if (kind < 5) {
+            alignment = 64;
+        } else if (kind < 10) {
+            alignment = 4096;
+        }
+        
+        trace_alloc(trace, size, alignment);
+    }
+    
+    trace_free_all(trace);
+}
+
+/* Trace files: one "a <slot> <size> <alignment>" or "f <slot>" per line */
+
+static int trace_load(trace_t* trace, const char* path) {
+    FILE* file = fopen(path, "r");
+    if (!file) {
+        perror(path);
+        return OMNIOS_ERROR_IO;
+    }
+    
+    memset(trace, 0, sizeof(trace_t));
+    trace->name = path;
+    
+    char type;
+    unsigned slot, size, alignment;
+    char line[128];
+    while (fgets(line, sizeof(line), file)) {
+        if (sscanf(line, " %c %u %u %u", &type, &slot, &size, &alignment) == 4 && type == 'a') {
+            trace_push(trace, OP_ALLOC, slot, size, alignment);
+        } else if (sscanf(line, " %c %u", &type, &slot) == 2 && type == 'f') {
+            trace_push(trace, OP_FREE, slot, 0, 0);
+        }
+    }
+    
+    fclose(file);
+    return OMNIOS_SUCCESS;
+}
+
+static int trace_save(const trace_t* trace, const char* path) {
+    FILE* file = fopen(path, "w");
+    if (!file) {
+        perror(path);
+        return OMNIOS_ERROR_IO;
+    }
+    
+    for (uint32_t i = 0; i < trace->count; i++) {
+        const trace_op_t* op = &trace->ops[i];
+        if (op->type == OP_ALLOC) {
+            fprintf(file, "a %u %u %u\n", op->slot, op->size, op->alignment);
+        } else {
+            fprintf(file, "f %u\n", op->slot);
+        }
+    }
+    
+    fclose(file);
+    return OMNIOS_SUCCESS;
+}
+
+/* Replay */
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static int arena_init(uint32_t arena_mb) {
+    uint32_t length = arena_mb * 1024 * 1024;
+    void* arena = mmap((void*)ARENA_BASE, length, PROT_READ | PROT_WRITE,
+                       MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED_NOREPLACE, -1, 0);
+    if (arena != (void*)ARENA_BASE) {
+        perror("membench: arena mmap");
+        return OMNIOS_ERROR_MEMORY;
+    }
+    
+    // Present the arena to the kernel as the only usable E820 range
+    static boot_memory_map_t map;
+    map.count = 1;
+    map.entries[0].base = ARENA_BASE;
+    map.entries[0].length = length;
+    map.entries[0].type = E820_TYPE_USABLE;
+    map.entries[0].acpi_attributes = 1;
+    
+    return memory_init(&map);
+}
+
+// Mark the first and last byte so overlapping blocks show up on free
+static inline uint8_t slot_pattern(uint32_t slot) {
+    return (uint8_t)(slot ^ (slot >> 8) ^ 0xA5);
+}
+
+static void fill_pattern(uint8_t* ptr, uint32_t size, uint32_t slot) {
+    ptr[0] = slot_pattern(slot);
+    ptr[size - 1] = slot_pattern(slot);
+}
+
+static bool check_pattern(const uint8_t* ptr, uint32_t size, uint32_t slot) {
+    return ptr[0] == slot_pattern(slot) && ptr[size - 1] == slot_pattern(slot);
+}
+
+static int replay(const trace_t* trace, const bench_options_t* options) {
+    if (arena_init(options->arena_mb) != OMNIOS_SUCCESS) {
+        return 1;
+    }
+    
+    void** pointers = calloc(trace->slots, sizeof(void*));
+    uint32_t* sizes = calloc(trace->slots, sizeof(uint32_t));
+    uint32_t baseline_used = memory_get_used();
+    uint32_t peak_used = 0;
+    uint32_t peak_heap_fragmentation = 0;
+    uint64_t elapsed = 0;
+    memory_stats_t stats;
+    
+    if (options->series) {
+        printf("%-10s %10s %10s %10s %10s\n", "op", "used KB", "heap KB", "heap frag", "page frag");
+    }
+    
+    for (uint32_t start = 0; start < trace->count; start += options->interval) {
+        uint32_t end = start + options->interval;
+        if (end > trace->count) {
+            end = trace->count;
+        }
+        
+        uint64_t begin = now_ns();
+        for (uint32_t i = start; i < end; i++) {
+            const trace_op_t* op = &trace->ops[i];
+            
+            if (op->type == OP_FREE) {
+                if (options->verify && pointers[op->slot] &&
+                    !check_pattern(pointers[op->slot], sizes[op->slot], op->slot)) {
+                    fprintf(stderr, "membench: %s: corruption in slot %u at op %u\n",
+                            trace->name, op->slot, i);
+                    return 1;
+                }
+                
+                memory_free(pointers[op->slot]);
+                pointers[op->slot] = NULL;
+                continue;
+            }
+            
+            void* ptr = op->alignment ? memory_allocate_aligned(op->size, op->alignment)
+                                      : memory_allocate(op->size);
+            if (!ptr) {
+                fprintf(stderr, "membench: %s: allocation of %u bytes failed at op %u\n",
+                        trace->name, op->size, i);
+                return 1;
+            }
+            
+            if (options->verify) {
+                if (op->alignment && ((uintptr_t)ptr & (op->alignment - 1))) {
+                    fprintf(stderr, "membench: %s: misaligned pointer at op %u\n", trace->name, i);
+                    return 1;
+                }
+                fill_pattern(ptr, op->size, op->slot);
+            }
+            
+            pointers[op->slot] = ptr;
+            sizes[op->slot] = op->size;
+        }
+        elapsed += now_ns() - begin;
+        
+        // Sample between timed batches so the stats walk is not measured
+        memory_get_stats(&stats);
+        uint32_t used = stats.used_memory - baseline_used;
+        if (used > peak_used) {
+            peak_used = used;
+        }
+        
+        if (stats.heap_fragmentation > peak_heap_fragmentation) {
+            peak_heap_fragmentation = stats.heap_fragmentation;
+        }
+        
+        if (options->series) {
+            printf("%-10u %10u %10u %9u%% %9u%%\n", end, used / 1024, stats.heap_used / 1024,
+                   stats.heap_fragmentation, stats.page_fragmentation);
+        }
+    }
+    
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    
+    printf("%-10s %10u %8.1f %12u %12ld %9u%% %9u%% %10u\n",
+           trace->name, trace->count,
+           trace->count ? (double)elapsed / trace->count : 0.0,
+           peak_used / 1024, usage.ru_maxrss,
+           peak_heap_fragmentation, stats.page_fragmentation,
+           (memory_get_used() - baseline_used) / 1024);
+    
+    free(pointers);
+    free(sizes);
+    return 0;
+}
+
+// Each trace runs in its own process: fresh allocator state and its own peak RSS
+static int run_trace(const trace_t* trace, const bench_options_t* options) {
+    fflush(stdout);
+    pid_t pid = fork();
+    if (pid < 0) {
+        perror("membench: fork");
+        return 1;
+    }
+    
+    if (pid == 0) {
+        int result = replay(trace, options);
+        fflush(stdout);
+        _exit(result);
+    }
+    
+    int status;
+    waitpid(pid, &status, 0);
+    return (WIFEXITED(status) && WEXITSTATUS(status) == 0) ? 0 : 1;
+}
+
+static void usage(const char* program) {
+    fprintf(stderr,
+            "Usage: %s [options] [omnifs|package|random|all]\n"
+            "  -n OPS       operations per generated trace (default %d)\n"
+            "  -m MB        arena size in MB (default %d)\n"
+            "  -s SEED      generator seed (default 1)\n"
+            "  -i OPS       sampling interval (default %d)\n"
+            "  -r FILE      replay a trace file instead of generating\n"
+            "  -d FILE      write the generated trace to FILE\n"
+            "  -c           verify contents and alignment\n"
+            "  -t           print fragmentation over time\n",
+            program, DEFAULT_OPS, ARENA_DEFAULT_MB, DEFAULT_INTERVAL);
+}
+
+int main(int argc, char** argv) {
+    bench_options_t options = {
+        .ops = DEFAULT_OPS,
+        .arena_mb = ARENA_DEFAULT_MB,
+        .interval = DEFAULT_INTERVAL,
+        .seed = 1,
+    };
+    const char* replay_path = NULL;
+    const char* dump_path = NULL;
+    int opt;
+    
+    while ((opt = getopt(argc, argv, "n:m:s:i:r:d:cth")) != -1) {
+        switch (opt) {
+            case 'n': options.ops = strtoul(optarg, NULL, 0); break;
+            case 'm': options.arena_mb = strtoul(optarg, NULL, 0); break;
+            case 's': options.seed = strtoul(optarg, NULL, 0); break;
+            case 'i': options.interval = strtoul(optarg, NULL, 0); break;
+            case 'r': replay_path = optarg; break;
+            case 'd': dump_path = optarg; break;
+            case 'c': options.verify = true; break;
+            case 't': options.series = true; break;
+            default:
+                usage(argv[0]);
+                return opt == 'h' ? 0 : 2;
+        }
+    }
+    
+    if (options.arena_mb < 4 || options.arena_mb > ARENA_MAX_MB || options.interval == 0) {
+        usage(argv[0]);
+        return 2;
+    }
+    
+    const char* which = optind < argc ? argv[optind] : "all";
+    static const struct {
+        const char* name;
+        void (*generate)(trace_t* trace, uint32_t ops);
+    } generators[] = {
+        { "omnifs", generate_omnifs },
+        { "package", generate_package },
+        { "random", generate_random },
+    };
+    
+    printf("%-10s %10s %8s %12s %12s %10s %10s %10s\n",
+           "trace", "ops", "ns/op", "peak KB", "peak RSS KB", "heap frag", "page frag", "leak KB");
+    
+    if (replay_path) {
+        trace_t trace;
+        if (trace_load(&trace, replay_path) != OMNIOS_SUCCESS) {
+            return 1;
+        }
+        int result = run_trace(&trace, &options);
+        trace_destroy(&trace);
+        return result;
+    }
+    
+    int result = 0;
+    bool matched = false;
+    for (size_t i = 0; i < sizeof(generators) / sizeof(generators[0]); i++) {
+        if (strcmp(which, "all") != 0 && strcmp(which, generators[i].name) != 0) {
+            continue;
+        }
+        
+        matched = true;
+        g_rng_state = options.seed * 0x9E3779B97F4A7C15ULL + 1;
+        
+        trace_t trace;
+        generators[i].generate(&trace, options.ops);
+        if (dump_path) {
+            trace_save(&trace, dump_path);
+        }
+        
+        result |= run_trace(&trace, &options);
+        trace_destroy(&trace);
+    }
+    
+    if (!matched) {
+        usage(argv[0]);
+        return 2;
+    }
+    
+    return result;
+}
@@ -0,0 +1,1025 @@
+/*
+ * OmniOS 2.0 fsck.omnifs
+ * Checks an OmniFS image without mounting it. Committed journal
+ * transactions are replayed first with the kernel's journal code, then
+ * the image is mapped read-only and checked in four passes, each spread
+ * over worker threads a group at a time:
+ *   1. metadata block checksums (version 5), by block group
+ *   2. inodes: block maps, extent trees and directory contents, by
+ *      inode table group; every block and name found is recorded
+ *   3. connectivity: every inode named once and reachable from the root
+ *   4. block bitmap and reference counts against the blocks found, by
+ *      block group
+ * Exit status follows fsck(8): 0 clean, 4 errors left, 8 not checked.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "omnios.h"
+#include "kernel/crc32c.h"
+#include "fs/bcache.h"
+#include "fs/omnifs_format.h"
+#include "fs/omnifs_dir.h"
+#include "fs/omnifs_journal.h"
+
+#define FSCK_EXIT_CLEAN         0
+#define FSCK_EXIT_ERRORS        4
+#define FSCK_EXIT_FAILED        8
+
+#define FSCK_MAX_THREADS        64
+#define FSCK_MAX_REPORTS        100     // Error lines printed without -v
+#define FSCK_INODE_GROUP        1024    // Inodes per pass 2 and 3 work item
+#define FSCK_MAX_EXTENT_DEPTH   8
+#define FSCK_MAX_PATH_DEPTH     4096    // Parent links followed before calling it a loop
+#define FSCK_NAME_MAX           255
+
+#define DIRENT_HEADER_SIZE      sizeof(omnifs_dirent_t)
+#define DIRENT_SIZE(name_len)   ((DIRENT_HEADER_SIZE + (name_len) + 3) & ~3)
+
+// What a block was found holding besides file data
+#define BLOCK_DATA              0
+#define BLOCK_EXTENT_NODE       1
+#define BLOCK_DIRECTORY         2
+
+// Reachability of an inode, settled in pass 3
+#define REACH_UNKNOWN           0
+#define REACH_ROOT              1
+#define REACH_LOST              2
+
+typedef void (*fsck_task_t)(uint32_t group);
+
+// The image and everything the passes record about it
+typedef struct {
+    const uint8_t* image;
+    uint64_t image_size;
+    omnifs_superblock_t superblock;
+    uint32_t block_size;
+    uint32_t total_blocks;
+    uint32_t inode_count;
+    uint32_t inode_size;
+    uint32_t payload;         // Table bytes per block
+    uint32_t per_block;       // Inodes per table block, 0 when records straddle blocks
+    uint32_t group_blocks;    // Blocks per block group: one bitmap block's worth
+    bool checksums;
+    
+    uint8_t* block_bitmap;
+    uint8_t* inode_bitmap;
+    uint16_t* refcounts;      // NULL before version 4
+    
+    uint32_t* owners;         // Extents and nodes claiming each block
+    uint8_t* kinds;           // BLOCK_* of each claimed block
+    uint32_t* parents;        // Directory naming each inode, 0 for none
+    uint8_t* named_types;     // File type of that name
+    uint8_t* reach;           // REACH_* of each inode
+    
+    uint64_t errors;
+    uint64_t files;
+    uint64_t directories;
+    uint64_t used_blocks;     // Set in the bitmap
+} fsck_state_t;
+
+// One inode being checked in pass 2
+typedef struct {
+    uint32_t number;
+    const omnifs_inode_t* inode;
+    uint32_t* map;            // Disk block of each file block, directories only
+    uint32_t map_blocks;
+    uint64_t mapped;          // Blocks its extents cover
+    bool damaged;             // Map incomplete; counts are not compared
+} fsck_file_t;
+
+// Hash range of names a directory leaf may hold
+typedef struct {
+    uint32_t low;
+    uint32_t high;
+    bool bounded;             // False for the last leaf
+    bool continued;           // Names hashing to high may be here as well
+} fsck_range_t;
+
+// A live directory record, for the duplicate name check
+typedef struct {
+    uint32_t hash;
+    uint8_t length;
+    const char* name;
+} fsck_name_t;
+
+typedef struct {
+    fsck_name_t* names;
+    uint32_t count;
+    uint32_t capacity;
+} fsck_names_t;
+
+static fsck_state_t g_fsck;
+static uint32_t g_threads = 1;
+static bool g_verbose = false;
+static uint32_t g_next_group;
+static uint32_t g_groups;
+static fsck_task_t g_task;
+static uint64_t g_reported;
+static pthread_mutex_t g_report_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void fsck_error(const char* format, ...) {
+    __atomic_fetch_add(&g_fsck.errors, 1, __ATOMIC_RELAXED);
+    uint64_t reported = __atomic_fetch_add(&g_reported, 1, __ATOMIC_RELAXED);
+    if (!g_verbose && reported >= FSCK_MAX_REPORTS) {
+        return;
+    }
+    
+    va_list args;
+    va_start(args, format);
+    pthread_mutex_lock(&g_report_lock);
+    vprintf(format, args);
+    putchar('\n');
+    if (!g_verbose && reported == FSCK_MAX_REPORTS - 1) {
+        printf("further errors are counted but not listed; -v lists them all\n");
+    }
+    pthread_mutex_unlock(&g_report_lock);
+    va_end(args);
+}
+
+static void* fsck_worker(void* unused) {
+    uint32_t group;
+    while ((group = __atomic_fetch_add(&g_next_group, 1, __ATOMIC_RELAXED)) < g_groups) {
+        g_task(group);
+    }
+    return NULL;
+}
+
+// Run task once for every group, spread over the worker threads
+static void fsck_run(const char* name, fsck_task_t task, uint32_t groups) {
+    uint64_t start = now_ns();
+    pthread_t threads[FSCK_MAX_THREADS];
+    uint32_t count = g_threads < groups ? g_threads : groups;
+    
+    g_task = task;
+    g_groups = groups;
+    g_next_group = 0;
+    for (uint32_t i = 1; i < count; i++) {
+        if (pthread_create(&threads[i], NULL, fsck_worker, NULL) != 0) {
+            count = i;
+            break;
+        }
+    }
+    fsck_worker(NULL);
+    for (uint32_t i = 1; i < count; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    
+    if (g_verbose) {
+        printf("%-14s %6u groups %9.1f ms\n", name, groups, (double)(now_ns() - start) / 1e6);
+    }
+}
+
+static inline bool bit_set(const uint8_t* bitmap, uint32_t bit) {
+    return (bitmap[bit / 8] >> (bit % 8)) & 1;
+}
+
+static inline const uint8_t* fsck_block(uint32_t block) {
+    return g_fsck.image + (uint64_t)block * g_fsck.block_size;
+}
+
+static bool fsck_block_sealed(uint32_t block) {
+    const uint8_t* data = fsck_block(block);
+    uint32_t stored;
+    memcpy(&stored, data + g_fsck.block_size - OMNIFS_CHECKSUM_SIZE, sizeof(stored));
+    return crc32c(0, data, g_fsck.block_size - OMNIFS_CHECKSUM_SIZE) == stored;
+}
+
+// Copy size bytes of a table starting at block start, payload bytes a block
+static void fsck_gather(uint32_t start, void* table, uint32_t size) {
+    for (uint32_t done = 0; done < size; done += g_fsck.payload) {
+        uint32_t bytes = size - done < g_fsck.payload ? size - done : g_fsck.payload;
+        memcpy((uint8_t*)table + done, fsck_block(start + done / g_fsck.payload), bytes);
+    }
+}
+
+static void fsck_read_inode(uint32_t number, omnifs_inode_t* inode) {
+    uint64_t offset = (uint64_t)g_fsck.superblock.inode_table * g_fsck.block_size;
+    if (g_fsck.per_block) {
+        offset += (uint64_t)(number / g_fsck.per_block) * g_fsck.block_size +
+                  (number % g_fsck.per_block) * g_fsck.inode_size;
+    } else {
+        offset += (uint64_t)number * g_fsck.inode_size;
+    }
+    
+    memset(inode, 0, sizeof(omnifs_inode_t));
+    memcpy(inode, g_fsck.image + offset, g_fsck.inode_size);
+}
+
+static const char* fsck_region(uint32_t block) {
+    const omnifs_superblock_t* sb = &g_fsck.superblock;
+    if (block == 0) {
+        return "superblock";
+    } else if (block < sb->inode_bitmap) {
+        return "block bitmap";
+    } else if (block < sb->inode_table) {
+        return "inode bitmap";
+    } else if (block >= sb->refcount_table && block < sb->refcount_table + sb->refcount_blocks) {
+        return "reference counts";
+    }
+    return "inode table";
+}
+
+// Pass 1: every table block of the group closes with a valid checksum
+static void check_checksums(uint32_t group) {
+    const omnifs_superblock_t* sb = &g_fsck.superblock;
+    uint32_t start = group * g_fsck.group_blocks;
+    uint32_t end = start + g_fsck.group_blocks < sb->data_blocks ? start + g_fsck.group_blocks : sb->data_blocks;
+    
+    for (uint32_t block = start; block < end; block++) {
+        if (block >= sb->journal_start && block < sb->journal_start + sb->journal_blocks) {
+            continue; // Not covered
+        }
+        if (!fsck_block_sealed(block)) {
+            fsck_error("block %u (%s) fails its checksum", block, fsck_region(block));
+        }
+    }
+}
+
+// Count an extent's blocks as owned by file
+static bool claim_blocks(fsck_file_t* file, uint32_t start, uint32_t length, uint8_t kind) {
+    const omnifs_superblock_t* sb = &g_fsck.superblock;
+    if (start < sb->data_blocks || start >= g_fsck.total_blocks || length > g_fsck.total_blocks - start) {
+        fsck_error("inode %u maps blocks %u-%u outside the data area", file->number, start, start + length - 1);
+        file->damaged = true;
+        return false;
+    }
+    
+    for (uint32_t i = 0; i < length; i++) {
+        __atomic_fetch_add(&g_fsck.owners[start + i], 1, __ATOMIC_RELAXED);
+        if (kind != BLOCK_DATA) {
+            g_fsck.kinds[start + i] = kind;
+        }
+    }
+    return true;
+}
+
+static void map_blocks(fsck_file_t* file, uint32_t logical, uint32_t start, uint32_t length) {
+    for (uint32_t i = 0; i < length && file->map && logical + i < file->map_blocks; i++) {
+        file->map[logical + i] = start + i;
+    }
+}
+
+static uint32_t extent_node_max(void) {
+    uint32_t tail = g_fsck.checksums ? OMNIFS_CHECKSUM_SIZE : 0;
+    return (g_fsck.block_size - sizeof(omnifs_extent_header_t) - tail) / sizeof(omnifs_extent_t);
+}
+
+// Check one extent tree node covering file blocks [low, high) and
+// everything below it
+static void check_extent_node(fsck_file_t* file, const omnifs_extent_header_t* node, uint32_t max,
+                              int depth, uint32_t low, uint64_t high) {
+    if (node->magic != OMNIFS_EXTENT_MAGIC || node->max > max || node->entries > node->max ||
+        (depth >= 0 && node->depth != depth) || node->depth >= FSCK_MAX_EXTENT_DEPTH) {
+        fsck_error("inode %u has a damaged extent node (depth %u, %u of %u entries)", file->number,
+                   node->depth, node->entries, node->max);
+        file->damaged = true;
+        return;
+    }
+    
+    uint64_t previous_end = low;
+    for (uint32_t i = 0; i < node->entries; i++) {
+        if (node->depth == 0) {
+            const omnifs_extent_t* extent = &((const omnifs_extent_t*)(node + 1))[i];
+            if (extent->length == 0 || extent->logical < previous_end ||
+                (uint64_t)extent->logical + extent->length > high) {
+                fsck_error("inode %u has a misplaced extent at file block %u", file->number, extent->logical);
+                file->damaged = true;
+                continue;
+            }
+            
+            previous_end = (uint64_t)extent->logical + extent->length;
+            if (claim_blocks(file, extent->start, extent->length, BLOCK_DATA)) {
+                map_blocks(file, extent->logical, extent->start, extent->length);
+                file->mapped += extent->length;
+            }
+            continue;
+        }
+        
+        const omnifs_extent_index_t* index = &((const omnifs_extent_index_t*)(node + 1))[i];
+        uint64_t next = i + 1 < node->entries ? ((const omnifs_extent_index_t*)(node + 1))[i + 1].logical : high;
+        if (index->logical < previous_end || next <= index->logical || next > high) {
+            fsck_error("inode %u has a misplaced index entry at file block %u", file->number, index->logical);
+            file->damaged = true;
+            continue;
+        }
+        previous_end = index->logical + 1;
+        
+        if (!claim_blocks(file, index->block, 1, BLOCK_EXTENT_NODE)) {
+            continue;
+        }
+        if (g_fsck.checksums && !fsck_block_sealed(index->block)) {
+            fsck_error("extent node %u of inode %u fails its checksum", index->block, file->number);
+            file->damaged = true;
+            continue;
+        }
+        check_extent_node(file, (const omnifs_extent_header_t*)fsck_block(index->block), extent_node_max(),
+                          node->depth - 1, index->logical, next);
+    }
+}
+
+// Version 1 block pointers: direct blocks and one indirect block
+static void check_pointers(fsck_file_t* file) {
+    const omnifs_inode_t* inode = file->inode;
+    for (uint32_t i = 0; i < OMNIFS_DIRECT_BLOCKS; i++) {
+        if (inode->direct[i] && claim_blocks(file, inode->direct[i], 1, BLOCK_DATA)) {
+            map_blocks(file, i, inode->direct[i], 1);
+        }
+    }
+    
+    if (inode->indirect && claim_blocks(file, inode->indirect, 1, BLOCK_EXTENT_NODE)) {
+        const uint32_t* pointers = (const uint32_t*)fsck_block(inode->indirect);
+        for (uint32_t i = 0; i < g_fsck.block_size / sizeof(uint32_t); i++) {
+            if (pointers[i] && claim_blocks(file, pointers[i], 1, BLOCK_DATA)) {
+                map_blocks(file, OMNIFS_DIRECT_BLOCKS + i, pointers[i], 1);
+            }
+        }
+    }
+}
+
+static bool names_add(fsck_names_t* names, const char* name, uint8_t length) {
+    if (names->count == names->capacity) {
+        uint32_t capacity = names->capacity ? names->capacity * 2 : 64;
+        fsck_name_t* grown = realloc(names->names, capacity * sizeof(fsck_name_t));
+        if (!grown) {
+            return false;
+        }
+        names->names = grown;
+        names->capacity = capacity;
+    }
+    
+    fsck_name_t* entry = &names->names[names->count++];
+    entry->hash = omnifs_dir_hash(name, length);
+    entry->length = length;
+    entry->name = name;
+    return true;
+}
+
+static int compare_names(const void* a, const void* b) {
+    const fsck_name_t* first = a;
+    const fsck_name_t* second = b;
+    if (first->hash != second->hash) {
+        return first->hash < second->hash ? -1 : 1;
+    }
+    if (first->length != second->length) {
+        return first->length < second->length ? -1 : 1;
+    }
+    return memcmp(first->name, second->name, first->length);
+}
+
+// A live record of directory dir
+static void check_name(uint32_t dir, const omnifs_dirent_t* entry, fsck_names_t* names) {
+    uint32_t child = entry->inode;
+    if (entry->name_len == 0 || memchr(entry->name, '/', entry->name_len) ||
+        memchr(entry->name, '\0', entry->name_len)) {
+        fsck_error("directory %u has an entry with a bad name for inode %u", dir, child);
+        return;
+    }
+    if (child >= g_fsck.inode_count || !bit_set(g_fsck.inode_bitmap, child)) {
+        fsck_error("directory %u: '%.*s' names free inode %u", dir, entry->name_len, entry->name, child);
+        return;
+    }
+    
+    uint32_t expected = 0;
+    if (!__atomic_compare_exchange_n(&g_fsck.parents[child], &expected, dir, false, __ATOMIC_RELAXED,
+                                     __ATOMIC_RELAXED)) {
+        fsck_error("inode %u is named '%.*s' in directory %u and also in directory %u", child,
+                   entry->name_len, entry->name, dir, expected);
+        return;
+    }
+    g_fsck.named_types[child] = entry->file_type;
+    names_add(names, entry->name, entry->name_len);
+}
+
+// Walk a chain of records over size bytes. Leaves must be filled exactly
+// and, on version 5, leave the checksum in the slack of the last record.
+static bool check_records(uint32_t dir, const uint8_t* data, uint32_t size, bool leaf, const fsck_range_t* range,
+                          fsck_names_t* names) {
+    uint32_t offset = 0;
+    while (offset < size) {
+        const omnifs_dirent_t* entry = (const omnifs_dirent_t*)(data + offset);
+        if (offset + DIRENT_HEADER_SIZE > size || entry->rec_len < DIRENT_HEADER_SIZE || entry->rec_len % 4 ||
+            entry->rec_len > size - offset || DIRENT_HEADER_SIZE + entry->name_len > entry->rec_len) {
+            fsck_error("directory %u has a damaged record at offset %u", dir, offset);
+            return false;
+        }
+        
+        if (entry->inode) {
+            if (range) {
+                uint32_t hash = omnifs_dir_hash(entry->name, entry->name_len);
+                if (hash < range->low || (range->bounded && (hash > range->high ||
+                                                             (hash == range->high && !range->continued)))) {
+                    fsck_error("directory %u: '%.*s' is in the wrong leaf for its hash", dir, entry->name_len,
+                               entry->name);
+                }
+            }
+            check_name(dir, entry, names);
+        }
+        
+        uint32_t used = entry->inode ? DIRENT_SIZE(entry->name_len) : 0;
+        if (leaf && g_fsck.checksums && offset + entry->rec_len == size &&
+            offset + used > size - OMNIFS_CHECKSUM_SIZE) {
+            fsck_error("directory %u: the last record of a leaf covers the checksum", dir);
+        }
+        offset += entry->rec_len;
+    }
+    return true;
+}
+
+static bool dx_node_valid(const omnifs_dx_node_t* node) {
+    uint32_t tail = g_fsck.checksums ? OMNIFS_CHECKSUM_SIZE : 0;
+    return node->inode == 0 && node->rec_len == g_fsck.block_size && node->magic == OMNIFS_DX_MAGIC &&
+           node->hash_version == OMNIFS_DX_HASH_FNV1A && node->count > 0 && node->count <= node->limit &&
+           node->limit <= (g_fsck.block_size - sizeof(omnifs_dx_node_t)) / sizeof(omnifs_dx_entry_t) &&
+           sizeof(omnifs_dx_node_t) + node->count * sizeof(omnifs_dx_entry_t) <= g_fsck.block_size - tail;
+}
+
+static const uint8_t* dir_block(fsck_file_t* file, uint32_t block) {
+    uint32_t physical = file->map[block];
+    if (physical == 0) {
+        fsck_error("directory %u has no block %u", file->number, block);
+        return NULL;
+    }
+    if (g_fsck.checksums && !fsck_block_sealed(physical)) {
+        fsck_error("block %u of directory %u fails its checksum", block, file->number);
+        return NULL;
+    }
+    return fsck_block(physical);
+}
+
+// Check index node block, levels above the leaves, and what it points at
+static void check_dx_node(fsck_file_t* file, uint32_t block, uint32_t levels, const fsck_range_t* range,
+                          uint8_t* seen, fsck_names_t* names) {
+    const uint8_t* data = dir_block(file, block);
+    if (!data) {
+        return;
+    }
+    
+    const omnifs_dx_node_t* node = (const omnifs_dx_node_t*)data;
+    if (!dx_node_valid(node)) {
+        fsck_error("directory %u has a damaged index block %u", file->number, block);
+        return;
+    }
+    
+    const omnifs_dx_entry_t* entries = (const omnifs_dx_entry_t*)(node + 1);
+    for (uint32_t i = 0; i < node->count; i++) {
+        fsck_range_t child = *range;
+        if (i > 0) {
+            child.low = entries[i].hash & ~OMNIFS_DX_CONTINUED;
+        }
+        if (i + 1 < node->count) {
+            child.high = entries[i + 1].hash & ~OMNIFS_DX_CONTINUED;
+            child.bounded = true;
+            child.continued = (entries[i + 1].hash & OMNIFS_DX_CONTINUED) != 0;
+        }
+        if (child.low < range->low || (child.bounded && child.high < child.low)) {
+            fsck_error("directory %u: index block %u is out of hash order", file->number, block);
+            return;
+        }
+        
+        uint32_t target = entries[i].block;
+        if (target == 0 || target >= file->map_blocks || seen[target]) {
+            fsck_error("directory %u: index block %u points at block %u", file->number, block, target);
+            continue;
+        }
+        seen[target] = 1;
+        
+        if (levels > 0) {
+            check_dx_node(file, target, levels - 1, &child, seen, names);
+            continue;
+        }
+        
+        const uint8_t* leaf = dir_block(file, target);
+        if (leaf) {
+            check_records(file->number, leaf, g_fsck.block_size, true, &child, names);
+        }
+    }
+}
+
+static void check_directory(fsck_file_t* file) {
+    const omnifs_inode_t* inode = file->inode;
+    fsck_names_t names = { NULL, 0, 0 };
+    uint8_t* copy = NULL;
+    
+    if (inode->flags & OMNIFS_INODE_INLINE) {
+        check_records(file->number, inode->inline_data, inode->size, false, NULL, &names);
+    } else if (!file->damaged) {
+        const omnifs_dx_node_t* root = NULL;
+        if (g_fsck.superblock.version >= OMNIFS_VERSION_EXTENTS && inode->size >= 2 * g_fsck.block_size &&
+            file->map[0]) {
+            root = (const omnifs_dx_node_t*)fsck_block(file->map[0]);
+        }
+        
+        if (root && root->inode == 0 && root->magic == OMNIFS_DX_MAGIC) {
+            // Every block below the root is an index node or leaf named once
+            uint8_t* seen = calloc(file->map_blocks, 1);
+            fsck_range_t range = { 0, 0, false, false };
+            if (!seen) {
+                fsck_error("directory %u not checked: out of memory", file->number);
+            } else if (root->levels >= OMNIFS_DX_MAX_DEPTH) {
+                fsck_error("directory %u has a %u level index", file->number, root->levels + 1);
+            } else {
+                seen[0] = 1;
+                check_dx_node(file, 0, root->levels, &range, seen, &names);
+                for (uint32_t i = 0; i < file->map_blocks; i++) {
+                    if (!seen[i]) {
+                        fsck_error("directory %u: block %u is not in its index", file->number, i);
+                    }
+                }
+            }
+            free(seen);
+        } else {
+            // Linear records may cross block boundaries; check a copy
+            copy = malloc(inode->size ? inode->size : 1);
+            bool whole = copy != NULL;
+            for (uint32_t i = 0; i < file->map_blocks && whole; i++) {
+                const uint8_t* data = dir_block(file, i);
+                uint32_t bytes = inode->size - i * g_fsck.block_size;
+                if (!data) {
+                    whole = false;
+                } else {
+                    memcpy(copy + i * g_fsck.block_size, data, bytes < g_fsck.block_size ? bytes : g_fsck.block_size);
+                }
+            }
+            if (whole) {
+                check_records(file->number, copy, inode->size, false, NULL, &names);
+            }
+        }
+    }
+    
+    qsort(names.names, names.count, sizeof(fsck_name_t), compare_names);
+    for (uint32_t i = 1; i < names.count; i++) {
+        if (compare_names(&names.names[i - 1], &names.names[i]) == 0) {
+            fsck_error("directory %u holds '%.*s' more than once", file->number, names.names[i].length,
+                       names.names[i].name);
+        }
+    }
+    free(names.names);
+    free(copy);
+}
+
+static void check_inode(uint32_t number) {
+    omnifs_inode_t inode;
+    fsck_read_inode(number, &inode);
+    
+    uint32_t type = inode.mode & 0xF000;
+    if (type != 0x4000 && type != 0x8000) {
+        fsck_error("inode %u has unknown type %06o", number, inode.mode);
+        return;
+    }
+    
+    bool directory = type == 0x4000;
+    __atomic_fetch_add(directory ? &g_fsck.directories : &g_fsck.files, 1, __ATOMIC_RELAXED);
+    
+    fsck_file_t file = { number, &inode, NULL, 0, 0, false };
+    if (directory && !(inode.flags & OMNIFS_INODE_INLINE)) {
+        file.map_blocks = (inode.size + g_fsck.block_size - 1) / g_fsck.block_size;
+        file.map = calloc(file.map_blocks ? file.map_blocks : 1, sizeof(uint32_t));
+        if (!file.map) {
+            fsck_error("inode %u not checked: out of memory", number);
+            return;
+        }
+    }
+    
+    if (inode.flags & OMNIFS_INODE_INLINE) {
+        if (g_fsck.superblock.version < OMNIFS_VERSION_INLINE || inode.size > OMNIFS_INLINE_SIZE ||
+            inode.blocks != 0) {
+            fsck_error("inode %u has bad inline contents (%u bytes)", number, inode.size);
+            file.damaged = true;
+        }
+    } else if (g_fsck.superblock.version >= OMNIFS_VERSION_EXTENTS) {
+        check_extent_node(&file, (const omnifs_extent_header_t*)inode.extent_root, OMNIFS_EXTENT_ROOT_ENTRIES,
+                          -1, 0, (uint64_t)UINT32_MAX + 1);
+        if (!file.damaged && file.mapped != inode.blocks) {
+            fsck_error("inode %u counts %u blocks but maps %llu", number, inode.blocks,
+                       (unsigned long long)file.mapped);
+        }
+    } else {
+        check_pointers(&file);
+    }
+    
+    if (directory) {
+        if (inode.flags & OMNIFS_INODE_COMPRESSED) {
+            fsck_error("directory %u is marked compressed", number);
+        }
+        for (uint32_t i = 0; i < file.map_blocks; i++) {
+            if (file.map[i]) {
+                g_fsck.kinds[file.map[i]] = BLOCK_DIRECTORY;
+            }
+        }
+        check_directory(&file);
+    }
+    free(file.map);
+}
+
+// Pass 2: allocated inodes of one group
+static void check_inodes(uint32_t group) {
+    uint32_t start = group * FSCK_INODE_GROUP;
+    uint32_t end = start + FSCK_INODE_GROUP < g_fsck.inode_count ? start + FSCK_INODE_GROUP : g_fsck.inode_count;
+    for (uint32_t number = start ? start : 1; number < end; number++) {
+        if (bit_set(g_fsck.inode_bitmap, number)) {
+            check_inode(number);
+        }
+    }
+}
+
+// Follow parent links up from number until the root or a settled inode
+static uint8_t resolve_reach(uint32_t number) {
+    uint32_t root = g_fsck.superblock.root_inode;
+    uint32_t current = number;
+    uint8_t reach = REACH_LOST;
+    
+    for (uint32_t steps = 0; steps < FSCK_MAX_PATH_DEPTH; steps++) {
+        if (current == root) {
+            reach = REACH_ROOT;
+            break;
+        }
+        uint8_t known = __atomic_load_n(&g_fsck.reach[current], __ATOMIC_RELAXED);
+        if (known != REACH_UNKNOWN) {
+            reach = known;
+            break;
+        }
+        current = g_fsck.parents[current];
+        if (current == 0) {
+            break;
+        }
+    }
+    
+    // Every thread walking this path settles on the same answer
+    for (current = number; current != 0 && current != root; current = g_fsck.parents[current]) {
+        if (__atomic_exchange_n(&g_fsck.reach[current], reach, __ATOMIC_RELAXED) == reach) {
+            break;
+        }
+    }
+    return reach;
+}
+
+// Pass 3: every allocated inode but the root has one name on a path
+// from the root, of the right file type
+static void check_connectivity(uint32_t group) {
+    uint32_t root = g_fsck.superblock.root_inode;
+    uint32_t start = group * FSCK_INODE_GROUP;
+    uint32_t end = start + FSCK_INODE_GROUP < g_fsck.inode_count ? start + FSCK_INODE_GROUP : g_fsck.inode_count;
+    
+    for (uint32_t number = start ? start : 1; number < end; number++) {
+        if (!bit_set(g_fsck.inode_bitmap, number) || number == root) {
+            continue;
+        }
+        
+        uint32_t parent = g_fsck.parents[number];
+        if (parent == 0) {
+            fsck_error("inode %u is allocated but in no directory", number);
+            continue;
+        }
+        if (resolve_reach(number) != REACH_ROOT) {
+            fsck_error("inode %u is in directory %u, which is cut off from the root", number, parent);
+        }
+        
+        omnifs_inode_t inode;
+        fsck_read_inode(number, &inode);
+        uint8_t type = (inode.mode & 0xF000) == 0x4000 ? OMNIFS_FILE_TYPE_DIR : OMNIFS_FILE_TYPE_REG;
+        if (g_fsck.named_types[number] != type) {
+            fsck_error("inode %u is listed in directory %u with file type %u, not %u", number, parent,
+                       g_fsck.named_types[number], type);
+        }
+    }
+}
+
+// Pass 4: the bitmap and reference counts of one block group match the
+// blocks pass 2 found
+static void check_blocks(uint32_t group) {
+    const omnifs_superblock_t* sb = &g_fsck.superblock;
+    uint32_t start = group * g_fsck.group_blocks;
+    uint32_t end = start + g_fsck.group_blocks < g_fsck.total_blocks ? start + g_fsck.group_blocks :
+                   g_fsck.total_blocks;
+    uint64_t used = 0;
+    
+    for (uint32_t block = start; block < end; block++) {
+        uint32_t owners = g_fsck.owners[block];
+        bool marked = bit_set(g_fsck.block_bitmap, block);
+        used += marked;
+        
+        if (block < sb->data_blocks) {
+            if (!marked) {
+                fsck_error("metadata block %u is marked free", block);
+            }
+            continue;
+        }
+        
+        if (owners > 0 && !marked) {
+            fsck_error("block %u is in use but marked free", block);
+        } else if (owners == 0 && marked) {
+            fsck_error("block %u is marked in use but nothing holds it", block);
+        }
+        
+        uint32_t counted = g_fsck.refcounts ? g_fsck.refcounts[block] : 0;
+        if (owners > 1 && g_fsck.kinds[block] != BLOCK_DATA) {
+            fsck_error("%s block %u is claimed %u times", g_fsck.kinds[block] == BLOCK_DIRECTORY ?
+                       "directory" : "extent tree", block, owners);
+        } else if (owners > 1 && !g_fsck.refcounts) {
+            fsck_error("block %u is claimed by %u extents", block, owners);
+        } else if (g_fsck.refcounts && counted != (owners ? owners - 1 : 0)) {
+            fsck_error("block %u has %u owners but a reference count of %u", block, owners, counted + 1);
+        }
+    }
+    
+    __atomic_fetch_add(&g_fsck.used_blocks, used, __ATOMIC_RELAXED);
+}
+
+// Replay committed transactions so the check sees what a mount would
+static int replay_journal(const char* image, bool dry_run) {
+    const omnifs_superblock_t* sb = &g_fsck.superblock;
+    if (sb->version < OMNIFS_VERSION_EXTENTS || sb->journal_blocks < OMNIFS_JOURNAL_MIN_BLOCKS) {
+        return FSCK_EXIT_CLEAN;
+    }
+    
+    // Pending when a descriptor of the next sequence follows the journal superblock
+    omnifs_journal_super_t super;
+    omnifs_journal_header_t first;
+    uint32_t journal = sb->journal_start * sb->block_size;
+    if (device_read(image, journal, &super, sizeof(super)) != OMNIOS_SUCCESS ||
+        device_read(image, journal + sb->block_size, &first, sizeof(first)) != OMNIOS_SUCCESS) {
+        fprintf(stderr, "fsck.omnifs: %s: cannot read the journal\n", image);
+        return FSCK_EXIT_FAILED;
+    }
+    if (super.header.magic != OMNIFS_JOURNAL_MAGIC || super.header.type != OMNIFS_JOURNAL_SUPER) {
+        fsck_error("journal superblock at block %u is invalid", sb->journal_start);
+        return FSCK_EXIT_CLEAN;
+    }
+    if (first.magic != OMNIFS_JOURNAL_MAGIC || first.type != OMNIFS_JOURNAL_DESCRIPTOR ||
+        first.sequence != super.header.sequence) {
+        return FSCK_EXIT_CLEAN;
+    }
+    
+    if (dry_run) {
+        printf("%s: journal holds transactions; checking without replaying them\n", image);
+        return FSCK_EXIT_CLEAN;
+    }
+    
+    host_image_close();
+    if (!host_image_open(image, 0, true)) {
+        fprintf(stderr, "fsck.omnifs: %s: %s\n", image, strerror(errno));
+        return FSCK_EXIT_FAILED;
+    }
+    
+    bcache_init(image, sb->block_size, BCACHE_DEFAULT_BUFFERS);
+    int result = omnifs_journal_open(image, sb->block_size, sb->journal_start, sb->journal_blocks);
+    omnifs_journal_stats_t stats;
+    omnifs_journal_get_stats(&stats);
+    if (result == OMNIOS_SUCCESS) {
+        result = omnifs_journal_close();
+    }
+    bcache_shutdown();
+    
+    if (result != OMNIOS_SUCCESS) {
+        fprintf(stderr, "fsck.omnifs: %s: journal replay failed\n", image);
+        return FSCK_EXIT_FAILED;
+    }
+    printf("%s: replayed %u journal transactions (%u blocks)\n", image, stats.replayed_transactions,
+           stats.replayed_blocks);
+    return FSCK_EXIT_CLEAN;
+}
+
+// Superblock fields everything else relies on
+static bool check_superblock(const char* image) {
+    omnifs_superblock_t* sb = &g_fsck.superblock;
+    uint32_t block_size = sb->block_size;
+    
+    if (sb->magic != OMNIFS_MAGIC) {
+        fprintf(stderr, "fsck.omnifs: %s: not an OmniFS image\n", image);
+        return false;
+    }
+    if (sb->version < OMNIFS_VERSION_POINTERS || sb->version > OMNIFS_VERSION_CURRENT) {
+        fprintf(stderr, "fsck.omnifs: %s: unsupported version %u\n", image, sb->version);
+        return false;
+    }
+    
+    uint32_t inode_size = sb->version >= OMNIFS_VERSION_INLINE ? sb->inode_size : OMNIFS_INODE_SIZE_V2;
+    bool layout = block_size >= 512 && block_size <= 65536 && (block_size & (block_size - 1)) == 0 &&
+                  (uint64_t)sb->total_blocks * block_size <= g_fsck.image_size &&
+                  inode_size >= OMNIFS_INODE_SIZE_V2 && inode_size <= sizeof(omnifs_inode_t) &&
+                  sb->inode_count > 1 && sb->root_inode > 0 && sb->root_inode < sb->inode_count &&
+                  sb->block_bitmap > 0 && sb->block_bitmap < sb->inode_bitmap &&
+                  sb->inode_bitmap < sb->inode_table && sb->inode_table < sb->data_blocks &&
+                  sb->data_blocks < sb->total_blocks &&
+                  (sb->journal_blocks == 0 || sb->journal_start + sb->journal_blocks <= sb->data_blocks) &&
+                  (sb->refcount_blocks == 0 || sb->refcount_table + sb->refcount_blocks <= sb->data_blocks);
+    if (!layout) {
+        fprintf(stderr, "fsck.omnifs: %s: superblock layout is damaged\n", image);
+        return false;
+    }
+    
+    g_fsck.block_size = block_size;
+    g_fsck.total_blocks = sb->total_blocks;
+    g_fsck.inode_count = sb->inode_count;
+    g_fsck.inode_size = inode_size;
+    g_fsck.checksums = sb->version >= OMNIFS_VERSION_CHECKSUMS;
+    g_fsck.payload = block_size - (g_fsck.checksums ? OMNIFS_CHECKSUM_SIZE : 0);
+    g_fsck.per_block = g_fsck.checksums ? g_fsck.payload / inode_size : 0;
+    g_fsck.group_blocks = block_size * 8;
+    
+    // The tables must fit before the next region starts
+    uint32_t table_blocks = g_fsck.per_block ? (sb->inode_count + g_fsck.per_block - 1) / g_fsck.per_block :
+                            (uint32_t)(((uint64_t)sb->inode_count * inode_size + block_size - 1) / block_size);
+    if (sb->inode_bitmap - sb->block_bitmap < (sb->total_blocks / 8 + g_fsck.payload) / g_fsck.payload ||
+        sb->inode_table - sb->inode_bitmap < (sb->inode_count / 8 + g_fsck.payload) / g_fsck.payload ||
+        sb->inode_table + table_blocks > sb->data_blocks ||
+        (sb->refcount_blocks > 0 && (uint64_t)sb->refcount_blocks * g_fsck.payload < sb->total_blocks * 2ULL)) {
+        fprintf(stderr, "fsck.omnifs: %s: superblock layout is damaged\n", image);
+        return false;
+    }
+    
+    if (g_fsck.checksums && !fsck_block_sealed(0)) {
+        fprintf(stderr, "fsck.omnifs: %s: superblock fails its checksum\n", image);
+        return false;
+    }
+    return true;
+}
+
+static bool load_tables(void) {
+    const omnifs_superblock_t* sb = &g_fsck.superblock;
+    g_fsck.block_bitmap = calloc((sb->total_blocks + 7) / 8 + 1, 1);
+    g_fsck.inode_bitmap = calloc((sb->inode_count + 7) / 8 + 1, 1);
+    g_fsck.owners = calloc(sb->total_blocks, sizeof(uint32_t));
+    g_fsck.kinds = calloc(sb->total_blocks, 1);
+    g_fsck.parents = calloc(sb->inode_count, sizeof(uint32_t));
+    g_fsck.named_types = calloc(sb->inode_count, 1);
+    g_fsck.reach = calloc(sb->inode_count, 1);
+    if (!g_fsck.block_bitmap || !g_fsck.inode_bitmap || !g_fsck.owners || !g_fsck.kinds || !g_fsck.parents ||
+        !g_fsck.named_types || !g_fsck.reach) {
+        return false;
+    }
+    
+    fsck_gather(sb->block_bitmap, g_fsck.block_bitmap, (sb->total_blocks + 7) / 8);
+    fsck_gather(sb->inode_bitmap, g_fsck.inode_bitmap, (sb->inode_count + 7) / 8);
+    if (sb->version >= OMNIFS_VERSION_REFLINK && sb->refcount_blocks > 0) {
+        g_fsck.refcounts = malloc(sb->total_blocks * sizeof(uint16_t));
+        if (!g_fsck.refcounts) {
+            return false;
+        }
+        fsck_gather(sb->refcount_table, g_fsck.refcounts, sb->total_blocks * sizeof(uint16_t));
+    }
+    return true;
+}
+
+static void free_tables(void) {
+    free(g_fsck.block_bitmap);
+    free(g_fsck.inode_bitmap);
+    free(g_fsck.refcounts);
+    free(g_fsck.owners);
+    free(g_fsck.kinds);
+    free(g_fsck.parents);
+    free(g_fsck.named_types);
+    free(g_fsck.reach);
+}
+
+// Root directory and the free counts the superblock keeps
+static void check_summary(void) {
+    const omnifs_superblock_t* sb = &g_fsck.superblock;
+    uint32_t root = sb->root_inode;
+    omnifs_inode_t inode;
+    fsck_read_inode(root, &inode);
+    
+    if (!bit_set(g_fsck.inode_bitmap, root) || (inode.mode & 0xF000) != 0x4000) {
+        fsck_error("root inode %u is not an allocated directory", root);
+    } else if (g_fsck.parents[root] != 0) {
+        fsck_error("root directory is named in directory %u", g_fsck.parents[root]);
+    }
+    
+    // Inode 0 is reserved; a mount marks it in the bitmap without counting it
+    uint32_t used_inodes = 0;
+    for (uint32_t i = 1; i < sb->inode_count; i++) {
+        used_inodes += bit_set(g_fsck.inode_bitmap, i);
+    }
+    if (sb->free_inodes != sb->inode_count - used_inodes) {
+        fsck_error("superblock counts %u free inodes, the bitmap %u", sb->free_inodes,
+                   sb->inode_count - used_inodes);
+    }
+    if (sb->free_blocks != sb->total_blocks - g_fsck.used_blocks) {
+        fsck_error("superblock counts %u free blocks, the bitmap %llu", sb->free_blocks,
+                   (unsigned long long)(sb->total_blocks - g_fsck.used_blocks));
+    }
+}
+
+static void usage(const char* program) {
+    fprintf(stderr, "usage: %s [-j threads] [-n] [-v] image\n", program);
+}
+
+int main(int argc, char** argv) {
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    bool dry_run = false;
+    int option;
+    
+    g_threads = cpus > 0 ? (uint32_t)cpus : 1;
+    while ((option = getopt(argc, argv, "j:nvh")) != -1) {
+        switch (option) {
+        case 'j':
+            g_threads = strtoul(optarg, NULL, 0);
+            break;
+        case 'n':
+            dry_run = true;
+            break;
+        case 'v':
+            g_verbose = true;
+            break;
+        default:
+            usage(argv[0]);
+            return option == 'h' ? FSCK_EXIT_CLEAN : FSCK_EXIT_FAILED;
+        }
+    }
+    
+    if (optind != argc - 1 || g_threads == 0) {
+        usage(argv[0]);
+        return FSCK_EXIT_FAILED;
+    }
+    if (g_threads > FSCK_MAX_THREADS) {
+        g_threads = FSCK_MAX_THREADS;
+    }
+    
+    const char* image = argv[optind];
+    uint64_t start = now_ns();
+    if (!host_image_open(image, 0, false)) {
+        fprintf(stderr, "fsck.omnifs: %s: %s\n", image, strerror(errno));
+        return FSCK_EXIT_FAILED;
+    }
+    g_fsck.image_size = host_image_size();
+    if (device_read(image, 0, &g_fsck.superblock, sizeof(omnifs_superblock_t)) != OMNIOS_SUCCESS) {
+        fprintf(stderr, "fsck.omnifs: %s: cannot read the superblock\n", image);
+        return FSCK_EXIT_FAILED;
+    }
+    
+    int status = replay_journal(image, dry_run);
+    host_image_close();
+    if (status != FSCK_EXIT_CLEAN) {
+        return status;
+    }
+    
+    int fd = open(image, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        fprintf(stderr, "fsck.omnifs: %s: %s\n", image, strerror(errno));
+        return FSCK_EXIT_FAILED;
+    }
+    void* mapped = mmap(NULL, g_fsck.image_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (mapped == MAP_FAILED) {
+        fprintf(stderr, "fsck.omnifs: %s: %s\n", image, strerror(errno));
+        return FSCK_EXIT_FAILED;
+    }
+    g_fsck.image = mapped;
+    memcpy(&g_fsck.superblock, g_fsck.image, sizeof(omnifs_superblock_t)); // As replayed
+    
+    if (!check_superblock(image)) {
+        munmap(mapped, g_fsck.image_size);
+        return FSCK_EXIT_ERRORS;
+    }
+    if (!load_tables()) {
+        fprintf(stderr, "fsck.omnifs: out of memory\n");
+        free_tables();
+        munmap(mapped, g_fsck.image_size);
+        return FSCK_EXIT_FAILED;
+    }
+    
+    uint32_t block_groups = (g_fsck.total_blocks + g_fsck.group_blocks - 1) / g_fsck.group_blocks;
+    uint32_t inode_groups = (g_fsck.inode_count + FSCK_INODE_GROUP - 1) / FSCK_INODE_GROUP;
+    if (g_fsck.checksums) {
+        uint32_t table_groups = (g_fsck.superblock.data_blocks + g_fsck.group_blocks - 1) / g_fsck.group_blocks;
+        fsck_run("checksums", check_checksums, table_groups);
+    }
+    fsck_run("inodes", check_inodes, inode_groups);
+    fsck_run("connectivity", check_connectivity, inode_groups);
+    fsck_run("blocks", check_blocks, block_groups);
+    check_summary();
+    
+    printf("%s: %s, %llu files, %llu directories, %llu/%u blocks", image,
+           g_fsck.errors ? "errors found" : "clean", (unsigned long long)g_fsck.files,
+           (unsigned long long)g_fsck.directories, (unsigned long long)g_fsck.used_blocks, g_fsck.total_blocks);
+    if (g_fsck.errors) {
+        printf(", %llu errors", (unsigned long long)g_fsck.errors);
+    }
+    if (g_verbose) {
+        printf(" (%u threads, %.1f ms)", g_threads, (double)(now_ns() - start) / 1e6);
+    }
+    printf("\n");
+    
+    free_tables();
+    munmap(mapped, g_fsck.image_size);
+    return g_fsck.errors ? FSCK_EXIT_ERRORS : FSCK_EXIT_CLEAN;
+}
@@ -0,0 +1,171 @@
+/*
+ * OmniOS 2.0 Host Image Shim
+ * Kernel services for omnifs.c on Linux: the device is an image file
+ * read and written with pread/pwrite, the heap is malloc
+ */
+
+#define _GNU_SOURCE
+#include <stdarg.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <linux/fs.h>
+
+#include "omnios.h"
+#include "kernel/memory.h"
+
+#define HOST_IMAGE_MAX_SIZE     (1ULL << 32)    // Device offsets are 32-bit
+
+static int g_fd = -1;
+static uint64_t g_size = 0;
+static bool g_verbose = false;
+
+void* memory_allocate(uint32_t size) {
+    return malloc(size);
+}
+
+void* memory_allocate_aligned(uint32_t size, uint32_t alignment) {
+    void* ptr = NULL;
+    return posix_memalign(&ptr, alignment, size) == 0 ? ptr : NULL;
+}
+
+void memory_free(void* ptr) {
+    free(ptr);
+}
+
+void console_print(const char* format, ...) {
+    if (!g_verbose) {
+        return;
+    }
+    
+    va_list args;
+    va_start(args, format);
+    vfprintf(stderr, format, args);
+    va_end(args);
+}
+
+// SOURCE_DATE_EPOCH pins every timestamp, so builds pack identical images
+uint32_t get_current_time(void) {
+    const char* epoch = getenv("SOURCE_DATE_EPOCH");
+    return epoch ? (uint32_t)strtoul(epoch, NULL, 10) : (uint32_t)time(NULL);
+}
+
+int device_read(const char* device, uint32_t offset, void* buffer, uint32_t size) {
+    if (g_fd < 0 || (uint64_t)offset + size > g_size) {
+        return OMNIOS_ERROR_IO;
+    }
+    
+    uint8_t* out = buffer;
+    while (size > 0) {
+        ssize_t done = pread(g_fd, out, size, offset);
+        if (done <= 0) {
+            if (done < 0 && errno == EINTR) {
+                continue;
+            }
+            return OMNIOS_ERROR_IO;
+        }
+        out += done;
+        offset += done;
+        size -= done;
+    }
+    return OMNIOS_SUCCESS;
+}
+
+int device_write(const char* device, uint32_t offset, const void* buffer, uint32_t size) {
+    if (g_fd < 0 || (uint64_t)offset + size > g_size) {
+        return OMNIOS_ERROR_IO;
+    }
+    
+    const uint8_t* in = buffer;
+    while (size > 0) {
+        ssize_t done = pwrite(g_fd, in, size, offset);
+        if (done <= 0) {
+            if (done < 0 && errno == EINTR) {
+                continue;
+            }
+            return OMNIOS_ERROR_IO;
+        }
+        in += done;
+        offset += done;
+        size -= done;
+    }
+    return OMNIOS_SUCCESS;
+}
+
+bool host_image_open(const char* path, uint64_t size, bool writable) {
+    host_image_close();
+    
+    int flags = writable ? O_RDWR : O_RDONLY;
+    if (size > 0) {
+        flags |= O_CREAT;
+    }
+    int fd = open(path, flags | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        return false;
+    }
+    
+    struct stat info;
+    if (fstat(fd, &info) != 0) {
+        close(fd);
+        return false;
+    }
+    
+    uint64_t bytes = info.st_size;
+    if (S_ISBLK(info.st_mode)) {
+        if (ioctl(fd, BLKGETSIZE64, &bytes) != 0) {
+            close(fd);
+            return false;
+        }
+    } else if (size > 0 && ftruncate(fd, size) != 0) {
+        close(fd);
+        return false;
+    } else if (size > 0) {
+        bytes = size;
+    }
+    
+    g_fd = fd;
+    g_size = bytes < HOST_IMAGE_MAX_SIZE ? bytes : HOST_IMAGE_MAX_SIZE - 1;
+    return true;
+}
+
+void host_image_close(void) {
+    if (g_fd >= 0) {
+        close(g_fd);
+        g_fd = -1;
+        g_size = 0;
+    }
+}
+
+uint64_t host_image_size(void) {
+    return g_size;
+}
+
+void host_image_set_verbose(bool verbose) {
+    g_verbose = verbose;
+}
+
+bool host_image_parse_size(const char* text, uint64_t* size) {
+    char* end;
+    uint64_t value = strtoull(text, &end, 0);
+    
+    switch (*end) {
+    case 'k': case 'K':
+        value <<= 10;
+        end++;
+        break;
+    case 'm': case 'M':
+        value <<= 20;
+        end++;
+        break;
+    case 'g': case 'G':
+        value <<= 30;
+        end++;
+        break;
+    }
+    
+    *size = value;
+    return end != text && *end == '\0' && value > 0;
+}
@@ -0,0 +1,67 @@
+/*
+ * OmniOS 2.0 Host Image Shim
+ * Forced include for building omnifs.c and its modules as a Linux
+ * program: device I/O on an image file and the kernel services and
+ * types omnifs.c takes from the rest of the kernel
+ */
+
+#ifndef OMNIFS_TOOLS_HOST_IMAGE_H
+#define OMNIFS_TOOLS_HOST_IMAGE_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <sched.h>
+
+// Threads here can be preempted while holding a kernel lock, so waiters
+// give up the CPU rather than spin out their time slice
+#define SYNC_WAIT()             sched_yield()
+
+// Directory entry file types
+#define OMNIFS_FILE_TYPE_REG    1
+#define OMNIFS_FILE_TYPE_DIR    2
+
+// .opi package layout, for the installer in omnifs.c
+#define OPI_MAGIC               0x3149504F  // 'OPI1'
+#define OPI_VERSION             1
+
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    char package_name[32];
+    uint32_t file_count;
+    char dependencies[256];
+    char description[128];
+    uint32_t total_size;
+} opi_package_header_t;
+
+typedef struct {
+    char filename[64];
+    uint32_t size;
+    uint32_t permissions;
+} opi_file_entry_t;
+
+// Kernel services
+void console_print(const char* format, ...);
+uint32_t get_current_time(void);
+int device_read(const char* device, uint32_t offset, void* buffer, uint32_t size);
+int device_write(const char* device, uint32_t offset, const void* buffer, uint32_t size);
+
+// Open path as the device every OmniFS call names by it. size > 0 creates
+// or resizes the file first; 0 keeps it as it is. Offsets are 32-bit, so
+// images stop at 4GB. Returns false with errno set.
+bool host_image_open(const char* path, uint64_t size, bool writable);
+void host_image_close(void);
+
+// Bytes in the open image
+uint64_t host_image_size(void);
+
+// Byte count with an optional K, M or G suffix
+bool host_image_parse_size(const char* text, uint64_t* size);
+
+// console_print output goes to stderr only when verbose
+void host_image_set_verbose(bool verbose);
+
+#endif /* OMNIFS_TOOLS_HOST_IMAGE_H */
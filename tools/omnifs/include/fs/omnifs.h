@@ -0,0 +1,44 @@
+/*
+ * OmniOS 2.0 OmniFS (host build)
+ * Stand-in for the kernel's fs/omnifs.h, which is not part of this tree:
+ * the omnifs.c entry points the tools call. The kernel services and types
+ * omnifs.c expects come from host_image.h, forced ahead of every source.
+ */
+
+#ifndef FS_OMNIFS_H
+#define FS_OMNIFS_H
+
+#include "omnios.h"
+#include "kernel/memory.h"
+#include "fs/omnifs_format.h"
+#include "fs/omnifs_dir.h"
+
+int omnifs_format(const char* device, uint32_t size);
+int omnifs_mount(const char* device);
+int omnifs_unmount(void);
+int omnifs_sync(void);
+
+uint32_t omnifs_find_inode(const char* path);
+int omnifs_create_directory(const char* path);
+int omnifs_create_file(const char* path, uint32_t mode);
+int omnifs_read_file(const char* path, void* buffer, uint32_t size, uint32_t offset);
+int omnifs_write_file(const char* path, const void* buffer, uint32_t size, uint32_t offset);
+int omnifs_readdir(const char* path, uint32_t* cookie, omnifs_dir_entry_t* entries, int max_entries);
+int omnifs_set_compression(const char* path, bool enable);
+
+// Inode and block level calls shared with the directory and package code.
+// Only the lookup and directory entry calls lock the volume; the others
+// expect to run inside one of the calls above.
+uint32_t omnifs_find_child_inode(uint32_t parent_inode, const char* name);
+uint32_t omnifs_allocate_inode(void);
+uint32_t omnifs_allocate_block(void);
+uint32_t omnifs_get_block_number(omnifs_inode_t* inode, uint32_t block_index);
+int omnifs_add_directory_entry(uint32_t parent_inode, const char* name, uint32_t child_inode, uint8_t file_type);
+
+// .opi packages
+int omnifs_install_opi_package(const char* package_path);
+int omnifs_check_dependencies(const opi_package_header_t* header);
+bool omnifs_is_package_installed(const char* package_name);
+int omnifs_register_package(const opi_package_header_t* header, const char* install_path);
+
+#endif /* FS_OMNIFS_H */
@@ -0,0 +1,104 @@
+/*
+ * OmniOS 2.0 mkfs.omnifs
+ * Formats an image file or block device with the kernel's own
+ * omnifs_format, creating or resizing the file when a size is given
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <getopt.h>
+
+#include "omnios.h"
+#include "fs/omnifs.h"
+
+#define MKFS_MIN_SIZE           (256 * 1024)    // Leaves room for data past the tables
+
+static void usage(const char* program) {
+    fprintf(stderr, "usage: %s [-s size[K|M|G]] [-q] [-v] image\n", program);
+}
+
+static void print_layout(const char* image) {
+    omnifs_superblock_t superblock;
+    if (device_read(image, 0, &superblock, sizeof(superblock)) != OMNIOS_SUCCESS) {
+        return;
+    }
+    
+    uint32_t block_size = superblock.block_size;
+    printf("%s: OmniFS version %u, %u blocks of %u bytes, %u inodes\n", image, superblock.version,
+           superblock.total_blocks, block_size, superblock.inode_count);
+    printf("  block bitmap   %u\n", superblock.block_bitmap);
+    printf("  inode bitmap   %u\n", superblock.inode_bitmap);
+    printf("  inode table    %u\n", superblock.inode_table);
+    if (superblock.journal_blocks > 0) {
+        printf("  journal        %u (%u blocks)\n", superblock.journal_start, superblock.journal_blocks);
+    }
+    if (superblock.refcount_blocks > 0) {
+        printf("  refcounts      %u (%u blocks)\n", superblock.refcount_table, superblock.refcount_blocks);
+    }
+    printf("  data           %u (%u free blocks, %llu KB)\n", superblock.data_blocks, superblock.free_blocks,
+           (unsigned long long)superblock.free_blocks * block_size / 1024);
+}
+
+int main(int argc, char** argv) {
+    uint64_t size = 0;
+    bool quiet = false;
+    int option;
+    
+    while ((option = getopt(argc, argv, "s:qvh")) != -1) {
+        switch (option) {
+        case 's':
+            if (!host_image_parse_size(optarg, &size)) {
+                fprintf(stderr, "mkfs.omnifs: bad size '%s'\n", optarg);
+                return 1;
+            }
+            break;
+        case 'q':
+            quiet = true;
+            break;
+        case 'v':
+            host_image_set_verbose(true);
+            break;
+        default:
+            usage(argv[0]);
+            return option == 'h' ? 0 : 1;
+        }
+    }
+    
+    if (optind != argc - 1) {
+        usage(argv[0]);
+        return 1;
+    }
+    
+    const char* image = argv[optind];
+    if (size >= (1ULL << 32)) {
+        fprintf(stderr, "mkfs.omnifs: images are limited to 4GB\n");
+        return 1;
+    }
+    if (!host_image_open(image, size, true)) {
+        fprintf(stderr, "mkfs.omnifs: %s: %s\n", image, strerror(errno));
+        return 1;
+    }
+    
+    uint64_t bytes = host_image_size();
+    if (bytes < MKFS_MIN_SIZE) {
+        fprintf(stderr, "mkfs.omnifs: %s: %llu bytes is too small, give a size with -s\n", image,
+                (unsigned long long)bytes);
+        host_image_close();
+        return 1;
+    }
+    
+    if (omnifs_format(image, (uint32_t)bytes) != OMNIOS_SUCCESS) {
+        fprintf(stderr, "mkfs.omnifs: formatting %s failed\n", image);
+        host_image_close();
+        return 1;
+    }
+    
+    if (!quiet) {
+        print_layout(image);
+    }
+    host_image_close();
+    return 0;
+}
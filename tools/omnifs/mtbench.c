@@ -0,0 +1,284 @@
+/*
+ * OmniOS 2.0 omnifs-mtbench
+ * Times path lookups, reads and writes from 1, 2, 4... threads, each
+ * working on a file of its own, on a scratch image through the kernel's
+ * own file system code. -g puts one global mutex around every call to
+ * show what a file system with a single big lock would do instead.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <pthread.h>
+
+#include "omnios.h"
+#include "fs/omnifs.h"
+
+#define DEFAULT_THREADS         8
+#define DEFAULT_FILE_KB         2048
+#define DEFAULT_OPS             20000
+#define DEFAULT_IMAGE_MB        256
+#define BENCH_IO_SIZE           4096            // Bytes per read or write call
+#define BENCH_DEPTH             4               // Directory levels above each file
+
+typedef enum {
+    PHASE_LOOKUP,
+    PHASE_READ,
+    PHASE_WRITE,
+    PHASE_COUNT
+} phase_t;
+
+static const char* g_phase_names[PHASE_COUNT] = { "lookup", "read", "write" };
+
+typedef struct {
+    uint32_t max_threads;
+    uint32_t file_kb;
+    uint32_t ops;                 // Calls per thread and phase
+    bool big_lock;
+} options_t;
+
+typedef struct {
+    pthread_t thread;
+    uint32_t index;
+    phase_t phase;
+    const options_t* options;
+    pthread_barrier_t* start;
+    uint64_t began;
+    uint64_t ended;
+    bool failed;
+} worker_t;
+
+static const char* g_image;
+static pthread_mutex_t g_big_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+// Each thread's file sits BENCH_DEPTH directories down, so lookups walk
+// several cached names
+static void file_path(char* buffer, size_t size, uint32_t index) {
+    snprintf(buffer, size, "/bench/t%u/a/b/c/file", index);
+}
+
+static void big_lock(const options_t* options) {
+    if (options->big_lock) {
+        pthread_mutex_lock(&g_big_lock);
+    }
+}
+
+static void big_unlock(const options_t* options) {
+    if (options->big_lock) {
+        pthread_mutex_unlock(&g_big_lock);
+    }
+}
+
+static void* worker_main(void* argument) {
+    worker_t* worker = argument;
+    const options_t* options = worker->options;
+    uint32_t blocks = options->file_kb * 1024 / BENCH_IO_SIZE;
+    uint32_t seed = worker->index * 2654435761u + 1;
+    uint8_t buffer[BENCH_IO_SIZE];
+    char path[64];
+    
+    file_path(path, sizeof(path), worker->index);
+    memset(buffer, (int)worker->index, sizeof(buffer));
+    pthread_barrier_wait(worker->start);
+    worker->began = now_ns();
+    
+    for (uint32_t i = 0; i < options->ops && !worker->failed; i++) {
+        seed = seed * 1103515245 + 12345;
+        uint32_t offset = (seed >> 8) % blocks * BENCH_IO_SIZE;
+        
+        big_lock(options);
+        switch (worker->phase) {
+        case PHASE_LOOKUP:
+            worker->failed = omnifs_find_inode(path) == 0;
+            break;
+        case PHASE_READ:
+            worker->failed = omnifs_read_file(path, buffer, BENCH_IO_SIZE, offset) != OMNIOS_SUCCESS ||
+                             buffer[0] != (uint8_t)worker->index;
+            break;
+        default:
+            worker->failed = omnifs_write_file(path, buffer, BENCH_IO_SIZE, offset) != OMNIOS_SUCCESS;
+            break;
+        }
+        big_unlock(options);
+    }
+    
+    worker->ended = now_ns();
+    return NULL;
+}
+
+// Calls per second of threads threads running phase together
+static bool run_phase(phase_t phase, uint32_t threads, const options_t* options, double* rate) {
+    worker_t* workers = calloc(threads, sizeof(worker_t));
+    pthread_barrier_t start;
+    if (!workers || pthread_barrier_init(&start, NULL, threads + 1) != 0) {
+        free(workers);
+        return false;
+    }
+    
+    for (uint32_t i = 0; i < threads; i++) {
+        workers[i].index = i;
+        workers[i].phase = phase;
+        workers[i].options = options;
+        workers[i].start = &start;
+        pthread_create(&workers[i].thread, NULL, worker_main, &workers[i]);
+    }
+    
+    // From the first thread starting to the last one finishing
+    pthread_barrier_wait(&start);
+    uint64_t begin = UINT64_MAX;
+    uint64_t end = 0;
+    bool ok = true;
+    for (uint32_t i = 0; i < threads; i++) {
+        pthread_join(workers[i].thread, NULL);
+        if (workers[i].failed) {
+            fprintf(stderr, "omnifs-mtbench: %s failed in thread %u\n", g_phase_names[phase], i);
+            ok = false;
+        }
+        begin = workers[i].began < begin ? workers[i].began : begin;
+        end = workers[i].ended > end ? workers[i].ended : end;
+    }
+    uint64_t elapsed = end - begin;
+    
+    pthread_barrier_destroy(&start);
+    free(workers);
+    *rate = (double)threads * options->ops * 1e9 / (elapsed ? elapsed : 1);
+    return ok;
+}
+
+// One file per possible thread, filled with its index so reads can be checked
+static bool create_files(const options_t* options) {
+    uint8_t* data = malloc(options->file_kb * 1024);
+    if (!data || omnifs_create_directory("/bench") != OMNIOS_SUCCESS) {
+        free(data);
+        return false;
+    }
+    
+    bool ok = true;
+    for (uint32_t i = 0; i < options->max_threads && ok; i++) {
+        char path[64];
+        snprintf(path, sizeof(path), "/bench/t%u", i);
+        ok = omnifs_create_directory(path) == OMNIOS_SUCCESS;
+        
+        static const char* levels[] = { "/a", "/b", "/c" };
+        for (uint32_t level = 0; level < BENCH_DEPTH - 1 && ok; level++) {
+            strcat(path, levels[level]);
+            ok = omnifs_create_directory(path) == OMNIOS_SUCCESS;
+        }
+        
+        file_path(path, sizeof(path), i);
+        memset(data, (int)i, options->file_kb * 1024);
+        ok = ok && omnifs_create_file(path, 0644) == OMNIOS_SUCCESS &&
+             omnifs_write_file(path, data, options->file_kb * 1024, 0) == OMNIOS_SUCCESS;
+    }
+    
+    free(data);
+    return ok && omnifs_sync() == OMNIOS_SUCCESS;
+}
+
+static void usage(const char* program) {
+    fprintf(stderr,
+            "usage: %s [-t threads] [-f file_kb] [-o ops] [-s image_size] [-g] [-k] image\n"
+            "  -g  serialize every call on one global lock for comparison\n"
+            "  -k  keep the image for fsck.omnifs afterwards\n", program);
+}
+
+int main(int argc, char** argv) {
+    options_t options = { DEFAULT_THREADS, DEFAULT_FILE_KB, DEFAULT_OPS, false };
+    uint64_t size = (uint64_t)DEFAULT_IMAGE_MB << 20;
+    bool keep = false;
+    int option;
+    
+    while ((option = getopt(argc, argv, "t:f:o:s:gkh")) != -1) {
+        switch (option) {
+        case 't':
+            options.max_threads = strtoul(optarg, NULL, 0);
+            break;
+        case 'f':
+            options.file_kb = strtoul(optarg, NULL, 0);
+            break;
+        case 'o':
+            options.ops = strtoul(optarg, NULL, 0);
+            break;
+        case 's':
+            if (!host_image_parse_size(optarg, &size)) {
+                fprintf(stderr, "omnifs-mtbench: bad size '%s'\n", optarg);
+                return 1;
+            }
+            break;
+        case 'g':
+            options.big_lock = true;
+            break;
+        case 'k':
+            keep = true;
+            break;
+        default:
+            usage(argv[0]);
+            return option == 'h' ? 0 : 1;
+        }
+    }
+    
+    if (optind != argc - 1 || options.max_threads == 0 || options.ops == 0 ||
+        options.file_kb * 1024 < BENCH_IO_SIZE || size >= (1ULL << 32)) {
+        usage(argv[0]);
+        return 1;
+    }
+    
+    g_image = argv[optind];
+    if (!host_image_open(g_image, size, true)) {
+        fprintf(stderr, "omnifs-mtbench: %s: %s\n", g_image, strerror(errno));
+        return 1;
+    }
+    
+    if (omnifs_format(g_image, (uint32_t)size) != OMNIOS_SUCCESS || omnifs_mount(g_image) != OMNIOS_SUCCESS ||
+        !create_files(&options)) {
+        fprintf(stderr, "omnifs-mtbench: setting up %s failed\n", g_image);
+        host_image_close();
+        return 1;
+    }
+    
+    printf("%u files of %u KB, %u calls of %u bytes per thread, %s, %ld CPUs\n", options.max_threads,
+           options.file_kb, options.ops, BENCH_IO_SIZE, options.big_lock ? "global lock" : "fine-grained locks",
+           sysconf(_SC_NPROCESSORS_ONLN));
+    printf("%7s %12s %8s %12s %8s %12s %8s\n", "threads", "lookups/s", "scale", "reads/s", "scale",
+           "writes/s", "scale");
+    
+    bool ok = true;
+    double base[PHASE_COUNT] = { 0 };
+    for (uint32_t threads = 1; threads <= options.max_threads && ok; threads *= 2) {
+        double rate[PHASE_COUNT];
+        for (int phase = 0; phase < PHASE_COUNT && ok; phase++) {
+            ok = run_phase((phase_t)phase, threads, &options, &rate[phase]);
+            if (threads == 1) {
+                base[phase] = rate[phase];
+            }
+        }
+        
+        if (ok) {
+            printf("%7u %12.0f %7.2fx %12.0f %7.2fx %12.0f %7.2fx\n", threads,
+                   rate[PHASE_LOOKUP], rate[PHASE_LOOKUP] / base[PHASE_LOOKUP],
+                   rate[PHASE_READ], rate[PHASE_READ] / base[PHASE_READ],
+                   rate[PHASE_WRITE], rate[PHASE_WRITE] / base[PHASE_WRITE]);
+        }
+    }
+    
+    if (omnifs_unmount() != OMNIOS_SUCCESS) {
+        fprintf(stderr, "omnifs-mtbench: unmounting %s failed\n", g_image);
+        ok = false;
+    }
+    host_image_close();
+    if (!keep) {
+        unlink(g_image);
+    }
+    return ok ? 0 : 1;
+}
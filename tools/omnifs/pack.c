@@ -0,0 +1,341 @@
+/*
+ * OmniOS 2.0 omnifs-pack
+ * Builds an OmniFS image from a host directory tree through the kernel's
+ * own file system code: format, create every directory and file in
+ * name order, copy the data and unmount. Without a size the image is
+ * made just large enough for the tree plus some headroom. Set
+ * SOURCE_DATE_EPOCH for byte-identical images across builds.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <time.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <sys/stat.h>
+
+#include "omnios.h"
+#include "fs/omnifs.h"
+#include "fs/omnifs_dir.h"
+#include "fs/omnifs_journal.h"
+
+#define PACK_CHUNK              (1024 * 1024)   // File data copied per write
+#define PACK_PATH_MAX           4096
+#define PACK_BLOCK_SIZE         4096            // What omnifs_format uses
+#define PACK_MIN_SIZE           (1024 * 1024)
+#define PACK_HEADROOM_PERCENT   10              // Free space left in sized images
+#define PACK_MAX_SIZE           ((1ULL << 32) - PACK_BLOCK_SIZE)
+
+// One file or directory of the tree, in creation order
+typedef struct {
+    char* path;               // Relative to the tree, '/' separated
+    uint64_t size;
+    uint32_t mode;            // Permission bits
+    bool directory;
+} pack_entry_t;
+
+typedef struct {
+    pack_entry_t* entries;
+    uint32_t count;
+    uint32_t capacity;
+    uint64_t data_blocks;     // Blocks the files will take
+    uint64_t name_bytes;      // Directory records for every name
+    uint32_t directories;
+    uint32_t skipped;
+} pack_tree_t;
+
+typedef struct {
+    uint64_t size;
+    bool compress;
+    bool quiet;
+} options_t;
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static bool tree_add(pack_tree_t* tree, const char* path, const struct stat* info) {
+    if (tree->count == tree->capacity) {
+        uint32_t capacity = tree->capacity ? tree->capacity * 2 : 256;
+        pack_entry_t* entries = realloc(tree->entries, capacity * sizeof(pack_entry_t));
+        if (!entries) {
+            return false;
+        }
+        tree->entries = entries;
+        tree->capacity = capacity;
+    }
+    
+    pack_entry_t* entry = &tree->entries[tree->count];
+    entry->path = strdup(path);
+    if (!entry->path) {
+        return false;
+    }
+    entry->directory = S_ISDIR(info->st_mode);
+    entry->size = entry->directory ? 0 : (uint64_t)info->st_size;
+    entry->mode = info->st_mode & 0x0FFF;
+    tree->count++;
+    
+    const char* name = strrchr(path, '/');
+    name = name ? name + 1 : path;
+    tree->name_bytes += (sizeof(omnifs_dirent_t) + strlen(name) + 3) & ~3;
+    if (entry->directory) {
+        tree->directories++;
+    } else if (entry->size > OMNIFS_INLINE_SIZE) {
+        tree->data_blocks += (entry->size + PACK_BLOCK_SIZE - 1) / PACK_BLOCK_SIZE;
+    }
+    return true;
+}
+
+// Walk root/path depth first in name order, so a directory always comes
+// before what it holds and equal trees pack the same way
+static bool tree_scan(pack_tree_t* tree, const char* root, const char* path) {
+    char host[PACK_PATH_MAX];
+    snprintf(host, sizeof(host), "%s%s%s", root, *path ? "/" : "", path);
+    
+    struct dirent** names;
+    int count = scandir(host, &names, NULL, alphasort);
+    if (count < 0) {
+        fprintf(stderr, "omnifs-pack: %s: %s\n", host, strerror(errno));
+        return false;
+    }
+    
+    bool ok = true;
+    for (int i = 0; i < count; i++) {
+        const char* name = names[i]->d_name;
+        if (!ok || strcmp(name, ".") == 0 || strcmp(name, "..") == 0) {
+            continue;
+        }
+        
+        char child[PACK_PATH_MAX];
+        char child_host[2 * PACK_PATH_MAX];
+        int length = snprintf(child, sizeof(child), "%s%s%s", path, *path ? "/" : "", name);
+        snprintf(child_host, sizeof(child_host), "%s/%s", root, child);
+        
+        struct stat info;
+        if (length >= PACK_PATH_MAX - 1 || lstat(child_host, &info) != 0) {
+            fprintf(stderr, "omnifs-pack: %s: %s\n", child_host, length >= PACK_PATH_MAX - 1 ?
+                    "path too long" : strerror(errno));
+            ok = false;
+        } else if (strlen(name) > OMNIFS_DIR_NAME_MAX) {
+            fprintf(stderr, "omnifs-pack: %s: name too long\n", child_host);
+            ok = false;
+        } else if (!S_ISDIR(info.st_mode) && !S_ISREG(info.st_mode)) {
+            fprintf(stderr, "omnifs-pack: %s: skipped, not a file or directory\n", child_host);
+            tree->skipped++;
+        } else if (S_ISREG(info.st_mode) && (uint64_t)info.st_size > UINT32_MAX) {
+            fprintf(stderr, "omnifs-pack: %s: larger than 4GB\n", child_host);
+            ok = false;
+        } else if (!tree_add(tree, child, &info)) {
+            fprintf(stderr, "omnifs-pack: out of memory\n");
+            ok = false;
+        } else if (S_ISDIR(info.st_mode)) {
+            ok = tree_scan(tree, root, child);
+        }
+    }
+    
+    for (int i = 0; i < count; i++) {
+        free(names[i]);
+    }
+    free(names);
+    return ok;
+}
+
+// Blocks omnifs_format keeps for itself on a device of total blocks;
+// mirrors its layout
+static uint64_t format_overhead(uint64_t total) {
+    uint64_t payload = PACK_BLOCK_SIZE - OMNIFS_CHECKSUM_SIZE;
+    uint64_t inodes = total / 4;
+    uint64_t journal = total / 16;
+    if (journal > OMNIFS_JOURNAL_DEFAULT_BLOCKS) {
+        journal = OMNIFS_JOURNAL_DEFAULT_BLOCKS;
+    } else if (journal < OMNIFS_JOURNAL_MIN_BLOCKS) {
+        journal = 0;
+    }
+    
+    return 1 + ((total + 7) / 8 + payload - 1) / payload + ((inodes + 7) / 8 + payload - 1) / payload +
+           (inodes + payload / OMNIFS_INODE_SIZE - 1) / (payload / OMNIFS_INODE_SIZE) + journal +
+           (total * 2 + payload - 1) / payload;
+}
+
+// Smallest image holding the tree with headroom to spare
+static uint64_t image_size(const pack_tree_t* tree) {
+    // Directories outgrowing their inode take index and leaf blocks at
+    // about half fill, plus extent tree nodes for fragmented files
+    uint64_t needed = tree->data_blocks + 2 * tree->name_bytes / PACK_BLOCK_SIZE + tree->directories +
+                      tree->data_blocks / 256 + 16;
+    needed += needed * PACK_HEADROOM_PERCENT / 100;
+    
+    uint64_t total = needed;
+    while (total - format_overhead(total) < needed || total / 4 < (uint64_t)tree->count + 2) {
+        total += total / 8 + 1;
+    }
+    
+    uint64_t bytes = total * PACK_BLOCK_SIZE;
+    return bytes < PACK_MIN_SIZE ? PACK_MIN_SIZE : bytes;
+}
+
+static bool copy_file(const char* host, const char* path, uint8_t* chunk) {
+    int fd = open(host, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        fprintf(stderr, "omnifs-pack: %s: %s\n", host, strerror(errno));
+        return false;
+    }
+    
+    uint32_t offset = 0;
+    bool ok = true;
+    for (;;) {
+        ssize_t length = read(fd, chunk, PACK_CHUNK);
+        if (length < 0 && errno == EINTR) {
+            continue;
+        }
+        if (length <= 0) {
+            if (length < 0) {
+                fprintf(stderr, "omnifs-pack: %s: %s\n", host, strerror(errno));
+                ok = false;
+            }
+            break;
+        }
+        
+        int result = omnifs_write_file(path, chunk, (uint32_t)length, offset);
+        if (result != OMNIOS_SUCCESS) {
+            fprintf(stderr, "omnifs-pack: writing %s failed (%d)%s\n", path, result,
+                    result == OMNIOS_ERROR_MEMORY ? ", image full" : "");
+            ok = false;
+            break;
+        }
+        offset += length;
+    }
+    
+    close(fd);
+    return ok;
+}
+
+static bool pack_tree(const pack_tree_t* tree, const char* root, const options_t* options) {
+    uint8_t* chunk = malloc(PACK_CHUNK);
+    if (!chunk) {
+        fprintf(stderr, "omnifs-pack: out of memory\n");
+        return false;
+    }
+    
+    bool ok = true;
+    for (uint32_t i = 0; i < tree->count && ok; i++) {
+        const pack_entry_t* entry = &tree->entries[i];
+        char path[PACK_PATH_MAX + 1];
+        char host[PACK_PATH_MAX];
+        snprintf(path, sizeof(path), "/%s", entry->path);
+        snprintf(host, sizeof(host), "%s/%s", root, entry->path);
+        
+        int result = entry->directory ? omnifs_create_directory(path) : omnifs_create_file(path, entry->mode);
+        if (result == OMNIOS_SUCCESS && !entry->directory && options->compress) {
+            result = omnifs_set_compression(path, true);
+        }
+        if (result != OMNIOS_SUCCESS) {
+            fprintf(stderr, "omnifs-pack: creating %s failed (%d)%s\n", path, result,
+                    result == OMNIOS_ERROR_MEMORY ? ", image full" : "");
+            ok = false;
+        } else if (!entry->directory && entry->size > 0) {
+            ok = copy_file(host, path, chunk);
+        }
+    }
+    
+    free(chunk);
+    return ok;
+}
+
+static void usage(const char* program) {
+    fprintf(stderr, "usage: %s [-s size[K|M|G]] [-c] [-q] [-v] image directory\n", program);
+}
+
+int main(int argc, char** argv) {
+    options_t options = { 0, false, false };
+    int option;
+    
+    while ((option = getopt(argc, argv, "s:cqvh")) != -1) {
+        switch (option) {
+        case 's':
+            if (!host_image_parse_size(optarg, &options.size)) {
+                fprintf(stderr, "omnifs-pack: bad size '%s'\n", optarg);
+                return 1;
+            }
+            break;
+        case 'c':
+            options.compress = true;
+            break;
+        case 'q':
+            options.quiet = true;
+            break;
+        case 'v':
+            host_image_set_verbose(true);
+            break;
+        default:
+            usage(argv[0]);
+            return option == 'h' ? 0 : 1;
+        }
+    }
+    
+    if (optind != argc - 2) {
+        usage(argv[0]);
+        return 1;
+    }
+    
+    const char* image = argv[optind];
+    const char* root = argv[optind + 1];
+    uint64_t start = now_ns();
+    
+    pack_tree_t tree;
+    memset(&tree, 0, sizeof(tree));
+    if (!tree_scan(&tree, root, "")) {
+        return 1;
+    }
+    
+    uint64_t size = options.size ? options.size : image_size(&tree);
+    if (size > PACK_MAX_SIZE) {
+        fprintf(stderr, "omnifs-pack: a %llu byte image is over the 4GB limit\n", (unsigned long long)size);
+        return 1;
+    }
+    size -= size % PACK_BLOCK_SIZE;
+    
+    // Start from an empty file so no stale bytes survive in the image
+    if ((truncate(image, 0) != 0 && errno != ENOENT) || !host_image_open(image, size, true)) {
+        fprintf(stderr, "omnifs-pack: %s: %s\n", image, strerror(errno));
+        return 1;
+    }
+    
+    bool ok = omnifs_format(image, (uint32_t)size) == OMNIOS_SUCCESS && omnifs_mount(image) == OMNIOS_SUCCESS;
+    if (!ok) {
+        fprintf(stderr, "omnifs-pack: cannot format %s\n", image);
+    } else {
+        ok = pack_tree(&tree, root, &options);
+        if (omnifs_unmount() != OMNIOS_SUCCESS) {
+            fprintf(stderr, "omnifs-pack: writing %s failed\n", image);
+            ok = false;
+        }
+    }
+    host_image_close();
+    
+    if (ok && !options.quiet) {
+        uint64_t bytes = 0;
+        for (uint32_t i = 0; i < tree.count; i++) {
+            bytes += tree.entries[i].size;
+        }
+        printf("%s: %u files, %u directories, %llu KB in a %llu KB image, %.1f ms\n", image,
+               tree.count - tree.directories, tree.directories, (unsigned long long)(bytes / 1024),
+               (unsigned long long)(size / 1024), (double)(now_ns() - start) / 1e6);
+        if (tree.skipped > 0) {
+            printf("%s: %u entries skipped\n", image, tree.skipped);
+        }
+    }
+    
+    for (uint32_t i = 0; i < tree.count; i++) {
+        free(tree.entries[i].path);
+    }
+    free(tree.entries);
+    return ok ? 0 : 1;
+}